@@ -27,55 +27,262 @@ define_static_error(balancer_error_no_iface, "No interfaces are available");
 struct _Interface
 {
 	int index;
+	int id; //< Unique, small integer
 	int metric;
 	int use_count;
 	HostAddress addr;
+
+	//Bandwidth policy
+	atomic_ulong n_bytes; //< Relayed since the last tick
+	double rate; //< Smoothed throughput, bytes per second
+	double capacity; //< Decaying peak of rate, bytes per second
+
+	//Latency policy
+	double srtt; //< Smoothed round trip time in microseconds, 0 if unknown
+
+	//Scheduling
+	double key; //< interface_load(), unused under the connections policy
+	int rr_class, rr_pos; //< Round robin class and position in it
+
+	//Health
+	atomic_int n_failures; //< Consecutive failed connection attempts
+	int ejected; //< Taken out of the heap because it seems to be down
+	int removed; //< Taken out by balancer_remove(), kept until shutdown
+
+	//Shaping, token bucket protected by shaper_lock
+	double shape_rate; //< Bytes per second, 0 if not shaped
+	Mutex shaper_lock;
+	double tokens; //< Bytes that may be relayed now, may go negative
+	struct timeval refilled;
+
+	//Spare sockets bound to the interface, protected by spare_lock
+	Mutex spare_lock;
+	SocketHandle spares[BALANCER_SPARE_SOCKETS];
+	int n_spares;
+	atomic_int refill_queued; //< On the refill queue of some thread
+	Interface *refill_next;
 };
 NetworkType types = 0;
 
-//Min-heap data structure
+//Data kept per address family is indexed by family_index()
+#define N_FAMILIES (2)
+
+static const NetworkType families[N_FAMILIES] = 
+{
+	NETWORK_INET, NETWORK_INET6
+};
+
+static int family_index(NetworkType type)
+{
+	return type == NETWORK_INET ? 0 : 1;
+}
+
+//All interfaces, including ejected ones
+static Interface **all_ifaces = NULL;
+static size_t n_all_ifaces = 0, all_ifaces_alloc_len = 0;
+static int next_iface_id = 0;
+static int n_family_ifaces[N_FAMILIES] = { 0, 0 }; //< In all_ifaces
+
+//Removed interfaces. Sessions, health checks and statistics may still
+//refer to them, so they are only freed by balancer_shutdown(). Adding 
+//the address again brings back the same interface.
+static Interface **retired_ifaces = NULL;
+static size_t n_retired_ifaces = 0, retired_ifaces_alloc_len = 0;
+
+//Consecutive connection failures after which an interface is ejected
+static int failure_threshold = BALANCER_DEFAULT_FAILURE_THRESHOLD;
+
+//Set of interfaces changed, consistent hash rings must be rebuilt
+static int affinity_dirty = 1;
+
+static BalancerPolicy policy = BALANCER_POLICY_CONNECTIONS;
+
+//Bandwidth policy parameters
+#define BANDWIDTH_TICK_MSEC (1000)
+//Weight of the latest sample in rate
+#define BANDWIDTH_RATE_ALPHA (0.3)
+//Fraction of capacity kept on each tick when rate is below it
+#define BANDWIDTH_CAPACITY_DECAY (0.99)
+//Capacity assumed per unit of metric before anything is measured
+#define BANDWIDTH_PRIOR (1024.0 * 1024.0)
+//Throughput accounted for each connection, so that idle interfaces 
+//still receive connections in proportion to their metric.
+#define BANDWIDTH_CONNECTION_COST (16.0 * 1024.0)
+
+static struct event *bandwidth_tick_event = NULL;
+
+//Latency policy parameters
+//Weight of the latest sample in srtt, same as TCP
+#define LATENCY_RTT_ALPHA (0.125)
+//Added to every round trip time so that load still matters between 
+//interfaces with negligible latency
+#define LATENCY_BIAS_USEC (5000.0)
+
+//Shaping parameters
+//Bucket holds this much time worth of tokens
+#define SHAPER_BURST_MSEC (100)
+//Smallest bucket size, so that slow interfaces can still fill a buffer
+#define SHAPER_MIN_BURST (16.0 * 1024.0)
+//Shaped interfaces look this many times more loaded than they are
+#define SHAPER_PENALTY (4)
+
+//Interfaces are shared by all worker threads, all scheduling and
+//use counts are protected by this lock. The least loaded scheduler 
+//keeps interfaces ordered by use count; with counts kept per thread, 
+//each selection would have to sum them and restore the order. Instead
+//the lock is taken once per opened and closed connection, for an 
+//O(log n) heap update.
+static Mutex balancer_mutex = MUTEX_INITIALIZER;
+
+//Interfaces of one address family that can take connections. The
+//scheduler decides the order of data, index of each interface is its 
+//position there, or -1 if it is in no set.
+typedef struct
+{
+	int metric;
+	Interface **members;
+	size_t len, alloc_len;
+	size_t next; //< Member to use next
+} RoundRobinClass;
+
 typedef struct
 {
 	Interface **data;
 	size_t len, alloc_len;
-} Heap;
 
-Heap ip4[1] = {0}, ip6[1] = {0};
+	//Round robin, interfaces grouped by metric
+	RoundRobinClass *classes;
+	int n_classes, classes_alloc_len;
+	int *sequence; //< Classes in the order they are picked
+	size_t sequence_len, sequence_alloc_len, sequence_pos;
+	int sequence_dirty; //< Classes changed since sequence was computed
+} IfaceSet;
+
+static IfaceSet sets[N_FAMILIES];
+
+static IfaceSet *interface_set(Interface *iface)
+{
+	return sets + family_index(iface->addr.type);
+}
+
+//Load under bandwidth and latency policies
+static double interface_load(Interface *iface)
+{
+	double penalty = iface->shape_rate ? SHAPER_PENALTY : 1.0;
+
+	if (policy == BALANCER_POLICY_BANDWIDTH)
+	{
+		//Expected load relative to capacity, which shaping limits
+		double capacity = iface->capacity;
+		if (capacity < iface->metric * BANDWIDTH_PRIOR)
+			capacity = iface->metric * BANDWIDTH_PRIOR;
+		if (iface->shape_rate && capacity > iface->shape_rate)
+			capacity = iface->shape_rate;
+		return penalty 
+			* (iface->rate + iface->use_count * BANDWIDTH_CONNECTION_COST)
+			/ capacity;
+	}
+
+	//Expected delay grows with latency and with the number of 
+	//connections sharing the interface. Unmeasured interfaces look 
+	//fast so that they get measured.
+	return penalty * ((double) (iface->use_count + 1) / iface->metric)
+		* (iface->srtt + LATENCY_BIAS_USEC);
+}
+
+//Must be called whenever anything interface_load() uses changes
+static void interface_update_key(Interface *iface)
+{
+	if (policy != BALANCER_POLICY_CONNECTIONS)
+		iface->key = interface_load(iface);
+}
 
-static double value(Heap *heap, int idx)
+//Whether a should take the next connection rather than b
+static int interface_less(Interface *a, Interface *b)
 {
-	return ((double) heap->data[idx]->use_count / heap->data[idx]->metric);
+	if (policy == BALANCER_POLICY_CONNECTIONS)
+	{
+		//Compares use_count / metric without dividing
+		int64_t load_a = (int64_t) a->use_count 
+			* (a->shape_rate ? SHAPER_PENALTY : 1);
+		int64_t load_b = (int64_t) b->use_count 
+			* (b->shape_rate ? SHAPER_PENALTY : 1);
+		return load_a * b->metric < load_b * a->metric;
+	}
+
+	return a->key < b->key;
 }
 
-static void assign(Heap *heap, int idx, Interface *value)
+static void assign(IfaceSet *set, int idx, Interface *value)
 {
-	heap->data[idx] = value;
+	set->data[idx] = value;
 	if (value)
 		value->index = idx;
 }
 
+static void set_append(IfaceSet *set, Interface *iface)
+{
+	if (set->len >= set->alloc_len)
+	{
+		set->alloc_len = set->alloc_len ? set->alloc_len * 2 : 8;
+		set->data = fs_realloc(set->data, sizeof(void *) * set->alloc_len);
+	}
+	set->len++;
+	assign(set, set->len - 1, iface);
+}
+
+//Fills the hole with the last interface
+static void set_remove(IfaceSet *set, Interface *iface)
+{
+	int idx = iface->index;
+
+	abort_if_fail(set->len && idx >= 0 && idx < set->len, 
+			"Assertion failure");
+
+	iface->index = -1;
+	set->len--;
+	if (idx < set->len)
+		assign(set, idx, set->data[set->len]);
+}
+
+//Schedulers pick interfaces out of a set, comparing them with 
+//interface_less() where load matters. All functions are called with the
+//lock held.
+typedef struct
+{
+	//Adds iface, whose index is -1, to the set
+	void (*insert)(IfaceSet *set, Interface *iface);
+	void (*delete)(IfaceSet *set, Interface *iface);
+	//Load or metric of one interface has changed
+	void (*update)(IfaceSet *set, Interface *iface);
+	//Everything has changed, or the scheduler has just been chosen
+	void (*rebuild)(IfaceSet *set);
+	//Returns up to max distinct interfaces, best first, without using them
+	int (*select)(IfaceSet *set, int max, Interface **out);
+} Scheduler;
+
+//Least loaded first, from a min-heap
 #if 0
-static void assert_heap(Heap *heap)
+static void assert_heap(IfaceSet *heap)
 {
 	int i, parent;
 
 	for (i = 1; i < heap->len; i++)
 	{
 		parent = (i - 1) / 2;
-		abort_if_fail(value(heap, parent) <= value(heap, i),
+		abort_if_fail(! interface_less(heap->data[i], heap->data[parent]),
 				"Assertion failure");
 	}
 }
 #endif
 
-static void shift_up(Heap *heap, int idx)
+static void shift_up(IfaceSet *heap, int idx)
 {
 	Interface *tmp = heap->data[idx];
-	double tmp_value = value(heap, idx);
 	while (idx > 0)
 	{
 		int parent = (idx - 1) / 2;
-		if (value(heap, parent) <= tmp_value)
+		if (! interface_less(tmp, heap->data[parent]))
 			break;
 		assign(heap, idx, heap->data[parent]);
 		idx = parent;
@@ -85,10 +292,9 @@ static void shift_up(Heap *heap, int idx)
 	//assert_heap(heap);
 }
 
-static void shift_down(Heap *heap, int idx)
+static void shift_down(IfaceSet *heap, int idx)
 {
 	Interface *tmp = heap->data[idx];
-	double tmp_value = value(heap, idx);
 
 	while (idx < heap->len)
 	{
@@ -101,13 +307,13 @@ static void shift_down(Heap *heap, int idx)
 
 		if (right < heap->len)
 		{
-			if (value(heap, right) < value(heap, left))
+			if (interface_less(heap->data[right], heap->data[left]))
 				sel = right;
 		}
 
 		if (sel >= 0)
 		{
-			if (value(heap, sel) < tmp_value)
+			if (interface_less(heap->data[sel], tmp))
 			{
 				assign(heap, idx, heap->data[sel]);
 				idx = sel;
@@ -124,238 +330,1631 @@ static void shift_down(Heap *heap, int idx)
 	//assert_heap(heap);
 }
 
-static void heap_insert(Heap *heap, Interface *iface)
+static void heap_insert(IfaceSet *heap, Interface *iface)
 {
-	if (heap->alloc_len == 0)
-	{
-		heap->alloc_len = 8;
-		heap->data = fs_malloc(sizeof(void *) * heap->alloc_len);
-	}
-	else if (heap->alloc_len >= heap->len)
-	{
-		heap->alloc_len *= 2;
-		heap->data = fs_realloc(heap->data, sizeof(void *) * heap->alloc_len);
-	}
-	heap->len++;
-	assign(heap, heap->len - 1, iface);
+	set_append(heap, iface);
 	shift_up(heap, heap->len - 1);
 }
 
-static void heap_delete(Heap *heap, Interface *iface)
+static void heap_delete(IfaceSet *heap, Interface *iface)
 {
-	abort_if_fail(heap->len && iface->index >= 0 && iface->index < heap->len, 
-			"Assertion failure");
-
 	int idx = iface->index;
 
-	iface->index = -1;
-	heap->len--;
-	if (idx < heap->len - 1)
+	set_remove(heap, iface);
+	if (idx < heap->len)
 	{
-		heap->data[idx] = heap->data[heap->len - 1];
+		//Last element moved into the hole, it may need to go either way
+		Interface *moved = heap->data[idx];
 		shift_down(heap, idx);	
+		shift_up(heap, moved->index);
 	}
 }
 
-static Heap *select_heap(Interface *iface)
+static void heap_update(IfaceSet *heap, Interface *iface)
 {
-	if (iface->addr.type == NETWORK_INET)
-		return ip4;
-	else
-		return ip6;
+	shift_down(heap, iface->index);
+	shift_up(heap, iface->index);
 }
 
-void interface_close(Interface *iface)
+static void heapify(IfaceSet *heap)
 {
-	iface->use_count--;
-	shift_up(select_heap(iface), iface->index);
+	int i;
+
+	for (i = ((int) heap->len) / 2 - 1; i >= 0; i--)
+		shift_down(heap, i);
 }
 
-HostAddress interface_get_addr(Interface *iface)
+static int heap_select(IfaceSet *heap, int max, Interface **out)
 {
-	return iface->addr;
+	int i, n = 0;
+
+	if (max == 1 && heap->len)
+	{
+		out[0] = heap->data[0];
+		return 1;
+	}
+
+	//Take interfaces out one by one so that each is selected only once
+	while (n < max && heap->len)
+	{
+		out[n] = heap->data[0];
+		heap_delete(heap, out[n]);
+		n++;
+	}
+	for (i = 0; i < n; i++)
+		heap_insert(heap, out[i]);
+
+	return n;
 }
 
-Interface *balancer_add(HostAddress addr, int metric)
+static const Scheduler heap_scheduler = 
 {
-	Interface *iface;
+	heap_insert, heap_delete, heap_update, heapify, heap_select
+};
 
-	iface = (Interface *) fs_malloc(sizeof(Interface));
-	
-	iface->index = -1;
-	iface->addr = addr;
-	iface->metric = metric;
-	if (iface->metric < 0)
-		iface->metric = 1;
-	iface->use_count = 0;
-	
-	heap_insert(select_heap(iface), iface);
-	types |= addr.type;
-	
-	return iface;
+//Smooth weighted round robin by metric, ignoring load. It runs over 
+//classes of interfaces with equal metric, each weighing its metric times
+//its size, and cycles through the class picked. The order of classes is
+//computed once whenever classes change, so selection takes constant time.
+
+//Longest sequence of classes. Longer sequences are apportioned by 
+//largest remainder: each class gets one slot, and the rest are shared in
+//proportion to weight. A class then gets at most two slots more than its
+//exact share of the rest, and never less. There are more slots when 
+//classes outnumber them.
+#define RR_MAX_SEQUENCE (4096)
+
+static long rr_gcd(long a, long b)
+{
+	while (b)
+	{
+		long tmp = a % b;
+		a = b;
+		b = tmp;
+	}
+	return a;
 }
 
-Interface *balancer_add_from_string(const char *addr_with_metric)
+static void rr_build_sequence(IfaceSet *set)
 {
-	char *addr_str, *metric_str;
-	HostAddress addr;
-	int metric;
-	Status s;
+	long *weights, *current;
+	long g = 0, total = 0, slots, left;
+	size_t k;
+	int i, best;
 
-	addr_str = split_string(addr_with_metric, '@', &metric_str);
+	set->sequence_dirty = 0;
+	set->sequence_len = set->sequence_pos = 0;
+	if (! set->n_classes)
+		return;
 
-	if (addr_str)
+	weights = (long *) fs_malloc(sizeof(long) * set->n_classes * 2);
+	current = weights + set->n_classes;
+	for (i = 0; i < set->n_classes; i++)
 	{
-		char *endptr;
-		s = host_address_from_str(addr_str, &addr);	
-		metric = strtol(metric_str, &endptr, 10);
-		if (*endptr)
-			s = STATUS_FAILURE;
-		free(addr_str);
+		weights[i] = (long) set->classes[i].metric * set->classes[i].len;
+		g = rr_gcd(g, weights[i]);
 	}
-	else
+	for (i = 0; i < set->n_classes; i++)
 	{
-		s = host_address_from_str(addr_with_metric, &addr);	
-		metric = -1;
+		weights[i] /= g;
+		total += weights[i];
+	}
+	slots = set->n_classes > RR_MAX_SEQUENCE ? set->n_classes : RR_MAX_SEQUENCE;
+	if (total > slots)
+	{
+		//Remainders are kept in current until the sequence is built
+		left = slots - set->n_classes;
+		for (i = 0; i < set->n_classes; i++)
+		{
+			current[i] = weights[i] * left % total;
+			weights[i] = 1 + weights[i] * left / total;
+			slots -= weights[i];
+		}
+		for (; slots > 0; slots--)
+		{
+			best = 0;
+			for (i = 0; i < set->n_classes; i++)
+				if (current[i] > current[best])
+					best = i;
+			current[best] = -1;
+			weights[best]++;
+		}
+		total = left + set->n_classes;
 	}
 
-	abort_if_fail(s == STATUS_SUCCESS,
-			"Failed to parse address %s", addr_with_metric);
+	if (set->sequence_alloc_len < (size_t) total)
+	{
+		set->sequence_alloc_len = total;
+		set->sequence = fs_realloc(set->sequence, 
+				sizeof(int) * set->sequence_alloc_len);
+	}
+
+	memset(current, 0, sizeof(long) * set->n_classes);
+	for (k = 0; k < (size_t) total; k++)
+	{
+		best = 0;
+		for (i = 0; i < set->n_classes; i++)
+		{
+			current[i] += weights[i];
+			if (current[i] > current[best])
+				best = i;
+		}
+		current[best] -= total;
+		set->sequence[k] = best;
+	}
+	set->sequence_len = total;
 
-	return balancer_add(addr, metric);
+	free(weights);
 }
 
-/* Verify that all addressses can be bound to. 
- * (Windows has a wierd problem that some IP addresses magically fail to bind.
- * No explanation yet. Hence exists this workaround to make our lives a 
- * bit easier.)
- */
-void balancer_verify()
+static void rr_class_add(IfaceSet *set, Interface *iface)
 {
-	int i, j;
-	int n_fails = 0;
-	Heap *heaps[2] = { ip4, ip6 };
-	for (i = 0; i < 2; i++)
-	{
-		if (heaps[i]->len == 0)
-			continue;
+	RoundRobinClass *class;
+	int i;
 
-		//Copy
-		Interface **ifaces = fs_malloc(sizeof(void *) * heaps[i]->len);
-		for (j = 0; j < heaps[i]->len; j++)	
-			ifaces[j] = heaps[i]->data[j];
+	for (i = 0; i < set->n_classes; i++)
+		if (set->classes[i].metric == iface->metric)
+			break;
 
-		for (j = 0; j < heaps[i]->len; j++)	
+	if (i == set->n_classes)
+	{
+		if (set->n_classes >= set->classes_alloc_len)
 		{
-			SocketHandle hd;
-			SocketAddress addr;
-			addr.host = ifaces[j]->addr;
-			addr.port = 0;
-			const Error *e = socket_handle_create_bound(addr, &hd);
-			if (e)
-			{
-				char str[ADDRESS_MAX_LEN];
-				host_address_to_str(addr.host, str);
-				fprintf(stderr, 
-						"Warning: Address %s is unusable, removing (%s)\n",
-							str, error_desc(e));
-				error_handle(e);
-				heap_delete(heaps[i], ifaces[j]);
-				n_fails++;
-			}
+			set->classes_alloc_len = set->classes_alloc_len 
+				? set->classes_alloc_len * 2 : 4;
+			set->classes = fs_realloc(set->classes, 
+					sizeof(RoundRobinClass) * set->classes_alloc_len);
 		}
-		free(ifaces);
+		class = set->classes + set->n_classes++;
+		memset(class, 0, sizeof(RoundRobinClass));
+		class->metric = iface->metric;
 	}
-	if (n_fails > 0)
+	class = set->classes + i;
+
+	if (class->len >= class->alloc_len)
 	{
-		fprintf(stderr, "Warning: %d addresses are not usable\n", n_fails);
+		class->alloc_len = class->alloc_len ? class->alloc_len * 2 : 8;
+		class->members = fs_realloc(class->members, 
+				sizeof(Interface *) * class->alloc_len);
 	}
-	if (ip4->len == 0 && ip6->len == 0)
+	iface->rr_class = i;
+	iface->rr_pos = class->len;
+	class->members[class->len++] = iface;
+	set->sequence_dirty = 1;
+}
+
+static void rr_class_remove(IfaceSet *set, Interface *iface)
+{
+	RoundRobinClass *class = set->classes + iface->rr_class;
+	size_t j;
+
+	set->sequence_dirty = 1;
+	class->len--;
+	if (iface->rr_pos < class->len)
 	{
-		fprintf(stderr, "Error: No addresses remaining!\n");
-		exit(2);
+		class->members[iface->rr_pos] = class->members[class->len];
+		class->members[iface->rr_pos]->rr_pos = iface->rr_pos;
 	}
-}
+	if (class->len)
+		return;
 
-define_static_error(balancer_struct_no_iface,
-		"No suitable interface available");
+	//Fill the hole with the last class
+	free(class->members);
+	set->n_classes--;
+	if (iface->rr_class < set->n_classes)
+	{
+		*class = set->classes[set->n_classes];
+		for (j = 0; j < class->len; j++)
+			class->members[j]->rr_class = iface->rr_class;
+	}
+}
 
-const Error *balancer_open_iface(NetworkType types,
-		Interface **iface_out, SocketHandle *hd_out)
+static void rr_clear(IfaceSet *set)
 {
-	Heap *heaps[2] = { NULL, NULL };
-	Interface *selected = NULL;
-	Heap *selected_heap = NULL;
-	SocketHandle hd;
-	const Error *e = NULL;
 	int i;
 
-	if (types & NETWORK_INET)
-		heaps[0] = ip4;
-	if (types & NETWORK_INET6)
-		heaps[1] = ip6;
+	for (i = 0; i < set->n_classes; i++)
+		free(set->classes[i].members);
+	free(set->classes);
+	set->classes = NULL;
+	set->n_classes = set->classes_alloc_len = 0;
+	free(set->sequence);
+	set->sequence = NULL;
+	set->sequence_len = set->sequence_alloc_len = set->sequence_pos = 0;
+	set->sequence_dirty = 1;
+}
+
+static void rr_insert(IfaceSet *set, Interface *iface)
+{
+	set_append(set, iface);
+	rr_class_add(set, iface);
+}
+
+static void rr_delete(IfaceSet *set, Interface *iface)
+{
+	rr_class_remove(set, iface);
+	set_remove(set, iface);
+}
 
-	for (i = 0; i < 2; i++)
+static void rr_update(IfaceSet *set, Interface *iface)
+{
+	if (set->classes[iface->rr_class].metric != iface->metric)
 	{
-		if (!heaps[i])
-			continue;
+		rr_class_remove(set, iface);
+		rr_class_add(set, iface);
+	}
+}
 
-		if (heaps[i]->len == 0)
-			continue;
+static void rr_rebuild(IfaceSet *set)
+{
+	size_t i;
 
+	rr_clear(set);
+	for (i = 0; i < set->len; i++)
+		rr_class_add(set, set->data[i]);
+}
 
-		if (selected_heap)
-		{
-			if (value(heaps[i], 0) >= value(selected_heap, 0))
-				continue;
-		}
+static Interface *rr_next(IfaceSet *set)
+{
+	RoundRobinClass *class;
+
+	if (set->sequence_dirty)
+		rr_build_sequence(set);
+	if (! set->sequence_len)
+		return NULL;
+
+	if (set->sequence_pos >= set->sequence_len)
+		set->sequence_pos = 0;
+	class = set->classes + set->sequence[set->sequence_pos++];
+
+	if (class->next >= class->len)
+		class->next = 0;
+	return class->members[class->next++];
+}
+
+static int select_contains(Interface **selected, int n, Interface *iface)
+{
+	int i;
 
-		selected_heap = heaps[i];
+	for (i = 0; i < n; i++)
+		if (selected[i] == iface)
+			return 1;
+	return 0;
+}
+
+static int rr_select(IfaceSet *set, int max, Interface **out)
+{
+	size_t attempts;
+	int n = 0;
+
+	for (attempts = 0; n < max && attempts < set->len + max; attempts++)
+	{
+		Interface *iface = rr_next(set);
+		if (! iface)
+			break;
+		if (! select_contains(out, n, iface))
+			out[n++] = iface;
 	}
 
-	if (! selected_heap)
-		return balancer_error_no_iface_instance;
+	return n;
+}
 
-	selected = selected_heap->data[0];
+static const Scheduler rr_scheduler = 
+{
+	rr_insert, rr_delete, rr_update, rr_rebuild, rr_select
+};
+
+//Power of two choices: the less loaded of two interfaces picked at 
+//random. Close to least loaded without keeping anything in order.
+static uint32_t p2c_random_state = 2463534242u;
+
+static Interface *p2c_random(IfaceSet *set, Interface **selected, int n, 
+		Interface *other)
+{
+	Interface *iface;
+	uint32_t x;
+	int tries;
+	size_t i;
 
+	for (tries = 0; tries < 4; tries++)
 	{
-		SocketAddress addr;
-		addr.host = selected->addr;
-		addr.port = 0;
-		e = socket_handle_create_bound(addr, &hd);
+		//xorshift32
+		x = p2c_random_state;
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		p2c_random_state = x;
+
+		iface = set->data[x % set->len];
+		if (iface != other && ! select_contains(selected, n, iface))
+			return iface;
+	}
+
+	for (i = 0; i < set->len; i++)
+	{
+		iface = set->data[i];
+		if (iface != other && ! select_contains(selected, n, iface))
+			return iface;
 	}
-	if (e)
-		return e;
 
-	selected->use_count++;
-	shift_down(selected_heap, selected->index);
-	*iface_out = selected;
-	*hd_out = hd;
 	return NULL;
 }
 
-NetworkType balancer_get_available_types()
+static void p2c_nop(IfaceSet *set, Interface *iface)
 {
-	return types;
+
 }
 
-void balancer_shutdown()
+static void p2c_rebuild(IfaceSet *set)
 {
-	int i, j;
-	Heap *heaps[2] = { ip4, ip6 };
 
-	for (i = 0; i < 2; i++)
+}
+
+static int p2c_select(IfaceSet *set, int max, Interface **out)
+{
+	Interface *a, *b;
+	int n = 0;
+
+	while (n < max && (a = p2c_random(set, out, n, NULL)))
 	{
-		if (! heaps[i]->data)
-			continue;
+		b = p2c_random(set, out, n, a);
+		out[n++] = b && interface_less(b, a) ? b : a;
+	}
+
+	return n;
+}
+
+static const Scheduler p2c_scheduler = 
+{
+	set_append, set_remove, p2c_nop, p2c_rebuild, p2c_select
+};
+
+static const Scheduler *scheduler = &heap_scheduler;
+
+//Set membership, must be called with the lock held
+static void interface_enter_set(Interface *iface)
+{
+	interface_update_key(iface);
+	scheduler->insert(interface_set(iface), iface);
+}
+
+static void interface_leave_set(Interface *iface)
+{
+	scheduler->delete(interface_set(iface), iface);
+}
+
+//Must be called with the lock held after load or metric changed
+static void interface_changed(Interface *iface)
+{
+	if (iface->index < 0)
+		return;
+	interface_update_key(iface);
+	scheduler->update(interface_set(iface), iface);
+}
+
+//Keys of all interfaces have changed
+static void set_rebuild(IfaceSet *set)
+{
+	size_t i;
+
+	for (i = 0; i < set->len; i++)
+		interface_update_key(set->data[i]);
+	scheduler->rebuild(set);
+}
+
+static void interface_close_spares(Interface *iface);
+static void interface_log(Interface *iface, LogLevel level, const char *msg);
+
+void interface_close(Interface *iface)
+{
+	int drained;
 
-		for (j = 0; j < heaps[i]->len; j++)
-			free(heaps[i]->data[j]);
-		free(heaps[i]->data);
+	mutex_lock(&balancer_mutex);
+	iface->use_count--;
+	interface_changed(iface);
+	drained = iface->removed && iface->use_count == 0;
+	mutex_unlock(&balancer_mutex);
 
-		memset(heaps[i], 0, sizeof(Heap));
+	if (drained)
+	{
+		interface_close_spares(iface);
+		interface_log(iface, LOG_LEVEL_INFO, "Drained");
 	}
+}
 
-	types = 0;
+//Health management
+static void interface_log(Interface *iface, LogLevel level, const char *msg)
+{
+	char str[ADDRESS_MAX_LEN];
+
+	host_address_to_str(iface->addr, str);
+	log_message(level, "Interface %s: %s", str, msg);
+}
+
+int balancer_eject(Interface *iface)
+{
+	IfaceSet *set = interface_set(iface);
+	int res = 0;
+
+	mutex_lock(&balancer_mutex);
+	//Keep the last interface of each family, failing fast is no better
+	//than trying
+	if (! iface->ejected && iface->index >= 0 && set->len > 1)
+	{
+		interface_leave_set(iface);
+		iface->ejected = 1;
+		affinity_dirty = 1;
+		res = 1;
+	}
+	mutex_unlock(&balancer_mutex);
+
+	if (res)
+		interface_log(iface, LOG_LEVEL_WARNING, "Ejected, seems to be down");
+	return res;
+}
+
+void balancer_restore(Interface *iface)
+{
+	int res = 0;
+
+	mutex_lock(&balancer_mutex);
+	if (iface->ejected && ! iface->removed)
+	{
+		iface->ejected = 0;
+		atomic_store(&iface->n_failures, 0);
+		interface_enter_set(iface);
+		affinity_dirty = 1;
+		res = 1;
+	}
+	mutex_unlock(&balancer_mutex);
+
+	if (res)
+		interface_log(iface, LOG_LEVEL_INFO, "Restored");
+}
+
+int interface_is_ejected(Interface *iface)
+{
+	int res;
+
+	mutex_lock(&balancer_mutex);
+	res = iface->ejected;
+	mutex_unlock(&balancer_mutex);
+
+	return res;
+}
+
+void balancer_set_failure_threshold(int n)
+{
+	failure_threshold = n;
+}
+
+void interface_report_success(Interface *iface)
+{
+	if (atomic_load_explicit(&iface->n_failures, memory_order_relaxed))
+		atomic_store_explicit(&iface->n_failures, 0, memory_order_relaxed);
+}
+
+void interface_report_failure(Interface *iface)
+{
+	int n = atomic_fetch_add(&iface->n_failures, 1) + 1;
+
+	if (failure_threshold > 0 && n == failure_threshold)
+		balancer_eject(iface);
+}
+
+size_t balancer_get_ifaces(Interface **ifaces_out, size_t max)
+{
+	size_t i, res;
+
+	mutex_lock(&balancer_mutex);
+	for (i = 0; i < n_all_ifaces && i < max; i++)
+		ifaces_out[i] = all_ifaces[i];
+	res = n_all_ifaces;
+	mutex_unlock(&balancer_mutex);
+
+	return res;
+}
+
+HostAddress interface_get_addr(Interface *iface)
+{
+	return iface->addr;
+}
+
+int interface_get_id(Interface *iface)
+{
+	return iface->id;
+}
+
+void interface_get_info(Interface *iface, InterfaceInfo *info)
+{
+	mutex_lock(&balancer_mutex);
+	info->addr = iface->addr;
+	info->metric = iface->metric;
+	info->use_count = iface->use_count;
+	info->srtt = iface->srtt;
+	info->shape_rate = iface->shape_rate;
+	info->ejected = iface->ejected;
+	mutex_unlock(&balancer_mutex);
+
+	mutex_lock(&iface->spare_lock);
+	info->n_spares = iface->n_spares;
+	mutex_unlock(&iface->spare_lock);
+}
+
+//Adds tokens for the time elapsed, must be called with shaper_lock held
+static void shaper_refill(Interface *iface)
+{
+	struct timeval now, elapsed;
+	double burst;
+
+	event_base_gettimeofday_cached(evbase, &now);
+	if (evutil_timercmp(&now, &iface->refilled, <=))
+		return;
+	evutil_timersub(&now, &iface->refilled, &elapsed);
+	iface->refilled = now;
+
+	burst = iface->shape_rate * SHAPER_BURST_MSEC / 1000.0;
+	if (burst < SHAPER_MIN_BURST)
+		burst = SHAPER_MIN_BURST;
+
+	iface->tokens += iface->shape_rate 
+		* (elapsed.tv_sec + elapsed.tv_usec / 1000000.0);
+	if (iface->tokens > burst)
+		iface->tokens = burst;
+}
+
+void interface_add_bytes(Interface *iface, size_t n_bytes)
+{
+	atomic_fetch_add_explicit(&iface->n_bytes, n_bytes, memory_order_relaxed);
+
+	if (iface->shape_rate)
+	{
+		mutex_lock(&iface->shaper_lock);
+		shaper_refill(iface);
+		iface->tokens -= n_bytes;
+		mutex_unlock(&iface->shaper_lock);
+	}
+}
+
+void interface_set_rate_limit(Interface *iface, double bytes_per_sec)
+{
+	mutex_lock(&balancer_mutex);
+	mutex_lock(&iface->shaper_lock);
+	iface->shape_rate = bytes_per_sec;
+	iface->tokens = 0;
+	event_base_gettimeofday_cached(evbase, &iface->refilled);
+	mutex_unlock(&iface->shaper_lock);
+	interface_changed(iface);
+	mutex_unlock(&balancer_mutex);
+}
+
+void interface_set_metric(Interface *iface, int metric)
+{
+	mutex_lock(&balancer_mutex);
+	iface->metric = metric < 1 ? 1 : metric;
+	interface_changed(iface);
+	affinity_dirty = 1;
+	mutex_unlock(&balancer_mutex);
+}
+
+long interface_shaper_delay(Interface *iface)
+{
+	long res = 0;
+
+	if (! iface->shape_rate)
+		return 0;
+
+	mutex_lock(&iface->shaper_lock);
+	shaper_refill(iface);
+	if (iface->tokens <= 0)
+		res = (long) ((1.0 - iface->tokens) * 1000000.0 / iface->shape_rate) 
+			+ 1;
+	mutex_unlock(&iface->shaper_lock);
+
+	return res;
+}
+
+void interface_add_rtt_sample(Interface *iface, long usec)
+{
+	mutex_lock(&balancer_mutex);
+	if (iface->srtt == 0)
+		iface->srtt = usec;
+	else
+		iface->srtt = LATENCY_RTT_ALPHA * usec 
+			+ (1.0 - LATENCY_RTT_ALPHA) * iface->srtt;
+	if (policy == BALANCER_POLICY_LATENCY)
+		interface_changed(iface);
+	mutex_unlock(&balancer_mutex);
+}
+
+//Updates throughput estimates and reorders the interfaces
+static void bandwidth_tick(evutil_socket_t fd, short events, void *data)
+{
+	double interval = BANDWIDTH_TICK_MSEC / 1000.0;
+	int i, j;
+
+	mutex_lock(&balancer_mutex);
+	for (i = 0; i < N_FAMILIES; i++)
+	{
+		for (j = 0; j < sets[i].len; j++)
+		{
+			Interface *iface = sets[i].data[j];
+			double sample = atomic_exchange_explicit
+				(&iface->n_bytes, 0, memory_order_relaxed) / interval;
+
+			iface->rate = BANDWIDTH_RATE_ALPHA * sample
+				+ (1.0 - BANDWIDTH_RATE_ALPHA) * iface->rate;
+			iface->capacity *= BANDWIDTH_CAPACITY_DECAY;
+			if (iface->capacity < iface->rate)
+				iface->capacity = iface->rate;
+		}
+		set_rebuild(sets + i);
+	}
+	mutex_unlock(&balancer_mutex);
+}
+
+void balancer_set_policy(BalancerPolicy new_policy)
+{
+	int i;
+
+	mutex_lock(&balancer_mutex);
+	policy = new_policy;
+	for (i = 0; i < N_FAMILIES; i++)
+		set_rebuild(sets + i);
+	mutex_unlock(&balancer_mutex);
+
+	//Measurements are taken on the calling thread's event loop
+	if (policy == BALANCER_POLICY_BANDWIDTH && ! bandwidth_tick_event)
+	{
+		struct timeval tv = { BANDWIDTH_TICK_MSEC / 1000, 
+			(BANDWIDTH_TICK_MSEC % 1000) * 1000 };
+		bandwidth_tick_event = event_new(evbase, -1, EV_PERSIST,
+				bandwidth_tick, NULL);
+		event_add(bandwidth_tick_event, &tv);
+	}
+}
+
+Status balancer_policy_from_str(const char *str, BalancerPolicy *policy_out)
+{
+	if (strcmp(str, "connections") == 0)
+		*policy_out = BALANCER_POLICY_CONNECTIONS;
+	else if (strcmp(str, "bandwidth") == 0)
+		*policy_out = BALANCER_POLICY_BANDWIDTH;
+	else if (strcmp(str, "latency") == 0)
+		*policy_out = BALANCER_POLICY_LATENCY;
+	else
+		return STATUS_FAILURE;
+
+	return STATUS_SUCCESS;
+}
+
+void balancer_set_scheduler(BalancerScheduler id)
+{
+	static const Scheduler *schedulers[] = 
+	{
+		&heap_scheduler, &rr_scheduler, &p2c_scheduler
+	};
+	int i;
+
+	mutex_lock(&balancer_mutex);
+	for (i = 0; i < N_FAMILIES; i++)
+		rr_clear(sets + i);
+	scheduler = schedulers[id];
+	for (i = 0; i < N_FAMILIES; i++)
+		set_rebuild(sets + i);
+	mutex_unlock(&balancer_mutex);
+}
+
+Status balancer_scheduler_from_str(const char *str, 
+		BalancerScheduler *scheduler_out)
+{
+	if (strcmp(str, "least-loaded") == 0)
+		*scheduler_out = BALANCER_SCHEDULER_LEAST_LOADED;
+	else if (strcmp(str, "round-robin") == 0)
+		*scheduler_out = BALANCER_SCHEDULER_ROUND_ROBIN;
+	else if (strcmp(str, "two-choices") == 0)
+		*scheduler_out = BALANCER_SCHEDULER_TWO_CHOICES;
+	else
+		return STATUS_FAILURE;
+
+	return STATUS_SUCCESS;
+}
+
+
+//Lists of interfaces, must be called with the lock held
+static void all_ifaces_add(Interface *iface)
+{
+	if (n_all_ifaces >= all_ifaces_alloc_len)
+	{
+		all_ifaces_alloc_len = all_ifaces_alloc_len ? all_ifaces_alloc_len * 2 : 8;
+		all_ifaces = fs_realloc(all_ifaces, 
+				sizeof(Interface *) * all_ifaces_alloc_len);
+	}
+	all_ifaces[n_all_ifaces++] = iface;
+	n_family_ifaces[family_index(iface->addr.type)]++;
+	types |= iface->addr.type;
+}
+
+static void all_ifaces_remove(Interface *iface)
+{
+	size_t i;
+
+	for (i = 0; i < n_all_ifaces; i++)
+	{
+		if (all_ifaces[i] == iface)
+		{
+			all_ifaces[i] = all_ifaces[--n_all_ifaces];
+			break;
+		}
+	}
+
+	if (--n_family_ifaces[family_index(iface->addr.type)] == 0)
+		types &= ~iface->addr.type;
+}
+
+static Interface *retired_ifaces_take(HostAddress addr)
+{
+	size_t i;
+	Interface *iface;
+
+	for (i = 0; i < n_retired_ifaces; i++)
+	{
+		iface = retired_ifaces[i];
+		if (iface->addr.type == addr.type 
+				&& memcmp(iface->addr.ip, addr.ip, 
+					addr.type == NETWORK_INET ? 4 : 16) == 0)
+		{
+			retired_ifaces[i] = retired_ifaces[--n_retired_ifaces];
+			return iface;
+		}
+	}
+
+	return NULL;
+}
+
+static void retired_ifaces_add(Interface *iface)
+{
+	if (n_retired_ifaces >= retired_ifaces_alloc_len)
+	{
+		retired_ifaces_alloc_len = retired_ifaces_alloc_len 
+			? retired_ifaces_alloc_len * 2 : 8;
+		retired_ifaces = fs_realloc(retired_ifaces, 
+				sizeof(Interface *) * retired_ifaces_alloc_len);
+	}
+	retired_ifaces[n_retired_ifaces++] = iface;
+}
+
+static const Mutex shaper_lock_init = MUTEX_INITIALIZER;
+
+Interface *balancer_add(HostAddress addr, int metric)
+{
+	Interface *iface;
+
+	mutex_lock(&balancer_mutex);
+	iface = retired_ifaces_take(addr);
+	if (iface)
+	{
+		//Sessions still draining keep counting towards its load
+		iface->metric = metric < 1 ? 1 : metric;
+		iface->removed = 0;
+		iface->ejected = 0;
+		atomic_store(&iface->n_failures, 0);
+		all_ifaces_add(iface);
+		interface_enter_set(iface);
+		affinity_dirty = 1;
+		mutex_unlock(&balancer_mutex);
+
+		interface_log(iface, LOG_LEVEL_INFO, "Added again");
+		return iface;
+	}
+	mutex_unlock(&balancer_mutex);
+
+	iface = (Interface *) fs_malloc(sizeof(Interface));
+	
+	iface->index = -1;
+	iface->addr = addr;
+	iface->metric = metric < 1 ? 1 : metric;
+	iface->use_count = 0;
+	atomic_init(&iface->n_bytes, 0);
+	iface->rate = 0;
+	iface->capacity = 0;
+	iface->srtt = 0;
+	atomic_init(&iface->n_failures, 0);
+	iface->ejected = 0;
+	iface->removed = 0;
+	iface->shape_rate = 0;
+	iface->shaper_lock = shaper_lock_init;
+	iface->tokens = 0;
+	evutil_timerclear(&iface->refilled);
+	iface->spare_lock = shaper_lock_init;
+	iface->n_spares = 0;
+	atomic_init(&iface->refill_queued, 0);
+	iface->refill_next = NULL;
+	
+	mutex_lock(&balancer_mutex);
+	all_ifaces_add(iface);
+	iface->id = next_iface_id++;
+	interface_enter_set(iface);
+	affinity_dirty = 1;
+	mutex_unlock(&balancer_mutex);
+	
+	return iface;
+}
+
+void balancer_remove(Interface *iface)
+{
+	int drained;
+
+	mutex_lock(&balancer_mutex);
+	if (iface->removed)
+	{
+		mutex_unlock(&balancer_mutex);
+		return;
+	}
+	if (iface->index >= 0)
+		interface_leave_set(iface);
+	iface->removed = 1;
+	iface->ejected = 0;
+	all_ifaces_remove(iface);
+	retired_ifaces_add(iface);
+	affinity_dirty = 1;
+	drained = iface->use_count == 0;
+	mutex_unlock(&balancer_mutex);
+
+	if (drained)
+	{
+		interface_close_spares(iface);
+		interface_log(iface, LOG_LEVEL_INFO, "Removed");
+	}
+	else
+	{
+		interface_log(iface, LOG_LEVEL_INFO, 
+				"Removed, existing connections continue");
+	}
+}
+
+int interface_is_removed(Interface *iface)
+{
+	int res;
+
+	mutex_lock(&balancer_mutex);
+	res = iface->removed;
+	mutex_unlock(&balancer_mutex);
+
+	return res;
+}
+
+Status interface_spec_parse(const char *str, InterfaceSpec *spec_out)
+{
+	char *addr_str, *metric_str, *spec, *rate_str;
+	Status s = STATUS_SUCCESS;
+
+	spec_out->metric = -1;
+	spec_out->rate = 0;
+
+	//Optional rate limit after '/'
+	spec = split_string(str, '/', &rate_str);
+	if (spec)
+	{
+		s = parse_bitrate(rate_str, &spec_out->rate);
+		str = spec;
+	}
+
+	addr_str = split_string(str, '@', &metric_str);
+
+	if (s != STATUS_SUCCESS)
+	{
+		//Invalid rate limit
+	}
+	else if (addr_str)
+	{
+		char *endptr;
+		s = host_address_from_str(addr_str, &spec_out->addr);	
+		spec_out->metric = strtol(metric_str, &endptr, 10);
+		if (*endptr || spec_out->metric < 1)
+			s = STATUS_FAILURE;
+	}
+	else
+	{
+		s = host_address_from_str(str, &spec_out->addr);	
+	}
+
+	free(addr_str);
+	free(spec);
+	return s;
+}
+
+Interface *balancer_add_from_string(const char *addr_with_metric)
+{
+	InterfaceSpec spec;
+	Interface *iface;
+
+	abort_if_fail(interface_spec_parse(addr_with_metric, &spec) 
+			== STATUS_SUCCESS,
+			"Failed to parse address %s", addr_with_metric);
+
+	iface = balancer_add(spec.addr, spec.metric);
+	if (spec.rate)
+		interface_set_rate_limit(iface, spec.rate);
+
+	return iface;
+}
+
+/* Verify that all addressses can be bound to. 
+ * (Windows has a wierd problem that some IP addresses magically fail to bind.
+ * No explanation yet. Hence exists this workaround to make our lives a 
+ * bit easier.)
+ */
+void balancer_verify()
+{
+	int i, j;
+	int n_fails = 0;
+	size_t n_usable = 0;
+	for (i = 0; i < N_FAMILIES; i++)
+	{
+		size_t len = sets[i].len;
+		if (len == 0)
+			continue;
+
+		//Copy
+		Interface **ifaces = fs_malloc(sizeof(void *) * len);
+		for (j = 0; j < len; j++)	
+			ifaces[j] = sets[i].data[j];
+
+		for (j = 0; j < len; j++)	
+		{
+			SocketHandle hd;
+			SocketAddress addr;
+			addr.host = ifaces[j]->addr;
+			addr.port = 0;
+			const Error *e = socket_handle_create_bound(addr, &hd);
+			if (e)
+			{
+				char str[ADDRESS_MAX_LEN];
+				host_address_to_str(addr.host, str);
+				fprintf(stderr, 
+						"Warning: Address %s is unusable, removing (%s)\n",
+							str, error_desc(e));
+				error_handle(e);
+				balancer_remove(ifaces[j]);
+				n_fails++;
+			}
+		}
+		free(ifaces);
+	}
+	if (n_fails > 0)
+	{
+		fprintf(stderr, "Warning: %d addresses are not usable\n", n_fails);
+	}
+	for (i = 0; i < N_FAMILIES; i++)
+		n_usable += sets[i].len;
+	if (! n_usable)
+	{
+		fprintf(stderr, "Error: No addresses remaining!\n");
+		exit(2);
+	}
+}
+
+//Spare sockets
+//Creating and binding a socket takes several system calls. Each interface
+//keeps a few sockets ready, so that connecting does not wait for them.
+//Sockets taken are replaced once the thread has handled its pending 
+//events.
+static THREAD_LOCAL struct event *refill_event = NULL;
+static THREAD_LOCAL Interface *refill_head = NULL;
+
+static const Error *interface_create_socket
+	(Interface *iface, SocketHandle *hd_out)
+{
+	SocketAddress addr;
+	const Error *e;
+
+	addr.host = iface->addr;
+	addr.port = 0;
+	e = socket_handle_create_bound(addr, hd_out);
+	if (e)
+		return e;
+
+	e = socket_handle_set_blocking(*hd_out, 0);
+	if (e)
+		socket_handle_close(*hd_out);
+	return e;
+}
+
+static void interface_refill(Interface *iface)
+{
+	SocketHandle hd;
+	const Error *e;
+	int stored;
+
+	//Removed interfaces only need sockets again once they are added back
+	if (interface_is_removed(iface))
+		return;
+
+	while (1)
+	{
+		mutex_lock(&iface->spare_lock);
+		stored = iface->n_spares;
+		mutex_unlock(&iface->spare_lock);
+		if (stored >= BALANCER_SPARE_SOCKETS)
+			break;
+
+		e = interface_create_socket(iface, &hd);
+		if (e)
+		{
+			error_handle(e);
+			break;
+		}
+
+		mutex_lock(&iface->spare_lock);
+		stored = iface->n_spares < BALANCER_SPARE_SOCKETS;
+		if (stored)
+			iface->spares[iface->n_spares++] = hd;
+		mutex_unlock(&iface->spare_lock);
+		if (! stored)
+		{
+			socket_handle_close(hd);
+			break;
+		}
+	}
+}
+
+static void balancer_refill_cb(evutil_socket_t fd, short events, void *data)
+{
+	Interface *iface;
+
+	while (refill_head)
+	{
+		iface = refill_head;
+		refill_head = iface->refill_next;
+		atomic_store(&iface->refill_queued, 0);
+		interface_refill(iface);
+	}
+}
+
+static void interface_queue_refill(Interface *iface)
+{
+	if (atomic_exchange(&iface->refill_queued, 1))
+		return;
+
+	iface->refill_next = refill_head;
+	refill_head = iface;
+
+	if (! refill_event)
+	{
+		refill_event = event_new(evbase, -1, 0, balancer_refill_cb, NULL);
+		abort_if_fail(refill_event, "event_new() failed");
+	}
+	event_active(refill_event, EV_TIMEOUT, 0);
+}
+
+//Takes a spare socket, or creates one if there are none
+static const Error *interface_open_socket
+	(Interface *iface, SocketHandle *hd_out)
+{
+	int found = 0;
+
+	mutex_lock(&iface->spare_lock);
+	if (iface->n_spares)
+	{
+		*hd_out = iface->spares[--iface->n_spares];
+		found = 1;
+	}
+	mutex_unlock(&iface->spare_lock);
+
+	interface_queue_refill(iface);
+
+	if (found)
+		return NULL;
+	return interface_create_socket(iface, hd_out);
+}
+
+static void interface_close_spares(Interface *iface)
+{
+	int i;
+
+	mutex_lock(&iface->spare_lock);
+	for (i = 0; i < iface->n_spares; i++)
+		socket_handle_close(iface->spares[i]);
+	iface->n_spares = 0;
+	mutex_unlock(&iface->spare_lock);
+}
+
+void balancer_thread_shutdown()
+{
+	Interface *iface;
+
+	while (refill_head)
+	{
+		iface = refill_head;
+		refill_head = iface->refill_next;
+		atomic_store(&iface->refill_queued, 0);
+	}
+	if (refill_event)
+		event_free(refill_event);
+	refill_event = NULL;
+}
+
+define_static_error(balancer_struct_no_iface,
+		"No suitable interface available");
+
+//Picks up to max distinct interfaces, best first, and counts a use on each
+int balancer_select_ifaces(NetworkType types, int max, 
+		Interface **selected)
+{
+	Interface *candidates[N_FAMILIES][BALANCER_MAX_IFACES];
+	int n_candidates[N_FAMILIES] = { 0, 0 }, next[N_FAMILIES] = { 0, 0 };
+	int n_selected = 0;
+	int i;
+
+	abort_if_fail(max > 0 && max <= BALANCER_MAX_IFACES,
+			"Assertion failure");
+
+	mutex_lock(&balancer_mutex);
+
+	for (i = 0; i < N_FAMILIES; i++)
+		if (types & families[i])
+			n_candidates[i] = scheduler->select(sets + i, max, candidates[i]);
+
+	//Merge candidates of both families, best first
+	while (n_selected < max)
+	{
+		int sel = -1;
+
+		for (i = 0; i < N_FAMILIES; i++)
+		{
+			if (next[i] >= n_candidates[i])
+				continue;
+
+			if (sel >= 0 && ! interface_less(candidates[i][next[i]], 
+						candidates[sel][next[sel]]))
+				continue;
+
+			sel = i;
+		}
+
+		if (sel < 0)
+			break;
+
+		selected[n_selected++] = candidates[sel][next[sel]++];
+	}
+
+	//Account for the use before unlocking, so that other threads see it
+	for (i = 0; i < n_selected; i++)
+	{
+		selected[i]->use_count++;
+		interface_changed(selected[i]);
+	}
+
+	mutex_unlock(&balancer_mutex);
+
+	return n_selected;
+}
+
+//Opens sockets bound to up to max distinct interfaces with least load.
+//Returns error only if no socket could be opened.
+static const Error *balancer_open_ifaces_internal(NetworkType types, 
+		int max, int udp, 
+		Interface **ifaces_out, SocketHandle *hds_out, int *n_out)
+{
+	Interface *selected[BALANCER_MAX_IFACES];
+	int n_selected;
+	const Error *e = NULL;
+	int i, n_out_val = 0;
+
+	n_selected = balancer_select_ifaces(types, max, selected);
+	if (! n_selected)
+		return balancer_error_no_iface_instance;
+
+	for (i = 0; i < n_selected; i++)
+	{
+		SocketAddress addr;
+		SocketHandle hd;
+
+		addr.host = selected[i]->addr;
+		addr.port = 0;
+		error_handle(e);
+		if (udp)
+			e = socket_handle_create_udp(addr, &hd);
+		else
+			e = interface_open_socket(selected[i], &hd);
+		if (e)
+		{
+			interface_close(selected[i]);
+			continue;
+		}
+
+		ifaces_out[n_out_val] = selected[i];
+		hds_out[n_out_val] = hd;
+		n_out_val++;
+	}
+
+	*n_out = n_out_val;
+	if (n_out_val)
+	{
+		error_handle(e);
+		return NULL;
+	}
+	return e;
+}
+
+const Error *balancer_open_ifaces(NetworkType types, int max,
+		Interface **ifaces_out, SocketHandle *hds_out, int *n_out)
+{
+	return balancer_open_ifaces_internal(types, max, 0, 
+			ifaces_out, hds_out, n_out);
+}
+
+const Error *balancer_open_iface(NetworkType types,
+		Interface **iface_out, SocketHandle *hd_out)
+{
+	int n;
+
+	return balancer_open_ifaces(types, 1, iface_out, hd_out, &n);
+}
+
+const Error *balancer_open_iface_udp(NetworkType types,
+		Interface **iface_out, SocketHandle *hd_out)
+{
+	int n;
+
+	return balancer_open_ifaces_internal(types, 1, 1, 
+			iface_out, hd_out, &n);
+}
+
+//Affinity
+//Destinations are mapped to interfaces by consistent hashing, each
+//interface owning points on a ring in proportion to its metric. 
+//Mappings are remembered in a bounded table, so that a destination keeps
+//its interface until the interface is ejected or the entry is evicted.
+
+//Ring points per unit of metric
+#define AFFINITY_POINTS_PER_METRIC (16)
+
+typedef struct
+{
+	uint32_t hash;
+	Interface *iface;
+} RingPoint;
+
+typedef struct
+{
+	RingPoint *points;
+	size_t len;
+} Ring;
+
+static Ring rings[N_FAMILIES] = { {NULL, 0}, {NULL, 0} };
+
+typedef struct _AffinityEntry AffinityEntry;
+struct _AffinityEntry
+{
+	AffinityEntry *hash_next;
+	AffinityEntry *lru_prev, *lru_next; //< Most recently used first
+	uint32_t hash;
+	NetworkType type;
+	Interface *iface;
+	char key[];
+};
+
+static struct
+{
+	AffinityEntry **buckets;
+	size_t n_buckets; //< Power of 2
+	size_t len, max_len;
+	AffinityEntry *lru_head, *lru_tail;
+} affinity = { NULL, 0, 0, 0, NULL, NULL };
+
+//FNV-1a followed by a finalizer, so that nearby keys spread over the ring
+static uint32_t affinity_hash(const char *key, unsigned int salt)
+{
+	uint32_t hash = 2166136261u;
+	const char *iter;
+	uint8_t c;
+
+	for (iter = key; *iter; iter++)
+	{
+		c = *iter;
+		hash ^= (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+		hash *= 16777619u;
+	}
+	hash ^= salt;
+	hash *= 16777619u;
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+static int ring_point_cmp(const void *a, const void *b)
+{
+	uint32_t x = ((const RingPoint *) a)->hash;
+	uint32_t y = ((const RingPoint *) b)->hash;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void affinity_rebuild_rings()
+{
+	int i, k;
+	size_t j, n;
+
+	for (i = 0; i < N_FAMILIES; i++)
+	{
+		n = 0;
+		for (j = 0; j < sets[i].len; j++)
+			n += sets[i].data[j]->metric * AFFINITY_POINTS_PER_METRIC;
+
+		rings[i].points = fs_realloc(rings[i].points, 
+				sizeof(RingPoint) * (n + 1));
+		rings[i].len = 0;
+
+		for (j = 0; j < sets[i].len; j++)
+		{
+			Interface *iface = sets[i].data[j];
+			char str[ADDRESS_MAX_LEN];
+
+			//Points depend only on the address, not on set order
+			host_address_to_str(iface->addr, str);
+			for (k = 0; k < iface->metric * AFFINITY_POINTS_PER_METRIC; k++)
+			{
+				RingPoint *point = rings[i].points + rings[i].len++;
+				point->hash = affinity_hash(str, k);
+				point->iface = iface;
+			}
+		}
+
+		qsort(rings[i].points, rings[i].len, sizeof(RingPoint), 
+				ring_point_cmp);
+	}
+
+	affinity_dirty = 0;
+}
+
+static Interface *affinity_ring_lookup(Ring *ring, uint32_t hash)
+{
+	size_t lo = 0, hi = ring->len;
+
+	if (! ring->len)
+		return NULL;
+
+	//First point at or after hash, wrapping around
+	while (lo < hi)
+	{
+		size_t mid = (lo + hi) / 2;
+		if (ring->points[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == ring->len)
+		lo = 0;
+
+	return ring->points[lo].iface;
+}
+
+static void affinity_lru_unlink(AffinityEntry *entry)
+{
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		affinity.lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		affinity.lru_tail = entry->lru_prev;
+}
+
+static void affinity_lru_push(AffinityEntry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = affinity.lru_head;
+	if (affinity.lru_head)
+		affinity.lru_head->lru_prev = entry;
+	else
+		affinity.lru_tail = entry;
+	affinity.lru_head = entry;
+}
+
+static AffinityEntry **affinity_bucket(uint32_t hash)
+{
+	return affinity.buckets + (hash & (affinity.n_buckets - 1));
+}
+
+static void affinity_remove(AffinityEntry *entry)
+{
+	AffinityEntry **link = affinity_bucket(entry->hash);
+
+	while (*link != entry)
+		link = &((*link)->hash_next);
+	*link = entry->hash_next;
+
+	affinity_lru_unlink(entry);
+	affinity.len--;
+	free(entry);
+}
+
+void balancer_set_affinity(size_t max_entries)
+{
+	mutex_lock(&balancer_mutex);
+
+	while (affinity.len > max_entries)
+		affinity_remove(affinity.lru_tail);
+	affinity.max_len = max_entries;
+
+	if (max_entries && ! affinity.buckets)
+	{
+		affinity.n_buckets = 64;
+		while (affinity.n_buckets < max_entries)
+			affinity.n_buckets *= 2;
+		affinity.buckets = fs_malloc(sizeof(AffinityEntry *) 
+				* affinity.n_buckets);
+		memset(affinity.buckets, 0, 
+				sizeof(AffinityEntry *) * affinity.n_buckets);
+	}
+
+	mutex_unlock(&balancer_mutex);
+}
+
+int balancer_affinity_enabled()
+{
+	return affinity.max_len > 0;
+}
+
+//Finds interface for the key, must be called with the lock held
+static Interface *affinity_select(NetworkType type, const char *key)
+{
+	uint32_t hash = affinity_hash(key, type);
+	AffinityEntry *entry;
+	size_t key_len;
+	Interface *iface;
+
+	for (entry = *affinity_bucket(hash); entry; entry = entry->hash_next)
+	{
+		if (entry->hash == hash && entry->type == type
+				&& evutil_ascii_strcasecmp(entry->key, key) == 0)
+			break;
+	}
+
+	//Interfaces out of the sets were ejected or removed
+	if (entry && entry->iface->index >= 0)
+	{
+		affinity_lru_unlink(entry);
+		affinity_lru_push(entry);
+		return entry->iface;
+	}
+
+	if (affinity_dirty)
+		affinity_rebuild_rings();
+	iface = affinity_ring_lookup(rings + family_index(type), hash);
+	if (! iface)
+		return NULL;
+
+	if (entry)
+	{
+		//Previous interface was ejected or removed
+		entry->iface = iface;
+		affinity_lru_unlink(entry);
+		affinity_lru_push(entry);
+		return iface;
+	}
+
+	if (affinity.len >= affinity.max_len)
+		affinity_remove(affinity.lru_tail);
+
+	key_len = strlen(key);
+	entry = fs_malloc(sizeof(AffinityEntry) + key_len + 1);
+	memcpy(entry->key, key, key_len + 1);
+	entry->hash = hash;
+	entry->type = type;
+	entry->iface = iface;
+	entry->hash_next = *affinity_bucket(hash);
+	*affinity_bucket(hash) = entry;
+	affinity_lru_push(entry);
+	affinity.len++;
+
+	return iface;
+}
+
+const Error *balancer_open_iface_keyed(NetworkType type, const char *key,
+		Interface **iface_out, SocketHandle *hd_out)
+{
+	Interface *selected;
+	SocketHandle hd;
+	const Error *e;
+
+	if (! key || ! balancer_affinity_enabled())
+		return balancer_open_iface(type, iface_out, hd_out);
+
+	abort_if_fail(type == NETWORK_INET || type == NETWORK_INET6,
+			"Assertion failure");
+
+	mutex_lock(&balancer_mutex);
+	selected = affinity_select(type, key);
+	if (selected)
+	{
+		selected->use_count++;
+		interface_changed(selected);
+	}
+	mutex_unlock(&balancer_mutex);
+
+	if (! selected)
+		return balancer_error_no_iface_instance;
+
+	e = interface_open_socket(selected, &hd);
+	if (e)
+	{
+		interface_close(selected);
+		return e;
+	}
+
+	*iface_out = selected;
+	*hd_out = hd;
+	return NULL;
+}
+
+NetworkType balancer_get_available_types()
+{
+	return types;
+}
+
+void balancer_shutdown()
+{
+	int i;
+	size_t j;
+	for (i = 0; i < N_FAMILIES; i++)
+	{
+		rr_clear(sets + i);
+		if (sets[i].data)
+			free(sets[i].data);
+
+		memset(sets + i, 0, sizeof(IfaceSet));
+	}
+
+	while (affinity.len)
+		affinity_remove(affinity.lru_tail);
+	free(affinity.buckets);
+	memset(&affinity, 0, sizeof(affinity));
+	for (i = 0; i < N_FAMILIES; i++)
+	{
+		free(rings[i].points);
+		rings[i].points = NULL;
+		rings[i].len = 0;
+	}
+	affinity_dirty = 1;
+
+	//Interfaces on this thread's refill queue are about to be freed
+	balancer_thread_shutdown();
+	for (j = 0; j < n_all_ifaces; j++)
+	{
+		interface_close_spares(all_ifaces[j]);
+		free(all_ifaces[j]);
+	}
+	free(all_ifaces);
+	all_ifaces = NULL;
+	n_all_ifaces = all_ifaces_alloc_len = 0;
+	for (j = 0; j < n_retired_ifaces; j++)
+	{
+		interface_close_spares(retired_ifaces[j]);
+		free(retired_ifaces[j]);
+	}
+	free(retired_ifaces);
+	retired_ifaces = NULL;
+	n_retired_ifaces = retired_ifaces_alloc_len = 0;
+	memset(n_family_ifaces, 0, sizeof(n_family_ifaces));
+	next_iface_id = 0;
+
+	types = 0;
+
+	if (bandwidth_tick_event)
+	{
+		event_free(bandwidth_tick_event);
+		bandwidth_tick_event = NULL;
+	}
+	policy = BALANCER_POLICY_CONNECTIONS;
+	scheduler = &heap_scheduler;
 }
 
@@ -25,17 +25,159 @@ void interface_close(Interface *iface);
 
 HostAddress interface_get_addr(Interface *iface);
 
+//Small integer identifying the interface, unique until balancer_shutdown()
+int interface_get_id(Interface *iface);
+
+//Snapshot of interface state, for statistics
+typedef struct
+{
+	HostAddress addr;
+	int metric;
+	int use_count;
+	double srtt; //< Smoothed round trip time in microseconds, 0 if unknown
+	double shape_rate; //< Rate limit in bytes per second, 0 if none
+	int ejected;
+	int n_spares; //< Sockets ready for connecting
+} InterfaceInfo;
+
+void interface_get_info(Interface *iface, InterfaceInfo *info);
+
+//Accounts for data relayed through the interface
+void interface_add_bytes(Interface *iface, size_t n_bytes);
+
+//Shaping
+//Data relayed through a shaped interface is limited to its rate by a 
+//token bucket. The balancer prefers unshaped interfaces.
+void interface_set_rate_limit(Interface *iface, double bytes_per_sec);
+
+//Microseconds to wait before relaying any more data through the 
+//interface, 0 if it is not over its rate limit.
+long interface_shaper_delay(Interface *iface);
+
+//Accounts for a round trip time measured through the interface
+void interface_add_rtt_sample(Interface *iface, long usec);
+
+//Health management
+//Interfaces that seem to be down are ejected from selection until they 
+//are restored. The last interface of each address family is never ejected.
+#define BALANCER_DEFAULT_FAILURE_THRESHOLD (3)
+
+int balancer_eject(Interface *iface);
+
+void balancer_restore(Interface *iface);
+
+int interface_is_ejected(Interface *iface);
+
+//Number of consecutive connection failures that ejects an interface,
+//0 to disable.
+void balancer_set_failure_threshold(int n);
+
+//Outcome of a connection attempt through the interface. Only failures
+//that indicate a problem with the interface should be reported.
+void interface_report_success(Interface *iface);
+void interface_report_failure(Interface *iface);
+
+//Copies pointers to up to max interfaces, returns the total count
+size_t balancer_get_ifaces(Interface **ifaces_out, size_t max);
+
+//Metrics below 1 are taken as 1
 Interface *balancer_add(HostAddress addr, int metric);
 
+//Interface as given on the command line: address[@metric][/rate]
+typedef struct
+{
+	HostAddress addr;
+	int metric; //< At least 1, -1 if not given
+	double rate; //< Bytes per second, 0 if not given
+} InterfaceSpec;
+
+Status interface_spec_parse(const char *str, InterfaceSpec *spec_out);
+
 Interface *balancer_add_from_string(const char *addr_with_metric);
 
+//Takes the interface out of selection. Connections through it continue 
+//until they end, after which it is said to be drained. Adding the same
+//address again returns the same interface.
+void balancer_remove(Interface *iface);
+
+int interface_is_removed(Interface *iface);
+
+void interface_set_metric(Interface *iface, int metric);
+
 void balancer_verify();
 
+//How interfaces are selected
+typedef enum
+{
+	//Fewest connections relative to metric
+	BALANCER_POLICY_CONNECTIONS,
+	//Least measured throughput relative to estimated capacity, 
+	//metric sets the capacity assumed before anything is measured
+	BALANCER_POLICY_BANDWIDTH,
+	//Least expected delay, from round trip times measured when connecting 
+	//and by the kernel for established connections, multiplied by 
+	//connections relative to metric
+	BALANCER_POLICY_LATENCY
+} BalancerPolicy;
+
+void balancer_set_policy(BalancerPolicy policy);
+
+Status balancer_policy_from_str(const char *str, BalancerPolicy *policy_out);
+
+//How interfaces are picked, given their load under the policy
+typedef enum
+{
+	//Least loaded interface, kept at the top of a heap
+	BALANCER_SCHEDULER_LEAST_LOADED,
+	//Smooth weighted round robin in proportion to metric, ignoring load
+	BALANCER_SCHEDULER_ROUND_ROBIN,
+	//Less loaded of two interfaces picked at random
+	BALANCER_SCHEDULER_TWO_CHOICES
+} BalancerScheduler;
+
+void balancer_set_scheduler(BalancerScheduler scheduler);
+
+Status balancer_scheduler_from_str(const char *str, 
+		BalancerScheduler *scheduler_out);
+
 extern const char balancer_error_no_iface[];
 
+//Opens a non-blocking socket bound to the least loaded interface. 
+//Each interface keeps up to BALANCER_SPARE_SOCKETS sockets ready.
 const Error *balancer_open_iface(NetworkType types,
 		Interface **iface_out, SocketHandle *hd_out);
 
+#define BALANCER_SPARE_SOCKETS (4)
+
+#define BALANCER_MAX_IFACES (8)
+
+const Error *balancer_open_ifaces(NetworkType types, int max,
+		Interface **ifaces_out, SocketHandle *hds_out, int *n_out);
+
+//Only picks up to max distinct interfaces, without opening sockets.
+//Each one counts a connection until interface_close().
+int balancer_select_ifaces(NetworkType types, int max, 
+		Interface **ifaces_out);
+
+//Like balancer_open_iface(), but opens a datagram socket
+const Error *balancer_open_iface_udp(NetworkType types,
+		Interface **iface_out, SocketHandle *hd_out);
+
+//Affinity mode: each destination sticks to one interface, chosen by 
+//consistent hashing over interfaces weighted by metric. Up to max_entries
+//mappings are remembered, 0 disables affinity.
+void balancer_set_affinity(size_t max_entries);
+
+int balancer_affinity_enabled();
+
+//Like balancer_open_iface(), but in affinity mode the interface is chosen
+//by key (destination host name or address) instead of by load.
+const Error *balancer_open_iface_keyed(NetworkType type, const char *key,
+		Interface **iface_out, SocketHandle *hd_out);
+
 NetworkType balancer_get_available_types();
 
+//Drops the spare socket refills queued by the calling thread
+void balancer_thread_shutdown();
+
 void balancer_shutdown();
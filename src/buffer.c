@@ -0,0 +1,186 @@
+/* buffer.c
+ * Ring buffer for relayed data
+ * 
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ * 
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "incl.h"
+
+void ring_buffer_init(RingBuffer *buf, void *mem, size_t size)
+{
+	buf->data = (uint8_t *) mem;
+	buf->size = size;
+	buf->start = 0;
+	buf->len = 0;
+}
+
+void ring_buffer_move(RingBuffer *buf, void *mem, size_t size)
+{
+	IoVec vecs[2];
+	int n_vecs, i;
+	size_t done = 0;
+
+	abort_if_fail(buf->len <= size, "Ring buffer overflow");
+
+	n_vecs = ring_buffer_data_vecs(buf, vecs);
+	for (i = 0; i < n_vecs; i++)
+	{
+		memcpy((uint8_t *) mem + done, vecs[i].data, vecs[i].len);
+		done += vecs[i].len;
+	}
+
+	buf->data = (uint8_t *) mem;
+	buf->size = size;
+	buf->start = 0;
+}
+
+int ring_buffer_data_vecs(RingBuffer *buf, IoVec vecs[2])
+{
+	size_t first;
+
+	if (! buf->len)
+		return 0;
+
+	first = buf->size - buf->start;
+	if (first > buf->len)
+		first = buf->len;
+
+	vecs[0].data = buf->data + buf->start;
+	vecs[0].len = first;
+	if (first == buf->len)
+		return 1;
+
+	vecs[1].data = buf->data;
+	vecs[1].len = buf->len - first;
+	return 2;
+}
+
+int ring_buffer_space_vecs(RingBuffer *buf, IoVec vecs[2])
+{
+	size_t end, space;
+
+	space = ring_buffer_space(buf);
+	if (! space)
+		return 0;
+
+	end = buf->start + buf->len;
+	if (end >= buf->size)
+	{
+		//Free space is contiguous, between end and start
+		vecs[0].data = buf->data + end - buf->size;
+		vecs[0].len = space;
+		return 1;
+	}
+
+	vecs[0].data = buf->data + end;
+	vecs[0].len = buf->size - end;
+	if (vecs[0].len == space)
+		return 1;
+
+	vecs[1].data = buf->data;
+	vecs[1].len = space - vecs[0].len;
+	return 2;
+}
+
+void ring_buffer_produce(RingBuffer *buf, size_t len)
+{
+	abort_if_fail(len <= ring_buffer_space(buf), "Ring buffer overflow");
+
+	buf->len += len;
+}
+
+void ring_buffer_produce_at(RingBuffer *buf, size_t offset, size_t len)
+{
+	size_t end = buf->start + buf->len;
+
+	if (! buf->len)
+		buf->start = offset;
+	else
+		abort_if_fail(offset == (end >= buf->size ? end - buf->size : end),
+				"Ring buffer produced out of order");
+
+	ring_buffer_produce(buf, len);
+}
+
+void ring_buffer_consume(RingBuffer *buf, size_t len)
+{
+	abort_if_fail(len <= buf->len, "Ring buffer underflow");
+
+	buf->len -= len;
+	buf->start += len;
+	if (buf->start >= buf->size)
+		buf->start -= buf->size;
+
+	//Keep small exchanges (like SOCKS handshake) contiguous
+	if (! buf->len)
+		buf->start = 0;
+}
+
+static void reverse(uint8_t *data, size_t len)
+{
+	size_t i;
+	uint8_t tmp;
+
+	for (i = 0; i < len / 2; i++)
+	{
+		tmp = data[i];
+		data[i] = data[len - 1 - i];
+		data[len - 1 - i] = tmp;
+	}
+}
+
+uint8_t *ring_buffer_peek(RingBuffer *buf, size_t len)
+{
+	if (len > buf->len)
+		return NULL;
+
+	//Stored data wraps around, rotate it to the beginning.
+	//Only happens when data is being parsed, which is rare.
+	if (buf->start + len > buf->size)
+	{
+		reverse(buf->data, buf->start);
+		reverse(buf->data + buf->start, buf->size - buf->start);
+		reverse(buf->data, buf->size);
+		buf->start = 0;
+	}
+
+	return buf->data + buf->start;
+}
+
+Status ring_buffer_write(RingBuffer *buf, const void *data, size_t len)
+{
+	IoVec vecs[2];
+	int n_vecs, i;
+	size_t done = 0;
+
+	if (len > ring_buffer_space(buf))
+		return STATUS_FAILURE;
+
+	n_vecs = ring_buffer_space_vecs(buf, vecs);
+	for (i = 0; i < n_vecs && done < len; i++)
+	{
+		size_t part = len - done;
+		if (part > vecs[i].len)
+			part = vecs[i].len;
+
+		memcpy(vecs[i].data, (const uint8_t *) data + done, part);
+		done += part;
+	}
+	ring_buffer_produce(buf, len);
+
+	return STATUS_SUCCESS;
+}
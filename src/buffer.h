@@ -0,0 +1,68 @@
+/* buffer.h
+ * Ring buffer for relayed data
+ * 
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ * 
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Ring buffer over caller-provided memory
+typedef struct
+{
+	uint8_t *data;
+	size_t size;
+	size_t start; //< Index of first stored byte
+	size_t len; //< Number of stored bytes
+} RingBuffer;
+
+void ring_buffer_init(RingBuffer *buf, void *mem, size_t size);
+
+//Switches the buffer to other memory of the given size, copying the
+//stored data to its beginning. The old memory is no longer used.
+void ring_buffer_move(RingBuffer *buf, void *mem, size_t size);
+
+static inline size_t ring_buffer_len(const RingBuffer *buf)
+{
+	return buf->len;
+}
+
+static inline size_t ring_buffer_space(const RingBuffer *buf)
+{
+	return buf->size - buf->len;
+}
+
+//Fill vecs with stored data, returns number of vectors used (0 to 2)
+int ring_buffer_data_vecs(RingBuffer *buf, IoVec vecs[2]);
+
+//Fill vecs with free space, returns number of vectors used (0 to 2)
+int ring_buffer_space_vecs(RingBuffer *buf, IoVec vecs[2]);
+
+//Mark len bytes of free space as stored data
+void ring_buffer_produce(RingBuffer *buf, size_t len);
+
+//Like ring_buffer_produce(), for free space that was filled at offset 
+//without holding on to the buffer, e.g. by an asynchronous read. Data 
+//consumed meanwhile may have left the buffer empty.
+void ring_buffer_produce_at(RingBuffer *buf, size_t offset, size_t len);
+
+//Remove len bytes of stored data
+void ring_buffer_consume(RingBuffer *buf, size_t len);
+
+//Returns first len bytes of stored data as a contiguous block,
+//or NULL if less data is stored.
+uint8_t *ring_buffer_peek(RingBuffer *buf, size_t len);
+
+//Copies data into the buffer
+Status ring_buffer_write(RingBuffer *buf, const void *data, size_t len);
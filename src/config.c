@@ -0,0 +1,357 @@
+/* config.c
+ * Interfaces read from a file, reloaded while running
+ *
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ *
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "incl.h"
+
+#include <errno.h>
+#include <ctype.h>
+
+define_static_error(config_error_invalid, "Invalid configuration");
+
+//Interface from the file, found by address
+typedef struct _ConfigEntry ConfigEntry;
+struct _ConfigEntry
+{
+	ConfigEntry *hash_next;
+	HostAddress addr;
+	Interface *iface;
+	int metric;
+	double rate;
+	unsigned int generation; //< Of the last read listing it
+};
+
+static struct
+{
+	char *path;
+	ConfigEntry **buckets;
+	size_t n_buckets; //< Power of 2
+	size_t len;
+	unsigned int generation;
+} config = { NULL, NULL, 0, 0, 0 };
+
+static size_t host_address_len(HostAddress addr)
+{
+	return addr.type == NETWORK_INET ? 4 : 16;
+}
+
+static uint32_t config_hash(HostAddress addr)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < host_address_len(addr); i++)
+	{
+		hash ^= addr.ip[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static int config_addr_cmp(HostAddress a, HostAddress b)
+{
+	if (a.type != b.type)
+		return a.type < b.type ? -1 : 1;
+	return memcmp(a.ip, b.ip, host_address_len(a));
+}
+
+static ConfigEntry **config_bucket(HostAddress addr)
+{
+	return config.buckets + (config_hash(addr) & (config.n_buckets - 1));
+}
+
+static ConfigEntry *config_lookup(HostAddress addr)
+{
+	ConfigEntry *entry;
+
+	if (! config.n_buckets)
+		return NULL;
+
+	for (entry = *config_bucket(addr); entry; entry = entry->hash_next)
+		if (config_addr_cmp(entry->addr, addr) == 0)
+			return entry;
+
+	return NULL;
+}
+
+static void config_insert(ConfigEntry *entry)
+{
+	ConfigEntry **bucket;
+
+	//Keep chains short
+	if (config.len >= config.n_buckets)
+	{
+		ConfigEntry **old = config.buckets;
+		size_t old_len = config.n_buckets, i;
+
+		config.n_buckets = old_len ? old_len * 2 : 16;
+		config.buckets = fs_malloc(sizeof(ConfigEntry *) * config.n_buckets);
+		memset(config.buckets, 0, sizeof(ConfigEntry *) * config.n_buckets);
+		for (i = 0; i < old_len; i++)
+		{
+			ConfigEntry *iter, *next;
+			for (iter = old[i]; iter; iter = next)
+			{
+				next = iter->hash_next;
+				bucket = config_bucket(iter->addr);
+				iter->hash_next = *bucket;
+				*bucket = iter;
+			}
+		}
+		free(old);
+	}
+
+	bucket = config_bucket(entry->addr);
+	entry->hash_next = *bucket;
+	*bucket = entry;
+	config.len++;
+}
+
+//Parsing
+typedef struct
+{
+	InterfaceSpec *specs;
+	size_t len, alloc_len;
+} SpecList;
+
+static int spec_cmp(const void *a, const void *b)
+{
+	return config_addr_cmp(((const InterfaceSpec *) a)->addr,
+			((const InterfaceSpec *) b)->addr);
+}
+
+static const Error *config_parse(const char *path, SpecList *list)
+{
+	FILE *file;
+	char line[1024];
+	int line_no = 0;
+	const Error *e = NULL;
+	size_t i;
+
+	file = fopen(path, "r");
+	if (! file)
+		return error_printf(config_error_invalid, "Cannot open %s: %s",
+				path, strerror(errno));
+
+	while (! e && fgets(line, sizeof(line), file))
+	{
+		char *iter, *token;
+
+		line_no++;
+		if ((iter = strchr(line, '#')))
+			*iter = 0;
+
+		for (iter = line; ! e && *iter; )
+		{
+			InterfaceSpec spec;
+
+			while (*iter && isspace((unsigned char) *iter))
+				iter++;
+			if (! *iter)
+				break;
+			token = iter;
+			while (*iter && ! isspace((unsigned char) *iter))
+				iter++;
+			if (*iter)
+				*(iter++) = 0;
+
+			if (interface_spec_parse(token, &spec) != STATUS_SUCCESS)
+			{
+				e = error_printf(config_error_invalid, 
+						"%s:%d: Invalid interface '%s'", path, line_no, token);
+				break;
+			}
+			if (spec.metric < 0)
+				spec.metric = 1;
+
+			if (list->len >= list->alloc_len)
+			{
+				list->alloc_len = list->alloc_len ? list->alloc_len * 2 : 16;
+				list->specs = fs_realloc(list->specs, 
+						sizeof(InterfaceSpec) * list->alloc_len);
+			}
+			list->specs[list->len++] = spec;
+		}
+	}
+	if (! e && ferror(file))
+		e = error_printf(config_error_invalid, "Cannot read %s: %s",
+				path, strerror(errno));
+	fclose(file);
+	if (e)
+		return e;
+
+	//Each address may only be listed once
+	qsort(list->specs, list->len, sizeof(InterfaceSpec), spec_cmp);
+	for (i = 1; i < list->len; i++)
+	{
+		if (spec_cmp(list->specs + i - 1, list->specs + i) == 0)
+		{
+			char str[ADDRESS_MAX_LEN];
+			host_address_to_str(list->specs[i].addr, str);
+			return error_printf(config_error_invalid, 
+					"%s: Interface %s is listed more than once", path, str);
+		}
+	}
+
+	return NULL;
+}
+
+//Applying
+static void config_add(ConfigEntry *entry)
+{
+	entry->iface = balancer_add(entry->addr, entry->metric);
+	if (entry->rate)
+		interface_set_rate_limit(entry->iface, entry->rate);
+	health_add_iface(entry->iface);
+}
+
+static const Error *config_apply(SpecList *list)
+{
+	ConfigEntry *entry, **link;
+	int n_added = 0, n_removed = 0, n_changed = 0;
+	size_t i;
+
+	//An empty file must not take away the last interfaces
+	if (! list->len && balancer_get_ifaces(NULL, 0) <= config.len)
+		return error_printf(config_error_invalid, 
+				"%s: No interfaces left", config.path);
+
+	config.generation++;
+
+	for (i = 0; i < list->len; i++)
+	{
+		InterfaceSpec *spec = list->specs + i;
+
+		entry = config_lookup(spec->addr);
+		if (! entry)
+		{
+			entry = (ConfigEntry *) fs_malloc(sizeof(ConfigEntry));
+			entry->addr = spec->addr;
+			entry->metric = spec->metric;
+			entry->rate = spec->rate;
+			config_add(entry);
+			config_insert(entry);
+			n_added++;
+		}
+		else if (interface_is_removed(entry->iface))
+		{
+			//Found unusable at startup
+			entry->metric = spec->metric;
+			entry->rate = spec->rate;
+			config_add(entry);
+			n_added++;
+		}
+		else if (entry->metric != spec->metric || entry->rate != spec->rate)
+		{
+			if (entry->metric != spec->metric)
+				interface_set_metric(entry->iface, spec->metric);
+			if (entry->rate != spec->rate)
+				interface_set_rate_limit(entry->iface, spec->rate);
+			entry->metric = spec->metric;
+			entry->rate = spec->rate;
+			n_changed++;
+		}
+
+		entry->generation = config.generation;
+	}
+
+	//Entries not listed any more
+	for (i = 0; i < config.n_buckets; i++)
+	{
+		link = config.buckets + i;
+		while ((entry = *link))
+		{
+			if (entry->generation == config.generation)
+			{
+				link = &entry->hash_next;
+				continue;
+			}
+
+			*link = entry->hash_next;
+			config.len--;
+			health_remove_iface(entry->iface);
+			balancer_remove(entry->iface);
+			free(entry);
+			n_removed++;
+		}
+	}
+
+	log_message(LOG_LEVEL_INFO, 
+			"Read %s: %d interfaces added, %d removed, %d changed",
+			config.path, n_added, n_removed, n_changed);
+	return NULL;
+}
+
+const Error *config_load(const char *path)
+{
+	char *old_path = config.path;
+	const Error *e;
+
+	config.path = fs_strdup_printf("%s", path);
+	e = config_reload();
+	if (e)
+	{
+		free(config.path);
+		config.path = old_path;
+	}
+	else
+	{
+		free(old_path);
+	}
+	return e;
+}
+
+const Error *config_reload()
+{
+	SpecList list = { NULL, 0, 0 };
+	const Error *e;
+
+	abort_if_fail(config.path, "No configuration file loaded");
+
+	e = config_parse(config.path, &list);
+	if (! e)
+		e = config_apply(&list);
+	free(list.specs);
+
+	return e;
+}
+
+size_t config_get_n_ifaces()
+{
+	return config.len;
+}
+
+void config_shutdown()
+{
+	size_t i;
+
+	for (i = 0; i < config.n_buckets; i++)
+	{
+		ConfigEntry *iter, *next;
+		for (iter = config.buckets[i]; iter; iter = next)
+		{
+			next = iter->hash_next;
+			free(iter);
+		}
+	}
+	free(config.buckets);
+	free(config.path);
+	memset(&config, 0, sizeof(config));
+}
@@ -0,0 +1,40 @@
+/* config.h
+ * Interfaces read from a file, reloaded while running
+ *
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ *
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//The file lists interfaces in the same form as the command line, 
+//separated by white space. '#' starts a comment running to the end of 
+//the line. Reading the file again applies only the differences: new 
+//interfaces are added, missing ones are removed from the balancer and 
+//drain, and changed metrics and rate limits are updated in place.
+//Must be used from a single thread, the one running health checks.
+
+extern const char config_error_invalid[];
+
+//Reads the file. Nothing is changed if the file cannot be read or 
+//has errors.
+const Error *config_load(const char *path);
+
+//Reads the file given to config_load() again
+const Error *config_reload();
+
+//Number of interfaces from the file
+size_t config_get_n_ifaces();
+
+void config_shutdown();
@@ -30,62 +30,171 @@ struct _AddrList
 	SocketAddress addr;
 };
 
+//One connection attempt
+typedef struct
+{
+	Connector *connector;
+	SocketHandle hd;
+	Interface *iface; //< NULL if the slot is unused
+	struct event *event; //< Allocated along with the connector
+	struct timeval start_time;
+} ConnAttempt;
+
+//Addresses waiting to be tried, FIFO per address family
+typedef struct
+{
+	AddrList *head, *tail;
+} AddrQueue;
+
 struct _Connector
 {
 	//Connection subsystem
-	AddrList *addrs;
+	AddrQueue queues[2]; //< IPv6, IPv4
+	int next_family; //< Index of queue to try next
 	int final;
-	SocketHandle hd;
-	Interface *iface;
-	struct event *event;
+	ConnAttempt attempts[CONNECTOR_MAX_ATTEMPTS];
+	int n_attempts; //< Attempts in progress
+	int stagger_expired; //< Whether another attempt may be started now
+	struct event *stagger_event; //< Allocated along with the connector
+	struct event *deadline_event; //< Allocated along with the connector
+	int deadline_armed;
 	const Error *last_error;
+	char key[CONNECTOR_KEY_MAX_LEN]; //< Destination, for interface affinity
+	ConnectorFlags flags;
 
 	//DNS subsystem
 	uint16_t port;
 	DnsRequest *dns_request;
+	struct timeval dns_start_time;
 	
 	//Callback subsystem
 	int returned;
 	ConnectRes res;
 	ConnectorCB cb;
 	void *cb_data;
-	struct event *cb_event;
+	struct event *cb_event; //< Points to cb_event_mem while pending
 	int idle_mode;
+
+	//Event structures, allocated along with the connector
+	struct event *cb_event_mem;
 };
 
+//Number of events allocated along with each connector
+#define CONNECTOR_N_EVENTS (3 + CONNECTOR_MAX_ATTEMPTS)
+
+//Allocators
+static THREAD_LOCAL Pool connector_pool[1] = { POOL_INIT("connector") };
+static THREAD_LOCAL Pool addr_list_pool[1] = { POOL_INIT("addr_list") };
+
+//Timing
+static struct timeval conn_stagger = { 0, CONNECTOR_DEFAULT_STAGGER * 1000 };
+static struct timeval conn_timeout = { CONNECTOR_DEFAULT_TIMEOUT / 1000, 0 };
+
+static struct timeval conn_ms_to_timeval(long ms)
+{
+	struct timeval tv;
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	return tv;
+}
+
+void connector_set_timing(long stagger_ms, long timeout_ms)
+{
+	conn_stagger = conn_ms_to_timeval(stagger_ms);
+	conn_timeout = conn_ms_to_timeval(timeout_ms);
+}
+
+//Number of interfaces each address is tried on simultaneously
+static int conn_race_ifaces = 1;
+
+static int conn_fastopen = 0;
+
+void connector_set_fastopen(int enabled)
+{
+	conn_fastopen = enabled;
+}
+
+void connector_set_race_ifaces(int n)
+{
+	abort_if_fail(n > 0 && n <= CONNECTOR_MAX_ATTEMPTS,
+			"Number of interfaces to race must be between 1 and %d",
+			CONNECTOR_MAX_ATTEMPTS);
+	conn_race_ifaces = n;
+}
+
 //Forward declarations
 static void connector_return(Connector *connector, ConnectRes res);
 
 //Connection subsystem
+static void conn_stagger_cb(evutil_socket_t fd, short events, void *data);
+static void conn_deadline_cb(evutil_socket_t fd, short events, void *data);
+
 static void conn_init(Connector *connector)
 {
 	//Only nonzero members need to be set.
+	connector->stagger_expired = 1;
+	evtimer_assign(connector->stagger_event, evbase,
+			conn_stagger_cb, connector);
+	evtimer_assign(connector->deadline_event, evbase,
+			conn_deadline_cb, connector);
+
+	//Deadline covers name resolution too
+	if (conn_timeout.tv_sec || conn_timeout.tv_usec)
+	{
+		event_add(connector->deadline_event, &conn_timeout);
+		connector->deadline_armed = 1;
+	}
 }
 
-static void conn_free(Connector *connector)
+//Cancels an attempt in progress
+static void conn_attempt_cancel(ConnAttempt *attempt)
+{
+	event_del(attempt->event);
+	socket_handle_close(attempt->hd);
+	interface_close(attempt->iface);
+	attempt->iface = NULL;
+	attempt->connector->n_attempts--;
+}
+
+//Cancels all attempts in progress and stops timers
+static void conn_stop(Connector *connector)
 {
-	//Remove connection event
-	if (connector->event)
+	int i;
+
+	for (i = 0; i < CONNECTOR_MAX_ATTEMPTS; i++)
 	{
-		event_del(connector->event);
-		event_free(connector->event);
+		if (connector->attempts[i].iface)
+			conn_attempt_cancel(connector->attempts + i);
 	}
 
-	//Cancel ongoing connection if any
-	if (connector->iface)
+	event_del(connector->stagger_event);
+	if (connector->deadline_armed)
 	{
-		socket_handle_close(connector->hd);
-		interface_close(connector->iface);
+		event_del(connector->deadline_event);
+		connector->deadline_armed = 0;
 	}
+}
+
+static void conn_free(Connector *connector)
+{
+	int i;
+
+	conn_stop(connector);
 
 	//Free all addresses
-	AddrList *bak;
-	while (connector->addrs)
+	for (i = 0; i < 2; i++)
 	{
-		bak = connector->addrs->next;
-		free(connector->addrs);
-		connector->addrs = bak;
+		AddrList *bak;
+		while (connector->queues[i].head)
+		{
+			bak = connector->queues[i].head->next;
+			pool_free(addr_list_pool, connector->queues[i].head);
+			connector->queues[i].head = bak;
+		}
 	}
+
+	error_handle(connector->last_error);
+	connector->last_error = NULL;
 }
 
 static void conn_set_last_error(Connector *connector, const Error *e)
@@ -94,125 +203,280 @@ static void conn_set_last_error(Connector *connector, const Error *e)
 	connector->last_error = e;
 }
 
+static int conn_has_addrs(Connector *connector)
+{
+	return connector->queues[0].head || connector->queues[1].head;
+}
+
+//Pops the next address to try, alternating between address families,
+//IPv6 first.
+static SocketAddress conn_pop_addr(Connector *connector)
+{
+	AddrQueue *queue;
+	AddrList *list_ptr;
+	SocketAddress addr;
+	int idx = connector->next_family;
+
+	if (! connector->queues[idx].head)
+		idx = 1 - idx;
+	queue = connector->queues + idx;
+	connector->next_family = 1 - idx;
+
+	list_ptr = queue->head;
+	queue->head = list_ptr->next;
+	if (! queue->head)
+		queue->tail = NULL;
+	addr = list_ptr->addr;
+	pool_free(addr_list_pool, list_ptr);
+
+	return addr;
+}
+
+//Returns successful connection and cancels the rest
+static void conn_succeed(Connector *connector, SocketHandle hd, Interface *iface)
+{
+	ConnectRes res;
+
+	conn_stop(connector);
+
+	res.e = NULL;
+	res.hd = hd;
+	res.iface = iface;
+	connector_return(connector, res);
+}
+
+//Whether the error could be the fault of the interface rather than
+//the destination
+static int conn_error_blames_iface(const Error *e)
+{
+	return e->type == socket_error_timeout
+		|| e->type == socket_error_network_unreachable
+		|| e->type == socket_error_host_unreachable;
+}
+
 static void conn_start(Connector *connector);
 
 static void conn_connect_cb(evutil_socket_t fd, short events, void *data)
 {
-	Connector *connector = (Connector *) data;
-	ConnectRes res;
+	ConnAttempt *attempt = (ConnAttempt *) data;
+	Connector *connector = attempt->connector;
+	SocketHandle hd = attempt->hd;
+	Interface *iface = attempt->iface;
+	const Error *e;
+	struct timeval now;
+	uint64_t usec;
 
-	//Remove event
-	event_del(connector->event);
-	event_free(connector->event);
-	connector->event = NULL;
+	//Vacate the slot (event is not persistent, already deleted)
+	attempt->iface = NULL;
+	connector->n_attempts--;
 
-	//Get the connection information and vacate connector
-	res.e = socket_handle_get_status(connector->hd);
-	res.hd = connector->hd;
-	res.iface = connector->iface;
-	connector->iface = NULL;
+	//Get the connection information
+	e = socket_handle_get_status(hd);
 
-	if (res.e)
+	evutil_gettimeofday(&now, NULL);
+	usec = stats_usec_since(&attempt->start_time, &now);
+	trace_probe4(connect_done, connector, interface_get_id(iface), ! e, usec);
+
+	if (e)
 	{
-		conn_set_last_error(connector, res.e);
+		stats_iface_connect(iface, 0);
+		if (conn_error_blames_iface(e))
+			interface_report_failure(iface);
+		conn_set_last_error(connector, e);
 
 		//Close socket
-		socket_handle_close(res.hd);
-		interface_close(res.iface);
+		socket_handle_close(hd);
+		interface_close(iface);
 
-		//Connect to next address if available
+		//Try next address right away
+		connector->stagger_expired = 1;
 		conn_start(connector);
 	}
 	else
 	{
-		connector_return(connector, res);
+		//Handshake time is a round trip time sample for the interface
+		interface_add_rtt_sample(iface, usec);
+		interface_report_success(iface);
+		stats_iface_connect(iface, 1);
+		stats_iface_connect_time(iface, usec);
+
+		conn_succeed(connector, hd, iface);
 	}
 }
 
-//Start connecting to the next address on the list.
-//Call this function after adding addressing or finalizing.
-static void conn_start(Connector *connector)
+//Starts attempts to connect to given address, one for each of the 
+//interfaces raced.
+//Returns 1 if any attempt is in progress, 0 if all failed and -1 if the
+//connection was established immediately (connector has returned).
+static int conn_attempt_start(Connector *connector, SocketAddress addr)
 {
-	//If returned do nothing
-	if (connector->returned)
-		return;
-
-	//If a connection is already in progress don't do anything.
-	//Callback function will take care of this.
-	if (connector->event)
-		return;
+	Interface *ifaces[BALANCER_MAX_IFACES];
+	SocketHandle hds[BALANCER_MAX_IFACES];
+	int n_ifaces, max_ifaces;
+	const Error *e;
+	int i, j = 0;
+	int res = 0;
+
+	//Open suitable interfaces
+	if (balancer_affinity_enabled())
+	{
+		//Racing would defeat affinity, use only the destination's interface
+		e = balancer_open_iface_keyed(addr.host.type, connector->key,
+				ifaces, hds);
+		n_ifaces = 1;
+	}
+	else
+	{
+		max_ifaces = CONNECTOR_MAX_ATTEMPTS - connector->n_attempts;
+		if (max_ifaces > conn_race_ifaces)
+			max_ifaces = conn_race_ifaces;
+		e = balancer_open_ifaces(addr.host.type, max_ifaces, 
+				ifaces, hds, &n_ifaces);
+	}
+	if (e)
+	{
+		conn_set_last_error(connector, e);
+		return 0;
+	}
 
-	while (connector->addrs)
+	for (i = 0; i < n_ifaces; i++)
 	{
-		ConnectRes res;
-		SocketAddress addr;
-		const Error *e;
+		ConnAttempt *attempt;
 
-		abort_if_fail(!connector->event, "Assertion failure");
+		//Connection was established using an earlier interface
+		if (res < 0)
+		{
+			socket_handle_close(hds[i]);
+			interface_close(ifaces[i]);
+			continue;
+		}
+
+		//Find a free slot
+		while (connector->attempts[j].iface)
+			j++;
+		attempt = connector->attempts + j;
 
-		//Pop an address
+		if (conn_fastopen && (connector->flags & CONNECTOR_FASTOPEN))
 		{
-			AddrList *list_ptr = connector->addrs;
-			connector->addrs = list_ptr->next;
-			addr = list_ptr->addr;
-			free(list_ptr);
+			e = socket_handle_set_fastopen_connect(hds[i]);
+			if (e)
+				error_handle(e);
 		}
 
-		//Open a suitable interface
-		e = balancer_open_iface(addr.host.type, &connector->iface, &connector->hd);
-		if (e)
+		//Connect
+		evutil_gettimeofday(&attempt->start_time, NULL);
+		trace_probe2(connect_start, connector, interface_get_id(ifaces[i]));
+		e = socket_handle_connect(hds[i], addr);
+		if (! e)
+		{
+			//Success, without even waiting
+			stats_iface_connect(ifaces[i], 1);
+			stats_iface_connect_time(ifaces[i], 0);
+			trace_probe4(connect_done, connector, 
+					interface_get_id(ifaces[i]), 1, 0);
+			conn_succeed(connector, hds[i], ifaces[i]);
+			res = -1;
+		}
+		else if (e->type == socket_error_in_progress)
+		{
+			//In progress, add event
+			error_handle(e);
+			attempt->hd = hds[i];
+			attempt->iface = ifaces[i];
+			connector->n_attempts++;
+			socket_handle_assign_event(hds[i], attempt->event, 
+					EV_WRITE, conn_connect_cb, attempt);
+			event_add(attempt->event, NULL);
+			res = 1;
+		}
+		else
 		{
+			//Fail
+			trace_probe4(connect_done, connector, 
+					interface_get_id(ifaces[i]), 0, 0);
+			stats_iface_connect(ifaces[i], 0);
+			if (conn_error_blames_iface(e))
+				interface_report_failure(ifaces[i]);
 			conn_set_last_error(connector, e);
-			continue;
+			socket_handle_close(hds[i]);
+			interface_close(ifaces[i]);
 		}
-		abort_if_fail(connector->iface, "Assertion failure");
+	}
 
-		//Enable non-blocking
-		e = socket_handle_set_blocking(connector->hd, 0);
-		abort_if_fail(!e,
-				"socket_handle_set_blocking(hd, 0): %s", error_desc(e));
+	return res;
+}
 
-		//Connect
-		e = socket_handle_connect(connector->hd, addr);
-		if (e)
+static void conn_stagger_cb(evutil_socket_t fd, short events, void *data)
+{
+	Connector *connector = (Connector *) data;
+
+	connector->stagger_expired = 1;
+	conn_start(connector);
+}
+
+static void conn_deadline_cb(evutil_socket_t fd, short events, void *data)
+{
+	Connector *connector = (Connector *) data;
+	ConnectRes res;
+	int i;
+
+	//Attempts still hanging at the deadline may be going through
+	//a dead uplink
+	for (i = 0; i < CONNECTOR_MAX_ATTEMPTS; i++)
+	{
+		if (connector->attempts[i].iface)
 		{
-			if (e->type == socket_error_in_progress)
-			{
-				//In progress, add event and exit
-				error_handle(e);
-				connector->event = socket_handle_create_event
-					(connector->hd, EV_WRITE, conn_connect_cb, connector);
-				event_add(connector->event, NULL);
-				break;
-			}
-			else
-			{
-				//Fail, try next address
-				conn_set_last_error(connector, e);
-				interface_close(connector->iface);
-				connector->iface = NULL;
-				continue;
-			}
+			interface_report_failure(connector->attempts[i].iface);
+			stats_iface_connect(connector->attempts[i].iface, 0);
 		}
+	}
 
-		//Success, without even waiting
-		//Get the connection information and vacate connector
-		res.e = NULL;
-		res.hd = connector->hd;
-		res.iface = connector->iface;
-		connector->iface = NULL;
+	connector->deadline_armed = 0;
+	conn_stop(connector);
 
-		connector_return(connector, res);
+	memset(&res, 0, sizeof(ConnectRes));
+	res.e = error_printf(socket_error_timeout, 
+			"Connection not established within time limit");
+	connector_return(connector, res);
+}
+
+//Starts connecting to the next address if the previous attempt 
+//failed or was started long enough ago.
+//Call this function after adding addresses or finalizing.
+static void conn_start(Connector *connector)
+{
+	//If returned do nothing
+	if (connector->returned)
 		return;
-	}
 
-	abort_if_fail(connector->event || (! connector->addrs),
-			"Assertion failure");
+	//Wait for the stagger timer unless nothing is in progress
+	if (connector->n_attempts && ! connector->stagger_expired)
+		return;
+
+	while (conn_has_addrs(connector) 
+			&& connector->n_attempts < CONNECTOR_MAX_ATTEMPTS)
+	{
+		int res = conn_attempt_start(connector, conn_pop_addr(connector));
+
+		if (res < 0)
+			return;
+		if (res > 0)
+		{
+			//Give this attempt a head start
+			connector->stagger_expired = 0;
+			event_add(connector->stagger_event, &conn_stagger);
+			break;
+		}
+	}
 
 	//Return error if no addresses left and is final
-	if (! connector->addrs && connector->final)
+	if (! connector->n_attempts && ! conn_has_addrs(connector) 
+			&& connector->final)
 	{
 		ConnectRes res;
+
+		conn_stop(connector);
+
 		memset(&res, 0, sizeof(ConnectRes));
 		res.e = connector->last_error;
 		connector->last_error = NULL;
@@ -223,34 +487,35 @@ static void conn_start(Connector *connector)
 		connector_return(connector, res);
 		return;
 	}
-
-	abort_if_fail((connector->iface ? 1 : 0) == (connector->event ? 1 : 0),
-			"Assertion failure");
 }
 
+//Queues an address, conn_start() must be called after this
 static void conn_add_addr(Connector *connector, SocketAddress addr)
 {
 	AddrList *new_addr;
+	AddrQueue *queue;
 
 	abort_if_fail(! connector->final,
 			"Assertion failure: "
 			"No address can be added after calling conn_set_final()");
 
-	//Add address to the list
-	new_addr = fs_malloc(sizeof(AddrList));
+	//Add address to the end of the list of its family
+	queue = connector->queues + (addr.host.type == NETWORK_INET6 ? 0 : 1);
+	new_addr = pool_alloc(addr_list_pool, sizeof(AddrList));
 	new_addr->addr = addr;
-	new_addr->next = connector->addrs;
-	connector->addrs = new_addr;
-
-	//If not already connecting, add an event
-	conn_start(connector);
+	new_addr->next = NULL;
+	if (queue->tail)
+		queue->tail->next = new_addr;
+	else
+		queue->head = new_addr;
+	queue->tail = new_addr;
 }
 
 static void conn_set_final(Connector *connector)
 {
 	connector->final = 1;
 
-	//Return error if there are no more addresses to connect
+	//Start connecting, or return error if there are no addresses
 	conn_start(connector);
 }
 
@@ -275,6 +540,13 @@ static void dns_cb
 {
 	size_t i;
 	Connector *connector = (Connector *) data;
+	struct timeval now;
+	uint64_t usec;
+
+	evutil_gettimeofday(&now, NULL);
+	usec = stats_usec_since(&connector->dns_start_time, &now);
+	stats_dns_time(usec);
+	trace_probe3(dns_done, connector, n_addrs, usec);
 
 	if (e)
 	{
@@ -295,6 +567,8 @@ static void dns_start(Connector *connector, const char *addr, uint16_t port)
 	//Set the port
 	connector->port = port;
 
+	evutil_gettimeofday(&connector->dns_start_time, NULL);
+	trace_probe1(dns_start, connector);
 	connector->dns_request = dns_request_resolve
 		(addr, port, balancer_get_available_types(), dns_cb, connector);
 }
@@ -304,7 +578,6 @@ void connector_return_idle(evutil_socket_t fd, short events, void *data)
 {
 	Connector *connector = (Connector *) data;
 
-	event_free(connector->cb_event);
 	connector->cb_event = NULL;
 	(* connector->cb)(connector->res, connector->cb_data);
 }
@@ -318,7 +591,8 @@ static void connector_return(Connector *connector, ConnectRes res)
 		connector->res = res;
 		abort_if_fail(! connector->cb_event, 
 				"Assertion failure");
-		connector->cb_event = event_new(evbase, -1, 0,
+		connector->cb_event = connector->cb_event_mem;
+		event_assign(connector->cb_event, evbase, -1, 0,
 				connector_return_idle, connector);
 		event_active(connector->cb_event, 0, 0);
 	}
@@ -331,9 +605,22 @@ static void connector_return(Connector *connector, ConnectRes res)
 //Creates an idle connector
 static Connector *connector_create(ConnectorCB cb, void *data)
 {
-	Connector *connector = (Connector *) fs_malloc(sizeof(Connector));
+	size_t event_size = event_get_struct_event_size();
+	Connector *connector = (Connector *) pool_alloc(connector_pool,
+			sizeof(Connector) + CONNECTOR_N_EVENTS * event_size);
+	char *mem = (char *) (connector + 1);
+	int i;
 
 	memset(connector, 0, sizeof(Connector));
+	connector->cb_event_mem = (struct event *) mem;
+	connector->stagger_event = (struct event *) (mem + event_size);
+	connector->deadline_event = (struct event *) (mem + 2 * event_size);
+	for (i = 0; i < CONNECTOR_MAX_ATTEMPTS; i++)
+	{
+		connector->attempts[i].connector = connector;
+		connector->attempts[i].event = (struct event *) 
+			(mem + (3 + i) * event_size);
+	}
 
 	connector->cb = cb;
 	connector->cb_data = data;
@@ -353,17 +640,19 @@ void connector_destroy(Connector *connector)
 	dns_free(connector);
 
 	if (connector->cb_event)
-		event_free(connector->cb_event);
+		event_del(connector->cb_event);
 
-	free(connector);
+	pool_free(connector_pool, connector);
 }
 
 //Connect to a remote socket
-Connector *connector_connect
-	(SocketAddress addr, ConnectorCB cb, void *data)
+Connector *connector_connect(SocketAddress addr, ConnectorFlags flags,
+		ConnectorCB cb, void *data)
 {
 	Connector *connector = connector_create(cb, data);
+	connector->flags = flags;
 
+	host_address_to_str(addr.host, connector->key);
 	conn_add_addr(connector, addr);
 	conn_set_final(connector);
 
@@ -373,11 +662,13 @@ Connector *connector_connect
 }
 
 //Connect by resolving name by DNS
-Connector *connector_connect_dns
-	(const char *name, uint16_t port, ConnectorCB cb, void *data)
+Connector *connector_connect_dns(const char *name, uint16_t port, 
+		ConnectorFlags flags, ConnectorCB cb, void *data)
 {
 	Connector *connector = connector_create(cb, data);
+	connector->flags = flags;
 
+	snprintf(connector->key, CONNECTOR_KEY_MAX_LEN, "%s", name);
 	dns_start(connector, name, port);
 
 	connector->idle_mode = 0;
@@ -28,6 +28,37 @@ typedef struct
 	Interface *iface;
 } ConnectRes;
 
+//Connection attempts are raced: if an attempt does not complete within
+//the stagger delay, the next address is tried in parallel, alternating 
+//between IPv6 and IPv4 (RFC 8305). The first one to connect wins.
+#define CONNECTOR_MAX_ATTEMPTS (BALANCER_MAX_IFACES)
+#define CONNECTOR_DEFAULT_STAGGER (250) //< Milliseconds
+#define CONNECTOR_DEFAULT_TIMEOUT (30000) //< Milliseconds
+
+//Longest destination name kept as the affinity key, including nul
+#define CONNECTOR_KEY_MAX_LEN (256)
+
+//Sets delay between attempts and the overall time limit for connecting,
+//including name resolution. Time limit of 0 means no limit.
+void connector_set_timing(long stagger_ms, long timeout_ms);
+
+//Optionally each address can be tried on several interfaces with the least
+//load at once, to avoid waiting on a congested or dead uplink.
+//Defaults to 1.
+void connector_set_race_ifaces(int n);
+
+//Options for a connection
+typedef enum
+{
+	//Caller has data to send right away. Use TCP Fast Open where 
+	//available, the connection is then returned before the handshake
+	//and errors only show up when writing.
+	CONNECTOR_FASTOPEN = 1 << 0
+} ConnectorFlags;
+
+//Whether CONNECTOR_FASTOPEN is honoured, defaults to off
+void connector_set_fastopen(int enabled);
+
 //Prototype for the callback function
 typedef void (*ConnectorCB)(ConnectRes res, void *data);
 
@@ -35,12 +66,12 @@ typedef void (*ConnectorCB)(ConnectRes res, void *data);
 typedef struct _Connector Connector;
 
 //Connect to a remote socket
-Connector *connector_connect
-	(SocketAddress addr, ConnectorCB cb, void *data);
+Connector *connector_connect(SocketAddress addr, ConnectorFlags flags,
+		ConnectorCB cb, void *data);
 
 //Connect by resolving name by DNS
-Connector *connector_connect_dns
-	(const char *name, uint16_t port, ConnectorCB cb, void *data);
+Connector *connector_connect_dns(const char *name, uint16_t port, 
+		ConnectorFlags flags, ConnectorCB cb, void *data);
 	
 //Destroys connector object.
 //Connection, if in progress, is cancelled and no callback is called.
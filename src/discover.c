@@ -0,0 +1,476 @@
+/* discover.c
+ * Interfaces found from local addresses, followed as they change
+ *
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ *
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "incl.h"
+
+#include <fnmatch.h>
+#include <limits.h>
+
+define_static_error(discover_error_invalid_rule, "Invalid discovery rule");
+
+//Rules
+typedef struct
+{
+	char *pattern;
+	int exclude;
+	int metric;
+	double rate;
+} DiscoverRule;
+
+static DiscoverRule *rules = NULL;
+static size_t n_rules = 0;
+
+static void discover_free_rules()
+{
+	size_t i;
+
+	for (i = 0; i < n_rules; i++)
+		free(rules[i].pattern);
+	free(rules);
+	rules = NULL;
+	n_rules = 0;
+}
+
+static Status discover_rule_parse(const char *str, DiscoverRule *rule)
+{
+	char *left, *right;
+	long metric = -1;
+	Status s = STATUS_SUCCESS;
+
+	rule->exclude = 0;
+	rule->metric = -1;
+	rule->rate = 0;
+
+	if (*str == '!')
+	{
+		rule->exclude = 1;
+		str++;
+	}
+
+	rule->pattern = fs_strdup_printf("%s", str);
+
+	//Optional rate limit after '/'
+	left = split_string(rule->pattern, '/', &right);
+	if (left)
+	{
+		s = parse_bitrate(right, &rule->rate);
+		strcpy(rule->pattern, left);
+		free(left);
+	}
+
+	//Optional metric after '@'
+	left = split_string(rule->pattern, '@', &right);
+	if (left)
+	{
+		if (s == STATUS_SUCCESS)
+			s = parse_long(right, &metric);
+		if (metric < 1 || metric > INT_MAX)
+			s = STATUS_FAILURE;
+		rule->metric = metric;
+		strcpy(rule->pattern, left);
+		free(left);
+	}
+
+	if (! *rule->pattern || (rule->exclude && (rule->metric >= 0 || rule->rate)))
+		s = STATUS_FAILURE;
+	if (s != STATUS_SUCCESS)
+		free(rule->pattern);
+	return s;
+}
+
+const Error *discover_set_rules(const char *str)
+{
+	char *copy = fs_strdup_printf("%s", str);
+	char *iter, *token;
+	const Error *e = NULL;
+
+	discover_free_rules();
+
+	for (iter = copy; ! e && iter; )
+	{
+		token = iter;
+		iter = strchr(iter, ',');
+		if (iter)
+			*(iter++) = 0;
+
+		rules = fs_realloc(rules, sizeof(DiscoverRule) * (n_rules + 1));
+		if (discover_rule_parse(token, rules + n_rules) != STATUS_SUCCESS)
+			e = error_printf(discover_error_invalid_rule, 
+					"Invalid discovery rule '%s'", token);
+		else
+			n_rules++;
+	}
+
+	free(copy);
+	if (e)
+		discover_free_rules();
+	return e;
+}
+
+int discover_match(const char *ifname, int *metric_out, double *rate_out)
+{
+	size_t i;
+
+	for (i = 0; i < n_rules; i++)
+	{
+		if (fnmatch(rules[i].pattern, ifname, 0) == 0)
+		{
+			*metric_out = rules[i].metric;
+			*rate_out = rules[i].rate;
+			return ! rules[i].exclude;
+		}
+	}
+
+	return 0;
+}
+
+//Addresses in use, few enough to be searched one by one
+typedef struct
+{
+	HostAddress addr;
+	Interface *iface;
+	unsigned int generation; //< Of the last listing of all addresses
+} DiscoverEntry;
+
+static DiscoverEntry *entries = NULL;
+static size_t n_entries = 0, entries_alloc_len = 0;
+
+size_t discover_get_n_ifaces()
+{
+	return n_entries;
+}
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+
+#include <errno.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+static struct
+{
+	int fd;
+	struct event *event;
+	uint32_t seq; //< Of the last dump request
+	int dumping;
+	int resync; //< Messages were lost during the dump
+	unsigned int generation;
+} discover = { -1, NULL, 0, 0, 0, 0 };
+
+static DiscoverEntry *discover_lookup(HostAddress addr)
+{
+	size_t i, len = addr.type == NETWORK_INET ? 4 : 16;
+
+	for (i = 0; i < n_entries; i++)
+		if (entries[i].addr.type == addr.type
+				&& memcmp(entries[i].addr.ip, addr.ip, len) == 0)
+			return entries + i;
+
+	return NULL;
+}
+
+static void discover_add(HostAddress addr, const char *ifname, 
+		int metric, double rate)
+{
+	DiscoverEntry *entry;
+	char str[ADDRESS_MAX_LEN];
+
+	host_address_to_str(addr, str);
+	log_message(LOG_LEVEL_INFO, "Found address %s on %s", str, ifname);
+
+	if (n_entries >= entries_alloc_len)
+	{
+		entries_alloc_len = entries_alloc_len ? entries_alloc_len * 2 : 8;
+		entries = fs_realloc(entries, 
+				sizeof(DiscoverEntry) * entries_alloc_len);
+	}
+	entry = entries + (n_entries++);
+	entry->addr = addr;
+	entry->iface = balancer_add(addr, metric);
+	if (rate)
+		interface_set_rate_limit(entry->iface, rate);
+	health_add_iface(entry->iface);
+	entry->generation = discover.generation;
+}
+
+static void discover_remove(DiscoverEntry *entry)
+{
+	health_remove_iface(entry->iface);
+	balancer_remove(entry->iface);
+	*entry = entries[--n_entries];
+}
+
+static void discover_handle_addr(struct nlmsghdr *nh)
+{
+	struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+	struct rtattr *rta;
+	int len = IFA_PAYLOAD(nh);
+	void *local = NULL, *address = NULL;
+	uint32_t flags = ifa->ifa_flags;
+	char ifname[IF_NAMESIZE];
+	HostAddress addr;
+	DiscoverEntry *entry;
+	int usable, metric = -1;
+	double rate = 0;
+
+	if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifaddrmsg)))
+		return;
+
+	for (rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+	{
+		if (rta->rta_type == IFA_LOCAL)
+			local = RTA_DATA(rta);
+		else if (rta->rta_type == IFA_ADDRESS)
+			address = RTA_DATA(rta);
+		else if (rta->rta_type == IFA_FLAGS
+				&& RTA_PAYLOAD(rta) >= sizeof(uint32_t))
+			memcpy(&flags, RTA_DATA(rta), sizeof(uint32_t));
+	}
+
+	//On point to point links IFA_ADDRESS is the other end
+	if (local)
+		address = local;
+	if (! address)
+		return;
+
+	memset(&addr, 0, sizeof(HostAddress));
+	if (ifa->ifa_family == AF_INET)
+	{
+		addr.type = NETWORK_INET;
+		memcpy(addr.ip, address, 4);
+	}
+	else if (ifa->ifa_family == AF_INET6)
+	{
+		addr.type = NETWORK_INET6;
+		memcpy(addr.ip, address, 16);
+	}
+	else
+	{
+		return;
+	}
+
+	//Addresses still being checked for duplicates come again when ready,
+	//deprecated ones are kept by the kernel for existing connections only
+	usable = nh->nlmsg_type == RTM_NEWADDR
+		&& ifa->ifa_scope == RT_SCOPE_UNIVERSE
+		&& ! (flags & (IFA_F_TENTATIVE | IFA_F_DADFAILED | IFA_F_DEPRECATED))
+		&& if_indextoname(ifa->ifa_index, ifname)
+		&& discover_match(ifname, &metric, &rate);
+
+	entry = discover_lookup(addr);
+	if (usable && ! entry)
+		discover_add(addr, ifname, metric, rate);
+	else if (usable)
+		entry->generation = discover.generation;
+	else if (entry)
+		discover_remove(entry);
+}
+
+static const Error *discover_request_dump()
+{
+	struct
+	{
+		struct nlmsghdr nh;
+		struct ifaddrmsg ifa;
+	} req;
+	struct sockaddr_nl kernel;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+	req.nh.nlmsg_type = RTM_GETADDR;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nh.nlmsg_seq = ++discover.seq;
+	req.ifa.ifa_family = AF_UNSPEC;
+
+	memset(&kernel, 0, sizeof(kernel));
+	kernel.nl_family = AF_NETLINK;
+
+	if (sendto(discover.fd, &req, req.nh.nlmsg_len, 0, 
+				(struct sockaddr *) &kernel, sizeof(kernel)) < 0)
+		return error_printf(socket_error_generic, 
+				"Failed to request addresses: %s", strerror(errno));
+
+	discover.dumping = 1;
+	discover.resync = 0;
+	discover.generation++;
+	return NULL;
+}
+
+static void discover_dump_done()
+{
+	size_t i;
+
+	discover.dumping = 0;
+
+	if (discover.resync)
+	{
+		error_handle(discover_request_dump());
+		return;
+	}
+
+	//Addresses missing from the listing were removed while events were lost
+	for (i = 0; i < n_entries; )
+	{
+		if (entries[i].generation != discover.generation)
+			discover_remove(entries + i);
+		else
+			i++;
+	}
+}
+
+//Handles all waiting messages, returns 0 when there are none left
+static int discover_read(int flags)
+{
+	//Large enough for one message of the address dump
+	static char buf[16384] __attribute__((aligned(4)));
+	struct sockaddr_nl sender;
+	socklen_t sender_len = sizeof(sender);
+	struct nlmsghdr *nh;
+	ssize_t len;
+
+	len = recvfrom(discover.fd, buf, sizeof(buf), flags, 
+			(struct sockaddr *) &sender, &sender_len);
+	if (len < 0)
+	{
+		if (errno == ENOBUFS)
+		{
+			//The kernel dropped notifications, list everything again
+			log_message(LOG_LEVEL_WARNING, 
+					"Address changes were lost, listing addresses again");
+			if (discover.dumping)
+				discover.resync = 1;
+			else
+				error_handle(discover_request_dump());
+			return 1;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			log_message(LOG_LEVEL_WARNING, 
+					"Failed to read address changes: %s", strerror(errno));
+		return 0;
+	}
+
+	//Only the kernel is trusted
+	if (sender.nl_pid != 0)
+		return 1;
+
+	for (nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, len); 
+			nh = NLMSG_NEXT(nh, len))
+	{
+		if (nh->nlmsg_type == RTM_NEWADDR || nh->nlmsg_type == RTM_DELADDR)
+		{
+			discover_handle_addr(nh);
+		}
+		else if (nh->nlmsg_type == NLMSG_DONE 
+				&& discover.dumping && nh->nlmsg_seq == discover.seq)
+		{
+			discover_dump_done();
+		}
+		else if (nh->nlmsg_type == NLMSG_ERROR
+				&& discover.dumping && nh->nlmsg_seq == discover.seq)
+		{
+			log_message(LOG_LEVEL_WARNING, "Failed to list addresses");
+			discover.dumping = 0;
+		}
+	}
+
+	return 1;
+}
+
+static void discover_read_cb(evutil_socket_t fd, short events, void *data)
+{
+	while (discover_read(MSG_DONTWAIT))
+		;
+}
+
+const Error *discover_start()
+{
+	struct sockaddr_nl local;
+	const Error *e;
+
+	abort_if_fail(discover.fd < 0, "Discovery already started");
+
+	discover.fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (discover.fd < 0)
+		return error_printf(socket_error_generic, 
+				"Failed to open netlink socket: %s", strerror(errno));
+
+	memset(&local, 0, sizeof(local));
+	local.nl_family = AF_NETLINK;
+	local.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if (bind(discover.fd, (struct sockaddr *) &local, sizeof(local)) < 0)
+	{
+		e = error_printf(socket_error_generic, 
+				"Failed to bind netlink socket: %s", strerror(errno));
+		close(discover.fd);
+		discover.fd = -1;
+		return e;
+	}
+
+	//Subscribed before listing, so no change is missed in between
+	e = discover_request_dump();
+	if (e)
+	{
+		close(discover.fd);
+		discover.fd = -1;
+		return e;
+	}
+	while (discover.dumping && discover_read(0))
+		;
+
+	discover.event = event_new(evbase, discover.fd, EV_READ | EV_PERSIST,
+			discover_read_cb, NULL);
+	abort_if_fail(discover.event, "event_new() failed");
+	event_add(discover.event, NULL);
+
+	return NULL;
+}
+
+void discover_shutdown()
+{
+	if (discover.event)
+		event_free(discover.event);
+	if (discover.fd >= 0)
+		close(discover.fd);
+	discover.event = NULL;
+	discover.fd = -1;
+	discover.dumping = 0;
+
+	//Interfaces stay with the balancer
+	free(entries);
+	entries = NULL;
+	n_entries = entries_alloc_len = 0;
+	discover_free_rules();
+}
+
+#else
+
+const Error *discover_start()
+{
+	return error_printf(socket_error_unsupported_backend_feature,
+			"Interface discovery is only supported on Linux");
+}
+
+void discover_shutdown()
+{
+	discover_free_rules();
+}
+
+#endif
@@ -0,0 +1,45 @@
+/* discover.h
+ * Interfaces found from local addresses, followed as they change
+ *
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ *
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Rules are separated by commas. Each one is a network interface name 
+//pattern as understood by fnmatch(), with an optional metric after '@' 
+//and rate limit after '/' like on the command line, or a pattern 
+//preceded by '!' to ignore matching interfaces. The first matching rule 
+//decides, interfaces matching none are ignored.
+//Globally routable addresses of matching interfaces are added to the 
+//balancer, and added or removed again as the kernel reports changes.
+//Must be used from a single thread, the one running health checks.
+
+extern const char discover_error_invalid_rule[];
+
+const Error *discover_set_rules(const char *rules);
+
+//Returns whether addresses on the named interface should be used, and 
+//the metric and rate limit to use for them
+int discover_match(const char *ifname, int *metric_out, double *rate_out);
+
+//Adds interfaces for current addresses and starts following changes on
+//the calling thread's event loop. Only supported on Linux.
+const Error *discover_start();
+
+//Number of addresses currently in use
+size_t discover_get_n_ifaces();
+
+void discover_shutdown();
@@ -0,0 +1,260 @@
+/* health.c
+ * Health checking of outgoing interfaces
+ * 
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ * 
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "incl.h"
+
+typedef struct
+{
+	Interface *iface;
+	int n_failures; //< Consecutive failed probes
+	SocketHandle hd;
+	struct event *evt; //< Non-NULL while probe is in progress
+} HealthState;
+
+//Probe targets
+static SocketAddress *probes = NULL;
+static size_t n_probes = 0;
+static size_t next_probe = 0;
+
+//Each state is allocated separately, probes in progress point to it
+static HealthState **states = NULL;
+static size_t n_states = 0;
+
+static struct event *tick_event = NULL;
+
+static struct timeval health_ms_to_timeval(long ms)
+{
+	struct timeval tv;
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	return tv;
+}
+
+static struct timeval interval = 
+	{ HEALTH_DEFAULT_INTERVAL / 1000, (HEALTH_DEFAULT_INTERVAL % 1000) * 1000 };
+static struct timeval timeout = 
+	{ HEALTH_DEFAULT_TIMEOUT / 1000, (HEALTH_DEFAULT_TIMEOUT % 1000) * 1000 };
+
+void health_add_probe(SocketAddress addr)
+{
+	probes = fs_realloc(probes, sizeof(SocketAddress) * (n_probes + 1));
+	probes[n_probes++] = addr;
+}
+
+void health_set_timing(long interval_ms, long timeout_ms)
+{
+	interval = health_ms_to_timeval(interval_ms);
+	timeout = health_ms_to_timeval(timeout_ms);
+}
+
+//Picks probe targets in turn, returns NULL if there is none for the family
+static SocketAddress *health_select_probe(NetworkType type)
+{
+	size_t i;
+
+	for (i = 0; i < n_probes; i++)
+	{
+		SocketAddress *probe = probes + ((next_probe + i) % n_probes);
+		if (probe->host.type == type)
+		{
+			next_probe = (next_probe + i + 1) % n_probes;
+			return probe;
+		}
+	}
+
+	return NULL;
+}
+
+static void health_probe_count(HealthState *state, const Error *e)
+{
+	if (e)
+	{
+		state->n_failures++;
+		if (state->n_failures == HEALTH_PROBE_FAILURES)
+			balancer_eject(state->iface);
+		error_handle(e);
+	}
+	else
+	{
+		state->n_failures = 0;
+		interface_report_success(state->iface);
+		balancer_restore(state->iface);
+	}
+}
+
+static void health_probe_done(HealthState *state, const Error *e)
+{
+	if (state->evt)
+	{
+		event_free(state->evt);
+		state->evt = NULL;
+	}
+	socket_handle_close(state->hd);
+
+	health_probe_count(state, e);
+}
+
+static void health_probe_cb(evutil_socket_t fd, short events, void *data)
+{
+	HealthState *state = (HealthState *) data;
+
+	if (events & EV_TIMEOUT)
+		health_probe_done(state, error_printf(socket_error_timeout,
+					"Health probe timed out"));
+	else
+		health_probe_done(state, socket_handle_get_status(state->hd));
+}
+
+static void health_probe_start(HealthState *state, SocketAddress *probe)
+{
+	SocketAddress bind_addr;
+	const Error *e;
+
+	bind_addr.host = interface_get_addr(state->iface);
+	bind_addr.port = 0;
+	e = socket_handle_create_bound(bind_addr, &state->hd);
+	if (e)
+	{
+		//Counts as failed, the address may have gone away from the host
+		health_probe_count(state, e);
+		return;
+	}
+
+	e = socket_handle_set_blocking(state->hd, 0);
+	abort_if_fail(!e,
+			"socket_handle_set_blocking(hd, 0): %s", error_desc(e));
+
+	e = socket_handle_connect(state->hd, *probe);
+	if (e && e->type == socket_error_in_progress)
+	{
+		error_handle(e);
+		state->evt = socket_handle_create_event(state->hd, EV_WRITE, 
+				health_probe_cb, state);
+		event_add(state->evt, &timeout);
+		return;
+	}
+
+	health_probe_done(state, e);
+}
+
+static void health_tick(evutil_socket_t fd, short events, void *data)
+{
+	size_t i;
+
+	for (i = 0; i < n_states; i++)
+	{
+		HealthState *state = states[i];
+		SocketAddress *probe;
+
+		//Previous probe still running
+		if (state->evt)
+			continue;
+
+		probe = health_select_probe(interface_get_addr(state->iface).type);
+		if (probe)
+			health_probe_start(state, probe);
+		else
+			balancer_restore(state->iface);
+	}
+}
+
+static void health_state_add(Interface *iface)
+{
+	HealthState *state = (HealthState *) fs_malloc(sizeof(HealthState));
+
+	state->iface = iface;
+	state->n_failures = 0;
+	state->evt = NULL;
+
+	states = fs_realloc(states, sizeof(HealthState *) * (n_states + 1));
+	states[n_states++] = state;
+}
+
+static void health_state_free(HealthState *state)
+{
+	if (state->evt)
+	{
+		event_free(state->evt);
+		socket_handle_close(state->hd);
+	}
+	free(state);
+}
+
+void health_add_iface(Interface *iface)
+{
+	if (tick_event)
+		health_state_add(iface);
+}
+
+void health_remove_iface(Interface *iface)
+{
+	size_t i;
+
+	for (i = 0; i < n_states; i++)
+	{
+		if (states[i]->iface == iface)
+		{
+			health_state_free(states[i]);
+			states[i] = states[--n_states];
+			return;
+		}
+	}
+}
+
+void health_start()
+{
+	Interface **ifaces;
+	size_t i, n_ifaces;
+
+	abort_if_fail(! tick_event, "Health checking already started");
+
+	n_ifaces = balancer_get_ifaces(NULL, 0);
+	ifaces = fs_malloc(sizeof(Interface *) * (n_ifaces + 1));
+	n_ifaces = balancer_get_ifaces(ifaces, n_ifaces);
+
+	for (i = 0; i < n_ifaces; i++)
+		health_state_add(ifaces[i]);
+	free(ifaces);
+
+	tick_event = event_new(evbase, -1, EV_PERSIST, health_tick, NULL);
+	event_add(tick_event, &interval);
+}
+
+void health_shutdown()
+{
+	size_t i;
+
+	for (i = 0; i < n_states; i++)
+		health_state_free(states[i]);
+	free(states);
+	states = NULL;
+	n_states = 0;
+
+	if (tick_event)
+	{
+		event_free(tick_event);
+		tick_event = NULL;
+	}
+
+	free(probes);
+	probes = NULL;
+	n_probes = 0;
+	next_probe = 0;
+}
@@ -0,0 +1,44 @@
+/* health.h
+ * Health checking of outgoing interfaces
+ * 
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ * 
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Periodically connects to probe targets through every interface, ejecting
+//interfaces whose probes fail and restoring them once probes succeed.
+//Interfaces without a probe target for their address family, ejected 
+//because connections through them failed, are restored on the next check.
+
+#define HEALTH_DEFAULT_INTERVAL (5000) //< Milliseconds
+#define HEALTH_DEFAULT_TIMEOUT (2000) //< Milliseconds
+
+//Consecutive failed probes that eject an interface
+#define HEALTH_PROBE_FAILURES (2)
+
+void health_add_probe(SocketAddress addr);
+
+void health_set_timing(long interval_ms, long timeout_ms);
+
+//Starts checking interfaces on the calling thread's event loop
+void health_start();
+
+//Interfaces added to or removed from the balancer after health_start(),
+//must be called on the same thread
+void health_add_iface(Interface *iface);
+void health_remove_iface(Interface *iface);
+
+void health_shutdown();
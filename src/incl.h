@@ -24,14 +24,29 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stdatomic.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include <event2/event.h>
 #include <event2/dns.h>
 
 #include "utils.h"
+#include "pool.h"
 #include "network.h"
+#include "uring.h"
+#include "buffer.h"
+#include "log.h"
+#include "trace.h"
 #include "balancer.h"
+#include "health.h"
 #include "socks.h"
 #include "connector.h"
+#include "udp.h"
 #include "session.h"
 #include "server.h"
+#include "stats.h"
+#include "config.h"
+#include "discover.h"
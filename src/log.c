@@ -0,0 +1,344 @@
+/* log.c
+ * Buffered, non-blocking logging
+ * 
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ * 
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "incl.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+//Size of per-thread log buffer
+#define LOG_BUFFER_SIZE (64 * 1024)
+
+//Maximum length of one message
+#define LOG_LINE_MAX (512)
+
+LogLevel log_level = LOG_LEVEL_INFO;
+
+static atomic_ulong n_dropped = 0;
+
+//Whether stdout was made non-blocking
+static atomic_int sink_nonblocking = -1;
+
+typedef struct
+{
+	RingBuffer ring;
+	struct event_base *base; //< Event loop the events belong to
+	struct event *flush_evt; //< Deferred flush
+	struct event *write_evt; //< Waits for stdout to become writable
+	int flush_pending;
+	unsigned long n_dropped; //< Drops not yet reported
+} LogBuffer;
+
+static THREAD_LOCAL LogBuffer *log_buffer = NULL;
+
+void log_set_level(LogLevel level)
+{
+	log_level = level;
+}
+
+Status log_level_from_str(const char *str, LogLevel *level_out)
+{
+	const char *names[] = { "error", "warning", "info", "debug", NULL };
+	int i;
+
+	for (i = 0; names[i]; i++)
+	{
+		if (strcmp(str, names[i]) == 0)
+		{
+			*level_out = i;
+			return STATUS_SUCCESS;
+		}
+	}
+
+	return STATUS_FAILURE;
+}
+
+unsigned long log_get_dropped()
+{
+	return atomic_load(&n_dropped);
+}
+
+//Pipes and sockets block when reader is slow, make them non-blocking.
+//Terminals and files are left alone.
+static void log_prepare_sink()
+{
+	int expected = -1;
+	int res = 0;
+
+#ifndef _WIN32
+	struct stat st;
+	if (fstat(STDOUT_FILENO, &st) == 0 
+			&& (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)))
+	{
+		int flags = fcntl(STDOUT_FILENO, F_GETFL);
+		if (flags >= 0 
+				&& fcntl(STDOUT_FILENO, F_SETFL, flags | O_NONBLOCK) == 0)
+			res = 1;
+	}
+#endif
+
+	atomic_compare_exchange_strong(&sink_nonblocking, &expected, res);
+}
+
+//Writes as much as possible. Returns 0 if stdout would block.
+static int log_write_out(LogBuffer *buf)
+{
+	while (1)
+	{
+		IoVec vecs[2];
+		int n_vecs;
+		long res;
+#ifndef _WIN32
+		struct iovec iov[2];
+		int i;
+#endif
+
+		//Report dropped messages once there is space again
+		if (buf->n_dropped)
+		{
+			char line[64];
+			int len = snprintf(line, sizeof(line), 
+					"%lu log messages dropped\n", buf->n_dropped);
+			if (ring_buffer_write(&buf->ring, line, len) == STATUS_SUCCESS)
+				buf->n_dropped = 0;
+		}
+
+		if (! ring_buffer_len(&buf->ring))
+			break;
+		n_vecs = ring_buffer_data_vecs(&buf->ring, vecs);
+
+#ifdef _WIN32
+		res = fwrite(vecs[0].data, 1, vecs[0].len, stdout);
+		fflush(stdout);
+		if (res <= 0)
+			res = vecs[0].len;
+#else
+		for (i = 0; i < n_vecs; i++)
+		{
+			iov[i].iov_base = vecs[i].data;
+			iov[i].iov_len = vecs[i].len;
+		}
+
+		res = writev(STDOUT_FILENO, iov, n_vecs);
+		if (res < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+
+			//Nowhere to report this, give up on the buffered data
+			res = ring_buffer_len(&buf->ring);
+		}
+#endif
+		ring_buffer_consume(&buf->ring, res);
+	}
+
+	return 1;
+}
+
+static void log_flush_cb(evutil_socket_t fd, short events, void *data)
+{
+	LogBuffer *buf = (LogBuffer *) data;
+
+	buf->flush_pending = 0;
+
+	if (! log_write_out(buf) && buf->write_evt)
+		event_add(buf->write_evt, NULL);
+}
+
+static LogBuffer *log_get_buffer()
+{
+	LogBuffer *buf = log_buffer;
+
+	if (! buf)
+	{
+		if (atomic_load(&sink_nonblocking) < 0)
+			log_prepare_sink();
+
+		buf = fs_malloc(sizeof(LogBuffer) + LOG_BUFFER_SIZE);
+		ring_buffer_init(&buf->ring, buf + 1, LOG_BUFFER_SIZE);
+		buf->base = NULL;
+		buf->flush_evt = NULL;
+		buf->write_evt = NULL;
+		buf->flush_pending = 0;
+		buf->n_dropped = 0;
+		log_buffer = buf;
+	}
+
+	//Messages logged before the event loop was created are written
+	//synchronously, switch to deferred writes once it exists
+	if (! buf->base && evbase)
+	{
+		buf->base = evbase;
+		buf->flush_evt = event_new(buf->base, -1, 0, log_flush_cb, buf);
+#ifndef _WIN32
+		buf->write_evt = event_new(buf->base, STDOUT_FILENO, EV_WRITE, 
+				log_flush_cb, buf);
+#endif
+	}
+
+	return buf;
+}
+
+void log_vmessage(LogLevel level, const char *fmt, va_list arglist)
+{
+	LogBuffer *buf;
+	char line[LOG_LINE_MAX];
+	int len = 0;
+
+	if (! log_enabled(level))
+		return;
+
+	buf = log_get_buffer();
+
+	if (level == LOG_LEVEL_ERROR)
+		len = snprintf(line, LOG_LINE_MAX, "ERROR: ");
+	else if (level == LOG_LEVEL_WARNING)
+		len = snprintf(line, LOG_LINE_MAX, "WARNING: ");
+
+	len += vsnprintf(line + len, LOG_LINE_MAX - len, fmt, arglist);
+	if (len > LOG_LINE_MAX - 2)
+		len = LOG_LINE_MAX - 2;
+	line[len++] = '\n';
+
+	if (ring_buffer_write(&buf->ring, line, len) != STATUS_SUCCESS)
+	{
+		buf->n_dropped++;
+		atomic_fetch_add(&n_dropped, 1);
+		return;
+	}
+
+	//Without an event loop, just write it out
+	if (! buf->flush_evt)
+	{
+		log_write_out(buf);
+		return;
+	}
+
+	//Batch all messages of this event loop iteration into one write,
+	//unless we are already waiting for stdout to drain
+	if (! buf->flush_pending && ! (buf->write_evt 
+				&& event_pending(buf->write_evt, EV_WRITE, NULL)))
+	{
+		buf->flush_pending = 1;
+		event_active(buf->flush_evt, 0, 0);
+	}
+}
+
+void log_message(LogLevel level, const char *fmt, ...)
+{
+	va_list arglist;
+
+	va_start(arglist, fmt);
+	log_vmessage(level, fmt, arglist);
+	va_end(arglist);
+}
+
+//Makes stdout blocking again if it was made non-blocking. Returns the 
+//flags for log_sink_restore(), or -1.
+static int log_sink_block()
+{
+	int flags = -1;
+
+#ifndef _WIN32
+	if (atomic_load(&sink_nonblocking) > 0)
+	{
+		flags = fcntl(STDOUT_FILENO, F_GETFL);
+		if (flags >= 0)
+			fcntl(STDOUT_FILENO, F_SETFL, flags & (~O_NONBLOCK));
+	}
+#endif
+
+	return flags;
+}
+
+static void log_sink_restore(int flags)
+{
+#ifndef _WIN32
+	if (flags >= 0)
+		fcntl(STDOUT_FILENO, F_SETFL, flags);
+#endif
+}
+
+void log_flush()
+{
+	LogBuffer *buf = log_buffer;
+	int flags;
+
+	if (! buf)
+		return;
+
+	flags = log_sink_block();
+	log_write_out(buf);
+	log_sink_restore(flags);
+}
+
+void log_dump(const void *data, size_t len)
+{
+	const char *iter = (const char *) data;
+	int flags;
+
+	flags = log_sink_block();
+	if (log_buffer)
+		log_write_out(log_buffer);
+
+#ifdef _WIN32
+	fwrite(iter, 1, len, stdout);
+	fflush(stdout);
+#else
+	while (len)
+	{
+		ssize_t res = write(STDOUT_FILENO, iter, len);
+		if (res < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		iter += res;
+		len -= res;
+	}
+#endif
+
+	log_sink_restore(flags);
+}
+
+void log_thread_shutdown()
+{
+	LogBuffer *buf = log_buffer;
+
+	if (! buf)
+		return;
+
+	log_flush();
+
+	if (buf->flush_evt)
+		event_free(buf->flush_evt);
+	if (buf->write_evt)
+		event_free(buf->write_evt);
+	free(buf);
+
+	log_buffer = NULL;
+}
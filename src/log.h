@@ -0,0 +1,59 @@
+/* log.h
+ * Buffered, non-blocking logging
+ * 
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ * 
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Messages are formatted into a preallocated per-thread buffer and written
+//to stdout from the event loop. If stdout cannot keep up, messages are 
+//dropped (and counted) instead of blocking the event loop.
+
+typedef enum
+{
+	LOG_LEVEL_ERROR = 0,
+	LOG_LEVEL_WARNING = 1,
+	LOG_LEVEL_INFO = 2,
+	LOG_LEVEL_DEBUG = 3
+} LogLevel;
+
+extern LogLevel log_level;
+
+static inline int log_enabled(LogLevel level)
+{
+	return level <= log_level;
+}
+
+void log_set_level(LogLevel level);
+
+Status log_level_from_str(const char *str, LogLevel *level_out);
+
+void log_vmessage(LogLevel level, const char *fmt, va_list arglist);
+
+void log_message(LogLevel level, const char *fmt, ...);
+
+//Number of messages dropped so far
+unsigned long log_get_dropped();
+
+//Writes out everything buffered by the calling thread, blocking if needed
+void log_flush();
+
+//Writes out data after the messages buffered by the calling thread, 
+//blocking if needed. For output too large for the buffer, like 
+//statistics dumps.
+void log_dump(const void *data, size_t len);
+
+void log_thread_shutdown();
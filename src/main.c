@@ -20,30 +20,366 @@
 
 #include "incl.h"
 
+#include <signal.h>
+#include <limits.h>
+#include <event2/buffer.h>
+
+//If arg is of form name=value, returns value, else NULL.
+static const char *option_value(const char *arg, const char *name)
+{
+	size_t len = strlen(name);
+
+	if (strncmp(arg, name, len) == 0 && arg[len] == '=')
+		return arg + len + 1;
+	return NULL;
+}
+
+//Parses value of --rcvbuf or --sndbuf into out
+static void parse_sockbuf(const char *val, int *out)
+{
+	size_t size;
+
+	abort_if_fail(parse_size(val, &size) == STATUS_SUCCESS
+			&& size <= INT_MAX,
+			"Invalid socket buffer size '%s'", val);
+	*out = size;
+}
+
+//Listening addresses, shared by all worker threads
+static const char **binds;
+static int n_binds;
+static ListenerFlags listener_flags = 0;
+
+static void worker_create_servers()
+{
+	int i;
+
+	for (i = 0; i < n_binds; i++)
+		server_create(binds[i], listener_flags);
+}
+
+#ifdef SIGUSR1
+static void dump_stats_cb(evutil_socket_t fd, short events, void *data)
+{
+	struct evbuffer *buf = evbuffer_new();
+
+	pool_dump_stats(buf);
+	stats_format(buf, STATS_FORMAT_TEXT);
+	log_dump(evbuffer_pullup(buf, -1), evbuffer_get_length(buf));
+	evbuffer_free(buf);
+}
+#endif
+
+#ifdef SIGHUP
+static void reload_config_cb(evutil_socket_t fd, short events, void *data)
+{
+	const Error *e = config_reload();
+
+	if (e)
+	{
+		log_message(LOG_LEVEL_WARNING, "Configuration not reloaded: %s",
+				error_desc(e));
+		error_handle(e);
+	}
+}
+#endif
+
+static void worker_main(void *data)
+{
+	int loop_stat;
+
+	utils_thread_init();
+	worker_create_servers();
+
+	loop_stat = event_base_loop(evbase, 0);
+	abort_with_liberror("event_base_loop() returned %d", loop_stat); 
+}
+
 int main(int argc, char *argv[])
 {
-	int i, len;
-	int bound = 0, iface_count = 0;
+	int i;
+	int iface_count = 0;
+	long n_threads = 1;
+	long dns_entries = DNS_CACHE_DEFAULT_ENTRIES;
+	long dns_ttl = DNS_CACHE_DEFAULT_TTL;
+	long dns_negative_ttl = DNS_CACHE_DEFAULT_NEGATIVE_TTL;
+	long connect_stagger = CONNECTOR_DEFAULT_STAGGER;
+	long connect_timeout = CONNECTOR_DEFAULT_TIMEOUT;
+	long probe_interval = HEALTH_DEFAULT_INTERVAL;
+	long probe_timeout = HEALTH_DEFAULT_TIMEOUT;
+	long max_sessions = 0, max_client_sessions = 0;
+	size_t max_buffered = 0;
+	SocketOptions socket_opts = SOCKET_OPTIONS_DEFAULT;
+	long handshake_timeout = SESSION_DEFAULT_HANDSHAKE_TIMEOUT;
+	long idle_timeout = SESSION_DEFAULT_IDLE_TIMEOUT;
 	int loop_stat;
+	const char *val;
+	const char *stats_addr = NULL;
+	const char *config_path = NULL;
+	const char *discover_rules = NULL;
+	static const char *default_binds[] = { "127.0.0.1:1080", "[::1]:1080" };
 	
 	//Call init functions
 	utils_init();
 	
 	//Read arguments
-	len = strlen("--bind=");
+	binds = fs_malloc(sizeof(const char *) * argc);
+	n_binds = 0;
 	for (i = 1; i < argc; i++)
 	{
 		if ((strcmp(argv[i], "-h") == 0)
 			|| (strcmp(argv[i], "--help") == 0))
 		{
-			printf("Usage: %s [--bind=addr:port] "
+			printf("Usage: %s [--bind=addr:port] [--listen-fastopen=on|off] "
+				"[--defer-accept=on|off] [--io-uring=on|off] "
+				"[--relay=splice|copy|uring] "
+				"[--threads=N] [--buffer-size=size] "
+				"[--log-level=error|warning|info|debug] "
+				"[--dns-cache=N] [--dns-ttl=seconds] "
+				"[--dns-negative-ttl=seconds] "
+				"[--connect-stagger=ms] [--connect-timeout=ms] "
+				"[--race-ifaces=N] [--fastopen-connect=on|off] "
+				"[--policy=connections|bandwidth|latency] "
+				"[--scheduler=least-loaded|round-robin|two-choices] "
+				"[--probe=addr:port] [--probe-interval=ms] "
+				"[--probe-timeout=ms] [--eject-after=N] "
+				"[--affinity=N] [--max-sessions=N] "
+				"[--max-client-sessions=N] [--max-buffered=size] "
+				"[--tcp-nodelay=on(default)|off] [--rcvbuf=size] [--sndbuf=size] "
+				"[--keepalive=seconds] [--handshake-timeout=ms] "
+				"[--idle-timeout=seconds] [--stats=addr:port] "
+				"[--config=path] [--discover=rules] "
 				"addr1@metric1 addr2@metric2 ...\n", argv[0]);
 			exit(1);
 		}
-		else if (strncmp(argv[i], "--bind=", len) == 0)
+		else if ((val = option_value(argv[i], "--bind")))
+		{
+			binds[n_binds++] = val;
+		}
+		else if ((val = option_value(argv[i], "--listen-fastopen")))
+		{
+			if (strcmp(val, "on") == 0)
+				listener_flags |= LISTENER_FASTOPEN;
+			else if (strcmp(val, "off") == 0)
+				listener_flags &= ~LISTENER_FASTOPEN;
+			else
+				abort_with_error("Invalid value for --listen-fastopen '%s'", 
+						val);
+		}
+		else if ((val = option_value(argv[i], "--defer-accept")))
+		{
+			if (strcmp(val, "on") == 0)
+				listener_flags |= LISTENER_DEFER_ACCEPT;
+			else if (strcmp(val, "off") == 0)
+				listener_flags &= ~LISTENER_DEFER_ACCEPT;
+			else
+				abort_with_error("Invalid value for --defer-accept '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--io-uring")))
+		{
+			if (strcmp(val, "on") == 0)
+				uring_set_enabled(1);
+			else if (strcmp(val, "off") == 0)
+				uring_set_enabled(0);
+			else
+				abort_with_error("Invalid value for --io-uring '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--relay")))
+		{
+			if (strcmp(val, "splice") == 0)
+				session_set_relay_mode(SESSION_RELAY_SPLICE);
+			else if (strcmp(val, "copy") == 0)
+				session_set_relay_mode(SESSION_RELAY_COPY);
+			else if (strcmp(val, "uring") == 0)
+				session_set_relay_mode(SESSION_RELAY_URING);
+			else
+				abort_with_error("Unknown relay mode '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--buffer-size")))
+		{
+			size_t size;
+			abort_if_fail(parse_size(val, &size) == STATUS_SUCCESS,
+					"Invalid buffer size '%s'", val);
+			session_set_buffer_size(size);
+		}
+		else if ((val = option_value(argv[i], "--log-level")))
+		{
+			LogLevel level;
+			abort_if_fail(log_level_from_str(val, &level) == STATUS_SUCCESS,
+					"Unknown log level '%s'", val);
+			log_set_level(level);
+		}
+		else if ((val = option_value(argv[i], "--dns-cache")))
+		{
+			abort_if_fail(parse_long(val, &dns_entries) == STATUS_SUCCESS
+					&& dns_entries >= 0,
+					"Invalid DNS cache size '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--dns-ttl")))
+		{
+			abort_if_fail(parse_long(val, &dns_ttl) == STATUS_SUCCESS
+					&& dns_ttl >= 0,
+					"Invalid DNS TTL '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--dns-negative-ttl")))
+		{
+			abort_if_fail(parse_long(val, &dns_negative_ttl) == STATUS_SUCCESS
+					&& dns_negative_ttl >= 0,
+					"Invalid DNS negative TTL '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--connect-stagger")))
+		{
+			abort_if_fail(parse_long(val, &connect_stagger) == STATUS_SUCCESS
+					&& connect_stagger >= 0,
+					"Invalid connection attempt delay '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--connect-timeout")))
+		{
+			abort_if_fail(parse_long(val, &connect_timeout) == STATUS_SUCCESS
+					&& connect_timeout >= 0,
+					"Invalid connection timeout '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--race-ifaces")))
 		{
-			server_create(argv[i] + len);
-			bound = 1;
+			long n;
+			abort_if_fail(parse_long(val, &n) == STATUS_SUCCESS
+					&& n > 0 && n <= CONNECTOR_MAX_ATTEMPTS,
+					"Invalid number of interfaces to race '%s'", val);
+			connector_set_race_ifaces(n);
+		}
+		else if ((val = option_value(argv[i], "--fastopen-connect")))
+		{
+			if (strcmp(val, "on") == 0)
+				connector_set_fastopen(1);
+			else if (strcmp(val, "off") == 0)
+				connector_set_fastopen(0);
+			else
+				abort_with_error("Invalid value for --fastopen-connect '%s'", 
+						val);
+		}
+		else if ((val = option_value(argv[i], "--affinity")))
+		{
+			long n;
+			abort_if_fail(parse_long(val, &n) == STATUS_SUCCESS && n >= 0,
+					"Invalid affinity table size '%s'", val);
+			balancer_set_affinity(n);
+		}
+		else if ((val = option_value(argv[i], "--policy")))
+		{
+			BalancerPolicy policy;
+			abort_if_fail(balancer_policy_from_str(val, &policy) 
+					== STATUS_SUCCESS,
+					"Unknown balancing policy '%s'", val);
+			balancer_set_policy(policy);
+		}
+		else if ((val = option_value(argv[i], "--scheduler")))
+		{
+			BalancerScheduler scheduler;
+			abort_if_fail(balancer_scheduler_from_str(val, &scheduler) 
+					== STATUS_SUCCESS,
+					"Unknown scheduler '%s'", val);
+			balancer_set_scheduler(scheduler);
+		}
+		else if ((val = option_value(argv[i], "--probe")))
+		{
+			SocketAddress addr;
+			abort_if_fail(socket_address_from_str(val, &addr) == STATUS_SUCCESS
+					&& addr.port != 0,
+					"Invalid probe address '%s'", val);
+			health_add_probe(addr);
+		}
+		else if ((val = option_value(argv[i], "--probe-interval")))
+		{
+			abort_if_fail(parse_long(val, &probe_interval) == STATUS_SUCCESS
+					&& probe_interval > 0,
+					"Invalid probe interval '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--probe-timeout")))
+		{
+			abort_if_fail(parse_long(val, &probe_timeout) == STATUS_SUCCESS
+					&& probe_timeout > 0,
+					"Invalid probe timeout '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--eject-after")))
+		{
+			long n;
+			abort_if_fail(parse_long(val, &n) == STATUS_SUCCESS && n >= 0,
+					"Invalid number of failures '%s'", val);
+			balancer_set_failure_threshold(n);
+		}
+		else if ((val = option_value(argv[i], "--max-sessions")))
+		{
+			abort_if_fail(parse_long(val, &max_sessions) == STATUS_SUCCESS
+					&& max_sessions >= 0,
+					"Invalid number of sessions '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--max-client-sessions")))
+		{
+			abort_if_fail(parse_long(val, &max_client_sessions) 
+					== STATUS_SUCCESS && max_client_sessions >= 0,
+					"Invalid number of sessions '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--max-buffered")))
+		{
+			abort_if_fail(parse_size(val, &max_buffered) == STATUS_SUCCESS,
+					"Invalid size '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--tcp-nodelay")))
+		{
+			if (strcmp(val, "on") == 0)
+				socket_opts.nodelay = 1;
+			else if (strcmp(val, "off") == 0)
+				socket_opts.nodelay = 0;
+			else
+				abort_with_error("Invalid value for --tcp-nodelay '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--rcvbuf")))
+		{
+			parse_sockbuf(val, &socket_opts.rcvbuf);
+		}
+		else if ((val = option_value(argv[i], "--sndbuf")))
+		{
+			parse_sockbuf(val, &socket_opts.sndbuf);
+		}
+		else if ((val = option_value(argv[i], "--keepalive")))
+		{
+			long n;
+			abort_if_fail(parse_long(val, &n) == STATUS_SUCCESS 
+					&& n >= 0 && n <= INT_MAX,
+					"Invalid keepalive time '%s'", val);
+			socket_opts.keepalive = n;
+		}
+		else if ((val = option_value(argv[i], "--handshake-timeout")))
+		{
+			abort_if_fail(parse_long(val, &handshake_timeout) 
+					== STATUS_SUCCESS && handshake_timeout >= 0,
+					"Invalid handshake timeout '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--idle-timeout")))
+		{
+			abort_if_fail(parse_long(val, &idle_timeout) == STATUS_SUCCESS
+					&& idle_timeout >= 0,
+					"Invalid idle timeout '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--stats")))
+		{
+			stats_addr = val;
+		}
+		else if ((val = option_value(argv[i], "--config")))
+		{
+			config_path = val;
+		}
+		else if ((val = option_value(argv[i], "--discover")))
+		{
+			const Error *e = discover_set_rules(val);
+			abort_if_fail(! e, "%s", error_desc(e));
+			discover_rules = val;
+		}
+		else if ((val = option_value(argv[i], "--threads")))
+		{
+			abort_if_fail(parse_long(val, &n_threads) == STATUS_SUCCESS
+					&& n_threads > 0,
+					"Invalid number of threads '%s'", val);
 		}
 		else
 		{
@@ -52,22 +388,77 @@ int main(int argc, char *argv[])
 		}
 	}
 	
-	if (! iface_count)
+	if (config_path)
+	{
+		const Error *e = config_load(config_path);
+		abort_if_fail(! e, "%s", error_desc(e));
+		iface_count += config_get_n_ifaces();
+	}
+
+	if (! iface_count && ! discover_rules)
 	{
 		abort_with_error("No addresses to dispatch.");
 	}
 
-	balancer_verify();
+	socket_set_options(&socket_opts);
+	if (iface_count)
+		balancer_verify();
+
+	//Discovered addresses are local already and need no verification
+	if (discover_rules)
+	{
+		const Error *e = discover_start();
+		abort_if_fail(! e, "%s", error_desc(e));
+		if (! iface_count && ! discover_get_n_ifaces())
+			log_message(LOG_LEVEL_WARNING, 
+					"No addresses yet, waiting for interfaces to come up");
+	}
+	dns_cache_set_limits(dns_entries, dns_ttl, dns_negative_ttl);
+	connector_set_timing(connect_stagger, connect_timeout);
+	health_set_timing(probe_interval, probe_timeout);
+	health_start();
+	server_set_limits(max_sessions, max_client_sessions, max_buffered);
+	session_set_timeouts(handshake_timeout, idle_timeout);
 	
 	//Default listening addresses
-	if (! bound)
+	if (! n_binds)
+	{
+		binds[n_binds++] = default_binds[0];
+		binds[n_binds++] = default_binds[1];
+	}
+
+	//Each worker thread gets its own listeners, kernel distributes
+	//incoming connections among them.
+	if (n_threads > 1)
+	{
+		abort_if_fail(thread_supported(),
+				"Threads are not supported in this build");
+		listener_flags |= LISTENER_REUSE_PORT;
+	}
+	worker_create_servers();
+	if (stats_addr)
+		stats_start_server(stats_addr);
+	for (i = 1; i < n_threads; i++)
+		thread_create(worker_main, NULL);
+
+#ifdef SIGUSR1
+	//Print statistics on demand
+	{
+		struct event *evt = evsignal_new(evbase, SIGUSR1, dump_stats_cb, NULL);
+		event_add(evt, NULL);
+	}
+#endif
+#ifdef SIGHUP
+	//Apply changes to the configuration file
+	if (config_path)
 	{
-		server_create("127.0.0.1:1080");
-		server_create("[::1]:1080");
+		struct event *evt = evsignal_new(evbase, SIGHUP, reload_config_cb, NULL);
+		event_add(evt, NULL);
 	}
+#endif
 	
 	//Start dispatch
-	printf("Running...\n");
+	log_message(LOG_LEVEL_INFO, "Running...");
 	loop_stat = event_base_loop(evbase, 0);
 	abort_with_liberror("event_base_loop() returned %d", loop_stat); 
 	
@@ -36,7 +36,9 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
 //Socket errors
@@ -60,7 +62,8 @@ const char socket_error_generic[] = "Generic socket error";
 
 const char socket_error_invalid_socket[] = "Invalid socket handle";
 const char socket_error_invalid_address[] = "Invalid address";
-const char socket_error_again[] = "Resource temoporarily unavailable";
+define_static_error(socket_error_again, "Resource temoporarily unavailable");
+define_static_error(socket_error_reset, "Connection reset by peer");
 const char socket_error_in_progress[] = "In progress";
 const char socket_error_already[] = "Socket is already connecting/connected";
 const char socket_error_timeout[] = "Operation timed out";
@@ -68,6 +71,7 @@ const char socket_error_network_unreachable[] = "Network unreachable";
 const char socket_error_host_unreachable[] = "Host unreachable";
 const char socket_error_connection_refused[] = "Connection refused";
 const char socket_error_dns_failure[] = "DNS failure";
+const char socket_error_no_fds[] = "Out of file descriptors or socket memory";
 const char socket_error_unsupported_backend_feature[]
 = "The current socket backend exhibits a feature that we cannot handle";
 
@@ -100,6 +104,12 @@ static const char *errno_to_error_type(int errno_val, WAFlags wa_flags)
 		return socket_error_host_unreachable;
 	else if (errno_val == ECONNREFUSED)
 		return socket_error_connection_refused;
+	else if (errno_val == ECONNRESET || errno_val == EPIPE 
+			|| errno_val == ECONNABORTED)
+		return socket_error_reset;
+	else if (errno_val == EMFILE || errno_val == ENFILE
+			|| errno_val == ENOBUFS || errno_val == ENOMEM)
+		return socket_error_no_fds;
 	else
 		return socket_error_generic;
 }
@@ -150,6 +160,27 @@ static const Error *error_from_errno
 }
 
 
+//Error for failed IO calls. Expected conditions map to static errors,
+//only unexpected failures get a formatted description.
+static const Error *io_error_from_errno(int errno_val, const char *fn, int fd)
+{
+	const char *type = errno_to_error_type(errno_val, 0);
+
+#ifdef _WIN32
+	if (errno_val == WSAEWOULDBLOCK)
+		type = socket_error_again;
+	else if (errno_val == WSAECONNRESET)
+		type = socket_error_reset;
+#endif
+
+	if (type == socket_error_again)
+		return socket_error_again_instance;
+	else if (type == socket_error_reset)
+		return socket_error_reset_instance;
+	else
+		return error_from_errno(errno_val, 0, "%s(fd = %d) failed", fn, fd);
+}
+
 
 //////////////////////////////////
 //Host address functions
@@ -440,16 +471,91 @@ static const Error *native_address_get_socket_address
 }
 
 
+//Options for connection sockets
+static SocketOptions socket_options = SOCKET_OPTIONS_DEFAULT;
+
+void socket_set_options(const SocketOptions *options)
+{
+	socket_options = *options;
+}
+
+static const Error *apply_socket_options(evutil_socket_t fd)
+{
+	const SocketOptions *opts = &socket_options;
+
+	if (opts->nodelay)
+	{
+		const int one = 1;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, 
+					sockopt(&one), sizeof(one)) < 0)
+			return error_from_errno(nv_error, 0,
+					"setsockopt(%d, IPPROTO_TCP, TCP_NODELAY, 1) failed", fd);
+	}
+
+	if (opts->rcvbuf)
+	{
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, 
+					sockopt(&opts->rcvbuf), sizeof(opts->rcvbuf)) < 0)
+			return error_from_errno(nv_error, 0,
+					"setsockopt(%d, SOL_SOCKET, SO_RCVBUF, %d) failed", 
+					fd, opts->rcvbuf);
+	}
+
+	if (opts->sndbuf)
+	{
+		if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, 
+					sockopt(&opts->sndbuf), sizeof(opts->sndbuf)) < 0)
+			return error_from_errno(nv_error, 0,
+					"setsockopt(%d, SOL_SOCKET, SO_SNDBUF, %d) failed", 
+					fd, opts->sndbuf);
+	}
+
+	if (opts->keepalive)
+	{
+		const int one = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, 
+					sockopt(&one), sizeof(one)) < 0)
+			return error_from_errno(nv_error, 0,
+					"setsockopt(%d, SOL_SOCKET, SO_KEEPALIVE, 1) failed", fd);
+#if defined(TCP_KEEPIDLE)
+		if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, 
+					sockopt(&opts->keepalive), sizeof(opts->keepalive)) < 0)
+			return error_from_errno(nv_error, 0,
+					"setsockopt(%d, IPPROTO_TCP, TCP_KEEPIDLE, %d) failed", 
+					fd, opts->keepalive);
+#elif defined(TCP_KEEPALIVE)
+		if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, 
+					sockopt(&opts->keepalive), sizeof(opts->keepalive)) < 0)
+			return error_from_errno(nv_error, 0,
+					"setsockopt(%d, IPPROTO_TCP, TCP_KEEPALIVE, %d) failed", 
+					fd, opts->keepalive);
+#endif
+	}
+
+	return NULL;
+}
+
 //Create socket
+//What create_socket() creates the socket for
+typedef enum
+{
+	SOCKET_KIND_OUTGOING,
+	SOCKET_KIND_LISTENER,
+	SOCKET_KIND_DATAGRAM
+} SocketKind;
+
 static const Error *create_socket(NetworkType type, void *ip, uint16_t port,
-		evutil_socket_t *fd_out)
+		SocketKind kind, ListenerFlags flags, evutil_socket_t *fd_out)
 {
 	evutil_socket_t fd;
 	NativeAddress native_addr;
 
 	native_addr = native_address_create(type, ip, port);
 
-	fd = socket(native_address_pf(native_addr), SOCK_STREAM, IPPROTO_TCP);
+	if (kind == SOCKET_KIND_DATAGRAM)
+		fd = socket(native_address_pf(native_addr), SOCK_DGRAM, IPPROTO_UDP);
+	else
+		fd = socket(native_address_pf(native_addr), SOCK_STREAM, IPPROTO_TCP);
 	if (fd < 0)
 		return error_from_errno(nv_error, 0, "socket() failed");
 
@@ -464,6 +570,36 @@ static const Error *create_socket(NetworkType type, void *ip, uint16_t port,
 		}
 	}
 
+	if (flags & LISTENER_REUSE_PORT)
+	{
+#ifdef SO_REUSEPORT
+		const int one = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, 
+					sockopt(&one), sizeof(one)) < 0)
+		{
+			nf_close(fd);
+			return error_from_errno(nv_error, 0,
+					"setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, 1) failed");
+		}
+#else
+		nf_close(fd);
+		return error_printf(socket_error_unsupported_backend_feature,
+				"SO_REUSEPORT is not supported on this platform");
+#endif
+	}
+
+#ifdef IP_BIND_ADDRESS_NO_PORT
+	//Leave choosing the port to connect(), which can then reuse ports 
+	//already bound for connections to other destinations. Kernels that
+	//do not know the option choose a port when binding, as usual.
+	if (kind == SOCKET_KIND_OUTGOING && port == 0)
+	{
+		const int one = 1;
+		setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, 
+				sockopt(&one), sizeof(one));
+	}
+#endif
+
 	if (bind(fd, &native_addr.generic, native_address_size(native_addr)) < 0)
 	{
 		nf_close(fd);
@@ -485,20 +621,86 @@ void socket_handle_close(SocketHandle hd)
 const Error *socket_handle_create_bound
 	(SocketAddress addr, SocketHandle *hd_out)
 {
-	return create_socket(addr.host.type, addr.host.ip, addr.port, &hd_out->fd);
+	const Error *e;
+
+	e = create_socket(addr.host.type, addr.host.ip, addr.port, 
+			SOCKET_KIND_OUTGOING, 0, &hd_out->fd);
+	if (e)
+		return e;
+
+	//Buffer sizes must be set before connecting to affect window scaling
+	e = apply_socket_options(hd_out->fd);
+	if (e)
+		nf_close(hd_out->fd);
+	return e;
+}
+
+//Creates a non-blocking datagram socket bound to the given address
+const Error *socket_handle_create_udp
+	(SocketAddress addr, SocketHandle *hd_out)
+{
+	const Error *e;
+
+	e = create_socket(addr.host.type, addr.host.ip, addr.port, 
+			SOCKET_KIND_DATAGRAM, 0, &hd_out->fd);
+	if (e)
+		return e;
+
+	e = socket_handle_set_blocking(*hd_out, 0);
+	if (e)
+		nf_close(hd_out->fd);
+	return e;
 }
 
 //Creates a listening socket bound to the given address
 const Error *socket_handle_create_listener
-	(SocketAddress addr, SocketHandle *hd_out)
+	(SocketAddress addr, ListenerFlags flags, SocketHandle *hd_out)
 {
 	const Error *e;
 	SocketHandle hd;
 
-	e = create_socket(addr.host.type, addr.host.ip, addr.port, &hd.fd);
+	e = create_socket(addr.host.type, addr.host.ip, addr.port, 
+			SOCKET_KIND_LISTENER, flags, &hd.fd);
 	if (e)
 		return e;
 
+	if (flags & LISTENER_FASTOPEN)
+	{
+#ifdef TCP_FASTOPEN
+		const int qlen = LISTENER_FASTOPEN_QLEN;
+		if (setsockopt(hd.fd, IPPROTO_TCP, TCP_FASTOPEN, 
+					sockopt(&qlen), sizeof(qlen)) < 0)
+		{
+			nf_close(hd.fd);
+			return error_from_errno(nv_error, 0,
+					"setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, %d) failed", qlen);
+		}
+#else
+		nf_close(hd.fd);
+		return error_printf(socket_error_unsupported_backend_feature,
+				"TCP_FASTOPEN is not supported on this platform");
+#endif
+	}
+
+	if (flags & LISTENER_DEFER_ACCEPT)
+	{
+#ifdef TCP_DEFER_ACCEPT
+		const int sec = LISTENER_DEFER_ACCEPT_SEC;
+		if (setsockopt(hd.fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, 
+					sockopt(&sec), sizeof(sec)) < 0)
+		{
+			nf_close(hd.fd);
+			return error_from_errno(nv_error, 0,
+					"setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, %d) failed", 
+					sec);
+		}
+#else
+		nf_close(hd.fd);
+		return error_printf(socket_error_unsupported_backend_feature,
+				"TCP_DEFER_ACCEPT is not supported on this platform");
+#endif
+	}
+
 	if (listen(hd.fd, SOMAXCONN) < 0)
 	{
 		nf_close(hd.fd);
@@ -522,6 +724,13 @@ struct event *socket_handle_create_event(SocketHandle hd, short events,
 	return event_new(evbase, hd.fd, events, callback_fn, callback_arg);
 }
 
+//Prepares a preallocated, non-pending event structure for given socket
+void socket_handle_assign_event(SocketHandle hd, struct event *evt,
+		short events, event_callback_fn callback_fn, void *callback_arg)
+{
+	event_assign(evt, evbase, hd.fd, events, callback_fn, callback_arg);
+}
+
 //Connects to a listening socket bound to given address
 const Error *socket_handle_connect(SocketHandle hd, SocketAddress addr)
 {
@@ -540,17 +749,90 @@ const Error *socket_handle_connect(SocketHandle hd, SocketAddress addr)
 	return NULL;
 }
 
+//Enables TCP Fast Open for an outgoing connection
+const Error *socket_handle_set_fastopen_connect(SocketHandle hd)
+{
+#ifdef TCP_FASTOPEN_CONNECT
+	const int one = 1;
+	if (setsockopt(hd.fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 
+				sockopt(&one), sizeof(one)) < 0)
+		return error_from_errno(nv_error, 0,
+				"setsockopt(%d, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1) failed",
+				hd.fd);
+	return NULL;
+#else
+	return error_printf(socket_error_unsupported_backend_feature,
+			"TCP_FASTOPEN_CONNECT is not supported on this platform");
+#endif
+}
+
 //Accepts a connection
 const Error *socket_handle_accept(SocketHandle hd, SocketHandle *hd_out)
 {
 	int res_fd;
+	const Error *e;
 
+#ifdef HAVE_ACCEPT4
+	res_fd = accept4(hd.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (res_fd < 0)
+		return error_from_errno(nv_error, 0, "accept4(fd = %d) failed", hd.fd);
+	hd_out->fd = res_fd;
+#else
 	res_fd = accept(hd.fd, NULL, NULL);
 	if (res_fd < 0)
 		return error_from_errno(nv_error, 0, "accept(fd = %d) failed", hd.fd);
-
 	hd_out->fd = res_fd;
-	return NULL;
+
+	e = socket_handle_set_blocking(*hd_out, 0);
+	if (e)
+	{
+		nf_close(res_fd);
+		return e;
+	}
+#endif
+
+	e = apply_socket_options(res_fd);
+	if (e)
+		nf_close(res_fd);
+	return e;
+}
+
+const Error *socket_handle_setup_accepted(SocketHandle hd)
+{
+	return apply_socket_options(hd.fd);
+}
+
+//Reserve descriptor
+void fd_reserve_init(FdReserve *reserve)
+{
+#ifdef _WIN32
+	reserve->fd = -1;
+#else
+	reserve->fd = open("/dev/null", O_RDONLY);
+#endif
+}
+
+void fd_reserve_free(FdReserve *reserve)
+{
+	if (reserve->fd >= 0)
+		close(reserve->fd);
+	reserve->fd = -1;
+}
+
+int socket_handle_drop_pending(SocketHandle hd, FdReserve *reserve)
+{
+	int res_fd;
+
+	if (reserve->fd < 0)
+		return 0;
+
+	close(reserve->fd);
+	res_fd = accept(hd.fd, NULL, NULL);
+	if (res_fd >= 0)
+		nf_close(res_fd);
+	fd_reserve_init(reserve);
+
+	return res_fd >= 0;
 }
 
 //Checks error status of given socket
@@ -581,6 +863,38 @@ const Error *socket_handle_getsockname
 	return native_address_get_socket_address(&native_addr.generic, addr_out);
 }
 
+//Returns address of the peer the socket is connected to
+const Error *socket_handle_getpeername
+	(SocketHandle hd, SocketAddress *addr_out)
+{
+	NativeAddress native_addr;
+	socklen_t native_addr_len = sizeof(NativeAddress);
+	
+	if (getpeername(hd.fd, &native_addr.generic, &native_addr_len) < 0)
+		return error_from_errno(nv_error, 0, "getpeername(fd = %d)", hd.fd);
+
+	return native_address_get_socket_address(&native_addr.generic, addr_out);
+}
+
+//Returns smoothed round trip time measured by the kernel, in microseconds
+const Error *socket_handle_get_rtt(SocketHandle hd, long *usec_out)
+{
+#if defined(TCP_INFO) && defined(__linux__)
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+
+	if (getsockopt(hd.fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+		return error_from_errno(nv_error, 0, 
+				"getsockopt(fd = %d, TCP_INFO)", hd.fd);
+
+	*usec_out = info.tcpi_rtt;
+	return NULL;
+#else
+	return error_printf(socket_error_unsupported_backend_feature,
+			"TCP_INFO is not supported on this platform");
+#endif
+}
+
 //Enables or disables nonblocking IO mode
 const Error *socket_handle_set_blocking(SocketHandle hd, int val)
 {
@@ -617,7 +931,7 @@ const Error *socket_handle_write
 	ssize_t res = send(hd.fd, data, len, 0);
 
 	if (res < 0)
-		return error_from_errno(nv_error, 0, "send(fd = %d) failed", hd.fd);
+		return io_error_from_errno(nv_error, "send", hd.fd);
 
 	*out = res;
 	return NULL;
@@ -629,63 +943,792 @@ const Error *socket_handle_read
 	ssize_t res = recv(hd.fd, data, len, 0);
 
 	if (res < 0)
-		return error_from_errno(nv_error, 0, "recv(fd = %d) failed", hd.fd);
+		return io_error_from_errno(nv_error, "recv", hd.fd);
+
+	*out = res;
+	return NULL;
+}
+
+const Error *socket_handle_writev
+	(SocketHandle hd, const IoVec *vecs, int n_vecs, size_t *out)
+{
+	int i;
+
+	abort_if_fail(n_vecs > 0 && n_vecs <= SOCKET_MAX_IOVECS,
+			"Invalid number of IO vectors");
+
+#ifdef _WIN32
+	WSABUF bufs[SOCKET_MAX_IOVECS];
+	DWORD res;
+
+	for (i = 0; i < n_vecs; i++)
+	{
+		bufs[i].buf = vecs[i].data;
+		bufs[i].len = vecs[i].len;
+	}
+
+	if (WSASend(hd.fd, bufs, n_vecs, &res, 0, NULL, NULL) != 0)
+		return io_error_from_errno(nv_error, "WSASend", hd.fd);
+#else
+	struct iovec iov[SOCKET_MAX_IOVECS];
+	ssize_t res;
+
+	for (i = 0; i < n_vecs; i++)
+	{
+		iov[i].iov_base = vecs[i].data;
+		iov[i].iov_len = vecs[i].len;
+	}
+
+	res = writev(hd.fd, iov, n_vecs);
+	if (res < 0)
+		return io_error_from_errno(nv_error, "writev", hd.fd);
+#endif
 
 	*out = res;
 	return NULL;
 }
 
+const Error *socket_handle_readv
+	(SocketHandle hd, const IoVec *vecs, int n_vecs, size_t *out)
+{
+	int i;
+
+	abort_if_fail(n_vecs > 0 && n_vecs <= SOCKET_MAX_IOVECS,
+			"Invalid number of IO vectors");
+
+#ifdef _WIN32
+	WSABUF bufs[SOCKET_MAX_IOVECS];
+	DWORD res, flags = 0;
+
+	for (i = 0; i < n_vecs; i++)
+	{
+		bufs[i].buf = vecs[i].data;
+		bufs[i].len = vecs[i].len;
+	}
+
+	if (WSARecv(hd.fd, bufs, n_vecs, &res, &flags, NULL, NULL) != 0)
+		return io_error_from_errno(nv_error, "WSARecv", hd.fd);
+#else
+	struct iovec iov[SOCKET_MAX_IOVECS];
+	ssize_t res;
+
+	for (i = 0; i < n_vecs; i++)
+	{
+		iov[i].iov_base = vecs[i].data;
+		iov[i].iov_len = vecs[i].len;
+	}
+
+	res = readv(hd.fd, iov, n_vecs);
+	if (res < 0)
+		return io_error_from_errno(nv_error, "readv", hd.fd);
+#endif
+
+	*out = res;
+	return NULL;
+}
+
+const Error *socket_handle_io_error(SocketHandle hd, int errno_val, 
+		const char *fn)
+{
+	return io_error_from_errno(errno_val, fn, hd.fd);
+}
+
+//Datagram IO
+//With recvmmsg() and sendmmsg() a whole batch costs one system call.
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+
+const Error *socket_handle_recv_datagrams
+	(SocketHandle hd, Datagram *msgs, int n_msgs, int *n_out)
+{
+	struct mmsghdr hdrs[SOCKET_MAX_DATAGRAMS];
+	struct iovec iov[SOCKET_MAX_DATAGRAMS];
+	NativeAddress addrs[SOCKET_MAX_DATAGRAMS];
+	int i, res, n = 0;
+
+	abort_if_fail(n_msgs > 0 && n_msgs <= SOCKET_MAX_DATAGRAMS,
+			"Invalid number of datagrams");
+
+	memset(hdrs, 0, sizeof(struct mmsghdr) * n_msgs);
+	for (i = 0; i < n_msgs; i++)
+	{
+		iov[i].iov_base = msgs[i].data;
+		iov[i].iov_len = msgs[i].len;
+		hdrs[i].msg_hdr.msg_name = addrs + i;
+		hdrs[i].msg_hdr.msg_namelen = sizeof(NativeAddress);
+		hdrs[i].msg_hdr.msg_iov = iov + i;
+		hdrs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	res = recvmmsg(hd.fd, hdrs, n_msgs, 0, NULL);
+	if (res < 0)
+		return io_error_from_errno(nv_error, "recvmmsg", hd.fd);
+
+	//Drop datagrams that did not fit
+	for (i = 0; i < res; i++)
+	{
+		const Error *e;
+
+		if (hdrs[i].msg_hdr.msg_flags & MSG_TRUNC)
+			continue;
+		e = native_address_get_socket_address(&addrs[i].generic, 
+				&msgs[n].addr);
+		if (e)
+		{
+			error_handle(e);
+			continue;
+		}
+		msgs[n].data = msgs[i].data;
+		msgs[n].len = hdrs[i].msg_len;
+		n++;
+	}
+
+	*n_out = n;
+	return NULL;
+}
+
+const Error *socket_handle_send_datagrams
+	(SocketHandle hd, const Datagram *msgs, int n_msgs, int *n_out)
+{
+	struct mmsghdr hdrs[SOCKET_MAX_DATAGRAMS];
+	struct iovec iov[SOCKET_MAX_DATAGRAMS];
+	NativeAddress addrs[SOCKET_MAX_DATAGRAMS];
+	int i, res;
+
+	abort_if_fail(n_msgs > 0 && n_msgs <= SOCKET_MAX_DATAGRAMS,
+			"Invalid number of datagrams");
+
+	memset(hdrs, 0, sizeof(struct mmsghdr) * n_msgs);
+	for (i = 0; i < n_msgs; i++)
+	{
+		addrs[i] = native_address_create(msgs[i].addr.host.type,
+				(void *) msgs[i].addr.host.ip, msgs[i].addr.port);
+		iov[i].iov_base = msgs[i].data;
+		iov[i].iov_len = msgs[i].len;
+		hdrs[i].msg_hdr.msg_name = addrs + i;
+		hdrs[i].msg_hdr.msg_namelen = native_address_size(addrs[i]);
+		hdrs[i].msg_hdr.msg_iov = iov + i;
+		hdrs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	res = sendmmsg(hd.fd, hdrs, n_msgs, 0);
+	if (res < 0)
+		return io_error_from_errno(nv_error, "sendmmsg", hd.fd);
+
+	*n_out = res;
+	return NULL;
+}
+
+#else
+
+const Error *socket_handle_recv_datagrams
+	(SocketHandle hd, Datagram *msgs, int n_msgs, int *n_out)
+{
+	int n = 0;
+
+	abort_if_fail(n_msgs > 0 && n_msgs <= SOCKET_MAX_DATAGRAMS,
+			"Invalid number of datagrams");
+
+	while (n < n_msgs)
+	{
+		NativeAddress addr;
+		socklen_t addr_len = sizeof(NativeAddress);
+		const Error *e;
+		int res;
+
+		res = recvfrom(hd.fd, msgs[n].data, msgs[n].len, 0, 
+				&addr.generic, &addr_len);
+		if (res < 0)
+		{
+			if (n > 0)
+				break;
+			return io_error_from_errno(nv_error, "recvfrom", hd.fd);
+		}
+		e = native_address_get_socket_address(&addr.generic, &msgs[n].addr);
+		if (e)
+		{
+			error_handle(e);
+			continue;
+		}
+		msgs[n].len = res;
+		n++;
+	}
+
+	*n_out = n;
+	return NULL;
+}
+
+const Error *socket_handle_send_datagrams
+	(SocketHandle hd, const Datagram *msgs, int n_msgs, int *n_out)
+{
+	int n;
+
+	abort_if_fail(n_msgs > 0 && n_msgs <= SOCKET_MAX_DATAGRAMS,
+			"Invalid number of datagrams");
+
+	for (n = 0; n < n_msgs; n++)
+	{
+		NativeAddress addr = native_address_create(msgs[n].addr.host.type,
+				(void *) msgs[n].addr.host.ip, msgs[n].addr.port);
+
+		if (sendto(hd.fd, msgs[n].data, msgs[n].len, 0, 
+					&addr.generic, native_address_size(addr)) < 0)
+		{
+			if (n > 0)
+				break;
+			return io_error_from_errno(nv_error, "sendto", hd.fd);
+		}
+	}
+
+	*n_out = n;
+	return NULL;
+}
+
+#endif
+
+//Zero-copy relaying
+#ifdef HAVE_SPLICE
+
+//Pipe size to request from the kernel
+#define RELAY_PIPE_SIZE (64 * 1024)
+
+int relay_pipe_supported()
+{
+	return 1;
+}
+
+const Error *relay_pipe_create(RelayPipe *pipe_out)
+{
+	RelayPipe res;
+	int size;
+
+#ifdef HAVE_PIPE2
+	if (pipe2(res.fds, O_NONBLOCK | O_CLOEXEC) < 0)
+		return error_from_errno(errno, 0, "pipe2() failed");
+#else
+	if (pipe(res.fds) < 0)
+		return error_from_errno(errno, 0, "pipe() failed");
+	fcntl(res.fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(res.fds[1], F_SETFL, O_NONBLOCK);
+#endif
+
+	//Failing to resize is harmless, just use whatever we got
+	fcntl(res.fds[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+	size = fcntl(res.fds[1], F_GETPIPE_SZ);
+	if (size <= 0)
+	{
+		close(res.fds[0]);
+		close(res.fds[1]);
+		return error_from_errno(errno, 0, "fcntl(F_GETPIPE_SZ) failed");
+	}
+
+	res.len = 0;
+	res.capacity = size;
+
+	*pipe_out = res;
+	return NULL;
+}
+
+void relay_pipe_close(RelayPipe *pipe)
+{
+	close(pipe->fds[0]);
+	close(pipe->fds[1]);
+}
+
+//Moves data from the socket into the pipe, as much as the pipe can hold.
+//*out is 0 on EOF.
+const Error *socket_handle_splice_read
+	(SocketHandle hd, RelayPipe *pipe, size_t *out)
+{
+	ssize_t res = splice(hd.fd, NULL, pipe->fds[1], NULL,
+			pipe->capacity - pipe->len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+	if (res < 0)
+		return io_error_from_errno(errno, "splice", hd.fd);
+
+	pipe->len += res;
+	*out = res;
+	return NULL;
+}
+
+//Moves data from the pipe to the socket
+const Error *socket_handle_splice_write
+	(SocketHandle hd, RelayPipe *pipe, size_t *out)
+{
+	ssize_t res = splice(pipe->fds[0], NULL, hd.fd, NULL,
+			pipe->len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+	if (res < 0)
+		return io_error_from_errno(errno, "splice", hd.fd);
+
+	pipe->len -= res;
+	*out = res;
+	return NULL;
+}
+
+#else
+
+int relay_pipe_supported()
+{
+	return 0;
+}
+
+const Error *relay_pipe_create(RelayPipe *pipe_out)
+{
+	return error_printf(socket_error_unsupported_backend_feature,
+			"Zero-copy relaying is not supported on this platform");
+}
+
+void relay_pipe_close(RelayPipe *pipe)
+{
+	abort_with_error("relay_pipe_close(): not supported");
+}
+
+const Error *socket_handle_splice_read
+	(SocketHandle hd, RelayPipe *pipe, size_t *out)
+{
+	abort_with_error("socket_handle_splice_read(): not supported");
+	return NULL;
+}
+
+const Error *socket_handle_splice_write
+	(SocketHandle hd, RelayPipe *pipe, size_t *out)
+{
+	abort_with_error("socket_handle_splice_write(): not supported");
+	return NULL;
+}
+
+#endif
+
 //Asynchronous DNS
+
+//Answers are cached per thread, keyed by hostname and address families.
+//Concurrent requests for the same key wait on a single lookup.
+//Numeric addresses and names in the hosts file are answered by
+//evdns_getaddrinfo() on a base without nameservers, and kept for the
+//configured TTL. Other names get one query per address family, and are
+//kept for the lowest TTL of their records, at most the configured TTL.
+
+typedef enum
+{
+	DNS_ENTRY_PENDING,
+	DNS_ENTRY_POSITIVE,
+	DNS_ENTRY_NEGATIVE
+} DnsEntryState;
+
+typedef struct _DnsEntry DnsEntry;
+struct _DnsEntry
+{
+	DnsEntry *hash_next;
+	DnsEntry *lru_prev, *lru_next; //< Most recently used first
+	uint32_t hash;
+	NetworkType types;
+	DnsEntryState state;
+	int busy; //< Set while waiters are being notified
+	int orphaned; //< Cache was destroyed while lookup was in progress
+	time_t expiry;
+	struct evdns_request *queries[2]; //< A and AAAA queries in progress
+	int n_queries; //< Queries that have not completed yet
+	int ttl; //< Lowest TTL of the records so far, -1 if none
+	int failed; //< A query failed for a reason other than a missing name
+	size_t n_addrs;
+	SocketAddress *addrs; //< Port is not set
+	DnsRequest *waiters;
+	char hostname[];
+};
+
 struct _DnsRequest
 {
 	DnsResponseCB cb;
 	void *cb_data;
-	struct evdns_getaddrinfo_request *evdns_req;
+	uint16_t port;
+	DnsEntry *entry; //< Entry being waited on, NULL once answered
+	DnsRequest *prev, *next;
 };
 
+typedef struct
+{
+	DnsEntry **buckets;
+	size_t n_buckets; //< Power of 2
+	size_t n_entries;
+	DnsEntry *lru_head, *lru_tail;
+	struct evdns_base *local_base; //< Hosts file only, no nameservers
+} DnsCache;
+
+static THREAD_LOCAL DnsCache *dns_cache = NULL;
+
+static size_t dns_cache_max_entries = DNS_CACHE_DEFAULT_ENTRIES;
+static int dns_cache_ttl = DNS_CACHE_DEFAULT_TTL;
+static int dns_cache_negative_ttl = DNS_CACHE_DEFAULT_NEGATIVE_TTL;
+
+static atomic_ulong dns_n_hits = 0;
+static atomic_ulong dns_n_negative_hits = 0;
+static atomic_ulong dns_n_misses = 0;
+static atomic_ulong dns_n_coalesced = 0;
+
+#define dns_stat_inc(x) atomic_fetch_add_explicit(&(x), 1, memory_order_relaxed)
+
+void dns_cache_set_limits(size_t max_entries, int ttl, int negative_ttl)
+{
+	dns_cache_max_entries = max_entries;
+	dns_cache_ttl = ttl;
+	dns_cache_negative_ttl = negative_ttl;
+}
+
+void dns_cache_get_stats(DnsCacheStats *stats)
+{
+	stats->n_hits = atomic_load(&dns_n_hits);
+	stats->n_negative_hits = atomic_load(&dns_n_negative_hits);
+	stats->n_misses = atomic_load(&dns_n_misses);
+	stats->n_coalesced = atomic_load(&dns_n_coalesced);
+}
+
+static time_t dns_now()
+{
+	struct timeval tv;
+
+	event_base_gettimeofday_cached(evbase, &tv);
+	return tv.tv_sec;
+}
+
+//FNV-1a, hostnames are case insensitive
+static uint32_t dns_hash(const char *hostname, NetworkType types)
+{
+	uint32_t hash = 2166136261u;
+	const char *iter;
+
+	for (iter = hostname; *iter; iter++)
+	{
+		hash ^= (uint8_t) tolower((unsigned char) *iter);
+		hash *= 16777619u;
+	}
+	hash ^= (uint32_t) types;
+	hash *= 16777619u;
+
+	return hash;
+}
+
+static DnsCache *dns_cache_get()
+{
+	DnsCache *cache = dns_cache;
+
+	if (! cache)
+	{
+		cache = fs_malloc(sizeof(DnsCache));
+		cache->n_buckets = 64;
+		cache->buckets = fs_malloc(sizeof(DnsEntry *) * cache->n_buckets);
+		memset(cache->buckets, 0, sizeof(DnsEntry *) * cache->n_buckets);
+		cache->n_entries = 0;
+		cache->lru_head = cache->lru_tail = NULL;
+		cache->local_base = evdns_base_new(evbase, 0);
+		abort_if_fail(cache->local_base, "evdns_base_new() failed");
+		evdns_base_load_hosts(cache->local_base, NULL);
+		dns_cache = cache;
+	}
+
+	return cache;
+}
+
+static void dns_cache_grow(DnsCache *cache)
+{
+	size_t n_buckets = cache->n_buckets * 2;
+	DnsEntry **buckets = fs_malloc(sizeof(DnsEntry *) * n_buckets);
+	size_t i;
+
+	memset(buckets, 0, sizeof(DnsEntry *) * n_buckets);
+	for (i = 0; i < cache->n_buckets; i++)
+	{
+		DnsEntry *iter, *next;
+		for (iter = cache->buckets[i]; iter; iter = next)
+		{
+			size_t idx = iter->hash & (n_buckets - 1);
+			next = iter->hash_next;
+			iter->hash_next = buckets[idx];
+			buckets[idx] = iter;
+		}
+	}
+
+	free(cache->buckets);
+	cache->buckets = buckets;
+	cache->n_buckets = n_buckets;
+}
+
+static void dns_lru_unlink(DnsCache *cache, DnsEntry *entry)
+{
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+}
+
+static void dns_lru_push(DnsCache *cache, DnsEntry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head)
+		cache->lru_head->lru_prev = entry;
+	else
+		cache->lru_tail = entry;
+	cache->lru_head = entry;
+}
+
+static DnsEntry *dns_cache_lookup
+	(DnsCache *cache, const char *hostname, NetworkType types, uint32_t hash)
+{
+	DnsEntry *iter;
+
+	for (iter = cache->buckets[hash & (cache->n_buckets - 1)]; iter; 
+			iter = iter->hash_next)
+	{
+		if (iter->hash == hash && iter->types == types
+				&& evutil_ascii_strcasecmp(iter->hostname, hostname) == 0)
+			return iter;
+	}
+
+	return NULL;
+}
+
+static void dns_entry_free(DnsEntry *entry)
+{
+	if (entry->addrs)
+		free(entry->addrs);
+	free(entry);
+}
+
+//Removes entry from the cache and frees it
+static void dns_cache_remove(DnsCache *cache, DnsEntry *entry)
+{
+	DnsEntry **link = cache->buckets + (entry->hash & (cache->n_buckets - 1));
+
+	while (*link != entry)
+		link = &((*link)->hash_next);
+	*link = entry->hash_next;
+
+	dns_lru_unlink(cache, entry);
+	cache->n_entries--;
+	dns_entry_free(entry);
+}
+
+//Removes least recently used answers until the cache is within its limit.
+//Lookups in progress are never removed.
+static void dns_cache_trim(DnsCache *cache, size_t limit)
+{
+	DnsEntry *iter, *prev;
+
+	for (iter = cache->lru_tail; iter && cache->n_entries > limit; iter = prev)
+	{
+		prev = iter->lru_prev;
+		if (iter->state != DNS_ENTRY_PENDING && ! iter->busy)
+			dns_cache_remove(cache, iter);
+	}
+}
+
+//Answers a request from a completed entry. Request must not be a waiter.
+static void dns_entry_answer(DnsEntry *entry, DnsRequest *dns_ctx)
+{
+	if (entry->state == DNS_ENTRY_POSITIVE)
+	{
+		SocketAddress *addrs;
+		size_t i;
+
+		addrs = fs_malloc(sizeof(SocketAddress) * entry->n_addrs);
+		for (i = 0; i < entry->n_addrs; i++)
+		{
+			addrs[i] = entry->addrs[i];
+			addrs[i].port = dns_ctx->port;
+		}
+		(* dns_ctx->cb)(NULL, entry->n_addrs, addrs, dns_ctx->cb_data);
+	}
+	else
+	{
+		(* dns_ctx->cb)(error_printf(socket_error_dns_failure, 
+					"DNS lookup failure for '%s'", entry->hostname),
+				0, NULL, dns_ctx->cb_data);
+	}
+}
+
+//Answers everyone waiting on entry, then keeps it for ttl seconds
+static void dns_entry_complete(DnsCache *cache, DnsEntry *entry, int ttl)
+{
+	DnsRequest *dns_ctx;
+
+	entry->expiry = dns_now() + ttl;
+
+	//Callbacks may start or destroy requests,
+	//so do not keep pointers to waiters across them.
+	entry->busy = 1;
+	while ((dns_ctx = entry->waiters))
+	{
+		entry->waiters = dns_ctx->next;
+		if (entry->waiters)
+			entry->waiters->prev = NULL;
+		dns_ctx->entry = NULL;
+		dns_ctx->next = dns_ctx->prev = NULL;
+
+		dns_entry_answer(entry, dns_ctx);
+	}
+	entry->busy = 0;
+
+	if (ttl <= 0)
+		dns_cache_remove(cache, entry);
+	else
+		dns_cache_trim(cache, dns_cache_max_entries);
+}
+
+//Answer for a name that needs no DNS
 static void dns_getaddrinfo_cb
 	(int result, struct evutil_addrinfo *res, void *arg)
 {
-	DnsRequest *dns_ctx = (DnsRequest *) arg;
+	DnsEntry *entry = (DnsEntry *) arg;
 	struct evutil_addrinfo *iter;
-	const Error *e = NULL;
-	SocketAddress *addrs = NULL;
-	size_t n_addrs = 0;
-
-	dns_ctx->evdns_req = NULL;
+	int ttl = 0;
 
-	//Do not continue on cancellation, cleanup has beed done
-	if (result == DNS_ERR_CANCEL || result == DNS_ERR_SHUTDOWN)
+	//Name is resolved with DNS instead, entry may be gone by now
+	if (result == EVUTIL_EAI_CANCEL)
+	{
+		if (res)
+			evutil_freeaddrinfo(res);
 		return;
+	}
 
-	if (res && result == DNS_ERR_NONE)
+	if (res && result == 0)
 	{
 		size_t i;
 
 		for (iter = res; iter; iter = iter->ai_next)
-			n_addrs++;
+			entry->n_addrs++;
 		
-		addrs = fs_malloc(sizeof(SocketAddress) * n_addrs);
+		entry->addrs = fs_malloc(sizeof(SocketAddress) * entry->n_addrs);
 
 		for (iter = res, i = 0; iter; iter = iter->ai_next, i++)
 		{
-			e = native_address_get_socket_address(iter->ai_addr, addrs + i);
+			const Error *e = native_address_get_socket_address
+				(iter->ai_addr, entry->addrs + i);
 			if (e)
 			{
-				free(addrs);
-				addrs = NULL;
-				n_addrs = 0;
+				error_handle(e);
+				free(entry->addrs);
+				entry->addrs = NULL;
+				entry->n_addrs = 0;
 				break;
 			}
 		}
+	}
+	if (res)
 		evutil_freeaddrinfo(res);
+
+	if (entry->n_addrs)
+	{
+		entry->state = DNS_ENTRY_POSITIVE;
+		ttl = dns_cache_ttl;
 	}
 	else
 	{
-		e = error_printf(socket_error_dns_failure, "DNS lookup failure");
+		//Only cache that the name does not exist, 
+		//not timeouts or server failures
+		entry->state = DNS_ENTRY_NEGATIVE;
+		if (result == EVUTIL_EAI_NONAME 
+#ifdef EVUTIL_EAI_NODATA
+				|| result == EVUTIL_EAI_NODATA
+#endif
+				|| result == 0)
+			ttl = dns_cache_negative_ttl;
 	}
 
-	(* dns_ctx->cb)(e, n_addrs, addrs, dns_ctx->cb_data);
+	dns_entry_complete(dns_cache, entry, ttl);
+}
+
+//Completion of the A (idx = 0) or AAAA (idx = 1) query of entry
+static void dns_query_done(DnsEntry *entry, int idx, 
+		int result, int count, int ttl, void *addresses)
+{
+	SocketAddress *addrs;
+	int i;
+
+	entry->queries[idx] = NULL;
+	entry->n_queries--;
+
+	//Cache was destroyed, nobody is waiting
+	if (entry->orphaned)
+	{
+		if (! entry->n_queries)
+			dns_entry_free(entry);
+		return;
+	}
+
+	if (result == DNS_ERR_NONE && count > 0)
+	{
+		entry->addrs = fs_realloc(entry->addrs, 
+				sizeof(SocketAddress) * (entry->n_addrs + count));
+
+		//IPv4 addresses come first, whichever answer arrives first
+		if (idx == 0)
+		{
+			memmove(entry->addrs + count, entry->addrs, 
+					sizeof(SocketAddress) * entry->n_addrs);
+			addrs = entry->addrs;
+		}
+		else
+		{
+			addrs = entry->addrs + entry->n_addrs;
+		}
+		memset(addrs, 0, sizeof(SocketAddress) * count);
+		for (i = 0; i < count; i++)
+		{
+			if (idx == 0)
+			{
+				addrs[i].host.type = NETWORK_INET;
+				memcpy(addrs[i].host.ip, (char *) addresses + 4 * i, 4);
+			}
+			else
+			{
+				addrs[i].host.type = NETWORK_INET6;
+				memcpy(addrs[i].host.ip, (char *) addresses + 16 * i, 16);
+			}
+		}
+		entry->n_addrs += count;
+
+		if (entry->ttl < 0 || ttl < entry->ttl)
+			entry->ttl = ttl;
+	}
+	else if (result != DNS_ERR_NONE && result != DNS_ERR_NOTEXIST
+			&& result != DNS_ERR_NODATA)
+	{
+		entry->failed = 1;
+	}
+
+	if (entry->n_queries)
+		return;
+
+	if (entry->n_addrs)
+	{
+		entry->state = DNS_ENTRY_POSITIVE;
+		ttl = entry->ttl < dns_cache_ttl ? entry->ttl : dns_cache_ttl;
+	}
+	else
+	{
+		//Only cache that the name does not exist, 
+		//not timeouts or server failures
+		entry->state = DNS_ENTRY_NEGATIVE;
+		ttl = entry->failed ? 0 : dns_cache_negative_ttl;
+	}
+
+	dns_entry_complete(dns_cache, entry, ttl);
+}
+
+static void dns_query_a_cb(int result, char type, int count, int ttl, 
+		void *addresses, void *arg)
+{
+	dns_query_done((DnsEntry *) arg, 0, result, count, ttl, addresses);
+}
+
+static void dns_query_aaaa_cb(int result, char type, int count, int ttl, 
+		void *addresses, void *arg)
+{
+	dns_query_done((DnsEntry *) arg, 1, result, count, ttl, addresses);
 }
 
 //Start resolving an address.
@@ -694,14 +1737,20 @@ DnsRequest *dns_request_resolve
 	 DnsResponseCB cb, void *cb_data)
 {
 	DnsRequest *dns_ctx;
-	char service[10];
+	DnsCache *cache;
+	DnsEntry *entry;
+	uint32_t hash;
+	size_t hostname_len;
 	struct evutil_addrinfo hints;
+	struct evdns_getaddrinfo_request *local_req;
 
 	//Build object
 	dns_ctx = fs_malloc(sizeof(DnsRequest));
 	dns_ctx->cb = cb;
 	dns_ctx->cb_data = cb_data;
-	dns_ctx->evdns_req = NULL;
+	dns_ctx->port = port;
+	dns_ctx->entry = NULL;
+	dns_ctx->prev = dns_ctx->next = NULL;
 
 	//Prepare hints
 	memset(&hints, 0, sizeof(struct evutil_addrinfo));
@@ -724,26 +1773,150 @@ DnsRequest *dns_request_resolve
 		return dns_ctx;
 	}
 	hints.ai_flags = AI_V4MAPPED | AI_ADDRCONFIG;
+	hints.ai_socktype = SOCK_STREAM;
+
+	//Look in the cache
+	cache = dns_cache_get();
+	hash = dns_hash(hostname, types);
+	entry = dns_cache_lookup(cache, hostname, types, hash);
+	if (entry && entry->state != DNS_ENTRY_PENDING && ! entry->busy
+			&& entry->expiry <= dns_now())
+	{
+		dns_cache_remove(cache, entry);
+		entry = NULL;
+	}
 
-	//Prepare port number
-	snprintf(service, 10, "%u", (unsigned int) ntohs(port));
-	service[9] = 0;
+	if (entry && entry->state == DNS_ENTRY_PENDING)
+	{
+		//Wait for lookup in progress
+		dns_stat_inc(dns_n_coalesced);
+		dns_ctx->entry = entry;
+		dns_ctx->next = entry->waiters;
+		if (entry->waiters)
+			entry->waiters->prev = dns_ctx;
+		entry->waiters = dns_ctx;
+		return dns_ctx;
+	}
+	else if (entry)
+	{
+		//Answer right away
+		if (entry->state == DNS_ENTRY_POSITIVE)
+			dns_stat_inc(dns_n_hits);
+		else
+			dns_stat_inc(dns_n_negative_hits);
+		dns_lru_unlink(cache, entry);
+		dns_lru_push(cache, entry);
+		dns_entry_answer(entry, dns_ctx);
+		return dns_ctx;
+	}
 
+	//Start a new lookup
+	dns_stat_inc(dns_n_misses);
+	hostname_len = strlen(hostname);
+	entry = fs_malloc(sizeof(DnsEntry) + hostname_len + 1);
+	memcpy(entry->hostname, hostname, hostname_len + 1);
+	entry->hash = hash;
+	entry->types = types;
+	entry->state = DNS_ENTRY_PENDING;
+	entry->busy = 0;
+	entry->orphaned = 0;
+	entry->expiry = 0;
+	entry->queries[0] = entry->queries[1] = NULL;
+	entry->n_queries = 0;
+	entry->ttl = -1;
+	entry->failed = 0;
+	entry->n_addrs = 0;
+	entry->addrs = NULL;
+	entry->waiters = dns_ctx;
+	dns_ctx->entry = entry;
+
+	if (cache->n_entries >= cache->n_buckets)
+		dns_cache_grow(cache);
+	entry->hash_next = cache->buckets[hash & (cache->n_buckets - 1)];
+	cache->buckets[hash & (cache->n_buckets - 1)] = entry;
+	dns_lru_push(cache, entry);
+	cache->n_entries++;
+
+	//Names that need no DNS are answered right here, so beware.
+	//Port is filled in separately for each request.
+	local_req = evdns_getaddrinfo(cache->local_base, hostname, NULL, &hints, 
+			dns_getaddrinfo_cb, entry);
+	if (! local_req)
+		return dns_ctx;
+	evdns_getaddrinfo_cancel(local_req);
 
-	//Resolve (This may call the user callback right here so beware)
-	dns_ctx->evdns_req = evdns_getaddrinfo
-		(evdns_base, hostname, service, &hints, dns_getaddrinfo_cb, dns_ctx);
+	//Ask the nameservers
+	if (types & NETWORK_INET)
+	{
+		entry->queries[0] = evdns_base_resolve_ipv4
+			(evdns_base, hostname, 0, dns_query_a_cb, entry);
+		if (entry->queries[0])
+			entry->n_queries++;
+	}
+	if (types & NETWORK_INET6)
+	{
+		entry->queries[1] = evdns_base_resolve_ipv6
+			(evdns_base, hostname, 0, dns_query_aaaa_cb, entry);
+		if (entry->queries[1])
+			entry->n_queries++;
+	}
+	if (! entry->n_queries)
+	{
+		entry->state = DNS_ENTRY_NEGATIVE;
+		dns_entry_complete(cache, entry, 0);
+	}
 
 	return dns_ctx;
 }
 
-//Destroy resolver context. If resolving was in progress, it is cancelled.
+//Destroy resolver context. If resolving was in progress, the lookup
+//continues in the background so that its answer can be cached.
 void dns_request_destroy(DnsRequest *dns_ctx)
 {
-	if (dns_ctx->evdns_req)
+	DnsEntry *entry = dns_ctx->entry;
+
+	if (entry)
 	{
-		evdns_getaddrinfo_cancel(dns_ctx->evdns_req);
-		dns_ctx->evdns_req = NULL;
+		if (dns_ctx->prev)
+			dns_ctx->prev->next = dns_ctx->next;
+		else
+			entry->waiters = dns_ctx->next;
+		if (dns_ctx->next)
+			dns_ctx->next->prev = dns_ctx->prev;
 	}
 	free(dns_ctx);
 }
+
+void dns_cache_thread_shutdown()
+{
+	DnsCache *cache = dns_cache;
+	DnsEntry *iter, *next;
+	int i;
+
+	if (! cache)
+		return;
+
+	for (iter = cache->lru_head; iter; iter = next)
+	{
+		next = iter->lru_next;
+		if (iter->state == DNS_ENTRY_PENDING)
+		{
+			//Freed by the callbacks
+			iter->orphaned = 1;
+			for (i = 0; i < 2; i++)
+			{
+				if (iter->queries[i])
+					evdns_cancel_request(evdns_base, iter->queries[i]);
+			}
+		}
+		else
+		{
+			dns_entry_free(iter);
+		}
+	}
+
+	evdns_base_free(cache->local_base, 0);
+	free(cache->buckets);
+	free(cache);
+	dns_cache = NULL;
+}
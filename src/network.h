@@ -18,9 +18,6 @@
  * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-//Buffer size to use
-#define BUFFER_SIZE (2048)
-
 //Maximum size of address string representation
 #define ADDRESS_MAX_LEN (50)
 
@@ -30,6 +27,7 @@ extern const char socket_error_generic[];
 extern const char socket_error_invalid_socket[];
 extern const char socket_error_invalid_address[];
 extern const char socket_error_again[];
+extern const char socket_error_reset[];
 extern const char socket_error_in_progress[];
 extern const char socket_error_already[];
 extern const char socket_error_timeout[];
@@ -37,8 +35,15 @@ extern const char socket_error_network_unreachable[];
 extern const char socket_error_host_unreachable[];
 extern const char socket_error_connection_refused[];
 extern const char socket_error_dns_failure[];
+extern const char socket_error_no_fds[];
 extern const char socket_error_unsupported_backend_feature[];
 
+//IO functions (socket_handle_read() and friends) return these
+//static errors for conditions that are part of normal operation,
+//so no memory is allocated for them.
+extern const Error socket_error_again_instance[1];
+extern const Error socket_error_reset_instance[1];
+
 //Type of network, IPV4 or IPV6
 //Can be bitwised-or
 typedef enum
@@ -76,26 +81,85 @@ typedef struct
 
 void socket_handle_close(SocketHandle hd);
 
+//Options applied to every accepted socket and to every socket created
+//by socket_handle_create_bound()
+typedef struct
+{
+	int nodelay; //< Set TCP_NODELAY
+	int rcvbuf, sndbuf; //< SO_RCVBUF and SO_SNDBUF in bytes, 0 for default
+	int keepalive; //< Idle seconds before keepalive probes, 0 to disable
+} SocketOptions;
+
+#define SOCKET_OPTIONS_DEFAULT { 1, 0, 0, 0 }
+
+void socket_set_options(const SocketOptions *options);
+
 const Error *socket_handle_create_bound
 	(SocketAddress addr, SocketHandle *hd_out);
 
+//Options for listening sockets
+typedef enum
+{
+	LISTENER_REUSE_PORT = 1 << 0, //< Share the port with other listeners
+	LISTENER_FASTOPEN = 1 << 1, //< Accept data with the SYN (TCP Fast Open)
+	LISTENER_DEFER_ACCEPT = 1 << 2 //< Report clients only once they send data
+} ListenerFlags;
+
+//Queue length for TCP Fast Open and the longest time a client is held 
+//back by deferred accept
+#define LISTENER_FASTOPEN_QLEN (256)
+#define LISTENER_DEFER_ACCEPT_SEC (5)
+
 const Error *socket_handle_create_listener
-	(SocketAddress addr, SocketHandle *hd_out);
+	(SocketAddress addr, ListenerFlags flags, SocketHandle *hd_out);
 
 int socket_handle_equal_with_native(SocketHandle hd, evutil_socket_t socket);
 
 struct event *socket_handle_create_event(SocketHandle hd, short events,
 		event_callback_fn callback_fn, void *callback_arg);
 
+void socket_handle_assign_event(SocketHandle hd, struct event *evt,
+		short events, event_callback_fn callback_fn, void *callback_arg);
+
 const Error *socket_handle_connect(SocketHandle hd, SocketAddress addr);
 
+//Makes the following connect() return at once and send the SYN along
+//with the first data written. Writes may then fail with 
+//socket_error_in_progress until the connection is established.
+const Error *socket_handle_set_fastopen_connect(SocketHandle hd);
+
+//Accepted sockets are non-blocking and have socket options applied
 const Error *socket_handle_accept(SocketHandle hd, SocketHandle *hd_out);
 
+//Applies socket options to a socket accepted by other means
+const Error *socket_handle_setup_accepted(SocketHandle hd);
+
+//A spare descriptor that is given up to accept and drop a connection 
+//when the process runs out of descriptors, so that clients are not left 
+//waiting in the backlog.
+typedef struct
+{
+	int fd; //< -1 if not available
+} FdReserve;
+
+void fd_reserve_init(FdReserve *reserve);
+
+void fd_reserve_free(FdReserve *reserve);
+
+//Accepts and closes one pending connection using the reserve, 
+//returns whether a connection was dropped.
+int socket_handle_drop_pending(SocketHandle hd, FdReserve *reserve);
+
 const Error *socket_handle_get_status(SocketHandle hd);
 
 const Error *socket_handle_getsockname
 	(SocketHandle hd, SocketAddress *addr_out);
 
+const Error *socket_handle_getpeername
+	(SocketHandle hd, SocketAddress *addr_out);
+
+const Error *socket_handle_get_rtt(SocketHandle hd, long *usec_out);
+
 const Error *socket_handle_set_blocking(SocketHandle hd, int val);
 
 const Error *socket_handle_write
@@ -104,6 +168,68 @@ const Error *socket_handle_write
 const Error *socket_handle_read
 	(SocketHandle hd, void *data, size_t len, size_t *out);
 
+//Scatter/gather IO
+typedef struct
+{
+	void *data;
+	size_t len;
+} IoVec;
+
+#define SOCKET_MAX_IOVECS (4)
+
+const Error *socket_handle_writev
+	(SocketHandle hd, const IoVec *vecs, int n_vecs, size_t *out);
+
+const Error *socket_handle_readv
+	(SocketHandle hd, const IoVec *vecs, int n_vecs, size_t *out);
+
+//Error for IO on hd that failed outside of these functions, e.g. through
+//io_uring
+const Error *socket_handle_io_error(SocketHandle hd, int errno_val, 
+		const char *fn);
+
+//Datagram sockets
+const Error *socket_handle_create_udp
+	(SocketAddress addr, SocketHandle *hd_out);
+
+typedef struct
+{
+	SocketAddress addr; //< Source of received, destination of sent datagrams
+	void *data;
+	size_t len; //< Capacity of data before receiving, then datagram length
+} Datagram;
+
+#define SOCKET_MAX_DATAGRAMS (32)
+
+//Receives up to n_msgs datagrams into the given buffers and stores their
+//number in n_out. Datagrams that do not fit their buffer are dropped.
+const Error *socket_handle_recv_datagrams
+	(SocketHandle hd, Datagram *msgs, int n_msgs, int *n_out);
+
+//Sends up to n_msgs datagrams, stores the number sent in n_out
+const Error *socket_handle_send_datagrams
+	(SocketHandle hd, const Datagram *msgs, int n_msgs, int *n_out);
+
+//Kernel pipe for zero-copy relaying between two sockets (Linux only)
+typedef struct
+{
+	int fds[2];
+	size_t len; //< Bytes currently held in the pipe
+	size_t capacity;
+} RelayPipe;
+
+int relay_pipe_supported();
+
+const Error *relay_pipe_create(RelayPipe *pipe_out);
+
+void relay_pipe_close(RelayPipe *pipe);
+
+const Error *socket_handle_splice_read
+	(SocketHandle hd, RelayPipe *pipe, size_t *out);
+
+const Error *socket_handle_splice_write
+	(SocketHandle hd, RelayPipe *pipe, size_t *out);
+
 //Asynchronous DNS
 typedef struct _DnsRequest DnsRequest;
 
@@ -116,3 +242,25 @@ DnsRequest *dns_request_resolve
 
 void dns_request_destroy(DnsRequest *dns_ctx);
 
+//DNS cache
+#define DNS_CACHE_DEFAULT_ENTRIES (1024)
+#define DNS_CACHE_DEFAULT_TTL (60)
+#define DNS_CACHE_DEFAULT_NEGATIVE_TTL (10)
+
+//Sets the number of answers kept by each thread and how many seconds 
+//answers and nonexistent names are remembered. Concurrent lookups for the
+//same name are merged even if max_entries is 0.
+void dns_cache_set_limits(size_t max_entries, int ttl, int negative_ttl);
+
+typedef struct
+{
+	unsigned long n_hits;
+	unsigned long n_negative_hits;
+	unsigned long n_misses;
+	unsigned long n_coalesced; //< Requests that waited on another lookup
+} DnsCacheStats;
+
+void dns_cache_get_stats(DnsCacheStats *stats);
+
+void dns_cache_thread_shutdown();
+
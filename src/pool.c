@@ -0,0 +1,218 @@
+/* pool.c
+ * Free list allocator for fixed size objects
+ * 
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ * 
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "incl.h"
+
+#include <event2/buffer.h>
+
+//Approximate amount of memory to allocate at once
+#define POOL_SLAB_SIZE (64 * 1024)
+
+//Objects and slab headers are aligned to this
+#define POOL_ALIGN (16)
+
+#define pool_round(x) (((x) + POOL_ALIGN - 1) & ~((size_t) POOL_ALIGN - 1))
+
+//All pools of all threads, for statistics
+static Pool *pools = NULL;
+static Mutex pools_mutex = MUTEX_INITIALIZER;
+
+//Pools used by the calling thread, for cleanup
+static THREAD_LOCAL Pool **thread_pools = NULL;
+static THREAD_LOCAL int n_thread_pools = 0;
+
+static void pool_register(Pool *pool)
+{
+	mutex_lock(&pools_mutex);
+	pool->next = pools;
+	pools = pool;
+	mutex_unlock(&pools_mutex);
+
+	thread_pools = fs_realloc(thread_pools, 
+			sizeof(Pool *) * (n_thread_pools + 1));
+	thread_pools[n_thread_pools++] = pool;
+
+	pool->registered = 1;
+}
+
+static void pool_unregister(Pool *pool)
+{
+	Pool **iter;
+
+	mutex_lock(&pools_mutex);
+	for (iter = &pools; *iter; iter = &((*iter)->next))
+	{
+		if (*iter == pool)
+		{
+			*iter = pool->next;
+			break;
+		}
+	}
+	mutex_unlock(&pools_mutex);
+
+	pool->registered = 0;
+}
+
+//Allocates a new slab and puts all its objects on the free list
+static void pool_grow(Pool *pool)
+{
+	size_t obj_size = pool_round(pool->size);
+	size_t header_size = pool_round(sizeof(void *));
+	size_t n_objs = POOL_SLAB_SIZE / obj_size;
+	char *slab;
+	size_t i;
+
+	if (n_objs < 1)
+		n_objs = 1;
+
+	slab = fs_malloc(header_size + obj_size * n_objs);
+
+	//Link slab
+	*((void **) slab) = pool->slabs;
+	pool->slabs = slab;
+
+	//Add objects to free list
+	for (i = 0; i < n_objs; i++)
+	{
+		void *obj = slab + header_size + i * obj_size;
+		*((void **) obj) = pool->free_list;
+		pool->free_list = obj;
+	}
+	counter_add(pool->n_free, n_objs);
+}
+
+void *pool_alloc(Pool *pool, size_t size)
+{
+	void *res;
+	unsigned long n_used;
+
+	if (! pool->registered)
+	{
+		if (pool->size == 0)
+			pool->size = size < sizeof(void *) ? sizeof(void *) : size;
+		pool_register(pool);
+	}
+	abort_if_fail(size <= pool->size, 
+			"Pool %s: requested size %ld, object size is %ld", 
+			pool->name, (long) size, (long) pool->size);
+
+	if (! pool->free_list)
+		pool_grow(pool);
+
+	res = pool->free_list;
+	pool->free_list = *((void **) res);
+
+	counter_add(pool->n_free, -1);
+	counter_add(pool->n_used, 1);
+	n_used = counter_get(pool->n_used);
+	if (n_used > counter_get(pool->high_water))
+		counter_set(pool->high_water, n_used);
+
+	return res;
+}
+
+void pool_free(Pool *pool, void *mem)
+{
+	*((void **) mem) = pool->free_list;
+	pool->free_list = mem;
+
+	counter_add(pool->n_used, -1);
+	counter_add(pool->n_free, 1);
+}
+
+//Statistics
+void pool_foreach_stats(PoolStatsFn fn, void *data)
+{
+	Pool *iter, *iter2;
+	PoolStats stats;
+
+	mutex_lock(&pools_mutex);
+
+	//Sum up pools with same name (one per thread)
+	for (iter = pools; iter; iter = iter->next)
+	{
+		for (iter2 = pools; iter2 != iter; iter2 = iter2->next)
+			if (strcmp(iter2->name, iter->name) == 0)
+				break;
+		if (iter2 != iter)
+			continue;
+
+		memset(&stats, 0, sizeof(stats));
+		stats.name = iter->name;
+		stats.size = iter->size;
+		for (iter2 = iter; iter2; iter2 = iter2->next)
+		{
+			if (strcmp(iter2->name, iter->name) != 0)
+				continue;
+			stats.n_used += counter_get(iter2->n_used);
+			stats.n_free += counter_get(iter2->n_free);
+			stats.high_water += counter_get(iter2->high_water);
+		}
+
+		(* fn)(&stats, data);
+	}
+
+	mutex_unlock(&pools_mutex);
+}
+
+static void pool_print_stats(const PoolStats *stats, void *data)
+{
+	evbuffer_add_printf((struct evbuffer *) data, 
+			"Pool %s: object size %ld, %lu in use, %lu free, "
+			"high water mark %lu\n",
+			stats->name, (long) stats->size, 
+			stats->n_used, stats->n_free, stats->high_water);
+}
+
+void pool_dump_stats(struct evbuffer *out)
+{
+	pool_foreach_stats(pool_print_stats, out);
+}
+
+void pool_thread_shutdown()
+{
+	int i;
+
+	for (i = 0; i < n_thread_pools; i++)
+	{
+		Pool *pool = thread_pools[i];
+
+		abort_if_fail(counter_get(pool->n_used) == 0, 
+				"Pool %s: %lu objects still in use",
+				pool->name, counter_get(pool->n_used));
+
+		pool_unregister(pool);
+
+		while (pool->slabs)
+		{
+			void *next = *((void **) pool->slabs);
+			free(pool->slabs);
+			pool->slabs = next;
+		}
+		pool->free_list = NULL;
+		pool->size = 0;
+		counter_set(pool->n_free, 0);
+		counter_set(pool->high_water, 0);
+	}
+
+	free(thread_pools);
+	thread_pools = NULL;
+	n_thread_pools = 0;
+}
@@ -0,0 +1,63 @@
+/* pool.h
+ * Free list allocator for fixed size objects
+ * 
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ * 
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//A pool hands out objects of one size, carved from larger slabs.
+//Freed objects are kept on a free list and never returned to malloc
+//until pool_thread_shutdown().
+//Pools are meant to be declared THREAD_LOCAL, objects must be freed by the 
+//thread that allocated them.
+typedef struct _Pool Pool;
+struct _Pool
+{
+	const char *name;
+	size_t size; //< Object size, fixed on first allocation
+	void *free_list;
+	void *slabs;
+	Counter n_used, n_free, high_water;
+	int registered;
+	Pool *next; //< Link in the list of all pools
+};
+
+#define POOL_INIT(_name) { _name, 0, NULL, NULL, 0, 0, 0, 0, NULL }
+
+void *pool_alloc(Pool *pool, size_t size);
+
+void pool_free(Pool *pool, void *mem);
+
+//Statistics for a pool, summed over all threads
+typedef struct
+{
+	const char *name;
+	size_t size;
+	unsigned long n_used, n_free, high_water;
+} PoolStats;
+
+typedef void (*PoolStatsFn)(const PoolStats *stats, void *data);
+
+void pool_foreach_stats(PoolStatsFn fn, void *data);
+
+struct evbuffer;
+
+//Appends one line per pool
+void pool_dump_stats(struct evbuffer *out);
+
+//Frees all memory held by pools of the calling thread.
+//No objects may be in use.
+void pool_thread_shutdown();
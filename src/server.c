@@ -20,68 +20,427 @@
 
 #include "incl.h"
 
+#include <errno.h>
 
 struct _Server
 {
 	SocketHandle hd;
 	struct event *evt;
 	int test_mode;
+	ListenerFlags flags;
+
+	//Admission control
+	int paused; //< Listener event is removed until resume_evt fires
+	struct event *resume_evt;
+	FdReserve reserve;
+
+	//Accepting through io_uring instead of evt
+	int use_uring;
+	UringOp accept_op;
 };
 
+//Admission limits, 0 means no limit
+static long max_sessions = 0;
+static long max_client_sessions = 0;
+static size_t max_buffered = 0;
+
+//Sessions of all threads
+static atomic_long n_sessions = 0;
+
+//Sessions per client address, protected by clients_mutex
+typedef struct _ClientEntry ClientEntry;
+struct _ClientEntry
+{
+	ClientEntry *next;
+	HostAddress addr;
+	long n_sessions;
+};
+
+#define SERVER_CLIENT_BUCKETS (256)
+
+static ClientEntry *clients[SERVER_CLIENT_BUCKETS];
+static Mutex clients_mutex = MUTEX_INITIALIZER;
+
+//Per session data
+typedef struct
+{
+	Server *server;
+	ClientEntry *client; //< NULL if not counted per client
+} ServerSession;
+
+static THREAD_LOCAL Pool server_session_pool[1] = { POOL_INIT("server_session") };
+
+void server_set_limits(long sessions, long client_sessions, size_t buffered)
+{
+	max_sessions = sessions;
+	max_client_sessions = client_sessions;
+	max_buffered = buffered;
+}
+
+static ClientEntry **clients_lookup(HostAddress addr)
+{
+	uint32_t hash = 2166136261u;
+	ClientEntry **iter;
+	int i;
+
+	for (i = 0; i < 16; i++)
+	{
+		hash ^= addr.ip[i];
+		hash *= 16777619u;
+	}
+
+	iter = clients + (hash % SERVER_CLIENT_BUCKETS);
+	while (*iter && ((*iter)->addr.type != addr.type 
+				|| memcmp((*iter)->addr.ip, addr.ip, 16) != 0))
+		iter = &((*iter)->next);
+
+	return iter;
+}
+
+//Counts a session of the client, returns NULL if the client is over
+//its limit.
+static ClientEntry *clients_acquire(HostAddress addr)
+{
+	ClientEntry **link, *entry;
+
+	mutex_lock(&clients_mutex);
+	link = clients_lookup(addr);
+	entry = *link;
+	if (! entry)
+	{
+		entry = (ClientEntry *) fs_malloc(sizeof(ClientEntry));
+		entry->next = NULL;
+		entry->addr = addr;
+		entry->n_sessions = 0;
+		*link = entry;
+	}
+	if (entry->n_sessions < max_client_sessions)
+		entry->n_sessions++;
+	else
+		entry = NULL;
+	mutex_unlock(&clients_mutex);
+
+	return entry;
+}
+
+static void clients_release(ClientEntry *entry)
+{
+	ClientEntry **link;
+
+	mutex_lock(&clients_mutex);
+	entry->n_sessions--;
+	if (entry->n_sessions == 0)
+	{
+		link = clients_lookup(entry->addr);
+		*link = entry->next;
+		free(entry);
+	}
+	mutex_unlock(&clients_mutex);
+}
+
+//Whether another session can be accepted within global limits
+static int server_can_admit()
+{
+	if (max_sessions && atomic_load(&n_sessions) >= max_sessions)
+		return 0;
+	if (max_buffered && session_get_buffered_bytes() >= max_buffered)
+		return 0;
+	return 1;
+}
+
+//Stops accepting for a while, so that the backlog and not the existing 
+//sessions absorb the overload.
+static void server_pause(Server *server)
+{
+	struct timeval tv = { 0, SERVER_PAUSE_MSEC * 1000 };
+
+	if (server->paused)
+		return;
+
+	if (server->use_uring)
+		uring_cancel(&server->accept_op);
+	else
+		event_del(server->evt);
+	evtimer_add(server->resume_evt, &tv);
+	server->paused = 1;
+}
+
+static void server_uring_start(Server *server);
+
+static void server_resume(Server *server)
+{
+	if (! server->paused)
+		return;
+
+	event_del(server->resume_evt);
+	server->paused = 0;
+	if (! server->use_uring)
+		event_add(server->evt, NULL);
+	//Otherwise restarted by the final completion, if still pending
+	else if (! server->accept_op.active)
+		server_uring_start(server);
+}
+
+static void server_resume_cb(evutil_socket_t fd, short events, void *data)
+{
+	server_resume((Server *) data);
+}
+
 static void session_state_change_cb
 		(Session *session, SessionState state, void *data)
 {
-	Server *server = (Server *) data;
+	ServerSession *ss = (ServerSession *) data;
+	Server *server = ss->server;
 
 	if (state == SESSION_CLOSED)
 	{
 		session_destroy(session);
 
+		atomic_fetch_sub(&n_sessions, 1);
+		if (ss->client)
+			clients_release(ss->client);
+		pool_free(server_session_pool, ss);
+
 		if (server->test_mode)
 		{
+			event_del(server->resume_evt);
+			server->paused = 0;
 			event_del(server->evt);
 			event_free(server->evt);
 			server->evt = NULL;
 			evloop_release();
 		}
+		else if (server->paused && server_can_admit())
+		{
+			server_resume(server);
+		}
 	}
 
 }
 
-void server_check(evutil_socket_t fd, short events, void *data)
+//Pauses the server if it cannot take another session
+static int server_admit(Server *server)
 {
-	Server *server = (Server *) data;
+	if (! server_can_admit())
+	{
+		log_message(LOG_LEVEL_DEBUG, "Overloaded, not accepting connections");
+		server_pause(server);
+		return 0;
+	}
+	return 1;
+}
 
-	SocketHandle client_hd;
+//Starts a session for an accepted client
+static void server_add_client(Server *server, SocketHandle client_hd)
+{
 	Session *session;
+	ServerSession *ss;
+	ClientEntry *client = NULL;
+	const Error *e;
+
+	if (max_client_sessions)
+	{
+		SocketAddress addr;
+
+		e = socket_handle_getpeername(client_hd, &addr);
+		if (e)
+		{
+			error_handle(e);
+			socket_handle_close(client_hd);
+			return;
+		}
+
+		client = clients_acquire(addr.host);
+		if (! client)
+		{
+			if (log_enabled(LOG_LEVEL_DEBUG))
+			{
+				char str[ADDRESS_MAX_LEN];
+				host_address_to_str(addr.host, str);
+				log_message(LOG_LEVEL_DEBUG, 
+						"Rejecting connection, client %s is over its limit",
+						str);
+			}
+			socket_handle_close(client_hd);
+			return;
+		}
+	}
+
+	ss = (ServerSession *) pool_alloc(server_session_pool, 
+			sizeof(ServerSession));
+	ss->server = server;
+	ss->client = client;
+	atomic_fetch_add(&n_sessions, 1);
+	stats_accept();
+	
+	session = session_create(client_hd);
+	session_set_callback(session, session_state_change_cb, ss);
+
+	//Greeting has most likely arrived already
+	if (server->flags & LISTENER_DEFER_ACCEPT)
+		session_read_now(session);
+}
+
+//Accepts one client, returns whether more may be accepted now
+static int server_accept(Server *server)
+{
+	SocketHandle client_hd;
 	const Error *e;
+
+	if (! server_admit(server))
+		return 0;
 	
 	e = socket_handle_accept(server->hd, &client_hd);
 	if (e)
-		abort_with_error("Failed to accept new connection: %s",
+	{
+		if (e->type == socket_error_no_fds)
+		{
+			//Otherwise the listener would stay readable and spin
+			log_message(LOG_LEVEL_WARNING, 
+					"Dropping connection, %s", error_desc(e));
+			socket_handle_drop_pending(server->hd, &server->reserve);
+			server_pause(server);
+		}
+		else if (e->type != socket_error_again 
+				&& e->type != socket_error_reset)
+		{
+			abort_with_error("Failed to accept new connection: %s",
+					error_desc(e));
+		}
+		error_handle(e);
+		return 0;
+	}
+
+	server_add_client(server, client_hd);
+	return 1;
+}
+
+//Accepting with io_uring: the kernel keeps accepting clients and 
+//reports each one, saving a wakeup and an accept() call per client.
+static void server_uring_fallback(Server *server)
+{
+	server->use_uring = 0;
+	if (! server->paused)
+		event_add(server->evt, NULL);
+}
+
+static void server_uring_start(Server *server)
+{
+	const Error *e;
+
+	e = uring_accept_multishot(server->hd, &server->accept_op);
+	if (e)
+	{
+		log_message(LOG_LEVEL_WARNING, "Accepting through libevent, %s",
 				error_desc(e));
-	
-	session = session_create(client_hd);
-	session_set_callback(session, session_state_change_cb, server);
+		error_handle(e);
+		server_uring_fallback(server);
+	}
+	else
+	{
+		log_message(LOG_LEVEL_DEBUG, "Accepting through io_uring");
+	}
 }
 
-static Server *server_create_internal(SocketHandle hd, int test_mode)
+static void server_uring_cb(int res, int more, void *data)
+{
+	Server *server = (Server *) data;
+
+	if (res >= 0)
+	{
+		SocketHandle client_hd = { res };
+		const Error *e;
+
+		e = socket_handle_setup_accepted(client_hd);
+		if (e)
+		{
+			error_handle(e);
+			socket_handle_close(client_hd);
+		}
+		else
+		{
+			server_add_client(server, client_hd);
+		}
+
+		//Clients already accepted by the kernel are still taken in
+		server_admit(server);
+	}
+	else if (res == -EINVAL || res == -EOPNOTSUPP)
+	{
+		//Kernel without multishot accept
+		log_message(LOG_LEVEL_INFO, 
+				"io_uring cannot accept clients, using libevent");
+		server_uring_fallback(server);
+		return;
+	}
+	else if (res == -EMFILE || res == -ENFILE 
+			|| res == -ENOBUFS || res == -ENOMEM)
+	{
+		log_message(LOG_LEVEL_WARNING, 
+				"Dropping connection, %s", strerror(-res));
+		socket_handle_drop_pending(server->hd, &server->reserve);
+		server_pause(server);
+	}
+	else if (res != -ECANCELED && res != -ECONNABORTED && res != -EAGAIN)
+	{
+		abort_with_error("Failed to accept new connection: %s", 
+				strerror(-res));
+	}
+
+	if (! more && server->use_uring && ! server->paused)
+		server_uring_start(server);
+}
+
+//Drains the accept queue, a bounded number of clients per wakeup so that
+//existing sessions are not starved during bursts
+void server_check(evutil_socket_t fd, short events, void *data)
+{
+	Server *server = (Server *) data;
+	int i;
+
+	for (i = 0; i < SERVER_ACCEPT_BATCH; i++)
+	{
+		if (! server_accept(server))
+			break;
+
+		//Test servers only ever handle one session
+		if (server->test_mode)
+			break;
+	}
+}
+
+static Server *server_create_internal
+	(SocketHandle hd, ListenerFlags flags, int test_mode)
 {
 	Server *server = (Server *) fs_malloc(sizeof(Server));
 
 	server->hd = hd;
+	server->flags = flags;
 
 	server->evt = socket_handle_create_event
 		(server->hd, EV_READ | EV_PERSIST, server_check, server);
-	event_add(server->evt, NULL);
 	evloop_hold();
 
 	server->test_mode = test_mode;
 
+	server->paused = 0;
+	server->resume_evt = evtimer_new(evbase, server_resume_cb, server);
+	fd_reserve_init(&server->reserve);
+
+	//Test servers stop after one session, which suits libevent better
+	server->accept_op.cb = server_uring_cb;
+	server->accept_op.data = server;
+	server->accept_op.active = 0;
+	server->use_uring = ! test_mode && uring_available();
+	if (server->use_uring)
+		server_uring_start(server);
+	else
+		event_add(server->evt, NULL);
+
 	return server;
 }
 
-Server *server_create(const char *str)
+Server *server_create(const char *str, ListenerFlags flags)
 {
 	SocketAddress addr;
 	SocketHandle hd;
@@ -91,28 +450,41 @@ Server *server_create(const char *str)
 			"Failed to read binding address");
 	if(addr.port == 0)
 		addr.port = htons(1080);
-	e = socket_handle_create_listener(addr, &hd);
+	e = socket_handle_create_listener(addr, flags, &hd);
 	abort_if_fail(!e, "Failed to create listener socket: %s", error_desc(e));
 	e = socket_handle_set_blocking(hd, 0);
 	abort_if_fail(!e, "Failed to enable nonblocking: %s", error_desc(e));
 
-	printf("Listening at %s\n", str);
-	return server_create_internal(hd, 0);
+	log_message(LOG_LEVEL_INFO, "Listening at %s", str);
+	return server_create_internal(hd, flags, 0);
+}
+
+Server *server_create_from_handle(SocketHandle hd, ListenerFlags flags)
+{
+	return server_create_internal(hd, flags, 0);
 }
 
 void server_destroy(Server *server)
 {
+	if (server->accept_op.active)
+	{
+		server->paused = 1;
+		uring_cancel(&server->accept_op);
+		uring_op_wait(&server->accept_op);
+	}
 	if (server->evt)
 	{
 		event_del(server->evt);
 		event_free(server->evt);
 		evloop_release();
 	}
+	event_free(server->resume_evt);
+	fd_reserve_free(&server->reserve);
 	socket_handle_close(server->hd);
 	free(server);
 }
 
 Server *server_create_test(SocketHandle hd)
 {
-	return server_create_internal(hd, 1);
+	return server_create_internal(hd, 0, 1);
 }
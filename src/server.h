@@ -20,8 +20,23 @@
 
 typedef struct _Server Server;
 
+//Admission control
+//When the number of sessions or the data buffered by them reaches its 
+//limit, listeners stop accepting for SERVER_PAUSE_MSEC or until a 
+//session closes. Connections from a client over its own limit are closed
+//right away. Limits of 0 mean no limit.
+#define SERVER_PAUSE_MSEC (100)
 
-Server *server_create(const char *str);
+//Most clients accepted per wakeup of a listener
+#define SERVER_ACCEPT_BATCH (32)
+
+void server_set_limits(long sessions, long client_sessions, size_t buffered);
+
+
+Server *server_create(const char *str, ListenerFlags flags);
+
+//Serves clients on an already listening, non-blocking socket
+Server *server_create_from_handle(SocketHandle hd, ListenerFlags flags);
 
 void server_destroy(Server *server);
 
@@ -20,6 +20,8 @@
 
 #include "incl.h"
 
+#include <errno.h>
+
 
 typedef enum 
 {
@@ -27,20 +29,70 @@ typedef enum
 	SESSION_REMOTE = 1
 } SessionLane;
 
+typedef enum
+{
+	SESSION_TIMEOUT_NONE = 0,
+	SESSION_TIMEOUT_HANDSHAKE,
+	SESSION_TIMEOUT_IDLE
+} SessionTimeout;
+
+//Receive or send in flight on a lane's connection
+typedef struct
+{
+	UringOp op;
+	Session *session;
+	int lane;
+	size_t offset; //< Where received data goes in the lane buffer
+} SessionUringOp;
+
 struct _Session
 {
 	struct {
 		SocketHandle hd;
 		int hd_valid;
-		uint8_t buffer[BUFFER_SIZE];
-		int start, end;
-		struct event *evt;
+		RingBuffer buffer; //< Without memory while the lane has no data
+		int buffer_class; //< Size class of the next buffer
+		size_t buffer_peak; //< Most data held since the buffer was taken
+		RelayPipe pipe; //< Used instead of buffer when pipe_valid is set
+		int pipe_valid;
+		int pipe_full; //< Pipe took no more data, until some is sent
+		struct event *evt; //< Allocated along with the session
+		short events; //< Events evt is armed for, 0 if not pending
+		unsigned long long n_bytes; //< Bytes received on the lane
+
+		//Used instead of evt when use_uring is set. recv receives into the
+		//lane buffer, send sends the opposite lane buffer.
+		SessionUringOp recv, send;
+		int hd_open; //< hd is closed, but not until recv and send complete
 	} lanes[2];
+	int use_uring; //< Lane buffers are registered io_uring buffers
+	unsigned long n_event_mods;
+	size_t n_buffered; //< Contribution to session_buffered_bytes
+
+	//Resumes reading when the interface is no longer over its rate limit
+	struct event *shaper_event; //< Allocated along with the session
+	int shaper_armed;
+
+	//Handshake and idle timeouts
+	struct event *timeout_event; //< Allocated along with the session
+	SessionTimeout timeout_kind; //< What timeout_event is armed for
+	struct timeval last_activity; //< Last successful read or write
+
+	//For the summary logged when session is destroyed
+	struct timeval start_time;
+	struct timeval state_time; //< When the current state was entered
+	SocketAddress client_addr;
+	int client_addr_valid;
+	HostAddress iface_addr;
+	int iface_addr_valid;
+	char dest[SESSION_DEST_MAX_LEN];
+	const char *result; //< Why the session ended, static string
 	
 	int state, prev_state;
 	unsigned int sid;
 	Interface *iface;
 	Connector *connector;
+	UdpAssociation *udp; //< Only in SESSION_ASSOCIATED state
 
 	SessionStateChangeCB cb;
 	void *cb_data;
@@ -50,27 +102,162 @@ struct _Session
 static void session_prepare(Session *session);
 void session_authenticator(Session *session);
 
+//Allocator
+static THREAD_LOCAL Pool session_pool[1] = { POOL_INIT("session") };
+
+//Relay mode for connected sessions
+static SessionRelayMode relay_mode = SESSION_RELAY_SPLICE;
+
+//Rings register buffers as large as the lane buffers, only when needed
+static void session_configure_uring();
+
+void session_set_relay_mode(SessionRelayMode mode)
+{
+	relay_mode = mode;
+	session_configure_uring();
+}
+
+//Capacity of the largest lane buffer
+static size_t buffer_size = SESSION_DEFAULT_BUFFER_SIZE;
+
+void session_set_buffer_size(size_t size)
+{
+	abort_if_fail(size >= SESSION_MIN_BUFFER_SIZE,
+			"Buffer size must be at least %d bytes",
+			(int) SESSION_MIN_BUFFER_SIZE);
+	buffer_size = size;
+	session_configure_uring();
+}
+
+static void session_configure_uring()
+{
+	uring_set_buffer_size(relay_mode == SESSION_RELAY_URING ? buffer_size : 0);
+}
+
+//Timeouts, 0 to disable
+static long handshake_timeout = SESSION_DEFAULT_HANDSHAKE_TIMEOUT; //< ms
+static long idle_timeout = SESSION_DEFAULT_IDLE_TIMEOUT; //< seconds
+
+//Idle sessions are checked this many times per idle timeout, so they
+//are closed at most a quarter of the timeout late.
+#define SESSION_IDLE_CHECKS (4)
+
+void session_set_timeouts(long handshake_ms, long idle_sec)
+{
+	handshake_timeout = handshake_ms;
+	idle_timeout = idle_sec;
+}
+
+//All sessions of a thread share the same durations, so libevent's common 
+//timeout queues make adding and removing timers O(1).
+static THREAD_LOCAL struct event_base *timeouts_base = NULL;
+static THREAD_LOCAL const struct timeval *handshake_tv, *idle_check_tv;
+
+static void session_timeouts_init()
+{
+	struct timeval tv;
+
+	if (timeouts_base == evbase)
+		return;
+
+	tv.tv_sec = handshake_timeout / 1000;
+	tv.tv_usec = (handshake_timeout % 1000) * 1000;
+	handshake_tv = event_base_init_common_timeout(evbase, &tv);
+
+	tv.tv_sec = idle_timeout / SESSION_IDLE_CHECKS;
+	tv.tv_usec = (idle_timeout % SESSION_IDLE_CHECKS) 
+		* (1000000 / SESSION_IDLE_CHECKS);
+	idle_check_tv = event_base_init_common_timeout(evbase, &tv);
+
+	abort_if_fail(handshake_tv && idle_check_tv,
+			"event_base_init_common_timeout() failed");
+	timeouts_base = evbase;
+}
+
+void session_thread_shutdown()
+{
+	timeouts_base = NULL;
+}
+
+//Data pending in all sessions
+static atomic_size_t session_buffered_bytes = 0;
+
+size_t session_get_buffered_bytes()
+{
+	return atomic_load_explicit(&session_buffered_bytes, memory_order_relaxed);
+}
+
 //Logging functions
 static void session_log
-	(Session *session, const char *format, ...)
+	(Session *session, LogLevel level, const char *format, ...)
 {
 	va_list args;
+	char msg[256];
 	
-	va_start(args, format);
-	
-	printf("Session %u: ", session->sid); 
-	
-	vprintf(format, args);
-	
-	printf("\n"); 
+	if (! log_enabled(level))
+		return;
 	
+	va_start(args, format);
+	vsnprintf(msg, sizeof(msg), format, args);
 	va_end(args);
+	
+	log_message(level, "Session %u: %s", session->sid, msg);
+}
+
+//Records why the session ended, first reason wins
+static void session_set_result(Session *session, const char *result)
+{
+	if (! session->result)
+		session->result = result;
+}
+
+//Logs one line describing the whole session
+static void session_log_summary(Session *session)
+{
+	char client[ADDRESS_MAX_LEN] = "-";
+	char iface[ADDRESS_MAX_LEN] = "-";
+	struct timeval now, duration;
+
+	if (! log_enabled(LOG_LEVEL_INFO))
+		return;
+
+	if (session->client_addr_valid)
+		socket_address_to_str(session->client_addr, client);
+	if (session->iface_addr_valid)
+		host_address_to_str(session->iface_addr, iface);
+	event_base_gettimeofday_cached(evbase, &now);
+	evutil_timersub(&now, &session->start_time, &duration);
+
+	log_message(LOG_LEVEL_INFO, 
+			"Session %u: client=%s dest=\"%s\" iface=%s result=\"%s\" "
+			"up=%llu down=%llu duration=%ld.%03ld events=%lu",
+			session->sid, client, session->dest, iface, 
+			session->result ? session->result : "closed",
+			session->lanes[SESSION_CLIENT].n_bytes,
+			session->lanes[SESSION_REMOTE].n_bytes,
+			(long) duration.tv_sec, (long) duration.tv_usec / 1000,
+			session->n_event_mods);
 }
 
 //State change functions
 //Does not call any callbacks
 static void session_set_state(Session *session, SessionState state)
 {
+	struct timeval now;
+	uint64_t usec;
+
+	//The cached time is too coarse for handshakes on fast links
+	if (session->state != state)
+	{
+		evutil_gettimeofday(&now, NULL);
+		usec = stats_usec_since(&session->state_time, &now);
+		if (session->state != SESSION_CLOSED)
+			stats_session_time(session->state, usec);
+		trace_probe4(session_state, session->sid, session->state, state, usec);
+		session->state_time = now;
+	}
+
+	stats_session_state(session->state, state);
 	session->state = state;
 
 	struct
@@ -83,6 +270,7 @@ static void session_set_state(Session *session, SessionState state)
 		entry(SESSION_REQUEST),
 		entry(SESSION_CONNECTING),
 		entry(SESSION_CONNECTED),
+		entry(SESSION_ASSOCIATED),
 		entry(SESSION_SHUTDOWN),
 		entry(SESSION_CLOSED),
 #undef entry
@@ -96,7 +284,8 @@ static void session_set_state(Session *session, SessionState state)
 			break;
 	}
 
-	session_log(session, "Session entered state %s", states[i].str);
+	session_log(session, LOG_LEVEL_DEBUG, 
+			"Session entered state %s", states[i].str);
 }
 
 //Buffer management functions
@@ -104,39 +293,480 @@ static void session_set_state(Session *session, SessionState state)
 //Peeks on data received from client into buffer.
 static uint8_t *session_peek(Session *session, int len)
 {
-	if (session->lanes[SESSION_CLIENT].start + len 
-		> session->lanes[SESSION_CLIENT].end)
-		return NULL;
-	return session->lanes[SESSION_CLIENT].buffer 
-		+ session->lanes[SESSION_CLIENT].start;
+	return ring_buffer_peek(&session->lanes[SESSION_CLIENT].buffer, len);
 }
 
 //Returns data received from client into buffer.
+//Returned data stays valid until the next read from client.
 static uint8_t *session_read(Session *session, int len)
 {
-	uint8_t *res = session->lanes[SESSION_CLIENT].buffer 
-		+ session->lanes[SESSION_CLIENT].start;
-	if (session->lanes[SESSION_CLIENT].start + len 
-		> session->lanes[SESSION_CLIENT].end)
+	uint8_t *res = ring_buffer_peek(&session->lanes[SESSION_CLIENT].buffer, len);
+	if (! res)
 		return NULL;
-	session->lanes[SESSION_CLIENT].start += len;
+	ring_buffer_consume(&session->lanes[SESSION_CLIENT].buffer, len);
 	
 	return res;
 }
 
-//Allocate space on buffer for writing
-static uint8_t *session_write_alloc(Session *session, int len)
+//Lane buffers are taken from pools of a few size classes, each twice as
+//large as the previous one up to buffer_size, and are held only while 
+//there is data in flight. A lane moves to the next class when it fills 
+//its buffer, and back to the previous one when it drains a buffer it 
+//never used more than a quarter of.
+#define SESSION_BUFFER_CLASSES (4)
+
+static THREAD_LOCAL Pool buffer_pools[SESSION_BUFFER_CLASSES] = 
 {
-	uint8_t *res = session->lanes[SESSION_REMOTE].buffer 
-		+ session->lanes[SESSION_REMOTE].end;
-	session->lanes[SESSION_REMOTE].end += len;
-	
+	POOL_INIT("lane-buffer-0"),
+	POOL_INIT("lane-buffer-1"),
+	POOL_INIT("lane-buffer-2"),
+	POOL_INIT("lane-buffer-3")
+};
+
+static size_t session_buffer_class_size(int buffer_class)
+{
+	size_t size = buffer_size >> (SESSION_BUFFER_CLASSES - 1 - buffer_class);
+
+	return size < SESSION_MIN_BUFFER_SIZE ? SESSION_MIN_BUFFER_SIZE : size;
+}
+
+//Gives the lane a buffer if it has none
+static void session_lane_alloc(Session *session, int lane)
+{
+	RingBuffer *buffer = &session->lanes[lane].buffer;
+	int buffer_class = session->lanes[lane].buffer_class;
+	size_t size = session_buffer_class_size(buffer_class);
+
+	if (buffer->data)
+		return;
+
+	ring_buffer_init(buffer, pool_alloc(buffer_pools + buffer_class, size), 
+			size);
+	session->lanes[lane].buffer_peak = 0;
+}
+
+static void session_lane_free(Session *session, int lane)
+{
+	RingBuffer *buffer = &session->lanes[lane].buffer;
+
+	if (! buffer->data)
+		return;
+
+	if (session->use_uring)
+		uring_buffer_give(buffer->data);
+	else
+		pool_free(buffer_pools + session->lanes[lane].buffer_class, 
+				buffer->data);
+	ring_buffer_init(buffer, NULL, 0);
+}
+
+//Returns the buffer of a drained lane
+static void session_lane_release(Session *session, int lane)
+{
+	RingBuffer *buffer = &session->lanes[lane].buffer;
+	int buffer_class = session->lanes[lane].buffer_class;
+
+	//Registered buffers are kept until the session ends
+	if (! buffer->data || ring_buffer_len(buffer) || session->use_uring)
+		return;
+
+	session_lane_free(session, lane);
+	if (buffer_class > 0 && session->lanes[lane].buffer_peak 
+			<= session_buffer_class_size(buffer_class) / 4)
+		session->lanes[lane].buffer_class = buffer_class - 1;
+}
+
+//Called after receiving into the lane buffer
+static void session_lane_adapt(Session *session, int lane)
+{
+	RingBuffer *buffer = &session->lanes[lane].buffer;
+	int buffer_class = session->lanes[lane].buffer_class;
+	void *old_mem = buffer->data;
+	size_t size;
+
+	if (ring_buffer_len(buffer) > session->lanes[lane].buffer_peak)
+		session->lanes[lane].buffer_peak = ring_buffer_len(buffer);
+
+	if (ring_buffer_space(buffer) || buffer_class == SESSION_BUFFER_CLASSES - 1)
+		return;
+
+	buffer_class++;
+	size = session_buffer_class_size(buffer_class);
+	ring_buffer_move(buffer, pool_alloc(buffer_pools + buffer_class, size),
+			size);
+	pool_free(buffer_pools + session->lanes[lane].buffer_class, old_mem);
+	session->lanes[lane].buffer_class = buffer_class;
+}
+
+//Queue data for sending to the client
+static void session_write(Session *session, const void *data, int len)
+{
+	Status s;
+
+	session_lane_alloc(session, SESSION_REMOTE);
+	s = ring_buffer_write(&session->lanes[SESSION_REMOTE].buffer, data, len);
+
+	abort_if_fail(s == STATUS_SUCCESS,
+			"Assertion failure (no space for reply)");
+}
+
+//Number of received bytes on the lane not yet sent to the opposite lane
+static size_t session_lane_pending(Session *session, int lane)
+{
+	size_t res = ring_buffer_len(&session->lanes[lane].buffer);
+	if (session->lanes[lane].pipe_valid)
+		res += session->lanes[lane].pipe.len;
 	return res;
 }
 
+//Whether more data can be received on the lane
+static int session_lane_can_read(Session *session, int lane)
+{
+	if (session->lanes[lane].pipe_valid)
+		return ! session->lanes[lane].pipe_full
+			&& session->lanes[lane].pipe.len 
+			< session->lanes[lane].pipe.capacity;
+	else
+		return ! session->lanes[lane].buffer.data
+			|| ring_buffer_space(&session->lanes[lane].buffer) > 0;
+}
+
+//Switches the session to zero-copy relaying, if possible.
+//Unsent data still in the buffers is sent before anything in the pipes.
+static void session_enable_splice(Session *session)
+{
+	int i;
+	const Error *e;
+
+	if (relay_mode != SESSION_RELAY_SPLICE || ! relay_pipe_supported())
+		return;
+
+	for (i = 0; i < 2; i++)
+	{
+		e = relay_pipe_create(&session->lanes[i].pipe);
+		if (e)
+		{
+			session_log(session, LOG_LEVEL_WARNING, 
+					"Cannot create relay pipe, "
+					"using buffered relaying (%s)", error_desc(e));
+			error_handle(e);
+			if (i == 1)
+			{
+				relay_pipe_close(&session->lanes[0].pipe);
+				session->lanes[0].pipe_valid = 0;
+			}
+			return;
+		}
+		session->lanes[i].pipe_valid = 1;
+	}
+}
+
+//Switches the session to relaying through io_uring, if possible. Both 
+//lanes move to registered buffers, and the sockets become blocking 
+//because io_uring waits for them itself.
+static void session_enable_uring(Session *session)
+{
+	RingBuffer *buffer;
+	void *mem[2];
+	int i;
+
+	if (relay_mode != SESSION_RELAY_URING)
+		return;
+
+	for (i = 0; i < 2; i++)
+	{
+		mem[i] = uring_buffer_take();
+		if (! mem[i])
+		{
+			session_log(session, LOG_LEVEL_DEBUG, 
+					"No io_uring buffers left, using buffered relaying");
+			if (i == 1)
+				uring_buffer_give(mem[0]);
+			return;
+		}
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		const Error *e;
+
+		buffer = &session->lanes[i].buffer;
+		if (buffer->data)
+		{
+			void *old_mem = buffer->data;
+			ring_buffer_move(buffer, mem[i], buffer_size);
+			pool_free(buffer_pools + session->lanes[i].buffer_class, old_mem);
+		}
+		else
+		{
+			ring_buffer_init(buffer, mem[i], buffer_size);
+		}
+
+		e = socket_handle_set_blocking(session->lanes[i].hd, 1);
+		if (e)
+			error_handle(e);
+	}
+	session->use_uring = 1;
+}
+
+//Drops the reference to the outgoing interface, reporting the round trip
+//time the kernel measured on the connection first.
+static void session_release_iface(Session *session)
+{
+	long rtt;
+	const Error *e;
+
+	if (! session->iface)
+		return;
+
+	if (session->lanes[SESSION_REMOTE].hd_valid)
+	{
+		e = socket_handle_get_rtt(session->lanes[SESSION_REMOTE].hd, &rtt);
+		if (e)
+			error_handle(e);
+		else if (rtt > 0)
+			interface_add_rtt_sample(session->iface, rtt);
+	}
+
+	interface_close(session->iface);
+	session->iface = NULL;
+}
+
+//Closes the connection of a lane. Operations in flight on it are 
+//cancelled and their completions ignored. The socket stays open until 
+//they complete: operations not yet handed over to the kernel would 
+//otherwise refer to whichever socket gets the same descriptor next.
+static void session_lane_close(Session *session, int lane)
+{
+	session->lanes[lane].hd_valid = 0;
+	if (session->use_uring && (session->lanes[lane].recv.op.active
+				|| session->lanes[lane].send.op.active))
+	{
+		uring_cancel(&session->lanes[lane].recv.op);
+		uring_cancel(&session->lanes[lane].send.op);
+		session->lanes[lane].hd_open = 1;
+		return;
+	}
+	socket_handle_close(session->lanes[lane].hd);
+}
+
+//Finishes session_lane_close() once operations are done
+static void session_lane_close_finish(Session *session, int lane)
+{
+	if (session->lanes[lane].hd_open 
+			&& ! session->lanes[lane].recv.op.active
+			&& ! session->lanes[lane].send.op.active)
+	{
+		socket_handle_close(session->lanes[lane].hd);
+		session->lanes[lane].hd_open = 0;
+	}
+}
+
+//Closes a lane whose connection failed or reached EOF
+static void session_lane_fail(Session *session, int lane)
+{
+	if (lane == SESSION_REMOTE)
+		session_release_iface(session);
+	session_lane_close(session, lane);
+	if (session->state != SESSION_SHUTDOWN)
+		session_set_state(session, SESSION_SHUTDOWN);
+}
+
+//Accounts for len bytes received on the lane
+static void session_lane_received(Session *session, int lane, size_t len)
+{
+	session->lanes[lane].n_bytes += len;
+	if (session->iface)
+	{
+		interface_add_bytes(session->iface, len);
+		if (lane == SESSION_REMOTE)
+			stats_iface_bytes(session->iface, len, 0);
+		else
+			stats_iface_bytes(session->iface, 0, len);
+	}
+}
+
+//If session is in shutdown state and all buffers are empty, then
+//enter closed state.
+static void session_check_closed(Session *session)
+{
+	if (session->state == SESSION_SHUTDOWN)
+	{
+		int cond = 0, i;
+		for(i = 0; i < 2; i++)
+		{
+			int opposite = 1 - i;
+			cond += session->lanes[i].hd_valid
+				? session_lane_pending(session, opposite)
+				: 0;
+		}
+		if (!cond)
+			session_set_state(session, SESSION_CLOSED);
+	}
+}
+
+//Closes both connections right away, dropping unsent data
+static void session_abort(Session *session, const char *result)
+{
+	int lane;
+
+	session_log(session, LOG_LEVEL_DEBUG, "Aborting (%s)", result);
+	session_set_result(session, result);
+
+	for (lane = 0; lane < 2; lane++)
+	{
+		if (session->lanes[lane].events)
+		{
+			event_del(session->lanes[lane].evt);
+			session->lanes[lane].events = 0;
+			session->n_event_mods++;
+		}
+	}
+
+	session_release_iface(session);
+	for (lane = 0; lane < 2; lane++)
+	{
+		if (session->lanes[lane].hd_valid)
+			session_lane_close(session, lane);
+	}
+
+	if (session->state != SESSION_SHUTDOWN)
+		session_set_state(session, SESSION_SHUTDOWN);
+	session_check_closed(session);
+	session_prepare(session);
+}
+
+//Timeouts
+
+static void session_timeout_cb(evutil_socket_t fd, short events, void *data)
+{
+	Session *session = (Session *) data;
+	SessionTimeout kind = session->timeout_kind;
+	struct timeval now, idle;
+
+	session->timeout_kind = SESSION_TIMEOUT_NONE;
+
+	if (kind == SESSION_TIMEOUT_HANDSHAKE)
+	{
+		session_abort(session, "handshake-timeout");
+	}
+	else if (kind == SESSION_TIMEOUT_IDLE)
+	{
+		struct timeval last = session->last_activity;
+
+		//Datagrams count as activity too
+		if (session->udp)
+		{
+			struct timeval udp_last;
+			udp_association_get_last_activity(session->udp, &udp_last);
+			if (evutil_timercmp(&udp_last, &last, >))
+				last = udp_last;
+		}
+
+		event_base_gettimeofday_cached(evbase, &now);
+		evutil_timersub(&now, &last, &idle);
+		if (idle.tv_sec >= idle_timeout)
+		{
+			session_abort(session, "idle-timeout");
+		}
+		else
+		{
+			evtimer_add(session->timeout_event, idle_check_tv);
+			session->timeout_kind = SESSION_TIMEOUT_IDLE;
+		}
+	}
+}
+
+//Arms the timeout suitable for the state the session just entered. 
+//Handshake timeout runs from creation until a connection is requested, 
+//idle timeout from establishing the connection until the end. 
+//Connecting is limited by the connector's own deadline.
+static void session_update_timeout(Session *session)
+{
+	SessionTimeout kind = session->timeout_kind;
+
+	if (session->state == SESSION_AUTH)
+		kind = handshake_timeout ? SESSION_TIMEOUT_HANDSHAKE 
+			: SESSION_TIMEOUT_NONE;
+	else if (session->state == SESSION_CONNECTING 
+			|| session->state == SESSION_CLOSED)
+		kind = SESSION_TIMEOUT_NONE;
+	else if (session->state == SESSION_CONNECTED
+			|| session->state == SESSION_ASSOCIATED)
+		kind = idle_timeout ? SESSION_TIMEOUT_IDLE : SESSION_TIMEOUT_NONE;
+
+	if (kind == session->timeout_kind)
+		return;
+
+	if (session->timeout_kind != SESSION_TIMEOUT_NONE)
+		event_del(session->timeout_event);
+
+	session->timeout_kind = kind;
+	if (kind != SESSION_TIMEOUT_NONE)
+	{
+		session_timeouts_init();
+		event_base_gettimeofday_cached(evbase, &session->last_activity);
+		evtimer_add(session->timeout_event, kind == SESSION_TIMEOUT_HANDSHAKE
+				? handshake_tv : idle_check_tv);
+	}
+}
+
 //Event management
 
 //Responds to IO events
+//Sends data received on the opposite lane over the connection of the 
+//lane, first from the buffer, then from the pipe. Returns whether the 
+//connection failed.
+static int session_lane_send(Session *session, int lane, int *io_done)
+{
+	int opposite = 1 - lane;
+	RingBuffer *buffer = &session->lanes[opposite].buffer;
+	int buffered = ring_buffer_len(buffer) > 0;
+	size_t io_res;
+	const Error *e;
+
+	if (buffered)
+	{
+		IoVec vecs[2];
+		int n_vecs = ring_buffer_data_vecs(buffer, vecs);
+
+		e = socket_handle_writev(session->lanes[lane].hd, vecs, n_vecs, 
+				&io_res);
+	}
+	else
+	{
+		e = socket_handle_splice_write(session->lanes[lane].hd,
+			&session->lanes[opposite].pipe, &io_res);
+	}
+
+	//Error handling
+	if (e)
+	{
+		int failed = 0;
+
+		//Fast open connection still waiting for the handshake
+		if (e->type != socket_error_again 
+				&& e->type != socket_error_in_progress)
+		{
+			failed = 1;
+			session_set_result(session, e->type);
+			session_log(session, LOG_LEVEL_DEBUG,
+					"Error %s", error_desc(e));
+		}
+		error_handle(e);
+		return failed;
+	}
+
+	abort_if_fail(io_res != 0, "Assertion failure");
+
+	*io_done = 1;
+	if (buffered)
+		ring_buffer_consume(buffer, io_res);
+	else
+		session->lanes[opposite].pipe_full = 0;
+	return 0;
+}
+
 static void session_check(evutil_socket_t fd, short events, void *data)
 {
 	SocketHandle hd;
@@ -145,6 +775,7 @@ static void session_check(evutil_socket_t fd, short events, void *data)
 	size_t io_res;
 	const Error *e;
 	int shutdown_needed = 0;
+	int io_done = 0;
 	
 	//Find the socket on which we received event
 	for (lane = 0; lane < 2; lane++)
@@ -168,21 +799,40 @@ static void session_check(evutil_socket_t fd, short events, void *data)
 			"Assertion failed");
 	
 		
-	//Read data into buffer
+	//Read data into buffer (or pipe)
 	if (events & EV_READ)
 	{
-		e = socket_handle_read(hd, 
-			session->lanes[lane].buffer + session->lanes[lane].end,
-			BUFFER_SIZE - session->lanes[lane].end,
-			&io_res);
+		if (session->lanes[lane].pipe_valid)
+		{
+			e = socket_handle_splice_read(hd, 
+				&session->lanes[lane].pipe, &io_res);
+		}
+		else
+		{
+			IoVec vecs[2];
+			int n_vecs;
+
+			session_lane_alloc(session, lane);
+			n_vecs = ring_buffer_space_vecs(&session->lanes[lane].buffer, vecs);
+			e = socket_handle_readv(hd, vecs, n_vecs, &io_res);
+		}
 		
 		//Error handling
 		if (e)
 		{
+			//The pipe runs out of slots before it holds capacity bytes. 
+			//Reading waits for the pipe to drain, or the level-triggered
+			//event would keep firing.
+			if (e->type == socket_error_again 
+					&& session->lanes[lane].pipe_valid
+					&& session->lanes[lane].pipe.len)
+				session->lanes[lane].pipe_full = 1;
+
 			if (e->type != socket_error_again)
 			{
 				shutdown_needed = 1;
-				session_log(session, 
+				session_set_result(session, e->type);
+				session_log(session, LOG_LEVEL_DEBUG,
 						"Error %s", error_desc(e));
 			}
 			error_handle(e);
@@ -190,103 +840,259 @@ static void session_check(evutil_socket_t fd, short events, void *data)
 		}
 		else if (io_res == 0)
 		{
-			session_log(session, "EOF encountered");
+			session_log(session, LOG_LEVEL_DEBUG, "EOF encountered");
+			session_set_result(session, 
+					lane == SESSION_CLIENT ? "client-eof" : "remote-eof");
 			shutdown_needed = 1;
 		}
 		else
 		{
-			session->lanes[lane].end += io_res;
+			io_done = 1;
+			session_lane_received(session, lane, io_res);
+			if (! session->lanes[lane].pipe_valid)
+			{
+				ring_buffer_produce(&session->lanes[lane].buffer, io_res);
+				session_lane_adapt(session, lane);
+			}
+
+			//Nothing is relayed over the connection of an association
+			if (session->state == SESSION_ASSOCIATED)
+				ring_buffer_consume(&session->lanes[lane].buffer,
+						ring_buffer_len(&session->lanes[lane].buffer));
+
+			//The other connection mostly has room, sending right away
+			//saves arming its write event for every read
+			if (session->state == SESSION_CONNECTED
+					&& ! (session->lanes[1 - lane].events & EV_WRITE)
+					&& session_lane_send(session, 1 - lane, &io_done))
+				session_lane_fail(session, 1 - lane);
 		}
 	}
 	
-	//Write from opposite buffer
+	//Write from opposite buffer, then from opposite pipe
 	if (events & EV_WRITE)
 	{
-		int opposite = 1 - lane;
-		
-		e = socket_handle_write(hd, 
-			session->lanes[opposite].buffer + session->lanes[opposite].start,
-			session->lanes[opposite].end - session->lanes[opposite].start,
-			&io_res);
-
-		abort_if_fail(io_res != 0, "Assertion failure");
-		
-		//Error handling
-		if (e)
-		{
-			if (e->type != socket_error_again)
-			{
-				shutdown_needed = 1;
-				session_log(session, 
-						"Error %s", error_desc(e));
-			}
-			error_handle(e);
-			e = NULL;
-		}
-		else
-		{
-			session->lanes[opposite].start += io_res;
-		}
-		
-		//If start of buffer crosses middle,
-		//shift the buffer contents to beginning
-		if (session->lanes[opposite].start >= (BUFFER_SIZE / 2))
-		{
-			int j, new_end;
-			
-			new_end = session->lanes[opposite].end - session->lanes[opposite].start;
-			
-			for (j = 0; j < new_end; j++)
-				session->lanes[opposite].buffer[j] 
-					= session->lanes[opposite].buffer
-						[j + session->lanes[opposite].start];
-			
-			session->lanes[opposite].start = 0;
-			session->lanes[opposite].end = new_end;
-		}
+		if (session_lane_send(session, lane, &io_done))
+			shutdown_needed = 1;
 	}
 
 	//Close the socket handle if anything failed
 	//If anything failed, then close socket handle and interface, if valid
 	if (shutdown_needed)
+		session_lane_fail(session, lane);
+
+	if (io_done)
+		event_base_gettimeofday_cached(evbase, &session->last_activity);
+
+	session_check_closed(session);
+
+	session_authenticator(session);
+
+	//Call prepare function
+	session_prepare(session);
+}
+
+static void session_shaper_cb(evutil_socket_t fd, short events, void *data)
+{
+	Session *session = (Session *) data;
+
+	session->shaper_armed = 0;
+	session_prepare(session);
+}
+
+//Relaying through io_uring. Each connection has at most one receive into 
+//its lane buffer and one send from the opposite lane buffer in flight.
+//They cannot be linked, a send only knows how much to send once the 
+//receive completes; instead session_prepare() submits the next 
+//operations, and all operations queued while handling completions are 
+//handed over to the kernel together.
+
+//Tries again when the submission queue has room
+static void session_uring_retry(Session *session)
+{
+	struct timeval tv = { 0, 1000 };
+
+	if (session->shaper_armed)
+		return;
+	evtimer_assign(session->shaper_event, evbase, session_shaper_cb, session);
+	evtimer_add(session->shaper_event, &tv);
+	session->shaper_armed = 1;
+}
+
+static void session_uring_recv_cb(int res, int more, void *data)
+{
+	SessionUringOp *uop = (SessionUringOp *) data;
+	Session *session = uop->session;
+	int lane = uop->lane;
+	const Error *e;
+
+	//Connection closed, the session may be going away
+	session_lane_close_finish(session, lane);
+	if (session->state == SESSION_CLOSED || ! session->lanes[lane].hd_valid)
+		return;
+
+	if (res > 0)
 	{
-		socket_handle_close(hd);
-		session->lanes[lane].hd_valid = 0;
-		if (lane == SESSION_REMOTE)
-		{
-			interface_close(session->iface);
-			session->iface = NULL;
-		}
-		if (session->state != SESSION_SHUTDOWN)
-			session_set_state(session, SESSION_SHUTDOWN);
+		session_lane_received(session, lane, res);
+		ring_buffer_produce_at(&session->lanes[lane].buffer, uop->offset, res);
+		event_base_gettimeofday_cached(evbase, &session->last_activity);
+	}
+	else if (res == 0)
+	{
+		session_log(session, LOG_LEVEL_DEBUG, "EOF encountered");
+		session_set_result(session, 
+				lane == SESSION_CLIENT ? "client-eof" : "remote-eof");
+		session_lane_fail(session, lane);
+	}
+	else if (res != -EAGAIN && res != -EINTR && res != -ECANCELED)
+	{
+		e = socket_handle_io_error(session->lanes[lane].hd, -res, "read");
+		session_set_result(session, e->type);
+		session_log(session, LOG_LEVEL_DEBUG, "Error %s", error_desc(e));
+		error_handle(e);
+		session_lane_fail(session, lane);
 	}
 
-	//If session is in shutdown state and all buffers are empty, then
-	//enter closed state.
-	if (session->state == SESSION_SHUTDOWN)
+	session_check_closed(session);
+	session_prepare(session);
+}
+
+static void session_uring_send_cb(int res, int more, void *data)
+{
+	SessionUringOp *uop = (SessionUringOp *) data;
+	Session *session = uop->session;
+	int lane = uop->lane;
+	const Error *e;
+
+	session_lane_close_finish(session, lane);
+	if (session->state == SESSION_CLOSED || ! session->lanes[lane].hd_valid)
+		return;
+
+	if (res > 0)
 	{
-		int cond = 0, i;
-		for(i = 0; i < 2; i++)
+		ring_buffer_consume(&session->lanes[1 - lane].buffer, res);
+		event_base_gettimeofday_cached(evbase, &session->last_activity);
+	}
+	else if (res < 0 && res != -EAGAIN && res != -EINTR && res != -ECANCELED)
+	{
+		e = socket_handle_io_error(session->lanes[lane].hd, -res, "write");
+		session_set_result(session, e->type);
+		session_log(session, LOG_LEVEL_DEBUG, "Error %s", error_desc(e));
+		error_handle(e);
+		session_lane_fail(session, lane);
+	}
+
+	session_check_closed(session);
+	session_prepare(session);
+}
+
+//Submits the operations the lane buffers allow. Receiving stops once the
+//session shuts down.
+static void session_uring_submit(Session *session, int throttled)
+{
+	int lane;
+	IoVec vecs[2];
+	const Error *e;
+
+	for (lane = 0; lane < 2; lane++)
+	{
+		SocketHandle hd = session->lanes[lane].hd;
+		RingBuffer *buffer = &session->lanes[lane].buffer;
+		RingBuffer *opposite = &session->lanes[1 - lane].buffer;
+		SessionUringOp *recv = &session->lanes[lane].recv;
+		SessionUringOp *send = &session->lanes[lane].send;
+
+		if (! session->lanes[lane].hd_valid)
+			continue;
+
+		if (session->state != SESSION_CONNECTED)
 		{
-			int opposite = 1 - i;
-			cond += session->lanes[i].hd_valid
-				? session->lanes[opposite].end - session->lanes[opposite].start
-				: 0;
+			uring_cancel(&recv->op);
+		}
+		else if (! recv->op.active && ! throttled 
+				&& ring_buffer_space_vecs(buffer, vecs))
+		{
+			recv->offset = (uint8_t *) vecs[0].data - buffer->data;
+			e = uring_read_fixed(hd, vecs[0].data, vecs[0].len, &recv->op);
+			if (e)
+			{
+				error_handle(e);
+				session_uring_retry(session);
+			}
+		}
+
+		if (! send->op.active && ring_buffer_data_vecs(opposite, vecs))
+		{
+			e = uring_write_fixed(hd, vecs[0].data, vecs[0].len, &send->op);
+			if (e)
+			{
+				error_handle(e);
+				session_uring_retry(session);
+			}
 		}
-		if (!cond)
-			session_set_state(session, SESSION_CLOSED);
 	}
+}
 
-	session_authenticator(session);
+//Whether operations that are not being cancelled are in flight
+static int session_uring_busy(Session *session)
+{
+	int lane, res = 0;
 
-	//Call prepare function
-	session_prepare(session);
+	if (! session->use_uring)
+		return 0;
+
+	for (lane = 0; lane < 2; lane++)
+	{
+		UringOp *recv = &session->lanes[lane].recv.op;
+		UringOp *send = &session->lanes[lane].send.op;
+
+		res += recv->active && ! recv->cancelled;
+		res += send->active && ! send->cancelled;
+	}
+
+	return res;
 }
 
 //Prepares events for socket handles as per buffer state
 static void session_prepare(Session *session)
 {
 	int lane;
+	int throttled = 0;
+	size_t n_buffered;
+
+	//Drained lanes give back their buffers
+	session_lane_release(session, SESSION_CLIENT);
+	session_lane_release(session, SESSION_REMOTE);
+
+	//Account for buffered data
+	n_buffered = session_lane_pending(session, SESSION_CLIENT)
+		+ session_lane_pending(session, SESSION_REMOTE);
+	if (n_buffered != session->n_buffered)
+	{
+		atomic_fetch_add_explicit(&session_buffered_bytes, 
+				n_buffered - session->n_buffered, memory_order_relaxed);
+		session->n_buffered = n_buffered;
+	}
+
+	//Stop reading while the interface is over its rate limit. Data 
+	//already received is still sent, and TCP flow control slows down
+	//the peers once the buffers fill up.
+	if (session->iface && session->state == SESSION_CONNECTED)
+	{
+		long delay = interface_shaper_delay(session->iface);
+		if (delay > 0)
+		{
+			throttled = 1;
+			if (! session->shaper_armed)
+			{
+				struct timeval tv = { delay / 1000000, delay % 1000000 };
+				evtimer_assign(session->shaper_event, evbase, 
+						session_shaper_cb, session);
+				evtimer_add(session->shaper_event, &tv);
+				session->shaper_armed = 1;
+			}
+		}
+	}
 	
 	for (lane = 0; lane < 2; lane++)
 	{
@@ -294,36 +1100,38 @@ static void session_prepare(Session *session)
 		short events = 0;
 		
 		//Create needed flags
-		if (session->state != SESSION_CLOSED && session->lanes[lane].hd_valid)
+		if (session->state != SESSION_CLOSED && session->lanes[lane].hd_valid
+				&& ! session->use_uring)
 		{
-			if (session->state != SESSION_SHUTDOWN)
-				if ((BUFFER_SIZE - session->lanes[lane].end) > 0)
+			if (session->state != SESSION_SHUTDOWN && ! throttled)
+				if (session_lane_can_read(session, lane))
 					events |= EV_READ;
 			
-			if ((session->lanes[opposite].end
-						- session->lanes[opposite].start) > 0)
+			if (session_lane_pending(session, opposite) > 0)
 				events |= EV_WRITE;
 		}
 
-		struct event *evt = session->lanes[lane].evt;
-
-		//Delete event if not needed or change is needed
-		if (evt && (!events || events != event_get_events(evt)))
+		//Re-arm the event only if the interest set changed
+		if (events != session->lanes[lane].events)
 		{
-			event_del(evt);
-			event_free(evt);
-			evt = NULL;
-		}
+			struct event *evt = session->lanes[lane].evt;
 
-		//Create a new event if needed
-		if (events && !evt)
-		{
-			evt = socket_handle_create_event(session->lanes[lane].hd,
-					events | EV_PERSIST, session_check, session);
-			event_add(evt, NULL);
-		}
+			if (session->lanes[lane].events)
+			{
+				event_del(evt);
+				session->n_event_mods++;
+			}
+
+			if (events)
+			{
+				socket_handle_assign_event(session->lanes[lane].hd, evt,
+						events | EV_PERSIST, session_check, session);
+				event_add(evt, NULL);
+				session->n_event_mods++;
+			}
 
-		session->lanes[lane].evt = evt;
+			session->lanes[lane].events = events;
+		}
 	}
 
 	//Cancel the connector when we are closing down the session
@@ -335,20 +1143,50 @@ static void session_prepare(Session *session)
 			connector_destroy(session->connector);
 			session->connector = NULL;
 		}
+		if (session->udp)
+		{
+			udp_association_destroy(session->udp);
+			session->udp = NULL;
+		}
+		if (session->shaper_armed)
+		{
+			event_del(session->shaper_event);
+			session->shaper_armed = 0;
+		}
+		if (session->state == SESSION_CLOSED && session->timeout_kind)
+		{
+			event_del(session->timeout_event);
+			session->timeout_kind = SESSION_TIMEOUT_NONE;
+		}
 	}
 
+	//Retries are armed on the shaper event, so this comes after it is
+	//cancelled
+	if (session->use_uring)
+		session_uring_submit(session, throttled);
+
 	//Assertion
-	abort_if_fail(session->lanes[SESSION_CLIENT].evt
-			|| session->lanes[SESSION_REMOTE].evt
+	abort_if_fail(session->lanes[SESSION_CLIENT].events
+			|| session->lanes[SESSION_REMOTE].events
+			|| session_uring_busy(session)
 			|| session->connector
+			|| session->shaper_armed
+			|| session->timeout_kind
 			? session->state != SESSION_CLOSED
 			: session->state == SESSION_CLOSED,
 			"Assertion failure (session %d entered dead state)",
 			session->sid);
 
+	abort_if_fail(session->state == SESSION_ASSOCIATED
+			? session->udp && session->lanes[SESSION_CLIENT].events : 1,
+			"Assertion failure (session %d lost its association)",
+			session->sid);
+
 	abort_if_fail(session->state == SESSION_CONNECTED 
-			? session->lanes[SESSION_CLIENT].evt
-				|| session->lanes[SESSION_REMOTE].evt
+			? session->lanes[SESSION_CLIENT].events
+				|| session->lanes[SESSION_REMOTE].events
+				|| session_uring_busy(session)
+				|| session->shaper_armed
 			: 1,
 			"Assertion failure (session %d entered semidead state)",
 			session->sid);
@@ -357,6 +1195,7 @@ static void session_prepare(Session *session)
 	if (session->state != session->prev_state)
 	{
 		session->prev_state = session->state;
+		session_update_timeout(session);
 		
 		if (session->cb)
 			(* session->cb)(session, session->state, session->cb_data);
@@ -367,9 +1206,8 @@ static void session_prepare(Session *session)
 //Protocol handling code here
 static void session_write_socks_error_base(Session *session, int socks_errcode)
 {
-	uint8_t *buffer;
+	uint8_t buffer[10];
 	
-	buffer = session_write_alloc(session, 10);
 	buffer[0] = 5;
 	buffer[1] = socks_errcode;
 	buffer[2] = 0;
@@ -380,13 +1218,15 @@ static void session_write_socks_error_base(Session *session, int socks_errcode)
 	buffer[7] = 0;
 	buffer[8] = 0;
 	buffer[9] = 0;
+	session_write(session, buffer, 10);
 }
 
 //This function calls user callback, so beware of reentrancy issues.
 static void session_write_socks_error(Session *session, int socks_errcode)
 {
 	session_write_socks_error_base(session, socks_errcode);
-	session_log(session, 
+	session_set_result(session, socks_reply_to_str(socks_errcode));
+	session_log(session, LOG_LEVEL_DEBUG,
 		"SOCKS error code %s sent", socks_reply_to_str(socks_errcode));
 	session_set_state(session, SESSION_SHUTDOWN);
 }
@@ -396,18 +1236,78 @@ static void session_write_connect_error(Session *session, const Error *e)
 {
 	int socks_errcode = socks_reply_from_error(e);
 	session_write_socks_error_base(session, socks_errcode);
-	session_log(session, 
+	session_set_result(session, socks_reply_to_str(socks_errcode));
+	session_log(session, LOG_LEVEL_DEBUG,
 		"SOCKS error code %s sent because of error: %s",
 		socks_reply_to_str(socks_errcode),
 		error_desc(e));
 	session_set_state(session, SESSION_SHUTDOWN);
 }
 
+//Sends data the client pipelined while connecting without waiting for
+//the event loop to report the remote socket writable
+static void session_flush_early_data(Session *session)
+{
+	RingBuffer *buffer = &session->lanes[SESSION_CLIENT].buffer;
+	IoVec vecs[2];
+	int n_vecs;
+	size_t io_res;
+	const Error *e;
+
+	if (! ring_buffer_len(buffer))
+		return;
+
+	n_vecs = ring_buffer_data_vecs(buffer, vecs);
+	e = socket_handle_writev(session->lanes[SESSION_REMOTE].hd, 
+			vecs, n_vecs, &io_res);
+	if (e)
+	{
+		//Errors are handled when the socket is reported writable
+		error_handle(e);
+		return;
+	}
+
+	session_log(session, LOG_LEVEL_DEBUG, 
+			"Sent %lu bytes of early data", (unsigned long) io_res);
+	ring_buffer_consume(buffer, io_res);
+}
+
+//Success reply carrying the bound address
+static void session_write_bound_reply(Session *session, SocketAddress addr)
+{
+	uint8_t buffer[22];
+	int reply_size;
+
+	if (addr.host.type == NETWORK_INET)
+	{
+		reply_size = 10;
+	}
+	else
+	{
+		reply_size = 22;
+	}
+
+	buffer[0] = 5;
+	buffer[1] = 0;
+	buffer[2] = 0;
+	if (addr.host.type == NETWORK_INET)
+	{
+		buffer[3] = 1;
+		memcpy(buffer + 4, addr.host.ip, 4);
+		memcpy(buffer + 8, &(addr.port), 2);
+	}
+	else
+	{
+		buffer[3] = 4;
+		memcpy(buffer + 4, addr.host.ip, 16);
+		memcpy(buffer + 20, &(addr.port), 2);
+	}
+	session_write(session, buffer, reply_size);
+}
+
 void session_connect_cb(ConnectRes res, void *data)
 {
 	Session *session = (Session *) data;
-	uint8_t *buffer;
-	int reply_size;
 	SocketAddress addr;
 	char addr_tostring[ADDRESS_MAX_LEN];
 	const Error *e;
@@ -435,42 +1335,23 @@ void session_connect_cb(ConnectRes res, void *data)
 		
 		//Log message
 		socket_address_to_str(addr, addr_tostring);
-		session_log(session,
+		session_log(session, LOG_LEVEL_DEBUG,
 				"Connection established, bound address: %s", addr_tostring);
 		
 		//Add reply
-		if (addr.host.type == NETWORK_INET)
-		{
-			reply_size = 10;
-		}
-		else
-		{
-			reply_size = 22;
-		}
-		
-		buffer = session_write_alloc(session, reply_size);
-		buffer[0] = 5;
-		buffer[1] = 0;
-		buffer[2] = 0;
-		if (addr.host.type == NETWORK_INET)
-		{
-			buffer[3] = 1;
-			memcpy(buffer + 4, addr.host.ip, 4);
-			memcpy(buffer + 8, &(addr.port), 2);
-		}
-		else
-		{
-			buffer[3] = 4;
-			memcpy(buffer + 4, addr.host.ip, 16);
-			memcpy(buffer + 20, &(addr.port), 2);
-		}
+		session_write_bound_reply(session, addr);
 		
 		//Setup session
 		socket_handle_set_blocking(res.hd, 0);
 		session->lanes[SESSION_REMOTE].hd = res.hd;
 		session->lanes[SESSION_REMOTE].hd_valid = 1;
 		session->iface = res.iface;
+		session->iface_addr = interface_get_addr(res.iface);
+		session->iface_addr_valid = 1;
 		session_set_state(session, SESSION_CONNECTED);
+		session_flush_early_data(session);
+		session_enable_uring(session);
+		session_enable_splice(session);
 		
 		//Assertions
 		if (! session->iface)
@@ -481,6 +1362,76 @@ void session_connect_cb(ConnectRes res, void *data)
 
 //TODO: Separate SOCKS protocol details from semantics
 
+//Data the client sent after its request can go out with the SYN
+static ConnectorFlags session_connect_flags(Session *session)
+{
+	if (session_lane_pending(session, SESSION_CLIENT) > 0)
+		return CONNECTOR_FASTOPEN;
+	return 0;
+}
+
+//Handles UDP ASSOCIATE. The client address in the request is only used
+//for its port, datagrams are accepted from the host the connection 
+//comes from.
+static void session_udp_associate(Session *session)
+{
+	SocketHandle hd = session->lanes[SESSION_CLIENT].hd;
+	SocketAddress local_addr, client_addr, bound;
+	char addr_tostring[ADDRESS_MAX_LEN];
+	uint8_t *buffer;
+	uint16_t port;
+	int len;
+	const Error *e;
+
+	buffer = session_peek(session, 5);
+	if (! buffer)
+		return;
+	if (buffer[3] == 1)
+		len = 4 + 4 + 2;
+	else if (buffer[3] == 4)
+		len = 4 + 16 + 2;
+	else if (buffer[3] == 3)
+		len = 4 + 1 + buffer[4] + 2;
+	else
+	{
+		session_write_socks_error(session, SOCKS_REPLY_ATYPE);
+		return;
+	}
+
+	buffer = session_read(session, len);
+	if (! buffer)
+		return;
+	memcpy(&port, buffer + len - 2, 2);
+
+	e = socket_handle_getsockname(hd, &local_addr);
+	if (! e)
+		e = socket_handle_getpeername(hd, &client_addr);
+	if (! e)
+	{
+		client_addr.port = port;
+		e = udp_association_create(local_addr.host, client_addr, 
+				&session->udp);
+	}
+	if (e)
+	{
+		session_write_connect_error(session, e);
+		error_handle(e);
+		return;
+	}
+
+	bound = udp_association_get_addr(session->udp);
+	socket_address_to_str(bound, addr_tostring);
+	session_log(session, LOG_LEVEL_DEBUG,
+			"UDP association established, relaying datagrams at %s", 
+			addr_tostring);
+	strcpy(session->dest, "udp-associate");
+
+	session_write_bound_reply(session, bound);
+	ring_buffer_consume(&session->lanes[SESSION_CLIENT].buffer,
+			ring_buffer_len(&session->lanes[SESSION_CLIENT].buffer));
+	session_set_state(session, SESSION_ASSOCIATED);
+}
+
 //Manages all authentication
 void session_authenticator(Session *session)
 {
@@ -499,8 +1450,9 @@ void session_authenticator(Session *session)
 		
 		if (buffer[0] != 5)
 		{
-			session_log(session, 
+			session_log(session, LOG_LEVEL_DEBUG,
 				"Unsupported SOCKS version %d", (int) buffer[0]);
+			session_set_result(session, "Unsupported SOCKS version");
 			session_set_state(session, SESSION_SHUTDOWN);
 			return;
 		}
@@ -520,19 +1472,21 @@ void session_authenticator(Session *session)
 		}
 		
 		//Write reply
-		buffer = session_write_alloc(session, 2);
-		buffer[0] = 5;
-		buffer[1] = selected;
+		{
+			uint8_t reply[2] = { 5, selected };
+			session_write(session, reply, 2);
+		}
 	
 		if (selected == 0xff)
 		{
+			session_set_result(session, "No acceptable method");
 			session_set_state(session, SESSION_SHUTDOWN);
 			return;
 		}
 		
 		session_read(session, 2 + n_methods);
 		session_set_state(session, SESSION_REQUEST);
-		session_log(session, "Authenticated");
+		session_log(session, LOG_LEVEL_DEBUG, "Authenticated");
 	}
 	
 	//Session request
@@ -547,7 +1501,8 @@ void session_authenticator(Session *session)
 		//Verify protocol version and command
 		if (buffer[0] != 5 || buffer[2] != 0)
 			socks_errcode = SOCKS_REPLY_GEN;
-		else if (buffer[1] != SOCKS_CMD_CONNECT)
+		else if (buffer[1] != SOCKS_CMD_CONNECT
+				&& buffer[1] != SOCKS_CMD_UDP_ASSOCIATE)
 			socks_errcode = SOCKS_REPLY_CMD;
 		
 		if (socks_errcode)
@@ -555,6 +1510,12 @@ void session_authenticator(Session *session)
 			session_write_socks_error(session, socks_errcode);
 			return;
 		}
+
+		if (buffer[1] == SOCKS_CMD_UDP_ASSOCIATE)
+		{
+			session_udp_associate(session);
+			return;
+		}
 		
 		//Read request
 		if (buffer[3] == 3)
@@ -581,20 +1542,21 @@ void session_authenticator(Session *session)
 			//Copy out port
 			port = *((uint16_t *) (buffer + 5 + domain_len));
 			
-			session_log(session, 
-				"Received request to connect to domain name \"%s:%d\"", 
-				domain, ntohs(port));
+			snprintf(session->dest, SESSION_DEST_MAX_LEN, "%s:%d",
+					domain, ntohs(port));
+			session_log(session, LOG_LEVEL_DEBUG,
+				"Received request to connect to domain name \"%s\"", 
+				session->dest);
 			
 			//Connect
-			session->connector = connector_connect_dns
-				(domain, port, session_connect_cb, session);
+			session->connector = connector_connect_dns(domain, port, 
+					session_connect_flags(session), session_connect_cb, session);
 				
 		}
 		else if (buffer[3] == 1)
 		{
 			//IPv4 address
 			SocketAddress addr;
-			char addr_tostring[ADDRESS_MAX_LEN];
 
 			buffer = session_read(session, 4 + 4 + 2);
 			if (! buffer)
@@ -604,20 +1566,19 @@ void session_authenticator(Session *session)
 			memcpy(addr.host.ip, buffer + 4, 4);
 			memcpy(&(addr.port), buffer + 8, 2);
 
-			socket_address_to_str(addr, addr_tostring);
-			session_log(session,
+			socket_address_to_str(addr, session->dest);
+			session_log(session, LOG_LEVEL_DEBUG,
 					"Received request to connect to ipv4 address %s",
-					addr_tostring);
+					session->dest);
 			
 			//Connect
-			session->connector = connector_connect
-				(addr, session_connect_cb, session);
+			session->connector = connector_connect(addr, 
+					session_connect_flags(session), session_connect_cb, session);
 		}
 		else if (buffer[3] == 4)
 		{
 			//IPv6 address
 			SocketAddress addr;
-			char addr_tostring[ADDRESS_MAX_LEN];
 			
 			buffer = session_read(session, 4 + 16 + 2);
 			if (! buffer)
@@ -627,14 +1588,14 @@ void session_authenticator(Session *session)
 			memcpy(addr.host.ip, buffer + 4, 16);
 			memcpy(&(addr.port), buffer + 20, 2);
 			
-			socket_address_to_str(addr, addr_tostring);
-			session_log(session,
+			socket_address_to_str(addr, session->dest);
+			session_log(session, LOG_LEVEL_DEBUG,
 					"Received request to connect to ipv6 address %s",
-					addr_tostring);
+					session->dest);
 			
 			//Connect
-			session->connector = connector_connect
-				(addr, session_connect_cb, session);
+			session->connector = connector_connect(addr, 
+					session_connect_flags(session), session_connect_cb, session);
 		}
 		else
 		{
@@ -648,42 +1609,85 @@ void session_authenticator(Session *session)
 	
 }
 
-static unsigned int session_counter = 0;
+static atomic_uint session_counter = 0;
 
 //Create a session
 Session *session_create(SocketHandle hd)
 {
 	Session *session;
 	int i;
+	size_t event_size = event_get_struct_event_size();
+	char *mem;
 	
-	session = (Session *) fs_malloc(sizeof(Session));
+	//Events are allocated right after the session structure
+	session = (Session *) pool_alloc(session_pool, sizeof(Session) 
+			+ 4 * event_size);
+	mem = (char *) (session + 1);
 	
 	//Initialize lanes
 	for (i = 0; i < 2; i++)
 	{
 		session->lanes[i].hd_valid = 0;
-		session->lanes[i].start = session->lanes[i].end = 0;
-		session->lanes[i].evt = NULL;
+		session->lanes[i].pipe_valid = 0;
+		session->lanes[i].pipe_full = 0;
+		session->lanes[i].evt = (struct event *) (mem + i * event_size);
+		ring_buffer_init(&session->lanes[i].buffer, NULL, 0);
+		session->lanes[i].buffer_class = 0;
+		session->lanes[i].buffer_peak = 0;
+		session->lanes[i].events = 0;
+		session->lanes[i].n_bytes = 0;
+		session->lanes[i].recv.op.cb = session_uring_recv_cb;
+		session->lanes[i].recv.op.data = &session->lanes[i].recv;
+		session->lanes[i].recv.op.active = 0;
+		session->lanes[i].recv.session = session;
+		session->lanes[i].recv.lane = i;
+		session->lanes[i].send.op.cb = session_uring_send_cb;
+		session->lanes[i].send.op.data = &session->lanes[i].send;
+		session->lanes[i].send.op.active = 0;
+		session->lanes[i].send.session = session;
+		session->lanes[i].send.lane = i;
+		session->lanes[i].hd_open = 0;
 	}
+	session->use_uring = 0;
 	
 	session->lanes[SESSION_CLIENT].hd = hd;
 	session->lanes[SESSION_CLIENT].hd_valid = 1;
 
 	
 	//Initialize others
-	session->sid = session_counter++;
+	session->sid = atomic_fetch_add(&session_counter, 1);
 	session->iface = NULL;
 	session->connector = NULL;
+	session->udp = NULL;
 	session->cb = NULL;
 	session->cb_data = NULL;
+	session->n_event_mods = 0;
+	session->n_buffered = 0;
+	session->shaper_event = (struct event *) (mem + 2 * event_size);
+	session->shaper_armed = 0;
+	session->timeout_event = (struct event *) (mem + 3 * event_size);
+	evtimer_assign(session->timeout_event, evbase, 
+			session_timeout_cb, session);
+	session->timeout_kind = SESSION_TIMEOUT_NONE;
 	session->prev_state = SESSION_CLOSED;
 	session->state = SESSION_CLOSED;
-	
-	//Make fd nonbocking
-	socket_handle_set_blocking(hd, 0);
+	session->result = NULL;
+	session->iface_addr_valid = 0;
+	strcpy(session->dest, "-");
+	event_base_gettimeofday_cached(evbase, &session->start_time);
+	evutil_gettimeofday(&session->state_time, NULL);
+	session->client_addr_valid = 0;
+	if (log_enabled(LOG_LEVEL_INFO))
+	{
+		const Error *e = socket_handle_getpeername(hd, &session->client_addr);
+		if (e)
+			error_handle(e);
+		else
+			session->client_addr_valid = 1;
+	}
 	
 	//Log message
-	session_log(session, "Created");
+	session_log(session, LOG_LEVEL_DEBUG, "Created");
 
 	//Start session
 	session_set_state(session, SESSION_AUTH);	
@@ -692,12 +1696,23 @@ Session *session_create(SocketHandle hd)
 	return session;
 }
 
+void session_read_now(Session *session)
+{
+	session_check(session->lanes[SESSION_CLIENT].hd.fd, EV_READ, session);
+}
+
 //Gets current state
 SessionState session_get_state(Session *session)
 {
 	return session->state;
 }
 
+//Number of times lane events were added or removed
+unsigned long session_get_event_mod_count(Session *session)
+{
+	return session->n_event_mods;
+}
+
 //Shuts down session by trying to send all unsent data
 void session_shutdown(Session *session)
 {
@@ -705,7 +1720,8 @@ void session_shutdown(Session *session)
 			&& session->state != SESSION_CLOSED,
 			"Session already shutting down");
 	
-	session_log(session, "Closed");
+	session_log(session, LOG_LEVEL_DEBUG, "Closed");
+	session_set_result(session, "Closed by server");
 
 	if (session->connector)
 		connector_destroy(session->connector);
@@ -717,20 +1733,52 @@ void session_destroy(Session *session)
 {
 	int i;
 
+	session_log(session, LOG_LEVEL_DEBUG, 
+			"Destroyed (%lu event modifications)", session->n_event_mods);
+	session_log_summary(session);
+
+	session_release_iface(session);
 	for (i = 0; i < 2; i++)
 	{
 		if (session->lanes[i].hd_valid)
-			socket_handle_close(session->lanes[i].hd);
-		if (session->lanes[i].evt)
-			event_free(session->lanes[i].evt);
+			session_lane_close(session, i);
+	}
+
+	//Operations in flight use the lane buffers, other sessions may be 
+	//handled while waiting
+	if (session->use_uring)
+	{
+		for (i = 0; i < 2; i++)
+		{
+			uring_op_wait(&session->lanes[i].recv.op);
+			uring_op_wait(&session->lanes[i].send.op);
+			session_lane_close_finish(session, i);
+		}
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		if (session->lanes[i].events)
+			event_del(session->lanes[i].evt);
+		if (session->lanes[i].pipe_valid)
+			relay_pipe_close(&session->lanes[i].pipe);
+		session_lane_free(session, i);
 	}
 
-	if (session->iface)
-		interface_close(session->iface);
 	if (session->connector)
 		connector_destroy(session->connector);
+	if (session->udp)
+		udp_association_destroy(session->udp);
+
+	if (session->shaper_armed)
+		event_del(session->shaper_event);
+	if (session->timeout_kind)
+		event_del(session->timeout_event);
+
+	atomic_fetch_sub_explicit(&session_buffered_bytes, session->n_buffered,
+			memory_order_relaxed);
 
-	free(session);
+	pool_free(session_pool, session);
 }
 
 void session_set_callback
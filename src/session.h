@@ -26,14 +26,57 @@ typedef enum
 	SESSION_REQUEST, //< waiting for client to send destination address
 	SESSION_CONNECTING, //< waiting for connection to remote host to establish
 	SESSION_CONNECTED, //< as it says, connection established
+	SESSION_ASSOCIATED, //< relaying datagrams for the client (UDP ASSOCIATE)
 	SESSION_SHUTDOWN, //< Only transmitting unsent data
 	SESSION_CLOSED //< dead state
 } SessionState;
 
+//How data is relayed once the session is connected
+typedef enum
+{
+	SESSION_RELAY_COPY, //< Through user space buffers
+	SESSION_RELAY_SPLICE, //< Through kernel pipes, where supported
+	SESSION_RELAY_URING //< Through io_uring with registered buffers, 
+	                    //< where supported
+} SessionRelayMode;
+
+void session_set_relay_mode(SessionRelayMode mode);
+
+//Largest capacity of each direction's buffer, smaller buffers are used
+//for connections that do not fill them
+#define SESSION_DEFAULT_BUFFER_SIZE (16 * 1024)
+#define SESSION_MIN_BUFFER_SIZE (512)
+
+void session_set_buffer_size(size_t size);
+
+//Clients must finish the SOCKS handshake within the handshake timeout,
+//and established connections are closed after being idle for the idle
+//timeout. 0 disables a timeout.
+#define SESSION_DEFAULT_HANDSHAKE_TIMEOUT (30000) //< Milliseconds
+#define SESSION_DEFAULT_IDLE_TIMEOUT (0) //< Seconds
+
+void session_set_timeouts(long handshake_ms, long idle_sec);
+
+void session_thread_shutdown();
+
+//Bytes received by all sessions of all threads and not yet sent
+size_t session_get_buffered_bytes();
+
+//Longest destination string (domain name and port)
+#define SESSION_DEST_MAX_LEN (264)
+
+//Takes over a non-blocking connected socket
 Session *session_create(SocketHandle hd);
 
+//Handles data that may already have arrived on the client connection,
+//without waiting for the event loop. Meant for listeners with deferred 
+//accept. Session callbacks may be called.
+void session_read_now(Session *session);
+
 SessionState session_get_state(Session *session);
 
+unsigned long session_get_event_mod_count(Session *session);
+
 void session_shutdown(Session *session);
 
 void session_destroy(Session *session);
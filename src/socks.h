@@ -29,8 +29,8 @@ typedef enum
 
 typedef enum
 {
-	SOCKS_CMD_CONNECT = 1, //< Only one that works
-	SOCKS_CMD_BIND = 2,
+	SOCKS_CMD_CONNECT = 1,
+	SOCKS_CMD_BIND = 2, //< Not supported
 	SOCKS_CMD_UDP_ASSOCIATE = 3
 } SocksRequestCommand;
 
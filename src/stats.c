@@ -0,0 +1,541 @@
+/* stats.c
+ * Counters for monitoring, and an HTTP endpoint serving them
+ *
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ *
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "incl.h"
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+
+THREAD_LOCAL StatsShard *stats_shard = NULL;
+
+//Shards of all running threads, and counters of threads that exited
+static StatsShard *shards = NULL;
+static StatsShard retired[1];
+static Mutex shards_mutex = MUTEX_INITIALIZER;
+
+static const Mutex shard_lock_init = MUTEX_INITIALIZER;
+
+static void stats_shard_init(StatsShard *shard)
+{
+	memset(shard, 0, sizeof(StatsShard));
+	shard->lock = shard_lock_init;
+}
+
+StatsShard *stats_shard_create()
+{
+	StatsShard *shard = (StatsShard *) fs_malloc(sizeof(StatsShard));
+
+	stats_shard_init(shard);
+
+	mutex_lock(&shards_mutex);
+	shard->next = shards;
+	shards = shard;
+	mutex_unlock(&shards_mutex);
+
+	return shard;
+}
+
+StatsInterface *stats_shard_grow(StatsShard *shard, int id)
+{
+	int len = shard->n_ifaces ? shard->n_ifaces : 8;
+
+	while (len <= id)
+		len *= 2;
+
+	mutex_lock(&shard->lock);
+	shard->ifaces = (StatsInterface *) fs_realloc(shard->ifaces, 
+			sizeof(StatsInterface) * len);
+	memset(shard->ifaces + shard->n_ifaces, 0, 
+			sizeof(StatsInterface) * (len - shard->n_ifaces));
+	shard->n_ifaces = len;
+	mutex_unlock(&shard->lock);
+
+	return shard->ifaces + id;
+}
+
+//Histograms
+uint64_t stats_hist_bucket_start(int bucket)
+{
+	int shift;
+
+	if (bucket < STATS_HIST_SUB)
+		return bucket;
+	shift = bucket / STATS_HIST_SUB - 1;
+	return ((uint64_t) STATS_HIST_SUB + bucket % STATS_HIST_SUB) << shift;
+}
+
+double stats_hist_quantile(const StatsHistogram *hist, double q)
+{
+	double target = q * counter_get(hist->count);
+	double seen = 0;
+	int i;
+
+	if (! counter_get(hist->count))
+		return 0;
+
+	//Values are assumed to be spread evenly within the bucket
+	for (i = 0; i < STATS_HIST_N_BUCKETS; i++)
+	{
+		unsigned long n = counter_get(hist->buckets[i]);
+		if (n && seen + n >= target)
+		{
+			double start = stats_hist_bucket_start(i);
+			double width = i + 1 < STATS_HIST_N_BUCKETS ?
+				stats_hist_bucket_start(i + 1) - start : 0;
+			return start + width * (target - seen) / n;
+		}
+		seen += n;
+	}
+
+	return stats_hist_bucket_start(STATS_HIST_N_BUCKETS - 1);
+}
+
+static void stats_hist_merge(StatsHistogram *dest, const StatsHistogram *src)
+{
+	int i;
+
+	if (! counter_get(src->count))
+		return;
+	for (i = 0; i < STATS_HIST_N_BUCKETS; i++)
+		counter_add(dest->buckets[i], counter_get(src->buckets[i]));
+	counter_add(dest->count, counter_get(src->count));
+	counter_add(dest->sum, counter_get(src->sum));
+}
+
+//Adds counters of src to dest, which must not be shared
+static void stats_shard_add(StatsShard *dest, StatsShard *src)
+{
+	int i;
+
+	counter_add(dest->n_accepts, counter_get(src->n_accepts));
+	for (i = 0; i < STATS_N_SESSION_STATES; i++)
+	{
+		counter_add(dest->n_sessions[i], counter_get(src->n_sessions[i]));
+		stats_hist_merge(dest->state_time + i, src->state_time + i);
+	}
+	stats_hist_merge(&dest->dns_time, &src->dns_time);
+
+	if (src->n_ifaces > dest->n_ifaces)
+		stats_shard_grow(dest, src->n_ifaces - 1);
+	for (i = 0; i < src->n_ifaces; i++)
+	{
+		StatsInterface *d = dest->ifaces + i, *s = src->ifaces + i;
+
+		counter_add(d->bytes_in, counter_get(s->bytes_in));
+		counter_add(d->bytes_out, counter_get(s->bytes_out));
+		counter_add(d->n_connect_ok, counter_get(s->n_connect_ok));
+		counter_add(d->n_connect_fail, counter_get(s->n_connect_fail));
+		stats_hist_merge(&d->connect_time, &s->connect_time);
+	}
+}
+
+//Sums up all shards into sum, free sum->ifaces afterwards
+static void stats_collect(StatsShard *sum)
+{
+	StatsShard *iter;
+
+	stats_shard_init(sum);
+
+	mutex_lock(&shards_mutex);
+	stats_shard_add(sum, retired);
+	for (iter = shards; iter; iter = iter->next)
+	{
+		mutex_lock(&iter->lock);
+		stats_shard_add(sum, iter);
+		mutex_unlock(&iter->lock);
+	}
+	mutex_unlock(&shards_mutex);
+}
+
+void stats_thread_shutdown()
+{
+	StatsShard **iter;
+
+	if (! stats_shard)
+		return;
+
+	mutex_lock(&shards_mutex);
+	for (iter = &shards; *iter; iter = &((*iter)->next))
+	{
+		if (*iter == stats_shard)
+		{
+			*iter = stats_shard->next;
+			break;
+		}
+	}
+	stats_shard_add(retired, stats_shard);
+	mutex_unlock(&shards_mutex);
+
+	free(stats_shard->ifaces);
+	free(stats_shard);
+	stats_shard = NULL;
+}
+
+//Accept rate, measured by the thread serving statistics
+static unsigned long last_accepts = 0;
+static double accept_rate = 0;
+
+static struct evhttp *stats_http = NULL;
+static struct event *stats_tick_event = NULL;
+
+static void stats_tick_cb(evutil_socket_t fd, short events, void *data)
+{
+	StatsShard sum;
+
+	stats_collect(&sum);
+	accept_rate = counter_get(sum.n_accepts) - last_accepts;
+	last_accepts = counter_get(sum.n_accepts);
+	free(sum.ifaces);
+}
+
+//Output
+static const char *session_state_names[STATS_N_SESSION_STATES] =
+{
+	"auth", "request", "connecting", "connected", "associated",
+	"shutdown"
+};
+
+static void stats_format_hist_text(struct evbuffer *out, const char *name,
+		const StatsHistogram *hist)
+{
+	unsigned long count = counter_get(hist->count);
+
+	if (! count)
+		return;
+
+	evbuffer_add_printf(out, "latency %s: count=%lu mean_ms=%.3f "
+			"p50_ms=%.3f p90_ms=%.3f p99_ms=%.3f\n", name, count,
+			counter_get(hist->sum) / 1000.0 / count,
+			stats_hist_quantile(hist, 0.5) / 1000.0,
+			stats_hist_quantile(hist, 0.9) / 1000.0,
+			stats_hist_quantile(hist, 0.99) / 1000.0);
+}
+
+static void stats_format_text(struct evbuffer *out, StatsShard *sum,
+		DnsCacheStats *dns, Interface **ifaces, size_t n_ifaces)
+{
+	StatsHistogram *connect_time;
+	size_t i;
+	int j;
+
+	evbuffer_add_printf(out, "sessions:");
+	for (j = 0; j < STATS_N_SESSION_STATES; j++)
+		evbuffer_add_printf(out, " %s=%lu", session_state_names[j],
+				counter_get(sum->n_sessions[j]));
+	evbuffer_add_printf(out, "\n");
+
+	evbuffer_add_printf(out, "accepts: total=%lu rate=%.0f/s\n",
+			counter_get(sum->n_accepts), accept_rate);
+
+	evbuffer_add_printf(out, "dns: hits=%lu negative_hits=%lu misses=%lu "
+			"coalesced=%lu\n", dns->n_hits, dns->n_negative_hits, 
+			dns->n_misses, dns->n_coalesced);
+
+	for (i = 0; i < n_ifaces; i++)
+	{
+		InterfaceInfo info;
+		StatsInterface *stats;
+		char addr[ADDRESS_MAX_LEN];
+
+		interface_get_info(ifaces[i], &info);
+		stats = sum->ifaces + interface_get_id(ifaces[i]);
+		host_address_to_str(info.addr, addr);
+
+		evbuffer_add_printf(out, "interface %s: metric=%d connections=%d "
+				"bytes_in=%lu bytes_out=%lu connects_ok=%lu connects_failed=%lu "
+				"rtt_ms=%.1f%s\n",
+				addr, info.metric, info.use_count,
+				counter_get(stats->bytes_in), counter_get(stats->bytes_out),
+				counter_get(stats->n_connect_ok), 
+				counter_get(stats->n_connect_fail),
+				info.srtt / 1000.0, info.ejected ? " ejected" : "");
+	}
+
+	//Time spent in each phase, connecting also per interface
+	for (j = 0; j < STATS_N_SESSION_STATES; j++)
+		stats_format_hist_text(out, session_state_names[j], 
+				sum->state_time + j);
+	stats_format_hist_text(out, "dns", &sum->dns_time);
+	connect_time = (StatsHistogram *) fs_malloc(sizeof(StatsHistogram));
+	memset(connect_time, 0, sizeof(StatsHistogram));
+	for (i = 0; i < n_ifaces; i++)
+		stats_hist_merge(connect_time, 
+				&sum->ifaces[interface_get_id(ifaces[i])].connect_time);
+	stats_format_hist_text(out, "connect", connect_time);
+	free(connect_time);
+	for (i = 0; i < n_ifaces; i++)
+	{
+		InterfaceInfo info;
+		char name[ADDRESS_MAX_LEN + 16];
+
+		interface_get_info(ifaces[i], &info);
+		strcpy(name, "connect ");
+		host_address_to_str(info.addr, name + strlen(name));
+		stats_format_hist_text(out, name, 
+				&sum->ifaces[interface_get_id(ifaces[i])].connect_time);
+	}
+}
+
+//Buckets are reported at powers of two from STATS_HIST_SUB microseconds
+static void stats_format_hist_prometheus(struct evbuffer *out, 
+		const char *name, const char *labels, const StatsHistogram *hist)
+{
+	unsigned long seen = 0;
+	uint64_t end;
+	int i;
+
+	for (i = 0; i < STATS_HIST_N_BUCKETS - 1; i++)
+	{
+		seen += counter_get(hist->buckets[i]);
+		end = stats_hist_bucket_start(i + 1);
+		if (end >= STATS_HIST_SUB && ! (end & (end - 1)))
+			evbuffer_add_printf(out, "%s_bucket{%s,le=\"%g\"} %lu\n",
+					name, labels, end / 1000000.0, seen);
+	}
+	evbuffer_add_printf(out, "%s_bucket{%s,le=\"+Inf\"} %lu\n"
+			"%s_sum{%s} %g\n%s_count{%s} %lu\n",
+			name, labels, counter_get(hist->count),
+			name, labels, counter_get(hist->sum) / 1000000.0,
+			name, labels, counter_get(hist->count));
+}
+
+static void stats_format_prometheus(struct evbuffer *out, StatsShard *sum,
+		DnsCacheStats *dns, Interface **ifaces, size_t n_ifaces)
+{
+	size_t i;
+	int j;
+	struct
+	{
+		const char *name, *type, *help;
+	} families[] = {
+		{ "dispatch_interface_connections", "gauge", 
+			"Connections using the interface" },
+		{ "dispatch_interface_bytes_total", "counter", 
+			"Bytes relayed through the interface" },
+		{ "dispatch_interface_connects_total", "counter", 
+			"Connection attempts through the interface" },
+		{ "dispatch_interface_rtt_seconds", "gauge", 
+			"Smoothed round trip time through the interface" },
+		{ "dispatch_interface_ejected", "gauge", 
+			"Whether the interface is taken out of use" },
+		{ "dispatch_interface_connect_seconds", "histogram", 
+			"Time taken by successful connection attempts" },
+		{ NULL, NULL, NULL }
+	};
+
+	evbuffer_add_printf(out, "# HELP dispatch_sessions Sessions by state\n"
+			"# TYPE dispatch_sessions gauge\n");
+	for (j = 0; j < STATS_N_SESSION_STATES; j++)
+		evbuffer_add_printf(out, "dispatch_sessions{state=\"%s\"} %lu\n", 
+				session_state_names[j], counter_get(sum->n_sessions[j]));
+
+	evbuffer_add_printf(out, 
+			"# HELP dispatch_accepts_total Clients accepted\n"
+			"# TYPE dispatch_accepts_total counter\n"
+			"dispatch_accepts_total %lu\n"
+			"# HELP dispatch_accept_rate Clients accepted in the last second\n"
+			"# TYPE dispatch_accept_rate gauge\n"
+			"dispatch_accept_rate %.0f\n",
+			counter_get(sum->n_accepts), accept_rate);
+
+	evbuffer_add_printf(out, 
+			"# HELP dispatch_phase_duration_seconds Time spent in each phase "
+			"of sessions, resolving names and connecting\n"
+			"# TYPE dispatch_phase_duration_seconds histogram\n");
+	for (j = 0; j < STATS_N_SESSION_STATES; j++)
+	{
+		char labels[32];
+		snprintf(labels, sizeof(labels), "phase=\"%s\"", 
+				session_state_names[j]);
+		stats_format_hist_prometheus(out, "dispatch_phase_duration_seconds",
+				labels, sum->state_time + j);
+	}
+	stats_format_hist_prometheus(out, "dispatch_phase_duration_seconds",
+			"phase=\"dns\"", &sum->dns_time);
+
+	evbuffer_add_printf(out, 
+			"# HELP dispatch_dns_lookups_total DNS lookups by outcome\n"
+			"# TYPE dispatch_dns_lookups_total counter\n"
+			"dispatch_dns_lookups_total{result=\"hit\"} %lu\n"
+			"dispatch_dns_lookups_total{result=\"negative_hit\"} %lu\n"
+			"dispatch_dns_lookups_total{result=\"miss\"} %lu\n"
+			"dispatch_dns_lookups_total{result=\"coalesced\"} %lu\n",
+			dns->n_hits, dns->n_negative_hits, dns->n_misses, 
+			dns->n_coalesced);
+
+	//One family at a time, as the format requires
+	for (j = 0; families[j].name; j++)
+	{
+		evbuffer_add_printf(out, "# HELP %s %s\n# TYPE %s %s\n",
+				families[j].name, families[j].help, 
+				families[j].name, families[j].type);
+
+		for (i = 0; i < n_ifaces; i++)
+		{
+			InterfaceInfo info;
+			StatsInterface *stats;
+			char addr[ADDRESS_MAX_LEN];
+			const char *name = families[j].name;
+
+			interface_get_info(ifaces[i], &info);
+			stats = sum->ifaces + interface_get_id(ifaces[i]);
+			host_address_to_str(info.addr, addr);
+
+			if (j == 0)
+				evbuffer_add_printf(out, "%s{interface=\"%s\"} %d\n",
+						name, addr, info.use_count);
+			else if (j == 1)
+				evbuffer_add_printf(out, 
+						"%s{interface=\"%s\",direction=\"in\"} %lu\n"
+						"%s{interface=\"%s\",direction=\"out\"} %lu\n",
+						name, addr, counter_get(stats->bytes_in),
+						name, addr, counter_get(stats->bytes_out));
+			else if (j == 2)
+				evbuffer_add_printf(out, 
+						"%s{interface=\"%s\",result=\"ok\"} %lu\n"
+						"%s{interface=\"%s\",result=\"failed\"} %lu\n",
+						name, addr, counter_get(stats->n_connect_ok),
+						name, addr, counter_get(stats->n_connect_fail));
+			else if (j == 3)
+				evbuffer_add_printf(out, "%s{interface=\"%s\"} %g\n",
+						name, addr, info.srtt / 1000000.0);
+			else if (j == 4)
+				evbuffer_add_printf(out, "%s{interface=\"%s\"} %d\n",
+						name, addr, info.ejected);
+			else
+			{
+				char labels[ADDRESS_MAX_LEN + 16];
+				snprintf(labels, sizeof(labels), "interface=\"%s\"", addr);
+				stats_format_hist_prometheus(out, name, labels, 
+						&stats->connect_time);
+			}
+		}
+	}
+}
+
+void stats_format(struct evbuffer *out, StatsFormat format)
+{
+	StatsShard sum;
+	DnsCacheStats dns;
+	Interface **ifaces;
+	size_t n_ifaces, i;
+	int max_id = -1;
+
+	n_ifaces = balancer_get_ifaces(NULL, 0);
+	ifaces = (Interface **) fs_malloc(sizeof(Interface *) * (n_ifaces + 1));
+	n_ifaces = balancer_get_ifaces(ifaces, n_ifaces);
+
+	stats_collect(&sum);
+	for (i = 0; i < n_ifaces; i++)
+		if (interface_get_id(ifaces[i]) > max_id)
+			max_id = interface_get_id(ifaces[i]);
+	if (max_id >= sum.n_ifaces)
+		stats_shard_grow(&sum, max_id);
+
+	dns_cache_get_stats(&dns);
+
+	if (format == STATS_FORMAT_PROMETHEUS)
+		stats_format_prometheus(out, &sum, &dns, ifaces, n_ifaces);
+	else
+		stats_format_text(out, &sum, &dns, ifaces, n_ifaces);
+
+	free(sum.ifaces);
+	free(ifaces);
+}
+
+//HTTP endpoint
+static void stats_http_cb(struct evhttp_request *req, void *data)
+{
+	const char *path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
+	struct evbuffer *buf;
+	StatsFormat format;
+	const char *content_type;
+
+	if (path && strcmp(path, "/metrics") == 0)
+	{
+		format = STATS_FORMAT_PROMETHEUS;
+		content_type = "text/plain; version=0.0.4";
+	}
+	else if (path && (strcmp(path, "/stats") == 0 || strcmp(path, "/") == 0))
+	{
+		format = STATS_FORMAT_TEXT;
+		content_type = "text/plain";
+	}
+	else
+	{
+		evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+		return;
+	}
+
+	buf = evbuffer_new();
+	abort_if_fail(buf, "evbuffer_new() failed");
+	stats_format(buf, format);
+	evhttp_add_header(evhttp_request_get_output_headers(req), 
+			"Content-Type", content_type);
+	evhttp_send_reply(req, HTTP_OK, "OK", buf);
+	evbuffer_free(buf);
+}
+
+void stats_start_server(const char *addr_str)
+{
+	SocketAddress addr;
+	SocketHandle hd;
+	const Error *e;
+	struct timeval tv = { 1, 0 };
+
+	abort_if_fail(socket_address_from_str(addr_str, &addr) == STATUS_SUCCESS
+			&& addr.port != 0,
+			"Invalid statistics address '%s'", addr_str);
+	e = socket_handle_create_listener(addr, 0, &hd);
+	abort_if_fail(!e, "Failed to create statistics listener: %s", 
+			error_desc(e));
+	e = socket_handle_set_blocking(hd, 0);
+	abort_if_fail(!e, "Failed to enable nonblocking: %s", error_desc(e));
+
+	stats_http = evhttp_new(evbase);
+	abort_if_fail(stats_http, "evhttp_new() failed");
+	evhttp_set_gencb(stats_http, stats_http_cb, NULL);
+	abort_if_fail(evhttp_accept_socket(stats_http, hd.fd) == 0,
+			"evhttp_accept_socket() failed");
+
+	stats_tick_event = event_new(evbase, -1, EV_PERSIST, stats_tick_cb, NULL);
+	event_add(stats_tick_event, &tv);
+
+	log_message(LOG_LEVEL_INFO, "Statistics at http://%s/stats", addr_str);
+}
+
+void stats_shutdown()
+{
+	if (stats_http)
+	{
+		evhttp_free(stats_http);
+		stats_http = NULL;
+	}
+	if (stats_tick_event)
+	{
+		event_free(stats_tick_event);
+		stats_tick_event = NULL;
+	}
+
+	free(retired->ifaces);
+	stats_shard_init(retired);
+	last_accepts = 0;
+	accept_rate = 0;
+}
@@ -0,0 +1,198 @@
+/* stats.h
+ * Counters for monitoring, and an HTTP endpoint serving them
+ *
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ *
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Counters are kept in one shard per thread, so updating them takes no
+//locks and no locked instructions. Readers add up all shards.
+
+#define STATS_N_SESSION_STATES (SESSION_CLOSED)
+
+//Latency histogram in microseconds. Values below STATS_HIST_SUB get a 
+//bucket each, every power of two above that is split into STATS_HIST_SUB
+//buckets, so buckets are never wider than 1/STATS_HIST_SUB of their 
+//values. Longer times than 2^STATS_HIST_MAX_BITS go to the last bucket.
+#define STATS_HIST_SUB_BITS (3)
+#define STATS_HIST_SUB (1 << STATS_HIST_SUB_BITS)
+#define STATS_HIST_MAX_BITS (36)
+#define STATS_HIST_N_BUCKETS \
+	((STATS_HIST_MAX_BITS - STATS_HIST_SUB_BITS + 1) * STATS_HIST_SUB)
+
+typedef struct
+{
+	Counter buckets[STATS_HIST_N_BUCKETS];
+	Counter count;
+	Counter sum; //< Microseconds
+} StatsHistogram;
+
+static inline int stats_hist_bucket(uint64_t usec)
+{
+	int msb, shift;
+
+	if (usec < STATS_HIST_SUB)
+		return usec;
+	msb = 63 - __builtin_clzll(usec);
+	if (msb >= STATS_HIST_MAX_BITS)
+		return STATS_HIST_N_BUCKETS - 1;
+	shift = msb - STATS_HIST_SUB_BITS;
+	return (shift + 1) * STATS_HIST_SUB 
+		+ ((usec >> shift) & (STATS_HIST_SUB - 1));
+}
+
+//Smallest value counted in the bucket
+uint64_t stats_hist_bucket_start(int bucket);
+
+static inline void stats_hist_add(StatsHistogram *hist, uint64_t usec)
+{
+	counter_add(hist->buckets[stats_hist_bucket(usec)], 1);
+	counter_add(hist->count, 1);
+	counter_add(hist->sum, usec);
+}
+
+//Estimates the value below which the given fraction of values lie,
+//in microseconds
+double stats_hist_quantile(const StatsHistogram *hist, double q);
+
+static inline uint64_t stats_usec_since(const struct timeval *start, 
+		const struct timeval *now)
+{
+	struct timeval elapsed;
+
+	evutil_timersub(now, start, &elapsed);
+	if (elapsed.tv_sec < 0)
+		return 0;
+	return (uint64_t) elapsed.tv_sec * 1000000 + elapsed.tv_usec;
+}
+
+typedef struct
+{
+	Counter bytes_in; //< Received from destinations
+	Counter bytes_out; //< Sent towards destinations
+	Counter n_connect_ok;
+	Counter n_connect_fail;
+	StatsHistogram connect_time; //< Of successful attempts
+} StatsInterface;
+
+typedef struct _StatsShard StatsShard;
+struct _StatsShard
+{
+	Counter n_accepts;
+	Counter n_sessions[STATS_N_SESSION_STATES]; //< Sessions in each state
+	StatsHistogram state_time[STATS_N_SESSION_STATES]; //< Spent in each state
+	StatsHistogram dns_time;
+
+	//Indexed by interface_get_id(), grown by the owning thread only
+	StatsInterface *ifaces;
+	int n_ifaces;
+	Mutex lock; //< Held by readers, and by the owner while growing ifaces
+
+	StatsShard *next;
+};
+
+extern THREAD_LOCAL StatsShard *stats_shard;
+
+StatsShard *stats_shard_create();
+
+StatsInterface *stats_shard_grow(StatsShard *shard, int id);
+
+static inline StatsShard *stats_get_shard()
+{
+	if (! stats_shard)
+		stats_shard = stats_shard_create();
+	return stats_shard;
+}
+
+static inline StatsInterface *stats_get_iface(Interface *iface)
+{
+	StatsShard *shard = stats_get_shard();
+	int id = interface_get_id(iface);
+
+	if (id >= shard->n_ifaces)
+		return stats_shard_grow(shard, id);
+	return shard->ifaces + id;
+}
+
+//Hot path updates
+static inline void stats_accept()
+{
+	counter_add(stats_get_shard()->n_accepts, 1);
+}
+
+static inline void stats_session_state(SessionState from, SessionState to)
+{
+	StatsShard *shard = stats_get_shard();
+
+	if (from < STATS_N_SESSION_STATES)
+		counter_add(shard->n_sessions[from], -1);
+	if (to < STATS_N_SESSION_STATES)
+		counter_add(shard->n_sessions[to], 1);
+}
+
+static inline void stats_iface_bytes
+	(Interface *iface, size_t bytes_in, size_t bytes_out)
+{
+	StatsInterface *stats = stats_get_iface(iface);
+
+	counter_add(stats->bytes_in, bytes_in);
+	counter_add(stats->bytes_out, bytes_out);
+}
+
+static inline void stats_iface_connect(Interface *iface, int success)
+{
+	StatsInterface *stats = stats_get_iface(iface);
+
+	if (success)
+		counter_add(stats->n_connect_ok, 1);
+	else
+		counter_add(stats->n_connect_fail, 1);
+}
+
+static inline void stats_session_time(SessionState state, uint64_t usec)
+{
+	if (state < STATS_N_SESSION_STATES)
+		stats_hist_add(stats_get_shard()->state_time + state, usec);
+}
+
+static inline void stats_dns_time(uint64_t usec)
+{
+	stats_hist_add(&stats_get_shard()->dns_time, usec);
+}
+
+static inline void stats_iface_connect_time(Interface *iface, uint64_t usec)
+{
+	stats_hist_add(&stats_get_iface(iface)->connect_time, usec);
+}
+
+//Output
+struct evbuffer;
+
+typedef enum
+{
+	STATS_FORMAT_TEXT,
+	STATS_FORMAT_PROMETHEUS
+} StatsFormat;
+
+void stats_format(struct evbuffer *out, StatsFormat format);
+
+//Serves /stats (text) and /metrics (Prometheus) over HTTP from the
+//calling thread's event loop
+void stats_start_server(const char *addr_str);
+
+void stats_thread_shutdown();
+
+void stats_shutdown();
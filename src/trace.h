@@ -0,0 +1,49 @@
+/* trace.h
+ * Static tracepoints for bpftrace and other USDT consumers
+ *
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ *
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Probes are placed under provider dispatch_ng when <sys/sdt.h> is found
+//at build time. Each one is a single no-op instruction until a tracer
+//attaches to it, so they are always compiled in.
+//
+//session_state(sid, from, to, usec): entered state 'to' after usec 
+//    microseconds in state 'from'
+//dns_start(connector), dns_done(connector, n_addrs, usec)
+//connect_start(connector, iface_id), 
+//connect_done(connector, iface_id, success, usec)
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define trace_probe1(name, a) DTRACE_PROBE1(dispatch_ng, name, a)
+#define trace_probe2(name, a, b) DTRACE_PROBE2(dispatch_ng, name, a, b)
+#define trace_probe3(name, a, b, c) \
+	DTRACE_PROBE3(dispatch_ng, name, a, b, c)
+#define trace_probe4(name, a, b, c, d) \
+	DTRACE_PROBE4(dispatch_ng, name, a, b, c, d)
+
+#else
+
+#define trace_probe1(name, a) ((void) 0)
+#define trace_probe2(name, a, b) ((void) 0)
+#define trace_probe3(name, a, b, c) ((void) 0)
+#define trace_probe4(name, a, b, c, d) ((void) 0)
+
+#endif
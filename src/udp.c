@@ -0,0 +1,515 @@
+/* udp.c
+ * Datagram relaying for SOCKS5 UDP ASSOCIATE
+ *
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ *
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "incl.h"
+
+//SOCKS header in front of each datagram: RSV(2) FRAG(1) ATYP(1) ADDR PORT(2)
+#define UDP_HEADER_MAX (4 + 1 + 255 + 2)
+//Longest header the proxy writes itself, for an IPv6 source
+#define UDP_HEADER_IP_MAX (4 + 16 + 2)
+#define UDP_BUFFER_SIZE (UDP_HEADER_MAX + UDP_MAX_PAYLOAD)
+
+typedef enum
+{
+	UDP_NAME_FREE,
+	UDP_NAME_PENDING,
+	UDP_NAME_RESOLVED,
+	UDP_NAME_FAILED
+} UdpNameState;
+
+typedef struct
+{
+	UdpAssociation *assoc;
+	UdpNameState state;
+	char name[256];
+	DnsRequest *request;
+	SocketAddress addr; //< Port comes from each datagram
+
+	//First datagram sent to the name while it is being resolved
+	void *held;
+	size_t held_len;
+	uint16_t held_port;
+} UdpName;
+
+typedef struct
+{
+	SocketHandle hd;
+	Interface *iface; //< NULL until opened
+	struct event *evt;
+} UdpRemote;
+
+struct _UdpAssociation
+{
+	SocketHandle client_hd;
+	struct event *client_evt;
+	SocketAddress addr; //< Of client_hd
+	SocketAddress client_addr; //< Port is 0 until the first datagram
+
+	UdpRemote remotes[2]; //< IPv4, IPv6
+	UdpName names[UDP_MAX_NAMES];
+	int next_name; //< Replaced next when all names are in use
+
+	struct timeval last_activity;
+	unsigned long n_up, n_down, n_dropped;
+};
+
+//Buffers for one batch, shared by all associations of the thread
+static THREAD_LOCAL char *udp_buffers = NULL;
+
+static char *udp_get_buffers()
+{
+	if (! udp_buffers)
+		udp_buffers = (char *) fs_malloc
+			(SOCKET_MAX_DATAGRAMS * UDP_BUFFER_SIZE);
+	return udp_buffers;
+}
+
+static int udp_family_index(NetworkType type)
+{
+	return type == NETWORK_INET6 ? 1 : 0;
+}
+
+static int host_address_equal(HostAddress a, HostAddress b)
+{
+	if (a.type != b.type)
+		return 0;
+	return memcmp(a.ip, b.ip, a.type == NETWORK_INET ? 4 : 16) == 0;
+}
+
+static void udp_remote_cb(evutil_socket_t fd, short events, void *data);
+
+//Opens the outgoing socket for the family on first use
+static UdpRemote *udp_get_remote(UdpAssociation *assoc, NetworkType type)
+{
+	UdpRemote *remote = assoc->remotes + udp_family_index(type);
+	const Error *e;
+
+	if (remote->iface)
+		return remote;
+
+	e = balancer_open_iface_udp(type, &remote->iface, &remote->hd);
+	if (e)
+	{
+		log_message(LOG_LEVEL_DEBUG, "Cannot relay datagrams: %s",
+				error_desc(e));
+		error_handle(e);
+		remote->iface = NULL;
+		return NULL;
+	}
+
+	remote->evt = event_new(evbase, remote->hd.fd, EV_READ | EV_PERSIST,
+			udp_remote_cb, assoc);
+	abort_if_fail(remote->evt, "event_new() failed");
+	event_add(remote->evt, NULL);
+
+	return remote;
+}
+
+//Sends datagrams of one family towards their destinations
+static void udp_send_up
+	(UdpAssociation *assoc, NetworkType type, Datagram *msgs, int n_msgs)
+{
+	UdpRemote *remote;
+	const Error *e;
+	size_t n_bytes = 0;
+	int i, n_sent = 0;
+
+	remote = udp_get_remote(assoc, type);
+
+	//Datagrams are not queued, over the rate limit they are dropped
+	if (remote && interface_shaper_delay(remote->iface) == 0)
+	{
+		e = socket_handle_send_datagrams(remote->hd, msgs, n_msgs, &n_sent);
+		if (e)
+			error_handle(e);
+	}
+
+	for (i = 0; i < n_sent; i++)
+		n_bytes += msgs[i].len;
+	if (n_bytes)
+	{
+		interface_add_bytes(remote->iface, n_bytes);
+		stats_iface_bytes(remote->iface, 0, n_bytes);
+		evutil_gettimeofday(&assoc->last_activity, NULL);
+	}
+	assoc->n_up += n_sent;
+	assoc->n_dropped += n_msgs - n_sent;
+}
+
+//Domain names
+static void udp_name_clear(UdpName *name)
+{
+	if (name->request)
+		dns_request_destroy(name->request);
+	if (name->held)
+		free(name->held);
+	name->request = NULL;
+	name->held = NULL;
+	name->state = UDP_NAME_FREE;
+}
+
+static void udp_name_cb
+	(const Error *e, size_t n_addrs, SocketAddress *addrs, void *data)
+{
+	UdpName *name = (UdpName *) data;
+	Datagram msg;
+
+	if (e)
+	{
+		log_message(LOG_LEVEL_DEBUG, "Cannot resolve %s: %s", 
+				name->name, error_desc(e));
+		error_handle(e);
+		name->state = UDP_NAME_FAILED;
+	}
+	else
+	{
+		name->state = UDP_NAME_RESOLVED;
+		name->addr = addrs[0];
+	}
+	if (addrs)
+		free(addrs);
+
+	if (name->held)
+	{
+		if (name->state == UDP_NAME_RESOLVED)
+		{
+			msg.addr = name->addr;
+			msg.addr.port = name->held_port;
+			msg.data = name->held;
+			msg.len = name->held_len;
+			udp_send_up(name->assoc, msg.addr.host.type, &msg, 1);
+		}
+		else
+		{
+			name->assoc->n_dropped++;
+		}
+		free(name->held);
+		name->held = NULL;
+	}
+}
+
+//Finds the address of a domain name. Returns 0 if it is not known yet,
+//the datagram is then sent once the name is resolved or dropped.
+static int udp_lookup_name(UdpAssociation *assoc, const char *hostname,
+		uint16_t port, const void *payload, size_t len, SocketAddress *out)
+{
+	UdpName *name = NULL;
+	int i;
+
+	for (i = 0; i < UDP_MAX_NAMES; i++)
+	{
+		if (assoc->names[i].state != UDP_NAME_FREE
+				&& strcmp(assoc->names[i].name, hostname) == 0)
+		{
+			name = assoc->names + i;
+			break;
+		}
+	}
+
+	if (name)
+	{
+		if (name->state == UDP_NAME_RESOLVED)
+		{
+			*out = name->addr;
+			out->port = port;
+			return 1;
+		}
+		assoc->n_dropped++;
+		return 0;
+	}
+
+	for (i = 0; i < UDP_MAX_NAMES; i++)
+	{
+		if (assoc->names[i].state == UDP_NAME_FREE)
+		{
+			name = assoc->names + i;
+			break;
+		}
+	}
+	if (! name)
+	{
+		name = assoc->names + assoc->next_name;
+		assoc->next_name = (assoc->next_name + 1) % UDP_MAX_NAMES;
+		udp_name_clear(name);
+	}
+
+	//The callback may run right away
+	name->state = UDP_NAME_PENDING;
+	strcpy(name->name, hostname);
+	name->held = fs_malloc(len ? len : 1);
+	memcpy(name->held, payload, len);
+	name->held_len = len;
+	name->held_port = port;
+	name->request = dns_request_resolve(hostname, 0, 
+			balancer_get_available_types(), udp_name_cb, name);
+
+	return 0;
+}
+
+//Accepts datagrams from the client only
+static int udp_check_source(UdpAssociation *assoc, SocketAddress addr)
+{
+	if (! host_address_equal(addr.host, assoc->client_addr.host))
+		return 0;
+	if (assoc->client_addr.port == 0)
+		assoc->client_addr.port = addr.port;
+	return addr.port == assoc->client_addr.port;
+}
+
+//Datagrams from the client
+static void udp_client_cb(evutil_socket_t fd, short events, void *data)
+{
+	UdpAssociation *assoc = (UdpAssociation *) data;
+	char *buffers = udp_get_buffers();
+	Datagram msgs[SOCKET_MAX_DATAGRAMS];
+	Datagram up[2][SOCKET_MAX_DATAGRAMS];
+	int n_up[2] = {0, 0};
+	const Error *e;
+	int i, n_msgs;
+
+	for (i = 0; i < SOCKET_MAX_DATAGRAMS; i++)
+	{
+		msgs[i].data = buffers + i * UDP_BUFFER_SIZE;
+		msgs[i].len = UDP_BUFFER_SIZE;
+	}
+
+	e = socket_handle_recv_datagrams
+		(assoc->client_hd, msgs, SOCKET_MAX_DATAGRAMS, &n_msgs);
+	if (e)
+	{
+		error_handle(e);
+		return;
+	}
+
+	for (i = 0; i < n_msgs; i++)
+	{
+		uint8_t *buf = (uint8_t *) msgs[i].data;
+		size_t len = msgs[i].len, hdr_len;
+		SocketAddress dest;
+		uint16_t port;
+		char hostname[256];
+
+		if (! udp_check_source(assoc, msgs[i].addr))
+		{
+			assoc->n_dropped++;
+			continue;
+		}
+
+		//Fragments are not supported
+		if (len < 4 || buf[0] != 0 || buf[1] != 0 || buf[2] != 0)
+		{
+			assoc->n_dropped++;
+			continue;
+		}
+
+		if (buf[3] == 1)
+			hdr_len = 4 + 4 + 2;
+		else if (buf[3] == 4)
+			hdr_len = 4 + 16 + 2;
+		else if (buf[3] == 3 && len > 4)
+			hdr_len = 4 + 1 + buf[4] + 2;
+		else
+			hdr_len = len + 1;
+		if (hdr_len > len || len - hdr_len > UDP_MAX_PAYLOAD)
+		{
+			assoc->n_dropped++;
+			continue;
+		}
+
+		memcpy(&port, buf + hdr_len - 2, 2);
+		if (buf[3] == 3)
+		{
+			memcpy(hostname, buf + 5, buf[4]);
+			hostname[buf[4]] = 0;
+			if (! udp_lookup_name(assoc, hostname, port, 
+						buf + hdr_len, len - hdr_len, &dest))
+				continue;
+		}
+		else
+		{
+			dest.host.type = buf[3] == 1 ? NETWORK_INET : NETWORK_INET6;
+			memcpy(dest.host.ip, buf + 4, hdr_len - 6);
+			dest.port = port;
+		}
+
+		{
+			int idx = udp_family_index(dest.host.type);
+			up[idx][n_up[idx]].addr = dest;
+			up[idx][n_up[idx]].data = buf + hdr_len;
+			up[idx][n_up[idx]].len = len - hdr_len;
+			n_up[idx]++;
+		}
+	}
+
+	if (n_up[0])
+		udp_send_up(assoc, NETWORK_INET, up[0], n_up[0]);
+	if (n_up[1])
+		udp_send_up(assoc, NETWORK_INET6, up[1], n_up[1]);
+}
+
+//Datagrams from destinations
+static void udp_remote_cb(evutil_socket_t fd, short events, void *data)
+{
+	UdpAssociation *assoc = (UdpAssociation *) data;
+	UdpRemote *remote = assoc->remotes;
+	char *buffers = udp_get_buffers();
+	Datagram msgs[SOCKET_MAX_DATAGRAMS];
+	const Error *e;
+	size_t n_bytes = 0;
+	int i, n_msgs, n_sent = 0;
+
+	if (! remote->iface || remote->hd.fd != fd)
+		remote = assoc->remotes + 1;
+
+	//Leave room for the header in front of each payload
+	for (i = 0; i < SOCKET_MAX_DATAGRAMS; i++)
+	{
+		msgs[i].data = buffers + i * UDP_BUFFER_SIZE + UDP_HEADER_IP_MAX;
+		msgs[i].len = UDP_MAX_PAYLOAD;
+	}
+
+	e = socket_handle_recv_datagrams
+		(remote->hd, msgs, SOCKET_MAX_DATAGRAMS, &n_msgs);
+	if (e)
+	{
+		error_handle(e);
+		return;
+	}
+
+	for (i = 0; i < n_msgs; i++)
+	{
+		SocketAddress src = msgs[i].addr;
+		size_t hdr_len = src.host.type == NETWORK_INET ? 4 + 4 + 2 : 4 + 16 + 2;
+		uint8_t *hdr = (uint8_t *) msgs[i].data - hdr_len;
+
+		n_bytes += msgs[i].len;
+		hdr[0] = hdr[1] = hdr[2] = 0;
+		hdr[3] = src.host.type == NETWORK_INET ? 1 : 4;
+		memcpy(hdr + 4, src.host.ip, hdr_len - 6);
+		memcpy(hdr + hdr_len - 2, &src.port, 2);
+
+		msgs[i].addr = assoc->client_addr;
+		msgs[i].data = hdr;
+		msgs[i].len += hdr_len;
+	}
+
+	interface_add_bytes(remote->iface, n_bytes);
+	stats_iface_bytes(remote->iface, n_bytes, 0);
+	if (n_msgs)
+		evutil_gettimeofday(&assoc->last_activity, NULL);
+
+	//Nowhere to send them before the client has sent anything
+	if (assoc->client_addr.port && n_msgs)
+	{
+		e = socket_handle_send_datagrams
+			(assoc->client_hd, msgs, n_msgs, &n_sent);
+		if (e)
+			error_handle(e);
+	}
+	assoc->n_down += n_sent;
+	assoc->n_dropped += n_msgs - n_sent;
+}
+
+//Object
+const Error *udp_association_create(HostAddress bind_host, 
+		SocketAddress client_addr, UdpAssociation **assoc_out)
+{
+	UdpAssociation *assoc;
+	SocketAddress addr;
+	SocketHandle hd;
+	const Error *e;
+	int i;
+
+	memset(&addr, 0, sizeof(SocketAddress));
+	addr.host = bind_host;
+	e = socket_handle_create_udp(addr, &hd);
+	if (e)
+		return e;
+	e = socket_handle_getsockname(hd, &addr);
+	if (e)
+	{
+		socket_handle_close(hd);
+		return e;
+	}
+
+	assoc = (UdpAssociation *) fs_malloc(sizeof(UdpAssociation));
+	memset(assoc, 0, sizeof(UdpAssociation));
+	assoc->client_hd = hd;
+	assoc->addr = addr;
+	assoc->client_addr = client_addr;
+	for (i = 0; i < UDP_MAX_NAMES; i++)
+		assoc->names[i].assoc = assoc;
+	evutil_gettimeofday(&assoc->last_activity, NULL);
+
+	assoc->client_evt = event_new(evbase, hd.fd, EV_READ | EV_PERSIST,
+			udp_client_cb, assoc);
+	abort_if_fail(assoc->client_evt, "event_new() failed");
+	event_add(assoc->client_evt, NULL);
+
+	*assoc_out = assoc;
+	return NULL;
+}
+
+SocketAddress udp_association_get_addr(UdpAssociation *assoc)
+{
+	return assoc->addr;
+}
+
+void udp_association_get_last_activity
+	(UdpAssociation *assoc, struct timeval *tv_out)
+{
+	*tv_out = assoc->last_activity;
+}
+
+void udp_association_destroy(UdpAssociation *assoc)
+{
+	char addr_str[ADDRESS_MAX_LEN];
+	int i;
+
+	socket_address_to_str(assoc->addr, addr_str);
+	log_message(LOG_LEVEL_DEBUG, 
+			"UDP association %s closed: %lu datagrams up, %lu down, %lu dropped",
+			addr_str, assoc->n_up, assoc->n_down, assoc->n_dropped);
+
+	for (i = 0; i < UDP_MAX_NAMES; i++)
+		udp_name_clear(assoc->names + i);
+
+	for (i = 0; i < 2; i++)
+	{
+		UdpRemote *remote = assoc->remotes + i;
+
+		if (! remote->iface)
+			continue;
+		event_free(remote->evt);
+		socket_handle_close(remote->hd);
+		interface_close(remote->iface);
+	}
+
+	event_free(assoc->client_evt);
+	socket_handle_close(assoc->client_hd);
+	free(assoc);
+}
+
+void udp_thread_shutdown()
+{
+	if (udp_buffers)
+		free(udp_buffers);
+	udp_buffers = NULL;
+}
@@ -0,0 +1,50 @@
+/* udp.h
+ * Datagram relaying for SOCKS5 UDP ASSOCIATE
+ *
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ *
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//An association has a socket the client sends its datagrams to and, for
+//each address family, a socket bound to an outgoing interface that the
+//balancer assigns when the first datagram of that family is relayed.
+//Datagrams move in batches through buffers shared by all associations
+//of a thread.
+
+typedef struct _UdpAssociation UdpAssociation;
+
+//Largest payload relayed, larger datagrams are dropped
+#define UDP_MAX_PAYLOAD (16 * 1024)
+
+//Domain names each association remembers the address of
+#define UDP_MAX_NAMES (8)
+
+//Creates an association listening on bind_host. Only datagrams from
+//client_addr are relayed; if its port is 0, the port of the first 
+//datagram is used.
+const Error *udp_association_create(HostAddress bind_host, 
+		SocketAddress client_addr, UdpAssociation **assoc_out);
+
+//Address the client has to send datagrams to
+SocketAddress udp_association_get_addr(UdpAssociation *assoc);
+
+//When a datagram was last relayed in either direction
+void udp_association_get_last_activity
+	(UdpAssociation *assoc, struct timeval *tv_out);
+
+void udp_association_destroy(UdpAssociation *assoc);
+
+void udp_thread_shutdown();
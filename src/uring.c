@@ -0,0 +1,641 @@
+/* uring.c
+ * Completion based IO through io_uring
+ *
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ *
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "incl.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+//Multishot accept needs Linux 5.19 headers
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_ACCEPT_MULTISHOT)
+#define URING_SUPPORTED
+#endif
+
+static int uring_enabled = 1;
+
+void uring_set_enabled(int val)
+{
+	uring_enabled = val;
+}
+
+//Size of registered buffers, 0 for none
+static size_t uring_buffer_size = 0;
+
+void uring_set_buffer_size(size_t size)
+{
+	uring_buffer_size = size;
+}
+
+#ifdef URING_SUPPORTED
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+//Ring mapped from the kernel, used without liburing
+typedef struct
+{
+	int fd;
+	struct event *event;
+
+	//Submission queue
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+
+	//Completion queue
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_map, *cq_map;
+	size_t sq_map_len, cq_map_len, sqes_len;
+
+	//Queued entries are handed over when this event runs
+	struct event *flush_event;
+	int flush_pending;
+	UringOp *cancels; //< Waiting for room in the submission queue
+
+	//Registered buffers, free ones are linked through their first bytes
+	void *buffers;
+	size_t buffers_len;
+	void *free_buffers;
+	size_t n_taken;
+} Uring;
+
+static THREAD_LOCAL Uring *uring = NULL;
+static THREAD_LOCAL int uring_failed = 0;
+
+static int uring_enter(unsigned to_submit, unsigned min_complete)
+{
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+
+	return syscall(__NR_io_uring_enter, uring->fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+static void uring_schedule_flush()
+{
+	if (uring->flush_pending)
+		return;
+	event_active(uring->flush_event, EV_TIMEOUT, 0);
+	uring->flush_pending = 1;
+}
+
+//Returns a cleared submission entry, or NULL if the queue is full
+static struct io_uring_sqe *uring_next_sqe()
+{
+	unsigned tail = *uring->sq_tail;
+	unsigned head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+
+	if (tail - head >= uring->sq_entries)
+		return NULL;
+
+	sqe = uring->sqes + (tail & *uring->sq_mask);
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+//Makes the entry returned by uring_next_sqe() visible to the kernel
+static void uring_advance(struct io_uring_sqe *sqe)
+{
+	unsigned tail = *uring->sq_tail;
+	unsigned idx = tail & *uring->sq_mask;
+
+	uring->sq_array[idx] = idx;
+	__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void uring_prep_cancel(struct io_uring_sqe *sqe, UringOp *op)
+{
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uintptr_t) op;
+	sqe->user_data = 0;
+}
+
+//Removes op from the cancels waiting for room
+static void uring_unqueue_cancel(UringOp *op)
+{
+	UringOp **iter;
+
+	for (iter = &uring->cancels; *iter; iter = &(*iter)->cancel_next)
+	{
+		if (*iter == op)
+		{
+			*iter = op->cancel_next;
+			break;
+		}
+	}
+	op->cancel_queued = 0;
+}
+
+//Hands over all queued entries to the kernel, along with cancels that 
+//waited for room. If the kernel is busy, they are handed over from the 
+//next event loop iteration. Never delivers completions.
+static const Error *uring_flush()
+{
+	struct io_uring_sqe *sqe;
+	unsigned n_queued;
+	int res;
+
+	while (1)
+	{
+		while (uring->cancels && (sqe = uring_next_sqe()))
+		{
+			UringOp *op = uring->cancels;
+
+			uring_unqueue_cancel(op);
+			uring_prep_cancel(sqe, op);
+			uring_advance(sqe);
+		}
+
+		n_queued = *uring->sq_tail 
+			- __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+		if (! n_queued)
+			return NULL;
+
+		res = uring_enter(n_queued, 0);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res == 0 || (res < 0 && (errno == EAGAIN || errno == EBUSY)))
+		{
+			uring_schedule_flush();
+			return NULL;
+		}
+		if (res < 0)
+			return error_printf(socket_error_generic,
+					"io_uring_enter() failed: %s", strerror(errno));
+	}
+}
+
+static void uring_flush_cb(evutil_socket_t fd, short events, void *data)
+{
+	const Error *e;
+
+	uring->flush_pending = 0;
+	e = uring_flush();
+	abort_if_fail(! e, "Failed to submit io_uring operations: %s",
+			error_desc(e));
+}
+
+//Like uring_next_sqe(), handing over queued entries to make room
+static struct io_uring_sqe *uring_get_sqe()
+{
+	struct io_uring_sqe *sqe = uring_next_sqe();
+
+	if (! sqe && ! uring_flush())
+		sqe = uring_next_sqe();
+	return sqe;
+}
+
+//Queues the entry returned by uring_get_sqe() for submission from the 
+//event loop, so that operations started while handling events share one
+//io_uring_enter() call
+static void uring_queue(struct io_uring_sqe *sqe)
+{
+	uring_advance(sqe);
+	uring_schedule_flush();
+}
+
+//Hands over the entry returned by uring_get_sqe() to the kernel now
+static const Error *uring_submit(struct io_uring_sqe *sqe)
+{
+	uring_queue(sqe);
+	return uring_flush();
+}
+
+//Callbacks may wait for operations, reaping completions from within 
+//this loop, so the head is read again for each completion.
+static void uring_reap()
+{
+	unsigned head, tail;
+
+	while (1)
+	{
+		struct io_uring_cqe cqe;
+		UringOp *op;
+		int more;
+
+		head = *uring->cq_head;
+		tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			break;
+
+		cqe = uring->cqes[head & *uring->cq_mask];
+		op = (UringOp *) (uintptr_t) cqe.user_data;
+		more = (cqe.flags & IORING_CQE_F_MORE) ? 1 : 0;
+
+		//Free the slot first, callbacks may submit more work
+		__atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+		//Completions of cancel requests carry no operation
+		if (op)
+		{
+			if (! more)
+			{
+				op->active = 0;
+				if (op->cancel_queued)
+					uring_unqueue_cancel(op);
+			}
+			(* op->cb)(cqe.res, more, op->data);
+		}
+	}
+}
+
+static void uring_check(evutil_socket_t fd, short events, void *data)
+{
+	uring_reap();
+}
+
+//Keeps errno of the failure that led here
+static void uring_free(Uring *ring)
+{
+	int saved_errno = errno;
+
+	if (ring->event)
+		event_free(ring->event);
+	if (ring->flush_event)
+		event_free(ring->flush_event);
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_map && ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_len);
+	if (ring->sq_map)
+		munmap(ring->sq_map, ring->sq_map_len);
+	close(ring->fd);
+	if (ring->buffers)
+		munmap(ring->buffers, ring->buffers_len);
+	free(ring);
+
+	errno = saved_errno;
+}
+
+//Registers one region split into buffers, so that fixed reads and writes
+//need not map user memory for each operation. The ring still works
+//without them.
+static void uring_create_buffers(Uring *ring)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t stride = (uring_buffer_size + page - 1) / page * page;
+	size_t n_buffers = URING_BUFFER_MEMORY / stride, i;
+	struct iovec iov;
+	void *mem;
+
+	if (! n_buffers)
+		n_buffers = 1;
+	mem = mmap(NULL, n_buffers * stride, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+	{
+		log_message(LOG_LEVEL_WARNING,
+				"Cannot allocate io_uring buffers: %s", strerror(errno));
+		return;
+	}
+
+	iov.iov_base = mem;
+	iov.iov_len = n_buffers * stride;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+				&iov, 1) < 0)
+	{
+		log_message(LOG_LEVEL_WARNING,
+				"Cannot register io_uring buffers (%s), relaying through "
+				"libevent", strerror(errno));
+		munmap(mem, n_buffers * stride);
+		return;
+	}
+
+	ring->buffers = mem;
+	ring->buffers_len = n_buffers * stride;
+	for (i = n_buffers; i > 0; i--)
+	{
+		void *buffer = (char *) mem + (i - 1) * stride;
+		*((void **) buffer) = ring->free_buffers;
+		ring->free_buffers = buffer;
+	}
+}
+
+static Uring *uring_create()
+{
+	struct io_uring_params params;
+	Uring *ring;
+	int fd;
+
+	memset(&params, 0, sizeof(params));
+	fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (fd < 0)
+		return NULL;
+
+	ring = (Uring *) fs_malloc(sizeof(Uring));
+	memset(ring, 0, sizeof(Uring));
+	ring->fd = fd;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	ring->sq_map_len = params.sq_off.array
+		+ params.sq_entries * sizeof(unsigned);
+	ring->cq_map_len = params.cq_off.cqes
+		+ params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring->cq_map_len > ring->sq_map_len)
+			ring->sq_map_len = ring->cq_map_len;
+		ring->cq_map_len = ring->sq_map_len;
+	}
+
+	ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->sq_map == MAP_FAILED)
+	{
+		ring->sq_map = NULL;
+		uring_free(ring);
+		return NULL;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		ring->cq_map = ring->sq_map;
+	}
+	else
+	{
+		ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (ring->cq_map == MAP_FAILED)
+		{
+			ring->cq_map = NULL;
+			uring_free(ring);
+			return NULL;
+		}
+	}
+
+	ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+	{
+		ring->sqes = NULL;
+		uring_free(ring);
+		return NULL;
+	}
+
+#define ring_ptr(map, off) ((unsigned *) ((char *) (map) + (off)))
+	ring->sq_head = ring_ptr(ring->sq_map, params.sq_off.head);
+	ring->sq_tail = ring_ptr(ring->sq_map, params.sq_off.tail);
+	ring->sq_mask = ring_ptr(ring->sq_map, params.sq_off.ring_mask);
+	ring->sq_array = ring_ptr(ring->sq_map, params.sq_off.array);
+	ring->sq_entries = params.sq_entries;
+	ring->cq_head = ring_ptr(ring->cq_map, params.cq_off.head);
+	ring->cq_tail = ring_ptr(ring->cq_map, params.cq_off.tail);
+	ring->cq_mask = ring_ptr(ring->cq_map, params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)
+		((char *) ring->cq_map + params.cq_off.cqes);
+#undef ring_ptr
+
+	//The ring becomes readable when completions are waiting
+	ring->event = event_new(evbase, fd, EV_READ | EV_PERSIST,
+			uring_check, NULL);
+	abort_if_fail(ring->event, "event_new() failed");
+	event_add(ring->event, NULL);
+
+	ring->flush_event = event_new(evbase, -1, 0, uring_flush_cb, NULL);
+	abort_if_fail(ring->flush_event, "event_new() failed");
+
+	//Registered before any operation is in flight, older kernels wait 
+	//for the ring to become idle
+	if (uring_buffer_size)
+		uring_create_buffers(ring);
+
+	return ring;
+}
+
+int uring_available()
+{
+	if (uring)
+		return 1;
+	if (! uring_enabled || uring_failed)
+		return 0;
+
+	uring = uring_create();
+	if (! uring)
+	{
+		log_message(LOG_LEVEL_WARNING,
+				"io_uring is not available (%s), using libevent",
+				strerror(errno));
+		uring_failed = 1;
+		return 0;
+	}
+
+	return 1;
+}
+
+const Error *uring_accept_multishot(SocketHandle hd, UringOp *op)
+{
+	struct io_uring_sqe *sqe;
+	const Error *e;
+
+	if (! uring_available())
+		return error_printf(socket_error_unsupported_backend_feature,
+				"io_uring is not available");
+
+	sqe = uring_get_sqe();
+	if (! sqe)
+		return error_printf(socket_error_again, "io_uring queue is full");
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = hd.fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = (uintptr_t) op;
+
+	e = uring_submit(sqe);
+	if (! e)
+	{
+		op->active = 1;
+		op->cancelled = 0;
+		op->cancel_queued = 0;
+	}
+	return e;
+}
+
+void *uring_buffer_take()
+{
+	void *mem;
+
+	if (! uring_available() || ! uring->free_buffers)
+		return NULL;
+
+	mem = uring->free_buffers;
+	uring->free_buffers = *((void **) mem);
+	uring->n_taken++;
+	return mem;
+}
+
+void uring_buffer_give(void *mem)
+{
+	*((void **) mem) = uring->free_buffers;
+	uring->free_buffers = mem;
+	uring->n_taken--;
+}
+
+size_t uring_buffer_get_n_taken()
+{
+	return uring ? uring->n_taken : 0;
+}
+
+static const Error *uring_rw_fixed(int opcode, SocketHandle hd,
+		void *data, size_t len, UringOp *op)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe();
+	if (! sqe)
+		return error_printf(socket_error_again, "io_uring queue is full");
+	sqe->opcode = opcode;
+	sqe->fd = hd.fd;
+	sqe->addr = (uintptr_t) data;
+	sqe->len = len;
+	sqe->buf_index = 0;
+	sqe->user_data = (uintptr_t) op;
+
+	uring_queue(sqe);
+	op->active = 1;
+	op->cancelled = 0;
+	op->cancel_queued = 0;
+	return NULL;
+}
+
+const Error *uring_read_fixed(SocketHandle hd, void *data, size_t len, 
+		UringOp *op)
+{
+	return uring_rw_fixed(IORING_OP_READ_FIXED, hd, data, len, op);
+}
+
+const Error *uring_write_fixed(SocketHandle hd, void *data, size_t len, 
+		UringOp *op)
+{
+	return uring_rw_fixed(IORING_OP_WRITE_FIXED, hd, data, len, op);
+}
+
+void uring_cancel(UringOp *op)
+{
+	struct io_uring_sqe *sqe;
+
+	if (! op->active || op->cancelled)
+		return;
+	op->cancelled = 1;
+
+	//Callers are in the middle of handling their own events, so no 
+	//completions are delivered to make room. The cancel is submitted 
+	//once the kernel takes more entries.
+	sqe = uring_get_sqe();
+	if (! sqe)
+	{
+		op->cancel_next = uring->cancels;
+		uring->cancels = op;
+		op->cancel_queued = 1;
+		uring_schedule_flush();
+		return;
+	}
+	uring_prep_cancel(sqe, op);
+	uring_queue(sqe);
+}
+
+void uring_op_wait(UringOp *op)
+{
+	const Error *e;
+
+	while (op->active)
+	{
+		e = uring_flush();
+		abort_if_fail(! e, "Failed to submit io_uring operations: %s",
+				error_desc(e));
+		if (uring_enter(0, 1) < 0 && errno != EINTR)
+			abort_with_error("io_uring_enter() failed: %s", strerror(errno));
+		uring_reap();
+	}
+}
+
+void uring_thread_shutdown()
+{
+	if (uring)
+		uring_free(uring);
+	uring = NULL;
+	uring_failed = 0;
+}
+
+#else
+
+int uring_available()
+{
+	return 0;
+}
+
+const Error *uring_accept_multishot(SocketHandle hd, UringOp *op)
+{
+	return error_printf(socket_error_unsupported_backend_feature,
+			"io_uring support is not compiled in");
+}
+
+void *uring_buffer_take()
+{
+	return NULL;
+}
+
+void uring_buffer_give(void *mem)
+{
+	abort_with_error("uring_buffer_give(): not supported");
+}
+
+size_t uring_buffer_get_n_taken()
+{
+	return 0;
+}
+
+const Error *uring_read_fixed(SocketHandle hd, void *data, size_t len, 
+		UringOp *op)
+{
+	return error_printf(socket_error_unsupported_backend_feature,
+			"io_uring support is not compiled in");
+}
+
+const Error *uring_write_fixed(SocketHandle hd, void *data, size_t len, 
+		UringOp *op)
+{
+	return error_printf(socket_error_unsupported_backend_feature,
+			"io_uring support is not compiled in");
+}
+
+void uring_cancel(UringOp *op)
+{
+	abort_with_error("uring_cancel(): not supported");
+}
+
+void uring_op_wait(UringOp *op)
+{
+	abort_with_error("uring_op_wait(): not supported");
+}
+
+void uring_thread_shutdown()
+{
+
+}
+
+#endif
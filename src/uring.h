@@ -0,0 +1,85 @@
+/* uring.h
+ * Completion based IO through io_uring
+ *
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ *
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Each thread has its own ring, whose completions are delivered from the
+//thread's event loop. Without io_uring support in the build or in the
+//kernel, uring_available() returns 0 and callers keep using libevent.
+
+//Called with the result of an operation (negative errno on failure).
+//more is set if the operation will complete again.
+typedef void (*UringCB)(int res, int more, void *data);
+
+//Must stay valid until its final completion
+typedef struct _UringOp UringOp;
+struct _UringOp
+{
+	UringCB cb;
+	void *data;
+	int active; //< Submitted and not completed for the last time
+	int cancelled; //< Asked to stop since it was submitted
+
+	//Cancel request waiting for room in the submission queue
+	int cancel_queued;
+	UringOp *cancel_next;
+};
+
+#define URING_ENTRIES (256)
+
+void uring_set_enabled(int val);
+
+//Each ring registers buffers of the given size with the kernel, taking 
+//up to URING_BUFFER_MEMORY bytes (counted against RLIMIT_MEMLOCK). 
+//0 (the default) registers none. Takes effect for rings set up later.
+#define URING_BUFFER_MEMORY (2 * 1024 * 1024)
+
+void uring_set_buffer_size(size_t size);
+
+//Sets up the ring of the calling thread if needed
+int uring_available();
+
+//Accepts clients on listening socket hd until cancelled or failed.
+//Accepted sockets are non-blocking, but have no other options applied.
+const Error *uring_accept_multishot(SocketHandle hd, UringOp *op);
+
+//Returns a registered buffer of the calling thread, or NULL if there are
+//none left
+void *uring_buffer_take();
+
+void uring_buffer_give(void *mem);
+
+//Number of registered buffers of the calling thread in use
+size_t uring_buffer_get_n_taken();
+
+//Reads from or writes to a stream socket, using len bytes of a buffer 
+//returned by uring_buffer_take(). Operations are queued and handed over 
+//to the kernel together from the event loop.
+const Error *uring_read_fixed(SocketHandle hd, void *data, size_t len, 
+		UringOp *op);
+
+const Error *uring_write_fixed(SocketHandle hd, void *data, size_t len, 
+		UringOp *op);
+
+//Asks for op to stop, its callback receives the final completion
+void uring_cancel(UringOp *op);
+
+//Processes completions until op is no longer active
+void uring_op_wait(UringOp *op);
+
+void uring_thread_shutdown();
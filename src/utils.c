@@ -35,6 +35,9 @@ void abort_with_error(const char *fmt, ...)
 {
 	va_list arglist;
 	
+	//Messages leading up to the failure are the most useful ones
+	log_flush();
+	
 	fprintf(stderr, "ERROR: ");
 	
 	va_start(arglist, fmt);
@@ -49,6 +52,9 @@ void abort_with_error(const char *fmt, ...)
 void abort_with_liberror(const char *fmt, ...)
 {
 	va_list arglist;
+	int errno_val = errno;
+	
+	log_flush();
 	
 	fprintf(stderr, "ERROR: ");
 	
@@ -56,7 +62,7 @@ void abort_with_liberror(const char *fmt, ...)
 	vfprintf(stderr, fmt, arglist);
 	va_end(arglist);
 	
-	fprintf(stderr, ": %s\n", strerror(errno));
+	fprintf(stderr, ": %s\n", strerror(errno_val));
 	
 	abort();
 }
@@ -168,6 +174,69 @@ Status parse_long(const char *str, long *out)
 	return STATUS_FAILURE;
 }
 
+//Parses a size with optional k, m or g suffix (powers of 1024)
+Status parse_size(const char *str, size_t *out)
+{
+	if (*str)
+	{
+		const char *end_ptr;
+		long res = strtol(str, (char **) &end_ptr, 10);
+		size_t mul = 1;
+
+		if (*end_ptr == 'k' || *end_ptr == 'K')
+			mul = 1024;
+		else if (*end_ptr == 'm' || *end_ptr == 'M')
+			mul = 1024 * 1024;
+		else if (*end_ptr == 'g' || *end_ptr == 'G')
+			mul = 1024 * 1024 * 1024;
+
+		if (end_ptr == str)
+			return STATUS_FAILURE;
+
+		if (mul != 1)
+			end_ptr++;
+
+		if (! * end_ptr && res >= 0)
+		{
+			*out = ((size_t) res) * mul;
+			return STATUS_SUCCESS;
+		}
+	}
+
+	return STATUS_FAILURE;
+}
+
+Status parse_bitrate(const char *str, double *out)
+{
+	if (*str)
+	{
+		char *end_ptr;
+		double res = strtod(str, &end_ptr);
+		double mul = 1;
+
+		if (end_ptr == str)
+			return STATUS_FAILURE;
+
+		if (*end_ptr == 'k' || *end_ptr == 'K')
+			mul = 1e3;
+		else if (*end_ptr == 'm' || *end_ptr == 'M')
+			mul = 1e6;
+		else if (*end_ptr == 'g' || *end_ptr == 'G')
+			mul = 1e9;
+
+		if (mul != 1)
+			end_ptr++;
+
+		if (! * end_ptr && res > 0)
+		{
+			*out = res * mul / 8;
+			return STATUS_SUCCESS;
+		}
+	}
+
+	return STATUS_FAILURE;
+}
+
 //Error reporting
 
 //Generic error
@@ -188,10 +257,60 @@ const Error *error_printf(const char *type, const char *fmt, ...)
 	return e;
 }
 
+//Threads
+#ifdef HAVE_PTHREAD_H
+typedef struct
+{
+	ThreadFn fn;
+	void *data;
+} ThreadStart;
+
+static void *thread_start(void *arg)
+{
+	ThreadStart start = *((ThreadStart *) arg);
+
+	free(arg);
+	(* start.fn)(start.data);
+
+	return NULL;
+}
+
+int thread_supported()
+{
+	return 1;
+}
+
+//Starts a detached thread
+void thread_create(ThreadFn fn, void *data)
+{
+	pthread_t thread;
+	ThreadStart *start = fs_malloc(sizeof(ThreadStart));
+	int res;
+
+	start->fn = fn;
+	start->data = data;
+
+	res = pthread_create(&thread, NULL, thread_start, start);
+	if (res != 0)
+		abort_with_error("pthread_create() failed: %s", strerror(res));
+	pthread_detach(thread);
+}
+#else
+int thread_supported()
+{
+	return 0;
+}
+
+void thread_create(ThreadFn fn, void *data)
+{
+	abort_with_error("Threads are not supported in this build");
+}
+#endif
+
 //Event loop
-struct event_base *evbase;
-struct evdns_base *evdns_base;
-int evloop_use_count = 0;
+THREAD_LOCAL struct event_base *evbase;
+THREAD_LOCAL struct evdns_base *evdns_base;
+static THREAD_LOCAL int evloop_use_count = 0;
 
 void evloop_hold()
 {
@@ -218,16 +337,39 @@ void utils_init()
 	//Ignore that useless signal
 	signal(SIGPIPE, SIG_IGN);
 #endif
-	evbase = event_base_new();
-	evdns_base = evdns_base_new(evbase, 1);
+	utils_thread_init();
 }
 
 void utils_shutdown()
 {
+	stats_shutdown();
+	utils_thread_shutdown();
 #ifdef _WIN32
 	WSACleanup();
 #endif
+}
+
+void utils_thread_init()
+{
+	evbase = event_base_new();
+	abort_if_fail(evbase, "event_base_new() failed");
+	evdns_base = evdns_base_new(evbase, 1);
+	evloop_use_count = 0;
+}
+
+void utils_thread_shutdown()
+{
+	session_thread_shutdown();
+	pool_thread_shutdown();
+	dns_cache_thread_shutdown();
+	uring_thread_shutdown();
+	balancer_thread_shutdown();
+	udp_thread_shutdown();
+	stats_thread_shutdown();
+	log_thread_shutdown();
 	evdns_base_free(evdns_base, 0);
 	event_base_free(evbase);
+	evdns_base = NULL;
+	evbase = NULL;
 }
 
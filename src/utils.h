@@ -52,6 +52,10 @@ char *split_string(const char *str, char delim, char **right_out);
 char *fs_strdup_vprintf(const char *fmt, va_list arglist);
 char *fs_strdup_printf(const char *fmt, ...);
 Status parse_long(const char *str, long *out);
+Status parse_size(const char *str, size_t *out);
+//Parses bit rate with a decimal suffix (e.g. 20M for 20 Mbit/s), 
+//result is in bytes per second.
+Status parse_bitrate(const char *str, double *out);
 
 //error reporting
 typedef struct _Error Error;
@@ -114,13 +118,46 @@ static inline const char *error_handle(const Error *e)
 }
 
 
-//Event loop (Must call utils_init() before using these)
-extern struct event_base *evbase;
-extern struct evdns_base *evdns_base;
+//Threads
+//Every thread that runs an event loop has its own evbase and evdns_base,
+//and objects are never shared between event loops.
+#define THREAD_LOCAL _Thread_local
+
+#ifdef HAVE_PTHREAD_H
+typedef pthread_mutex_t Mutex;
+#define MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define mutex_lock(m) pthread_mutex_lock(m)
+#define mutex_unlock(m) pthread_mutex_unlock(m)
+#else
+typedef int Mutex;
+#define MUTEX_INITIALIZER 0
+#define mutex_lock(m) ((void) (m))
+#define mutex_unlock(m) ((void) (m))
+#endif
+
+//Counter that is only modified by one thread but may be read by others.
+//Updates are plain loads and stores, no locked instructions.
+typedef atomic_ulong Counter;
+#define counter_get(c) atomic_load_explicit(&(c), memory_order_relaxed)
+#define counter_set(c, v) atomic_store_explicit(&(c), (v), memory_order_relaxed)
+#define counter_add(c, v) counter_set((c), counter_get(c) + (v))
+
+typedef void (*ThreadFn)(void *data);
+
+int thread_supported();
+void thread_create(ThreadFn fn, void *data);
+
+//Event loop (Must call utils_init() or utils_thread_init() before using these)
+extern THREAD_LOCAL struct event_base *evbase;
+extern THREAD_LOCAL struct evdns_base *evdns_base;
 
 void evloop_hold();
 void evloop_release();
 
 //Initializer and finalizer
+//utils_init() also initializes the event loop for the calling thread,
+//other threads have to call utils_thread_init().
 void utils_init();
 void utils_shutdown();
+void utils_thread_init();
+void utils_thread_shutdown();
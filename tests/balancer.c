@@ -20,6 +20,8 @@
 
 #include "libtest.h"
 
+#include <fcntl.h>
+
 typedef struct
 {
 	char istr[ADDRESS_MAX_LEN];
@@ -89,6 +91,553 @@ int test_balancer(NetworkType network_types, const AddressList *addrs)
 	return 1;
 }
 
+//Each call must return distinct interfaces with the least load
+int test_balancer_open_ifaces()
+{
+	Interface *added[4];
+	Interface *ifaces[2][3];
+	SocketHandle hds[3];
+	int n[2];
+	int i, j, k;
+
+	for (i = 0; i < 4; i++)
+		added[i] = balancer_add_from_string("0.0.0.0");
+
+	for (i = 0; i < 2; i++)
+	{
+		test_error_handle(balancer_open_ifaces
+				(NETWORK_INET, 3, ifaces[i], hds, n + i));
+		if (n[i] != 3)
+			return 0;
+		for (j = 0; j < 3; j++)
+			socket_handle_close(hds[j]);
+
+		for (j = 0; j < 3; j++)
+			for (k = 0; k < j; k++)
+				if (ifaces[i][j] == ifaces[i][k])
+					return 0;
+	}
+
+	//The interface left out the first time must be used the second time
+	for (i = 0; i < 4; i++)
+	{
+		for (j = 0; j < 3; j++)
+			if (ifaces[0][j] == added[i])
+				break;
+		if (j == 3)
+			break;
+	}
+	for (j = 0; j < 3; j++)
+		if (ifaces[1][j] == added[i])
+			break;
+	if (j == 3)
+		return 0;
+
+	//After closing everything interfaces must be evenly used again
+	for (i = 0; i < 2; i++)
+		for (j = 0; j < 3; j++)
+			interface_close(ifaces[i][j]);
+	test_error_handle(balancer_open_ifaces
+			(NETWORK_INET, 3, ifaces[0], hds, n));
+	for (j = 0; j < 3; j++)
+		socket_handle_close(hds[j]);
+	test_error_handle(balancer_open_ifaces
+			(NETWORK_INET, 1, ifaces[1], hds, n + 1));
+	socket_handle_close(hds[0]);
+	for (j = 0; j < 3; j++)
+		if (ifaces[0][j] == ifaces[1][0])
+			return 0;
+
+	balancer_shutdown();
+	return 1;
+}
+
+//Connections must avoid the interface carrying more traffic
+int test_balancer_bandwidth()
+{
+	Interface *busy, *idle;
+	int i;
+
+	busy = balancer_add_from_string("0.0.0.0");
+	idle = balancer_add_from_string("0.0.0.0");
+	balancer_set_policy(BALANCER_POLICY_BANDWIDTH);
+
+	//Wait for a measurement
+	interface_add_bytes(busy, 10 * 1024 * 1024);
+	event_base_loop(evbase, EVLOOP_ONCE);
+
+	for (i = 0; i < 10; i++)
+	{
+		Interface *iface;
+		SocketHandle hd;
+
+		test_error_handle(balancer_open_iface(NETWORK_INET, &iface, &hd));
+		socket_handle_close(hd);
+		if (iface != idle)
+			return 0;
+	}
+
+	balancer_shutdown();
+	return 1;
+}
+
+//Low latency interface must be preferred until it is loaded enough
+int test_balancer_latency()
+{
+	Interface *slow, *fast;
+	int i, n_slow = 0;
+
+	slow = balancer_add_from_string("0.0.0.0");
+	fast = balancer_add_from_string("0.0.0.0");
+	balancer_set_policy(BALANCER_POLICY_LATENCY);
+
+	interface_add_rtt_sample(slow, 100000);
+	interface_add_rtt_sample(fast, 1000);
+
+	for (i = 0; i < 40; i++)
+	{
+		Interface *iface;
+		SocketHandle hd;
+
+		test_error_handle(balancer_open_iface(NETWORK_INET, &iface, &hd));
+		socket_handle_close(hd);
+		if (i < 10 && iface != fast)
+			return 0;
+		if (iface == slow)
+			n_slow++;
+	}
+	if (n_slow == 0)
+		return 0;
+
+	balancer_shutdown();
+	return 1;
+}
+
+//Repeated failures must eject an interface, but never the last one
+int test_balancer_eject()
+{
+	Interface *bad, *good;
+	int i;
+
+	bad = balancer_add_from_string("0.0.0.0");
+	good = balancer_add_from_string("0.0.0.0");
+
+	for (i = 0; i < BALANCER_DEFAULT_FAILURE_THRESHOLD; i++)
+		interface_report_failure(bad);
+	if (! interface_is_ejected(bad))
+		return 0;
+
+	for (i = 0; i < 4; i++)
+	{
+		Interface *iface;
+		SocketHandle hd;
+
+		test_error_handle(balancer_open_iface(NETWORK_INET, &iface, &hd));
+		socket_handle_close(hd);
+		interface_close(iface);
+		if (iface != good)
+			return 0;
+	}
+
+	if (balancer_eject(good) || interface_is_ejected(good))
+		return 0;
+
+	balancer_restore(bad);
+	if (interface_is_ejected(bad))
+		return 0;
+
+	balancer_shutdown();
+	return 1;
+}
+
+#define AFFINITY_N_KEYS (200)
+
+static Interface *open_keyed(const char *key)
+{
+	Interface *iface;
+	SocketHandle hd;
+
+	test_error_handle(balancer_open_iface_keyed(NETWORK_INET, key, 
+				&iface, &hd));
+	socket_handle_close(hd);
+	interface_close(iface);
+	return iface;
+}
+
+int test_balancer_affinity()
+{
+	Interface *mapped[AFFINITY_N_KEYS];
+	Interface *added;
+	char key[32];
+	int i, n_moved = 0;
+
+	balancer_add_from_string("127.0.0.1");
+	balancer_add_from_string("127.0.0.2");
+	balancer_add_from_string("127.0.0.3");
+	balancer_add_from_string("127.0.0.4");
+	balancer_set_affinity(AFFINITY_N_KEYS);
+
+	for (i = 0; i < AFFINITY_N_KEYS; i++)
+	{
+		snprintf(key, sizeof(key), "host%d.example", i);
+		mapped[i] = open_keyed(key);
+	}
+
+	//Same destination, same interface
+	for (i = 0; i < AFFINITY_N_KEYS; i++)
+	{
+		snprintf(key, sizeof(key), "HOST%d.example", i);
+		if (open_keyed(key) != mapped[i])
+			return 0;
+	}
+
+	//New interface only takes over some of the destinations once 
+	//they are forgotten
+	added = balancer_add_from_string("127.0.0.5");
+	balancer_set_affinity(0);
+	balancer_set_affinity(AFFINITY_N_KEYS);
+	for (i = 0; i < AFFINITY_N_KEYS; i++)
+	{
+		Interface *iface;
+
+		snprintf(key, sizeof(key), "host%d.example", i);
+		iface = open_keyed(key);
+		if (iface != mapped[i])
+		{
+			if (iface != added)
+				return 0;
+			n_moved++;
+		}
+	}
+	if (n_moved == 0 || n_moved > AFFINITY_N_KEYS / 2)
+		return 0;
+
+	//Destinations of an ejected interface move elsewhere
+	balancer_eject(added);
+	for (i = 0; i < AFFINITY_N_KEYS; i++)
+	{
+		snprintf(key, sizeof(key), "host%d.example", i);
+		if (open_keyed(key) != mapped[i])
+			return 0;
+	}
+
+	balancer_set_affinity(0);
+	balancer_shutdown();
+	return 1;
+}
+
+int test_balancer_shaping()
+{
+	Interface *shaped, *unshaped;
+	Interface *ifaces[5];
+	SocketHandle hd;
+	long delay;
+	int i, n_unshaped = 0;
+
+	shaped = balancer_add_from_string("0.0.0.0@1/64k");
+	unshaped = balancer_add_from_string("0.0.0.0");
+
+	//64 kbit/s is 8000 bytes per second, bucket starts empty
+	interface_add_bytes(shaped, 8000);
+	delay = interface_shaper_delay(shaped);
+	if (delay < 900000 || delay > 1100000)
+		return 0;
+	if (interface_shaper_delay(unshaped) != 0)
+		return 0;
+
+	//Unshaped interface is preferred
+	for (i = 0; i < 5; i++)
+	{
+		test_error_handle(balancer_open_iface(NETWORK_INET, ifaces + i, &hd));
+		socket_handle_close(hd);
+		if (ifaces[i] == unshaped)
+			n_unshaped++;
+	}
+	for (i = 0; i < 5; i++)
+		interface_close(ifaces[i]);
+	if (n_unshaped < 3)
+		return 0;
+
+	balancer_shutdown();
+	return 1;
+}
+
+//Sockets are taken from the spares of the interface, which are refilled
+static const uint8_t iface_addr_loopback[4] = { 127, 0, 0, 1 };
+
+int test_balancer_spares()
+{
+	Interface *iface, *opened;
+	InterfaceInfo info;
+	SocketAddress addr;
+	SocketHandle hd;
+
+	iface = balancer_add_from_string("127.0.0.1");
+
+	test_error_handle(balancer_open_iface(NETWORK_INET, &opened, &hd));
+	socket_handle_close(hd);
+	interface_close(opened);
+	interface_get_info(iface, &info);
+	if (info.n_spares != 0)
+		return 0;
+
+	event_base_loop(evbase, EVLOOP_NONBLOCK);
+	interface_get_info(iface, &info);
+	if (info.n_spares != BALANCER_SPARE_SOCKETS)
+		return 0;
+
+	//Spare is bound to the interface and does not block
+	test_error_handle(balancer_open_iface(NETWORK_INET, &opened, &hd));
+	interface_get_info(iface, &info);
+	if (opened != iface || info.n_spares != BALANCER_SPARE_SOCKETS - 1)
+		return 0;
+	test_error_handle(socket_handle_getsockname(hd, &addr));
+	if (memcmp(addr.host.ip, iface_addr_loopback, 4) != 0)
+		return 0;
+	if (! (fcntl(hd.fd, F_GETFL) & O_NONBLOCK))
+		return 0;
+	socket_handle_close(hd);
+	interface_close(opened);
+
+	balancer_shutdown();
+	return 1;
+}
+
+//Round robin follows metrics whatever the load, and spreads out picks
+int test_balancer_round_robin()
+{
+	Interface *a, *b, *iface, *pair[2];
+	Interface *opened[16];
+	SocketHandle hd, hds[2];
+	int i, n, n_a = 0;
+
+	a = balancer_add_from_string("0.0.0.0");
+	b = balancer_add_from_string("0.0.0.0@3");
+	balancer_set_scheduler(BALANCER_SCHEDULER_ROUND_ROBIN);
+
+	for (i = 0; i < 8; i++)
+	{
+		test_error_handle(balancer_open_iface(NETWORK_INET, &iface, &hd));
+		socket_handle_close(hd);
+		opened[i] = iface;
+		if (iface == a)
+			n_a++;
+		if (i == 3 && n_a != 1)
+			return 0;
+	}
+	if (n_a != 2)
+		return 0;
+
+	//Equal metrics now
+	interface_set_metric(a, 3);
+	for (i = 8, n_a = 0; i < 14; i++)
+	{
+		test_error_handle(balancer_open_iface(NETWORK_INET, &iface, &hd));
+		socket_handle_close(hd);
+		opened[i] = iface;
+		if (iface == a)
+			n_a++;
+	}
+	if (n_a != 3)
+		return 0;
+
+	test_error_handle(balancer_open_ifaces(NETWORK_INET, 2, pair, hds, &n));
+	if (n != 2 || pair[0] == pair[1])
+		return 0;
+	for (i = 0; i < 2; i++)
+	{
+		socket_handle_close(hds[i]);
+		interface_close(pair[i]);
+	}
+
+	//Ejected interfaces are skipped
+	if (! balancer_eject(a))
+		return 0;
+	test_error_handle(balancer_open_iface(NETWORK_INET, &iface, &hd));
+	socket_handle_close(hd);
+	interface_close(iface);
+	if (iface != b)
+		return 0;
+	balancer_restore(a);
+
+	for (i = 0; i < 14; i++)
+		interface_close(opened[i]);
+	balancer_shutdown();
+	return 1;
+}
+
+//Metrics too far apart for one sequence still keep their proportions 
+//between the light interfaces
+int test_balancer_round_robin_scaled()
+{
+	Interface *a, *b, *iface;
+	SocketHandle hd;
+	int i, n_a = 0, n_b = 0;
+
+	a = balancer_add_from_string("0.0.0.0");
+	b = balancer_add_from_string("0.0.0.0@2");
+	balancer_add_from_string("0.0.0.0@10000");
+	balancer_set_scheduler(BALANCER_SCHEDULER_ROUND_ROBIN);
+
+	//One full sequence
+	for (i = 0; i < 4096; i++)
+	{
+		test_error_handle(balancer_open_iface(NETWORK_INET, &iface, &hd));
+		socket_handle_close(hd);
+		interface_close(iface);
+		if (iface == a)
+			n_a++;
+		else if (iface == b)
+			n_b++;
+	}
+
+	balancer_shutdown();
+	return n_a >= 1 && n_b > n_a && n_a + n_b <= 5;
+}
+
+//Two random choices keep interfaces close to evenly loaded
+int test_balancer_two_choices()
+{
+	Interface *added[8], *iface;
+	InterfaceInfo info;
+	SocketHandle hd;
+	int i, min = 1000, max = 0;
+
+	balancer_set_scheduler(BALANCER_SCHEDULER_TWO_CHOICES);
+	for (i = 0; i < 8; i++)
+		added[i] = balancer_add_from_string("0.0.0.0");
+
+	for (i = 0; i < 800; i++)
+	{
+		test_error_handle(balancer_open_iface(NETWORK_INET, &iface, &hd));
+		socket_handle_close(hd);
+	}
+
+	for (i = 0; i < 8; i++)
+	{
+		interface_get_info(added[i], &info);
+		if (info.use_count < min)
+			min = info.use_count;
+		if (info.use_count > max)
+			max = info.use_count;
+	}
+	if (max - min > 8)
+		return 0;
+
+	for (i = 0; i < 8; i++)
+		while ((interface_get_info(added[i], &info), info.use_count))
+			interface_close(added[i]);
+	balancer_shutdown();
+	return 1;
+}
+
+//Worker thread serving one session, like dispatch-ng --threads=N
+static atomic_int n_workers_done = 0;
+
+static void worker_main(void *data)
+{
+	SocketHandle *hd = (SocketHandle *) data;
+	Server *server;
+
+	utils_thread_init();
+	server = server_create_test(*hd);
+	event_base_loop(evbase, 0);
+	server_destroy(server);
+	utils_thread_shutdown();
+	atomic_fetch_add(&n_workers_done, 1);
+}
+
+static int sum_use_counts(Interface **ifaces, int n)
+{
+	InterfaceInfo info;
+	int i, res = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		interface_get_info(ifaces[i], &info);
+		res += info.use_count;
+	}
+	return res;
+}
+
+//Two worker threads relay a session each at the same time, use counts
+//of the shared interfaces stay consistent
+int test_balancer_threads()
+{
+	uint8_t request[3 + 10] = { 5, 1, 0, 5, 1, 0, 1, 127, 0, 0, 1 };
+	SocketHandle proxy_hds[2], clients[2], remotes[2], server_hd;
+	SocketAddress proxy_addr, server_addr, local_addr;
+	Interface *added[2];
+	uint8_t buf[2 + 10];
+	size_t out;
+	int i, j, res = 1;
+
+	if (! thread_supported())
+		return 1;
+
+	for (i = 0; i < 2; i++)
+		added[i] = balancer_add_from_string("0.0.0.0");
+	session_set_timeouts(0, 0);
+	test_open_listener("127.0.0.1", &server_hd, &server_addr);
+	abort_on_error(socket_handle_set_blocking(server_hd, 1));
+	memcpy(request + 11, &server_addr.port, 2);
+
+	memset(&local_addr, 0, sizeof(SocketAddress));
+	local_addr.host.type = NETWORK_INET;
+	for (i = 0; i < 2; i++)
+	{
+		test_open_listener("127.0.0.1", proxy_hds + i, &proxy_addr);
+		abort_on_error(socket_handle_set_blocking(proxy_hds[i], 0));
+		thread_create(worker_main, proxy_hds + i);
+
+		abort_on_error(socket_handle_create_bound(local_addr, clients + i));
+		abort_on_error(socket_handle_connect(clients[i], proxy_addr));
+		abort_on_error(socket_handle_write(clients[i], request, 
+					sizeof(request), &out));
+	}
+
+	//Both sessions are connected
+	for (i = 0; i < 2; i++)
+	{
+		abort_on_error(socket_handle_accept(server_hd, remotes + i));
+		abort_on_error(socket_handle_set_blocking(remotes[i], 1));
+		if (! test_read_exact(clients[i], buf, sizeof(buf)) || buf[1] != 0)
+			res = 0;
+	}
+	if (sum_use_counts(added, 2) != 2)
+		res = 0;
+
+	//Each client sends its number, destinations echo it back
+	for (i = 0; i < 2; i++)
+	{
+		buf[0] = i;
+		abort_on_error(socket_handle_write(clients[i], buf, 1, &out));
+	}
+	for (i = 0; i < 2; i++)
+	{
+		if (! test_read_exact(remotes[i], buf, 1))
+			res = 0;
+		abort_on_error(socket_handle_write(remotes[i], buf, 1, &out));
+	}
+	for (i = 0; i < 2; i++)
+	{
+		if (! test_read_exact(clients[i], buf, 1) || buf[0] != i)
+			res = 0;
+		socket_handle_close(clients[i]);
+	}
+
+	for (j = 0; j < 5000 && atomic_load(&n_workers_done) < 2; j++)
+		usleep(1000);
+	if (atomic_load(&n_workers_done) < 2 || sum_use_counts(added, 2) != 0)
+		res = 0;
+
+	for (i = 0; i < 2; i++)
+		socket_handle_close(remotes[i]);
+	socket_handle_close(server_hd);
+	balancer_shutdown();
+	return res;
+}
+
 int main()
 {
 	utils_init();
@@ -142,6 +691,18 @@ int main()
 			{"", 0}
 		}));
 
+	test_run(test_balancer_open_ifaces());
+	test_run(test_balancer_bandwidth());
+	test_run(test_balancer_latency());
+	test_run(test_balancer_eject());
+	test_run(test_balancer_affinity());
+	test_run(test_balancer_shaping());
+	test_run(test_balancer_spares());
+	test_run(test_balancer_round_robin());
+	test_run(test_balancer_round_robin_scaled());
+	test_run(test_balancer_two_choices());
+	test_run(test_balancer_threads());
+
 	utils_shutdown();
 	return 0;
 }
@@ -0,0 +1,158 @@
+/* bench-balancer.c
+ * Microbenchmark for interface selection in src/balancer.c
+ *
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ *
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Measures balancer_select_ifaces() followed by interface_close() of the
+//interface selected window operations earlier, for each scheduler and for
+//growing numbers of interfaces. With --sockets, balancer_open_iface() is
+//measured instead, which also takes or creates a socket on every open.
+//Run with 'make bench', arguments can be passed in BENCH_BALANCER_FLAGS.
+
+#include "libtest.h"
+
+static const char *option_value(const char *arg, const char *name)
+{
+	size_t len = strlen(name);
+
+	if (strncmp(arg, name, len) == 0 && arg[len] == '=')
+		return arg + len + 1;
+	return NULL;
+}
+
+static const struct
+{
+	const char *name;
+	BalancerScheduler scheduler;
+} schedulers[] = 
+{
+	{ "least-loaded", BALANCER_SCHEDULER_LEAST_LOADED },
+	{ "round-robin", BALANCER_SCHEDULER_ROUND_ROBIN },
+	{ "two-choices", BALANCER_SCHEDULER_TWO_CHOICES }
+};
+
+#define N_SCHEDULERS (sizeof(schedulers) / sizeof(schedulers[0]))
+
+static double bench_run(BalancerScheduler scheduler, long n_ifaces, 
+		long n_ops, long window, int sockets)
+{
+	Interface **opened;
+	Interface *iface;
+	SocketHandle hd;
+	struct timeval start, end, elapsed;
+	char spec[32];
+	long i;
+
+	balancer_set_scheduler(scheduler);
+	for (i = 0; i < n_ifaces; i++)
+	{
+		//A few distinct metrics, as round robin groups by metric
+		snprintf(spec, sizeof(spec), "0.0.0.0@%ld", i % 4 + 1);
+		balancer_add_from_string(spec);
+	}
+
+	opened = (Interface **) fs_malloc(sizeof(Interface *) * window);
+	memset(opened, 0, sizeof(Interface *) * window);
+
+	evutil_gettimeofday(&start, NULL);
+	for (i = 0; i < n_ops; i++)
+	{
+		if (sockets)
+		{
+			abort_on_error(balancer_open_iface(NETWORK_INET, &iface, &hd));
+			socket_handle_close(hd);
+		}
+		else
+		{
+			abort_if_fail(balancer_select_ifaces(NETWORK_INET, 1, &iface),
+					"No interface selected");
+		}
+		if (opened[i % window])
+			interface_close(opened[i % window]);
+		opened[i % window] = iface;
+	}
+	evutil_gettimeofday(&end, NULL);
+
+	for (i = 0; i < window; i++)
+		if (opened[i])
+			interface_close(opened[i]);
+	free(opened);
+	balancer_shutdown();
+
+	evutil_timersub(&end, &start, &elapsed);
+	return n_ops / (elapsed.tv_sec + elapsed.tv_usec / 1000000.0);
+}
+
+int main(int argc, char *argv[])
+{
+	static const long sizes[] = { 10, 100, 1000, 10000, 0 };
+	long n_ops = 200000, window = 64;
+	int sockets = 0;
+	const char *val;
+	size_t j;
+	int i;
+
+	utils_init();
+	log_set_level(LOG_LEVEL_WARNING);
+
+	for (i = 1; i < argc; i++)
+	{
+		if ((val = option_value(argv[i], "--ops")))
+		{
+			abort_if_fail(parse_long(val, &n_ops) == STATUS_SUCCESS
+					&& n_ops > 0, "Invalid ops '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--window")))
+		{
+			abort_if_fail(parse_long(val, &window) == STATUS_SUCCESS
+					&& window > 0, "Invalid window '%s'", val);
+		}
+		else if (strcmp(argv[i], "--sockets") == 0)
+		{
+			sockets = 1;
+		}
+		else
+		{
+			printf("Usage: %s [--ops=N] [--window=W] [--sockets]\n"
+					"Selects N interfaces through the balancer, each closed "
+					"after W more are selected. --sockets also opens a "
+					"socket for each.\n", argv[0]);
+			return 1;
+		}
+	}
+
+	printf("%-12s", "interfaces");
+	for (j = 0; j < N_SCHEDULERS; j++)
+		printf(" %14s", schedulers[j].name);
+	printf("      (operations/s)\n");
+
+	for (i = 0; sizes[i]; i++)
+	{
+		printf("%-12ld", sizes[i]);
+		for (j = 0; j < N_SCHEDULERS; j++)
+		{
+			fflush(stdout);
+			printf(" %14.0f", bench_run(schedulers[j].scheduler, 
+						sizes[i], n_ops, window, sockets));
+		}
+		printf("\n");
+	}
+
+	utils_shutdown();
+	return 0;
+}
@@ -0,0 +1,481 @@
+/* bench.c
+ * Throughput and latency benchmark for the whole proxy
+ *
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ *
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Proxy threads serve clients exactly like dispatch-ng does. The main
+//thread runs both the load generator and the sink server, so that the
+//proxy is measured rather than the kernel's scheduling of extra processes.
+//Run with 'make bench', arguments can be passed in BENCH_FLAGS.
+
+#include "libtest.h"
+
+#include <sys/socket.h>
+
+#define BENCH_CHUNK (64 * 1024)
+
+typedef enum
+{
+	BENCH_HANDSHAKE,
+	BENCH_UPLOAD,
+	BENCH_DRAIN
+} BenchState;
+
+typedef struct
+{
+	SocketHandle hd;
+	struct event *event;
+	BenchState state;
+	uint8_t request[32];
+	size_t request_len, request_pos;
+	uint8_t reply[32];
+	size_t reply_len;
+	size_t to_send;
+	long id; //< Number of the session, in order of starting
+	struct timeval start;
+} BenchClient;
+
+static struct
+{
+	//Parameters
+	long concurrency, rounds;
+	size_t bytes;
+
+	SocketAddress proxy_addr, sink_addr;
+
+	//Progress
+	long started, finished, failed, n_domain;
+	long *latencies; //< Handshake latency of each session in microseconds
+	size_t bytes_sent;
+} bench;
+
+static char chunk[BENCH_CHUNK];
+
+static void bench_client_start(BenchClient *client);
+static void bench_client_cb(evutil_socket_t fd, short events, void *data);
+
+//Waits for given events on client socket
+static void bench_client_wait(BenchClient *client, short flags)
+{
+	if (client->event)
+		event_free(client->event);
+	client->event = socket_handle_create_event(client->hd,
+			flags | EV_PERSIST, bench_client_cb, client);
+	event_add(client->event, NULL);
+}
+
+static void bench_client_finish(BenchClient *client, int success)
+{
+	event_free(client->event);
+	client->event = NULL;
+	socket_handle_close(client->hd);
+
+	bench.finished++;
+	if (! success)
+		bench.failed++;
+
+	if (bench.started < bench.concurrency * bench.rounds)
+		bench_client_start(client);
+	else if (bench.finished == bench.started)
+		event_base_loopbreak(evbase);
+}
+
+//Returns 1 if the operation has to wait, 0 if done, -1 on failure
+static int bench_check_error(const Error *e)
+{
+	if (! e)
+		return 0;
+	if (e->type == socket_error_again || e->type == socket_error_in_progress)
+	{
+		error_handle(e);
+		return 1;
+	}
+	fprintf(stderr, "Session failed: %s\n", error_desc(e));
+	error_handle(e);
+	return -1;
+}
+
+//Length of SOCKS5 method selection and connect reply, as far as known
+static size_t bench_reply_len(BenchClient *client)
+{
+	if (client->reply_len < 6)
+		return 6;
+	return 6 + (client->reply[5] == 4 ? 16 : 4) + 2;
+}
+
+static void bench_client_cb(evutil_socket_t fd, short events, void *data)
+{
+	BenchClient *client = (BenchClient *) data;
+	const Error *e;
+	size_t out;
+	int res;
+
+	if (client->state == BENCH_HANDSHAKE && client->request_pos
+			< client->request_len)
+	{
+		e = socket_handle_write(client->hd,
+				client->request + client->request_pos,
+				client->request_len - client->request_pos, &out);
+		if ((res = bench_check_error(e)) != 0)
+			goto wait_or_fail;
+		client->request_pos += out;
+		if (client->request_pos == client->request_len)
+			bench_client_wait(client, EV_READ);
+	}
+	else if (client->state == BENCH_HANDSHAKE)
+	{
+		e = socket_handle_read(client->hd, client->reply + client->reply_len,
+				bench_reply_len(client) - client->reply_len, &out);
+		if ((res = bench_check_error(e)) != 0)
+			goto wait_or_fail;
+		if (out == 0)
+		{
+			fprintf(stderr, "Session failed: proxy closed connection\n");
+			bench_client_finish(client, 0);
+			return;
+		}
+		client->reply_len += out;
+
+		if (client->reply_len >= 4
+				&& (client->reply[1] != 0 || client->reply[3] != 0))
+		{
+			fprintf(stderr, "Session failed: SOCKS reply %d\n",
+					(int) client->reply[3]);
+			bench_client_finish(client, 0);
+			return;
+		}
+
+		if (client->reply_len == bench_reply_len(client))
+		{
+			struct timeval now, elapsed;
+
+			evutil_gettimeofday(&now, NULL);
+			evutil_timersub(&now, &client->start, &elapsed);
+			bench.latencies[client->id] 
+				= elapsed.tv_sec * 1000000 + elapsed.tv_usec;
+			client->state = BENCH_UPLOAD;
+			bench_client_wait(client, EV_WRITE);
+		}
+	}
+	else if (client->state == BENCH_UPLOAD)
+	{
+		while (client->to_send)
+		{
+			size_t len = client->to_send < BENCH_CHUNK
+				? client->to_send : BENCH_CHUNK;
+
+			e = socket_handle_write(client->hd, chunk, len, &out);
+			if ((res = bench_check_error(e)) != 0)
+				goto wait_or_fail;
+			client->to_send -= out;
+			bench.bytes_sent += out;
+		}
+
+		//Proxy closes both sides once everything reached the sink
+		shutdown(client->hd.fd, SHUT_WR);
+		client->state = BENCH_DRAIN;
+		bench_client_wait(client, EV_READ);
+	}
+	else
+	{
+		e = socket_handle_read(client->hd, chunk, BENCH_CHUNK, &out);
+		if (e && e->type == socket_error_reset)
+		{
+			error_handle(e);
+			out = 0;
+		}
+		else if ((res = bench_check_error(e)) != 0)
+			goto wait_or_fail;
+		if (out == 0)
+			bench_client_finish(client, 1);
+	}
+	return;
+
+wait_or_fail:
+	if (res < 0)
+		bench_client_finish(client, 0);
+}
+
+static void bench_client_start(BenchClient *client)
+{
+	SocketAddress local_addr;
+	uint8_t *req = client->request;
+	const Error *e;
+
+	memset(&local_addr, 0, sizeof(SocketAddress));
+	local_addr.host.type = bench.proxy_addr.host.type;
+	abort_on_error(socket_handle_create_bound(local_addr, &client->hd));
+	abort_on_error(socket_handle_set_blocking(client->hd, 0));
+
+	client->state = BENCH_HANDSHAKE;
+	client->request_pos = 0;
+	client->reply_len = 0;
+	client->to_send = bench.bytes;
+	client->id = bench.started++;
+	evutil_gettimeofday(&client->start, NULL);
+
+	//Greeting and request are sent together, halves connect to the sink
+	//by address and halves by name
+	memcpy(req, "\x05\x01\x00\x05\x01\x00", 6);
+	if (client->id % 2)
+	{
+		req[6] = 3;
+		req[7] = 9;
+		memcpy(req + 8, "localhost", 9);
+		memcpy(req + 17, &bench.sink_addr.port, 2);
+		client->request_len = 19;
+		bench.n_domain++;
+	}
+	else
+	{
+		req[6] = 1;
+		memcpy(req + 7, bench.sink_addr.host.ip, 4);
+		memcpy(req + 11, &bench.sink_addr.port, 2);
+		client->request_len = 13;
+	}
+
+	e = socket_handle_connect(client->hd, bench.proxy_addr);
+	abort_if_fail(bench_check_error(e) >= 0, "Failed to connect to proxy");
+	client->event = NULL;
+	bench_client_wait(client, EV_WRITE);
+}
+
+//Sink server, discards everything it receives
+static void bench_sink_cb(evutil_socket_t fd, short events, void *data)
+{
+	struct event **evt_ptr = (struct event **) data;
+	SocketHandle hd = { fd };
+	const Error *e;
+	size_t out;
+
+	do
+	{
+		e = socket_handle_read(hd, chunk, BENCH_CHUNK, &out);
+	} while (! e && out > 0);
+
+	if (e && e->type == socket_error_again)
+	{
+		error_handle(e);
+		return;
+	}
+	if (e)
+		error_handle(e);
+
+	event_free(*evt_ptr);
+	free(evt_ptr);
+	socket_handle_close(hd);
+}
+
+static void bench_accept_cb(evutil_socket_t fd, short events, void *data)
+{
+	SocketHandle listener = { fd };
+	SocketHandle hd;
+	struct event **evt_ptr;
+	const Error *e;
+
+	while (! (e = socket_handle_accept(listener, &hd)))
+	{
+		evt_ptr = (struct event **) fs_malloc(sizeof(struct event *));
+		*evt_ptr = socket_handle_create_event(hd, EV_READ | EV_PERSIST,
+				bench_sink_cb, evt_ptr);
+		event_add(*evt_ptr, NULL);
+	}
+	abort_if_fail(e->type == socket_error_again, "Failed to accept: %s",
+			error_desc(e));
+	error_handle(e);
+}
+
+static void bench_proxy_main(void *data)
+{
+	SocketHandle *hd = (SocketHandle *) data;
+
+	utils_thread_init();
+	server_create_from_handle(*hd, LISTENER_REUSE_PORT);
+	event_base_loop(evbase, 0);
+}
+
+//Peak resident set size of the process, in kilobytes
+static long bench_peak_rss()
+{
+	FILE *status = fopen("/proc/self/status", "r");
+	char line[128];
+	long res = -1;
+
+	if (! status)
+		return -1;
+	while (fgets(line, sizeof(line), status))
+	{
+		if (strncmp(line, "VmHWM:", 6) == 0)
+			res = strtol(line + 6, NULL, 10);
+	}
+	fclose(status);
+
+	return res;
+}
+
+static int bench_compare_long(const void *a, const void *b)
+{
+	long x = *((const long *) a), y = *((const long *) b);
+
+	return x < y ? -1 : x > y;
+}
+
+static double bench_percentile(long *sorted, long n, int pct)
+{
+	long idx = (n * pct + 99) / 100 - 1;
+
+	return sorted[idx < 0 ? 0 : idx] / 1000.0;
+}
+
+static const char *option_value(const char *arg, const char *name)
+{
+	size_t len = strlen(name);
+
+	if (strncmp(arg, name, len) == 0 && arg[len] == '=')
+		return arg + len + 1;
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	long n_threads = 1, megabytes = 1, i, total;
+	SocketHandle sink_hd, *proxy_hds;
+	SocketAddress bind_addr;
+	BenchClient *clients;
+	struct event *accept_evt;
+	struct timeval start, end, elapsed;
+	double secs;
+	const char *val;
+
+	utils_init();
+	log_set_level(LOG_LEVEL_WARNING);
+
+	bench.concurrency = 100;
+	bench.rounds = 1;
+	for (i = 1; i < argc; i++)
+	{
+		if ((val = option_value(argv[i], "--sessions")))
+		{
+			abort_if_fail(parse_long(val, &bench.concurrency) == STATUS_SUCCESS
+					&& bench.concurrency > 0, "Invalid sessions '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--megabytes")))
+		{
+			abort_if_fail(parse_long(val, &megabytes) == STATUS_SUCCESS
+					&& megabytes >= 0, "Invalid megabytes '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--rounds")))
+		{
+			abort_if_fail(parse_long(val, &bench.rounds) == STATUS_SUCCESS
+					&& bench.rounds > 0, "Invalid rounds '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--threads")))
+		{
+			abort_if_fail(parse_long(val, &n_threads) == STATUS_SUCCESS
+					&& n_threads > 0, "Invalid threads '%s'", val);
+		}
+		else if ((val = option_value(argv[i], "--relay")))
+		{
+			if (strcmp(val, "copy") == 0)
+				session_set_relay_mode(SESSION_RELAY_COPY);
+			else if (strcmp(val, "uring") == 0)
+				session_set_relay_mode(SESSION_RELAY_URING);
+			else
+				session_set_relay_mode(SESSION_RELAY_SPLICE);
+		}
+		else if ((val = option_value(argv[i], "--buffer-size")))
+		{
+			size_t size;
+			abort_if_fail(parse_size(val, &size) == STATUS_SUCCESS,
+					"Invalid buffer size '%s'", val);
+			session_set_buffer_size(size);
+		}
+		else
+		{
+			printf("Usage: %s [--sessions=N] [--megabytes=M] [--rounds=R] "
+					"[--threads=N] [--relay=splice|copy|uring] "
+					"[--buffer-size=size]\n"
+					"Runs R rounds of N concurrent sessions, each sending "
+					"M megabytes through the proxy\n", argv[0]);
+			return 1;
+		}
+	}
+	bench.bytes = megabytes * 1024 * 1024;
+	total = bench.concurrency * bench.rounds;
+	bench.latencies = (long *) fs_malloc(sizeof(long) * total);
+	memset(bench.latencies, 0, sizeof(long) * total);
+
+	//Sink
+	test_open_listener("127.0.0.1", &sink_hd, &bench.sink_addr);
+	abort_on_error(socket_handle_set_blocking(sink_hd, 0));
+	accept_evt = socket_handle_create_event(sink_hd, EV_READ | EV_PERSIST,
+			bench_accept_cb, NULL);
+	event_add(accept_evt, NULL);
+
+	//Proxy threads share one port
+	balancer_add_from_string("0.0.0.0");
+	abort_if_fail(n_threads == 1 || thread_supported(),
+			"Threads are not supported in this build");
+	proxy_hds = (SocketHandle *) fs_malloc(sizeof(SocketHandle) * n_threads);
+	abort_if_fail(host_address_from_str("127.0.0.1", &bind_addr.host) 
+			== STATUS_SUCCESS, "Incorrect host address");
+	bind_addr.port = 0;
+	for (i = 0; i < n_threads; i++)
+	{
+		abort_on_error(socket_handle_create_listener(bind_addr, 
+					LISTENER_REUSE_PORT, proxy_hds + i));
+		abort_on_error(socket_handle_set_blocking(proxy_hds[i], 0));
+		abort_on_error(socket_handle_getsockname(proxy_hds[i], 
+					&bench.proxy_addr));
+		bind_addr.port = bench.proxy_addr.port;
+		thread_create(bench_proxy_main, proxy_hds + i);
+	}
+
+	//Load
+	evutil_gettimeofday(&start, NULL);
+	clients = (BenchClient *) fs_malloc(sizeof(BenchClient) 
+			* bench.concurrency);
+	for (i = 0; i < bench.concurrency; i++)
+		bench_client_start(clients + i);
+	event_base_loop(evbase, 0);
+	evutil_gettimeofday(&end, NULL);
+
+	//Report
+	evutil_timersub(&end, &start, &elapsed);
+	secs = elapsed.tv_sec + elapsed.tv_usec / 1000000.0;
+	qsort(bench.latencies, total, sizeof(long), bench_compare_long);
+
+	printf("sessions:           %ld (%ld by address, %ld by name), "
+			"%ld failed\n", total, total - bench.n_domain, bench.n_domain,
+			bench.failed);
+	printf("elapsed:            %.3f s\n", secs);
+	printf("connections/s:      %.1f\n", total / secs);
+	printf("handshake latency:  p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, "
+			"max %.3f ms\n", 
+			bench_percentile(bench.latencies, total, 50),
+			bench_percentile(bench.latencies, total, 90),
+			bench_percentile(bench.latencies, total, 99),
+			bench_percentile(bench.latencies, total, 100));
+	printf("throughput:         %.1f MB/s\n", 
+			bench.bytes_sent / secs / (1024 * 1024));
+	printf("peak RSS:           %ld kB\n", bench_peak_rss());
+
+	//Proxy threads are still running, leave without cleaning up
+	fflush(stdout);
+	_exit(bench.failed ? 1 : 0);
+}
@@ -0,0 +1,248 @@
+/* buffer.c
+ * Unit tests for src/buffer.c
+ * 
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ * 
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libtest.h"
+
+#define TEST_SIZE (16)
+
+//Reads len bytes out of the buffer through data vectors
+static int read_vecs(RingBuffer *buf, uint8_t *out, size_t len)
+{
+	IoVec vecs[2];
+	int n_vecs, i;
+	size_t done = 0;
+
+	n_vecs = ring_buffer_data_vecs(buf, vecs);
+	for (i = 0; i < n_vecs && done < len; i++)
+	{
+		size_t part = len - done;
+		if (part > vecs[i].len)
+			part = vecs[i].len;
+		memcpy(out + done, vecs[i].data, part);
+		done += part;
+	}
+	if (done != len)
+		return 0;
+
+	ring_buffer_consume(buf, len);
+	return 1;
+}
+
+//Pushes data through the buffer with different chunk sizes so that
+//data wraps around at different points
+int test_ring_buffer_wrap(size_t chunk)
+{
+	uint8_t mem[TEST_SIZE];
+	uint8_t in[TEST_SIZE], out[TEST_SIZE];
+	RingBuffer buf[1];
+	int round, i;
+	uint8_t counter = 0, expected = 0;
+
+	ring_buffer_init(buf, mem, TEST_SIZE);
+
+	//Keep one byte in the buffer so that start never resets
+	if (ring_buffer_write(buf, &counter, 1) != STATUS_SUCCESS)
+		return 0;
+	counter++;
+
+	for (round = 0; round < 50; round++)
+	{
+		for (i = 0; i < chunk; i++)
+			in[i] = counter++;
+		if (ring_buffer_write(buf, in, chunk) != STATUS_SUCCESS)
+			return 0;
+		if (ring_buffer_len(buf) != chunk + 1)
+			return 0;
+
+		if (! read_vecs(buf, out, chunk))
+			return 0;
+		for (i = 0; i < chunk; i++)
+			if (out[i] != expected++)
+				return 0;
+	}
+
+	return 1;
+}
+
+int test_ring_buffer_space()
+{
+	uint8_t mem[TEST_SIZE];
+	uint8_t data[TEST_SIZE] = {0};
+	RingBuffer buf[1];
+	IoVec vecs[2];
+	int n_vecs;
+
+	ring_buffer_init(buf, mem, TEST_SIZE);
+
+	if (ring_buffer_write(buf, data, TEST_SIZE + 1) != STATUS_FAILURE)
+		return 0;
+	if (ring_buffer_write(buf, data, 10) != STATUS_SUCCESS)
+		return 0;
+	ring_buffer_consume(buf, 6);
+
+	//Free space is now split around the stored data
+	n_vecs = ring_buffer_space_vecs(buf, vecs);
+	if (n_vecs != 2)
+		return 0;
+	if (vecs[0].data != mem + 10 || vecs[0].len != 6)
+		return 0;
+	if (vecs[1].data != mem || vecs[1].len != 6)
+		return 0;
+
+	ring_buffer_produce(buf, 12);
+	if (ring_buffer_space(buf) != 0)
+		return 0;
+	if (ring_buffer_space_vecs(buf, vecs) != 0)
+		return 0;
+
+	return 1;
+}
+
+int test_ring_buffer_peek()
+{
+	uint8_t mem[TEST_SIZE];
+	uint8_t data[TEST_SIZE];
+	const uint8_t expected[10] = { 10, 11, 2, 3, 4, 5, 6, 7, 8, 9 };
+	RingBuffer buf[1];
+	uint8_t *res;
+	int i;
+
+	for (i = 0; i < TEST_SIZE; i++)
+		data[i] = i;
+
+	ring_buffer_init(buf, mem, TEST_SIZE);
+
+	//Make stored data wrap around
+	if (ring_buffer_write(buf, data, 12) != STATUS_SUCCESS)
+		return 0;
+	ring_buffer_consume(buf, 10);
+	if (ring_buffer_write(buf, data + 2, 8) != STATUS_SUCCESS)
+		return 0;
+
+	if (ring_buffer_peek(buf, 11))
+		return 0;
+
+	res = ring_buffer_peek(buf, 10);
+	if (! res)
+		return 0;
+	for (i = 0; i < 10; i++)
+		if (res[i] != expected[i])
+			return 0;
+
+	//Peeking must not lose data
+	if (ring_buffer_len(buf) != 10)
+		return 0;
+
+	return 1;
+}
+
+//Wrapped data is kept in order when moving to larger and smaller memory
+int test_ring_buffer_move()
+{
+	uint8_t mem[TEST_SIZE], large[2 * TEST_SIZE], small[TEST_SIZE / 2];
+	uint8_t data[TEST_SIZE], out[TEST_SIZE];
+	RingBuffer buf[1];
+	int i;
+
+	for (i = 0; i < TEST_SIZE; i++)
+		data[i] = i;
+
+	ring_buffer_init(buf, mem, TEST_SIZE);
+	if (ring_buffer_write(buf, data, 12) != STATUS_SUCCESS)
+		return 0;
+	ring_buffer_consume(buf, 10);
+	if (ring_buffer_write(buf, data + 2, 6) != STATUS_SUCCESS)
+		return 0;
+
+	//Stored: 10, 11, 2 .. 7, wrapping around
+	ring_buffer_move(buf, large, sizeof(large));
+	if (ring_buffer_len(buf) != 8 || ring_buffer_space(buf) != 24)
+		return 0;
+	if (ring_buffer_write(buf, data, 16) != STATUS_SUCCESS)
+		return 0;
+	if (! read_vecs(buf, out, 2) || out[0] != 10 || out[1] != 11)
+		return 0;
+	if (! read_vecs(buf, out, 6) || memcmp(out, data + 2, 6) != 0)
+		return 0;
+
+	ring_buffer_consume(buf, 12);
+	ring_buffer_move(buf, small, sizeof(small));
+	if (ring_buffer_len(buf) != 4 || ring_buffer_space(buf) != 4)
+		return 0;
+	if (! read_vecs(buf, out, 4) || memcmp(out, data + 12, 4) != 0)
+		return 0;
+
+	return 1;
+}
+
+//Data received into free space stays in place while stored data drains
+int test_ring_buffer_produce_at()
+{
+	uint8_t mem[TEST_SIZE];
+	uint8_t data[TEST_SIZE], out[TEST_SIZE];
+	RingBuffer buf[1];
+	IoVec vecs[2];
+	size_t offset;
+	int i;
+
+	for (i = 0; i < TEST_SIZE; i++)
+		data[i] = i;
+
+	ring_buffer_init(buf, mem, TEST_SIZE);
+	if (ring_buffer_write(buf, data, 6) != STATUS_SUCCESS)
+		return 0;
+
+	//Receive after the stored data, which is consumed meanwhile
+	ring_buffer_space_vecs(buf, vecs);
+	offset = (uint8_t *) vecs[0].data - mem;
+	memcpy(vecs[0].data, data + 6, 4);
+	ring_buffer_consume(buf, 6);
+	ring_buffer_produce_at(buf, offset, 4);
+	if (ring_buffer_len(buf) != 4)
+		return 0;
+	if (! read_vecs(buf, out, 4) || memcmp(out, data + 6, 4) != 0)
+		return 0;
+
+	//Receive while data is still stored
+	if (ring_buffer_write(buf, data, 2) != STATUS_SUCCESS)
+		return 0;
+	ring_buffer_space_vecs(buf, vecs);
+	offset = (uint8_t *) vecs[0].data - mem;
+	memcpy(vecs[0].data, data + 2, 3);
+	ring_buffer_produce_at(buf, offset, 3);
+	if (! read_vecs(buf, out, 5) || memcmp(out, data, 5) != 0)
+		return 0;
+
+	return 1;
+}
+
+int main()
+{
+	test_run(test_ring_buffer_wrap(1));
+	test_run(test_ring_buffer_wrap(5));
+	test_run(test_ring_buffer_wrap(7));
+	test_run(test_ring_buffer_wrap(TEST_SIZE - 1));
+	test_run(test_ring_buffer_space());
+	test_run(test_ring_buffer_produce_at());
+	test_run(test_ring_buffer_peek());
+	test_run(test_ring_buffer_move());
+
+	return 0;
+}
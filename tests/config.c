@@ -0,0 +1,149 @@
+/* config.c
+ * Unit tests for src/config.c
+ * 
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ * 
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libtest.h"
+
+static char test_path[] = "/tmp/dispatch-config-XXXXXX";
+
+static void test_write_config(const char *content)
+{
+	FILE *file = fopen(test_path, "w");
+
+	abort_if_fail(file, "Cannot write %s", test_path);
+	fputs(content, file);
+	fclose(file);
+}
+
+//Returns the interface with the given address that the balancer uses
+static Interface *test_find_iface(const char *addr_str, InterfaceInfo *info)
+{
+	Interface *ifaces[16];
+	HostAddress addr;
+	size_t i, len;
+
+	abort_if_fail(host_address_from_str(addr_str, &addr) == STATUS_SUCCESS,
+			"Invalid address %s", addr_str);
+	len = balancer_get_ifaces(ifaces, 16);
+	for (i = 0; i < len; i++)
+	{
+		interface_get_info(ifaces[i], info);
+		if (info->addr.type == addr.type
+				&& memcmp(info->addr.ip, addr.ip, 4) == 0
+				&& ! interface_is_removed(ifaces[i]))
+			return ifaces[i];
+	}
+
+	return NULL;
+}
+
+//Reloading applies added, changed and removed interfaces
+int test_config_reload()
+{
+	Interface *a, *b, *c;
+	InterfaceInfo info;
+	Interface *open_iface;
+	SocketHandle hd, b_hd;
+	const Error *e;
+	int i;
+
+	test_write_config("127.0.0.1@2 127.0.0.2\n# Comment\n\n");
+	abort_on_error(config_load(test_path));
+	if (config_get_n_ifaces() != 2)
+		return 0;
+	if (! (a = test_find_iface("127.0.0.1", &info)) || info.metric != 2)
+		return 0;
+	if (! (b = test_find_iface("127.0.0.2", &info)))
+		return 0;
+
+	//Connection on b continues after b is removed
+	do
+	{
+		abort_on_error(balancer_open_iface(NETWORK_INET, &open_iface, &hd));
+		if (open_iface != b)
+		{
+			socket_handle_close(hd);
+			interface_close(open_iface);
+		}
+	} while (open_iface != b);
+	b_hd = hd;
+
+	test_write_config("127.0.0.1@5 # Changed\n127.0.0.3/8M\n");
+	abort_on_error(config_reload());
+	if (config_get_n_ifaces() != 2)
+		return 0;
+	if (test_find_iface("127.0.0.1", &info) != a || info.metric != 5)
+		return 0;
+	if (! (c = test_find_iface("127.0.0.3", &info)) || info.shape_rate != 1e6)
+		return 0;
+	if (! interface_is_removed(b) || test_find_iface("127.0.0.2", &info))
+		return 0;
+	for (i = 0; i < 10; i++)
+	{
+		abort_on_error(balancer_open_iface(NETWORK_INET, &open_iface, &hd));
+		socket_handle_close(hd);
+		interface_close(open_iface);
+		if (open_iface == b)
+			return 0;
+	}
+	socket_handle_close(b_hd);
+	interface_close(b);
+
+	//Files with errors change nothing
+	test_write_config("127.0.0.1 127.0.0.2@x\n");
+	if (! (e = config_reload()))
+		return 0;
+	error_handle(e);
+	test_write_config("127.0.0.1 127.0.0.2@0\n");
+	if (! (e = config_reload()))
+		return 0;
+	error_handle(e);
+	test_write_config("127.0.0.1 127.0.0.1@3\n");
+	if (! (e = config_reload()))
+		return 0;
+	error_handle(e);
+	if (config_get_n_ifaces() != 2 || test_find_iface("127.0.0.2", &info))
+		return 0;
+
+	//Adding an address again brings back its interface
+	test_write_config("127.0.0.1@5 127.0.0.2 127.0.0.3/8M\n");
+	abort_on_error(config_reload());
+	if (test_find_iface("127.0.0.2", &info) != b || interface_is_removed(b))
+		return 0;
+
+	config_shutdown();
+	balancer_shutdown();
+	return 1;
+}
+
+int main()
+{
+	int fd;
+
+	utils_init();
+	fd = mkstemp(test_path);
+	abort_if_fail(fd >= 0, "mkstemp() failed");
+	close(fd);
+
+	test_run(test_config_reload());
+
+	unlink(test_path);
+	utils_shutdown();
+	return 0;
+}
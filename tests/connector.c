@@ -0,0 +1,136 @@
+/* connector.c
+ * Unit tests for src/connector.c
+ * 
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ * 
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libtest.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+typedef struct
+{
+	int returned;
+	ConnectRes res;
+} ConnectResult;
+
+static void test_connect_cb(ConnectRes res, void *data)
+{
+	ConnectResult *result = (ConnectResult *) data;
+
+	result->returned = 1;
+	result->res = res;
+}
+
+static ConnectResult test_connect(SocketAddress addr)
+{
+	ConnectResult result;
+	Connector *connector;
+	int i;
+
+	memset(&result, 0, sizeof(ConnectResult));
+	connector = connector_connect(addr, 0, test_connect_cb, &result);
+	for (i = 0; i < 1000 && ! result.returned; i++)
+		event_base_loop(evbase, EVLOOP_ONCE);
+	connector_destroy(connector);
+
+	return result;
+}
+
+//Connecting to a listening socket succeeds
+int test_connector_success()
+{
+	SocketHandle listener;
+	SocketAddress addr;
+	ConnectResult result;
+
+	test_open_listener("127.0.0.1", &listener, &addr);
+
+	result = test_connect(addr);
+	if (! result.returned || result.res.e)
+		return 0;
+
+	socket_handle_close(result.res.hd);
+	interface_close(result.res.iface);
+	socket_handle_close(listener);
+	return 1;
+}
+
+//A listener whose accept queue is full drops SYNs, so connecting to it
+//hangs until the connector gives up.
+int test_connector_timeout()
+{
+	int fd, fillers[4];
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	SocketAddress addr;
+	ConnectResult result;
+	int i;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0
+			|| listen(fd, 0) < 0
+			|| getsockname(fd, (struct sockaddr *) &sin, &len) < 0)
+		return 0;
+
+	for (i = 0; i < 4; i++)
+	{
+		fillers[i] = socket(AF_INET, SOCK_STREAM, 0);
+		evutil_make_socket_nonblocking(fillers[i]);
+		connect(fillers[i], (struct sockaddr *) &sin, sizeof(sin));
+	}
+	usleep(100000);
+
+	addr.host.type = NETWORK_INET;
+	memcpy(addr.host.ip, &sin.sin_addr, 4);
+	addr.port = sin.sin_port;
+
+	connector_set_timing(50, 300);
+	result = test_connect(addr);
+	connector_set_timing(CONNECTOR_DEFAULT_STAGGER, CONNECTOR_DEFAULT_TIMEOUT);
+
+	for (i = 0; i < 4; i++)
+		close(fillers[i]);
+	close(fd);
+
+	if (! result.returned || ! result.res.e)
+		return 0;
+	if (socks_reply_from_error(result.res.e) != SOCKS_REPLY_TTLEXPIRED)
+		return 0;
+	error_handle(result.res.e);
+
+	return 1;
+}
+
+int main()
+{
+	utils_init();
+
+	balancer_add_from_string("127.0.0.1");
+
+	test_run(test_connector_success());
+	test_run(test_connector_timeout());
+
+	balancer_shutdown();
+	utils_shutdown();
+	return 0;
+}
@@ -0,0 +1,115 @@
+/* discover.c
+ * Unit tests for src/discover.c
+ * 
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ * 
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libtest.h"
+
+//The first matching rule decides
+int test_discover_rules()
+{
+	int metric;
+	double rate;
+	const Error *e;
+
+	abort_on_error(discover_set_rules("!docker*,wwan*@1/8M,eth0@3,*"));
+
+	if (discover_match("docker0", &metric, &rate))
+		return 0;
+	if (! discover_match("wwan0", &metric, &rate) 
+			|| metric != 1 || rate != 1e6)
+		return 0;
+	if (! discover_match("eth0", &metric, &rate) || metric != 3 || rate != 0)
+		return 0;
+	if (! discover_match("wlan0", &metric, &rate) || metric != -1)
+		return 0;
+
+	abort_on_error(discover_set_rules("eth*"));
+	if (discover_match("wlan0", &metric, &rate))
+		return 0;
+
+	if (! (e = discover_set_rules("eth0@x")))
+		return 0;
+	error_handle(e);
+	if (! (e = discover_set_rules("eth0@0")))
+		return 0;
+	error_handle(e);
+	if (! (e = discover_set_rules("eth0,,wlan0")))
+		return 0;
+	error_handle(e);
+	if (! (e = discover_set_rules("!eth0@2")))
+		return 0;
+	error_handle(e);
+
+	discover_shutdown();
+	return 1;
+}
+
+//Only globally scoped addresses of matching interfaces are used
+int test_discover_start()
+{
+	Interface *ifaces[64];
+	InterfaceInfo info;
+	size_t i, len;
+	const Error *e;
+
+	abort_on_error(discover_set_rules("*"));
+	e = discover_start();
+	if (e)
+	{
+		//Not Linux
+		error_handle(e);
+		discover_shutdown();
+		return 1;
+	}
+
+	len = balancer_get_ifaces(ifaces, 64);
+	if (len != discover_get_n_ifaces())
+		return 0;
+	for (i = 0; i < len; i++)
+	{
+		interface_get_info(ifaces[i], &info);
+		if (info.addr.type == NETWORK_INET && info.addr.ip[0] == 127)
+			return 0;
+		if (info.addr.type == NETWORK_INET6 
+				&& info.addr.ip[0] == 0xfe && (info.addr.ip[1] & 0xc0) == 0x80)
+			return 0;
+	}
+	discover_shutdown();
+
+	//Nothing matches
+	abort_on_error(discover_set_rules("no-such-interface*"));
+	abort_on_error(discover_start());
+	if (discover_get_n_ifaces() != 0)
+		return 0;
+	discover_shutdown();
+
+	balancer_shutdown();
+	return 1;
+}
+
+int main()
+{
+	utils_init();
+
+	test_run(test_discover_rules());
+	test_run(test_discover_start());
+
+	utils_shutdown();
+	return 0;
+}
@@ -0,0 +1,104 @@
+/* health.c
+ * Unit tests for src/health.c
+ * 
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ * 
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libtest.h"
+
+//Interfaces must be ejected when probes fail and restored when they succeed
+int test_health_probe()
+{
+	SocketHandle listener;
+	SocketAddress addr;
+	Interface *a, *b;
+	int i;
+
+	a = balancer_add_from_string("127.0.0.1");
+	b = balancer_add_from_string("127.0.0.1");
+
+	//Probe target that refuses connections
+	test_open_listener("127.0.0.1", &listener, &addr);
+	socket_handle_close(listener);
+	health_add_probe(addr);
+	health_set_timing(20, 200);
+	health_start();
+
+	//Only one of them can be ejected, the other one is the last one left
+	for (i = 0; i < 100 
+			&& ! interface_is_ejected(a) && ! interface_is_ejected(b); i++)
+		event_base_loop(evbase, EVLOOP_ONCE);
+	if (interface_is_ejected(a) + interface_is_ejected(b) != 1)
+		return 0;
+	health_shutdown();
+
+	//Probe target that accepts connections
+	test_open_listener("127.0.0.1", &listener, &addr);
+	health_add_probe(addr);
+	health_set_timing(20, 200);
+	health_start();
+
+	for (i = 0; i < 100 
+			&& (interface_is_ejected(a) || interface_is_ejected(b)); i++)
+		event_base_loop(evbase, EVLOOP_ONCE);
+	if (interface_is_ejected(a) || interface_is_ejected(b))
+		return 0;
+	health_shutdown();
+
+	socket_handle_close(listener);
+	balancer_shutdown();
+	return 1;
+}
+
+//Probes that cannot even bind to the address count as failed
+int test_health_unbound()
+{
+	SocketHandle listener;
+	SocketAddress addr;
+	Interface *a, *b;
+	int i;
+
+	//Not configured on the host
+	a = balancer_add_from_string("192.0.2.1");
+	b = balancer_add_from_string("127.0.0.1");
+
+	test_open_listener("127.0.0.1", &listener, &addr);
+	health_add_probe(addr);
+	health_set_timing(20, 200);
+	health_start();
+
+	for (i = 0; i < 100 && ! interface_is_ejected(a); i++)
+		event_base_loop(evbase, EVLOOP_ONCE);
+	if (! interface_is_ejected(a) || interface_is_ejected(b))
+		return 0;
+	health_shutdown();
+
+	socket_handle_close(listener);
+	balancer_shutdown();
+	return 1;
+}
+
+int main()
+{
+	utils_init();
+
+	test_run(test_health_probe());
+	test_run(test_health_unbound());
+
+	utils_shutdown();
+	return 0;
+}
@@ -398,10 +398,25 @@ void test_open_listener
 			"Incorrect host address");
 	bind_addr.port = 0;
 
-	abort_on_error(socket_handle_create_listener(bind_addr, &hd));
+	abort_on_error(socket_handle_create_listener(bind_addr, 0, &hd));
 	abort_on_error(socket_handle_getsockname(hd, &addr));
 
 	*hd_out = hd;
 	*addr_out = addr;
 }
 
+
+int test_read_exact(SocketHandle hd, void *buf, size_t len)
+{
+	size_t out, total = 0;
+
+	while (total < len)
+	{
+		abort_on_error(socket_handle_read(hd, (char *) buf + total, 
+					len - total, &out));
+		if (! out)
+			return 0;
+		total += out;
+	}
+	return 1;
+}
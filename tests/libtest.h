@@ -88,3 +88,6 @@ Actor *actor_create_client(SocketAddress addr, ScriptElement *script);
 
 void test_open_listener
 	(const char *host, SocketHandle *hd_out, SocketAddress *addr_out);
+
+//Reads exactly len bytes from a blocking socket, returns 0 on EOF
+int test_read_exact(SocketHandle hd, void *buf, size_t len);
@@ -0,0 +1,153 @@
+/* log.c
+ * Unit tests for src/log.c
+ *
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ *
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libtest.h"
+
+#include <errno.h>
+#include <fcntl.h>
+
+#define TEST_N_LINES (400) //< Of about 400 bytes, several times the buffer
+
+//stdout is redirected to a pipe, the read end is non-blocking
+static int test_output_fd;
+
+//Appends what was written to stdout so far, keeps out terminated
+static size_t test_read_output(char *out, size_t len, size_t max)
+{
+	ssize_t res;
+
+	while (len < max - 1)
+	{
+		res = read(test_output_fd, out + len, max - 1 - len);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			break;
+		len += res;
+	}
+	out[len] = 0;
+	return len;
+}
+
+//Runs the event loop until text shows up in the output
+static size_t test_wait_output(const char *text, char *out, size_t len,
+		size_t max)
+{
+	int i;
+
+	for (i = 0; i < 1000 && ! strstr(out, text); i++)
+	{
+		event_base_loop(evbase, EVLOOP_NONBLOCK);
+		len = test_read_output(out, len, max);
+	}
+	return len;
+}
+
+//Messages below the level are not written
+int test_log_level()
+{
+	char out[256];
+
+	log_set_level(LOG_LEVEL_WARNING);
+	log_message(LOG_LEVEL_DEBUG, "debug");
+	log_message(LOG_LEVEL_INFO, "info");
+	log_message(LOG_LEVEL_WARNING, "warning");
+	log_message(LOG_LEVEL_ERROR, "error");
+	log_flush();
+	log_set_level(LOG_LEVEL_INFO);
+
+	test_read_output(out, 0, sizeof(out));
+	return strcmp(out, "WARNING: warning\nERROR: error\n") == 0;
+}
+
+//Messages that do not fit the buffer are dropped. Those that fit are
+//written in order as stdout drains, followed by the number dropped.
+int test_log_full()
+{
+	static char out[TEST_N_LINES * 512];
+	char line[400], expected[512];
+	unsigned long dropped = log_get_dropped();
+	size_t len = 0;
+	char *iter;
+	int i;
+
+	memset(line, 'x', sizeof(line) - 1);
+	line[sizeof(line) - 1] = 0;
+	out[0] = 0;
+
+	for (i = 0; i < TEST_N_LINES; i++)
+		log_message(LOG_LEVEL_INFO, "%d %s", i, line);
+	dropped = log_get_dropped() - dropped;
+	if (! dropped || dropped >= TEST_N_LINES)
+		return 0;
+
+	len = test_wait_output("messages dropped\n", out, len, sizeof(out));
+	log_message(LOG_LEVEL_INFO, "after");
+	len = test_wait_output("after\n", out, len, sizeof(out));
+
+	iter = out;
+	for (i = 0; i < TEST_N_LINES - (int) dropped; i++)
+	{
+		snprintf(expected, sizeof(expected), "%d %s\n", i, line);
+		if (strncmp(iter, expected, strlen(expected)) != 0)
+			return 0;
+		iter += strlen(expected);
+	}
+	snprintf(expected, sizeof(expected),
+			"%lu log messages dropped\nafter\n", dropped);
+	return strcmp(iter, expected) == 0;
+}
+
+//Dumps are written between the messages logged before and after them
+int test_log_dump()
+{
+	char out[256];
+
+	log_message(LOG_LEVEL_INFO, "before");
+	log_dump("dump\n", 5);
+	log_message(LOG_LEVEL_INFO, "after");
+	log_flush();
+
+	test_read_output(out, 0, sizeof(out));
+	return strcmp(out, "before\ndump\nafter\n") == 0;
+}
+
+int main()
+{
+	int fds[2];
+
+	//Before anything is logged, the logger makes the pipe non-blocking
+	abort_if_fail(pipe(fds) == 0, "pipe(): %s", strerror(errno));
+	abort_if_fail(dup2(fds[1], STDOUT_FILENO) >= 0,
+			"dup2(): %s", strerror(errno));
+	close(fds[1]);
+	test_output_fd = fds[0];
+	abort_if_fail(fcntl(test_output_fd, F_SETFL, O_NONBLOCK) == 0,
+			"fcntl(): %s", strerror(errno));
+
+	utils_init();
+
+	test_run(test_log_level());
+	test_run(test_log_full());
+	test_run(test_log_dump());
+
+	utils_shutdown();
+	return 0;
+}
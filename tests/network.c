@@ -20,6 +20,10 @@
 
 #include "libtest.h"
 
+#include <event2/dns_struct.h>
+#include <event2/util.h>
+#include <netinet/tcp.h>
+
 const char *same = "e_str is same as i_str";
 
 int test_socket_address(const char *i_str, const char *e_str)
@@ -64,6 +68,337 @@ int test_getsockname(const char *i_str)
 	return 1;
 }
 
+//Expected IO conditions must be reported with static errors
+int test_io_static_errors()
+{
+	SocketHandle listener, client, server;
+	SocketAddress addr, local_addr;
+	const Error *e;
+	char buf[16];
+	size_t out;
+
+	test_open_listener("127.0.0.1", &listener, &addr);
+
+	memset(&local_addr, 0, sizeof(SocketAddress));
+	local_addr.host.type = NETWORK_INET;
+	test_error_handle(socket_handle_create_bound(local_addr, &client));
+	test_error_handle(socket_handle_connect(client, addr));
+	test_error_handle(socket_handle_accept(listener, &server));
+	test_error_handle(socket_handle_set_blocking(server, 0));
+
+	//Nothing to read
+	e = socket_handle_read(server, buf, sizeof(buf), &out);
+	if (e != socket_error_again_instance)
+		return 0;
+
+	{
+		IoVec vec = { buf, sizeof(buf) };
+		e = socket_handle_readv(server, &vec, 1, &out);
+		if (e != socket_error_again_instance)
+			return 0;
+	}
+
+	socket_handle_close(client);
+	socket_handle_close(server);
+	socket_handle_close(listener);
+
+	return 1;
+}
+
+typedef struct
+{
+	int answered;
+	size_t n_addrs;
+	uint16_t port;
+} DnsTestResult;
+
+static void test_dns_cb
+	(const Error *e, size_t n_addrs, SocketAddress *addrs, void *data)
+{
+	DnsTestResult *res = (DnsTestResult *) data;
+	size_t i;
+
+	res->answered = 1;
+	res->n_addrs = n_addrs;
+	if (e)
+	{
+		fprintf(stderr, "DNS error: %s\n", error_desc(e));
+		error_handle(e);
+	}
+	for (i = 0; i < n_addrs; i++)
+		res->port = addrs[i].port;
+	free(addrs);
+}
+
+static DnsTestResult test_dns_resolve(const char *hostname, uint16_t port)
+{
+	DnsTestResult res = {0, 0, 0};
+	DnsRequest *dns_ctx;
+	int i;
+
+	dns_ctx = dns_request_resolve
+		(hostname, htons(port), NETWORK_INET, test_dns_cb, &res);
+	for (i = 0; i < 100 && ! res.answered; i++)
+		event_base_loop(evbase, EVLOOP_ONCE);
+	dns_request_destroy(dns_ctx);
+
+	return res;
+}
+
+//Second lookup of the same name must be answered from the cache,
+//with the port of the second request
+int test_dns_cache()
+{
+	DnsCacheStats before, after;
+	DnsTestResult res;
+
+	dns_cache_get_stats(&before);
+
+	res = test_dns_resolve("localhost", 80);
+	if (! res.answered || ! res.n_addrs || res.port != htons(80))
+		return 0;
+
+	res = test_dns_resolve("LocalHost", 443);
+	if (! res.answered || ! res.n_addrs || res.port != htons(443))
+		return 0;
+
+	dns_cache_get_stats(&after);
+	if (after.n_misses - before.n_misses != 1
+			|| after.n_hits - before.n_hits != 1)
+		return 0;
+
+	return 1;
+}
+
+//Nameserver answering names of the form ttlN.test with N as the TTL
+static void test_dns_server_cb(struct evdns_server_request *req, void *data)
+{
+	int i, ttl;
+	uint32_t addr = htonl(0x7f000001);
+
+	//Letter case of names is randomized by the resolver
+	for (i = 0; i < req->nquestions; i++)
+	{
+		const char *name = req->questions[i]->name;
+
+		if (req->questions[i]->type == EVDNS_TYPE_A
+				&& evutil_ascii_strncasecmp(name, "ttl", 3) == 0
+				&& sscanf(name + 3, "%d", &ttl) == 1)
+			evdns_server_request_add_a_reply(req, name, 1, &addr, ttl);
+	}
+	evdns_server_request_respond(req, 0);
+}
+
+//Answers from DNS are kept no longer than their records allow
+int test_dns_record_ttl()
+{
+	struct evdns_server_port *port;
+	SocketAddress addr;
+	SocketHandle hd;
+	DnsCacheStats before, after;
+	DnsTestResult res;
+	char str[ADDRESS_MAX_LEN];
+	int i;
+
+	memset(&addr, 0, sizeof(SocketAddress));
+	abort_if_fail(host_address_from_str("127.0.0.1", &addr.host) 
+			== STATUS_SUCCESS, "Bad address");
+	abort_on_error(socket_handle_create_udp(addr, &hd));
+	abort_on_error(socket_handle_getsockname(hd, &addr));
+	port = evdns_add_server_port_with_base(evbase, hd.fd, 0, 
+			test_dns_server_cb, NULL);
+	abort_if_fail(port, "evdns_add_server_port_with_base() failed");
+
+	socket_address_to_str(addr, str);
+	evdns_base_clear_nameservers_and_suspend(evdns_base);
+	evdns_base_search_clear(evdns_base);
+	abort_if_fail(evdns_base_nameserver_ip_add(evdns_base, str) == 0,
+			"Cannot use nameserver %s", str);
+	evdns_base_resume(evdns_base);
+
+	dns_cache_get_stats(&before);
+	for (i = 0; i < 2; i++)
+	{
+		res = test_dns_resolve("ttl0.test", 80);
+		if (! res.answered || res.n_addrs != 1)
+			return 0;
+		res = test_dns_resolve("ttl3600.test", 80);
+		if (! res.answered || res.n_addrs != 1)
+			return 0;
+	}
+	dns_cache_get_stats(&after);
+	if (after.n_misses - before.n_misses != 3
+			|| after.n_hits - before.n_hits != 1)
+		return 0;
+
+	evdns_close_server_port(port);
+	socket_handle_close(hd);
+	return 1;
+}
+
+//Multishot accept reports every client until cancelled
+typedef struct
+{
+	UringOp op;
+	int n_accepted, n_final;
+} UringTest;
+
+static void test_uring_accept_cb(int res, int more, void *data)
+{
+	UringTest *test = (UringTest *) data;
+
+	if (res >= 0)
+	{
+		SocketHandle hd = { res };
+		socket_handle_close(hd);
+		test->n_accepted++;
+		if (test->n_accepted == 2)
+			uring_cancel(&test->op);
+	}
+	if (! more)
+	{
+		test->n_final++;
+		event_base_loopbreak(evbase);
+	}
+}
+
+int test_uring_accept()
+{
+	UringTest test;
+	SocketHandle listener, clients[2];
+	SocketAddress addr, local_addr;
+	int i;
+
+	//Nothing to test without io_uring
+	if (! uring_available())
+		return 1;
+
+	test_open_listener("127.0.0.1", &listener, &addr);
+	memset(&test, 0, sizeof(test));
+	test.op.cb = test_uring_accept_cb;
+	test.op.data = &test;
+	abort_on_error(uring_accept_multishot(listener, &test.op));
+
+	memset(&local_addr, 0, sizeof(SocketAddress));
+	local_addr.host.type = NETWORK_INET;
+	for (i = 0; i < 2; i++)
+	{
+		abort_on_error(socket_handle_create_bound(local_addr, clients + i));
+		abort_on_error(socket_handle_connect(clients[i], addr));
+	}
+
+	event_base_loop(evbase, 0);
+
+	for (i = 0; i < 2; i++)
+		socket_handle_close(clients[i]);
+	socket_handle_close(listener);
+
+	return test.n_accepted == 2 && test.n_final == 1 && ! test.op.active;
+}
+
+//Connected client and the socket accepted for it
+static void test_socket_pair(SocketHandle *client, SocketHandle *accepted)
+{
+	SocketHandle listener;
+	SocketAddress addr, local_addr;
+
+	test_open_listener("127.0.0.1", &listener, &addr);
+	memset(&local_addr, 0, sizeof(SocketAddress));
+	local_addr.host.type = NETWORK_INET;
+	abort_on_error(socket_handle_create_bound(local_addr, client));
+	abort_on_error(socket_handle_connect(*client, addr));
+	abort_on_error(socket_handle_accept(listener, accepted));
+	socket_handle_close(listener);
+}
+
+static int test_getsockopt(SocketHandle hd, int level, int name)
+{
+	int val = 0;
+	socklen_t len = sizeof(val);
+
+	abort_if_fail(getsockopt(hd.fd, level, name, &val, &len) == 0,
+			"getsockopt(): %s", strerror(errno));
+	return val;
+}
+
+//TCP_NODELAY is on by default for both ends, keepalive is off
+int test_socket_options_default()
+{
+	SocketHandle hds[2];
+	int i, res = 1;
+
+	test_socket_pair(hds, hds + 1);
+	for (i = 0; i < 2; i++)
+	{
+		if (! test_getsockopt(hds[i], IPPROTO_TCP, TCP_NODELAY)
+				|| test_getsockopt(hds[i], SOL_SOCKET, SO_KEEPALIVE))
+			res = 0;
+		socket_handle_close(hds[i]);
+	}
+	return res;
+}
+
+//Configured options apply to accepted sockets and to sockets created 
+//for connecting
+int test_socket_options_custom()
+{
+	SocketOptions options = { 0, 65536, 65536, 30 };
+	SocketOptions defaults = SOCKET_OPTIONS_DEFAULT;
+	SocketHandle hds[2];
+	int i, res = 1;
+
+	socket_set_options(&options);
+	test_socket_pair(hds, hds + 1);
+	for (i = 0; i < 2; i++)
+	{
+		if (test_getsockopt(hds[i], IPPROTO_TCP, TCP_NODELAY)
+				|| ! test_getsockopt(hds[i], SOL_SOCKET, SO_KEEPALIVE)
+				|| test_getsockopt(hds[i], SOL_SOCKET, SO_RCVBUF) < 65536
+				|| test_getsockopt(hds[i], SOL_SOCKET, SO_SNDBUF) < 65536)
+			res = 0;
+#ifdef TCP_KEEPIDLE
+		if (test_getsockopt(hds[i], IPPROTO_TCP, TCP_KEEPIDLE) != 30)
+			res = 0;
+#endif
+		socket_handle_close(hds[i]);
+	}
+	socket_set_options(&defaults);
+	return res;
+}
+
+//Listener flags set the matching socket options
+int test_listener_options()
+{
+	SocketAddress addr;
+	SocketHandle plain, flagged;
+	int res = 1;
+
+	abort_if_fail(host_address_from_str("127.0.0.1", &addr.host),
+			"Incorrect host address");
+	addr.port = 0;
+	abort_on_error(socket_handle_create_listener(addr, 0, &plain));
+	abort_on_error(socket_handle_create_listener(addr, 
+				LISTENER_REUSE_PORT | LISTENER_FASTOPEN | LISTENER_DEFER_ACCEPT,
+				&flagged));
+
+	if (test_getsockopt(plain, SOL_SOCKET, SO_REUSEPORT)
+			|| test_getsockopt(plain, IPPROTO_TCP, TCP_FASTOPEN)
+			|| test_getsockopt(plain, IPPROTO_TCP, TCP_DEFER_ACCEPT))
+		res = 0;
+
+	//The kernel rounds the deferral up to a number of SYN-ACK retransmits
+	if (! test_getsockopt(flagged, SOL_SOCKET, SO_REUSEPORT)
+			|| test_getsockopt(flagged, IPPROTO_TCP, TCP_FASTOPEN)
+			!= LISTENER_FASTOPEN_QLEN
+			|| test_getsockopt(flagged, IPPROTO_TCP, TCP_DEFER_ACCEPT)
+			< LISTENER_DEFER_ACCEPT_SEC)
+		res = 0;
+
+	socket_handle_close(plain);
+	socket_handle_close(flagged);
+	return res;
+}
+
 int main()
 {
 	utils_init();
@@ -80,5 +415,18 @@ int main()
 
 	test_run(test_getsockname("127.0.0.1:7080"));
 
+	test_run(test_io_static_errors());
+
+	test_run(test_dns_cache());
+	test_run(test_dns_record_ttl());
+
+	test_run(test_uring_accept());
+
+	test_run(test_socket_options_default());
+	test_run(test_socket_options_custom());
+#if defined(SO_REUSEPORT) && defined(TCP_FASTOPEN) && defined(TCP_DEFER_ACCEPT)
+	test_run(test_listener_options());
+#endif
+
 	utils_shutdown();
 }
@@ -0,0 +1,78 @@
+/* pool.c
+ * Unit tests for src/pool.c
+ * 
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ * 
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libtest.h"
+
+#define N_OBJS (1000)
+
+static THREAD_LOCAL Pool test_pool[1] = { POOL_INIT("test") };
+
+static void find_stats(const PoolStats *stats, void *data)
+{
+	if (strcmp(stats->name, "test") == 0)
+		*((PoolStats *) data) = *stats;
+}
+
+int test_pool_reuse()
+{
+	void *objs[N_OBJS];
+	void *first;
+	int i, j;
+	PoolStats stats;
+
+	//Objects must be distinct and writable
+	for (i = 0; i < N_OBJS; i++)
+	{
+		objs[i] = pool_alloc(test_pool, 100);
+		memset(objs[i], i & 0xff, 100);
+	}
+	for (i = 0; i < N_OBJS; i++)
+		for (j = 0; j < 100; j++)
+			if (((unsigned char *) objs[i])[j] != (i & 0xff))
+				return 0;
+
+	for (i = 0; i < N_OBJS; i++)
+		pool_free(test_pool, objs[i]);
+
+	//Freed objects are reused
+	first = pool_alloc(test_pool, 100);
+	if (first != objs[N_OBJS - 1])
+		return 0;
+
+	memset(&stats, 0, sizeof(stats));
+	pool_foreach_stats(find_stats, &stats);
+	if (stats.n_used != 1 || stats.high_water != N_OBJS)
+		return 0;
+
+	pool_free(test_pool, first);
+
+	return 1;
+}
+
+int main()
+{
+	utils_init();
+
+	test_run(test_pool_reuse());
+
+	utils_shutdown();
+
+	return 0;
+}
@@ -0,0 +1,277 @@
+/* server.c
+ * Unit tests for admission control in src/server.c
+ *
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ *
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libtest.h"
+
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#define TEST_N_CLIENTS (4)
+
+//What a client has seen from the proxy
+typedef enum
+{
+	TEST_WAITING,
+	TEST_SERVED, //< Got the method selection reply
+	TEST_CLOSED
+} TestClientState;
+
+//Connects a non-blocking client and sends the greeting
+static SocketHandle test_client(SocketAddress proxy_addr)
+{
+	const uint8_t greeting[] = { 5, 1, 0 };
+	SocketAddress local_addr;
+	SocketHandle hd;
+	size_t out;
+
+	memset(&local_addr, 0, sizeof(SocketAddress));
+	local_addr.host.type = NETWORK_INET;
+	abort_on_error(socket_handle_create_bound(local_addr, &hd));
+	abort_on_error(socket_handle_connect(hd, proxy_addr));
+	abort_on_error(socket_handle_write(hd, greeting, sizeof(greeting), &out));
+	abort_if_fail(out == sizeof(greeting), "Short write");
+	abort_on_error(socket_handle_set_blocking(hd, 0));
+
+	return hd;
+}
+
+//Checks once what arrived on the client
+static TestClientState test_client_state(SocketHandle hd)
+{
+	uint8_t buf[2];
+	size_t out;
+	const Error *e;
+
+	e = socket_handle_read(hd, buf, sizeof(buf), &out);
+	if (e)
+	{
+		int again = e->type == socket_error_again;
+
+		error_handle(e);
+		return again ? TEST_WAITING : TEST_CLOSED;
+	}
+	return out ? TEST_SERVED : TEST_CLOSED;
+}
+
+static void test_loop_ms(long ms)
+{
+	struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+
+	event_base_loopexit(evbase, &tv);
+	event_base_loop(evbase, 0);
+}
+
+//CPU time used by the process in microseconds
+static long test_cpu_usec()
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000L
+		+ usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static Server *test_server(SocketAddress *addr_out)
+{
+	SocketHandle hd;
+
+	test_open_listener("127.0.0.1", &hd, addr_out);
+	abort_on_error(socket_handle_set_blocking(hd, 0));
+	return server_create_from_handle(hd, 0);
+}
+
+static void test_close_clients(SocketHandle *clients, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		socket_handle_close(clients[i]);
+	test_loop_ms(50);
+}
+
+//Clients over the session limit wait in the backlog, and are accepted
+//once a session closes
+int test_server_session_limit()
+{
+	SocketHandle clients[TEST_N_CLIENTS];
+	SocketAddress addr;
+	Server *server;
+	int i, res;
+
+	server_set_limits(2, 0, 0);
+	server = test_server(&addr);
+	for (i = 0; i < TEST_N_CLIENTS; i++)
+		clients[i] = test_client(addr);
+
+	test_loop_ms(50);
+	res = test_client_state(clients[0]) == TEST_SERVED
+		&& test_client_state(clients[1]) == TEST_SERVED
+		&& test_client_state(clients[2]) == TEST_WAITING
+		&& test_client_state(clients[3]) == TEST_WAITING;
+
+	socket_handle_close(clients[0]);
+	test_loop_ms(50);
+	res = res && test_client_state(clients[2]) == TEST_SERVED
+		&& test_client_state(clients[3]) == TEST_WAITING;
+
+	test_close_clients(clients + 1, TEST_N_CLIENTS - 1);
+	server_destroy(server);
+	server_set_limits(0, 0, 0);
+	return res;
+}
+
+//Clients that connected before the loop ran are accepted 
+//SERVER_ACCEPT_BATCH per wakeup, and all of them are served
+int test_server_accept_batch()
+{
+	SocketHandle clients[2 * SERVER_ACCEPT_BATCH + 1];
+	SocketAddress addr;
+	Server *server;
+	long accepts;
+	int i, res;
+
+	server = test_server(&addr);
+	for (i = 0; i < 2 * SERVER_ACCEPT_BATCH + 1; i++)
+		clients[i] = test_client(addr);
+
+	accepts = counter_get(stats_get_shard()->n_accepts);
+	event_base_loop(evbase, EVLOOP_ONCE);
+	res = counter_get(stats_get_shard()->n_accepts) - accepts 
+		== SERVER_ACCEPT_BATCH;
+
+	test_loop_ms(50);
+	res = res && counter_get(stats_get_shard()->n_accepts) - accepts
+		== 2 * SERVER_ACCEPT_BATCH + 1;
+	for (i = 0; i < 2 * SERVER_ACCEPT_BATCH + 1; i++)
+		if (test_client_state(clients[i]) != TEST_SERVED)
+			res = 0;
+
+	test_close_clients(clients, 2 * SERVER_ACCEPT_BATCH + 1);
+	server_destroy(server);
+	return res;
+}
+
+//Connections of a client over its own limit are closed right away
+int test_server_client_limit()
+{
+	SocketHandle clients[3];
+	SocketAddress addr;
+	Server *server;
+	int res;
+
+	server_set_limits(0, 1, 0);
+	server = test_server(&addr);
+	clients[0] = test_client(addr);
+	test_loop_ms(50);
+	clients[1] = test_client(addr);
+	test_loop_ms(50);
+	res = test_client_state(clients[0]) == TEST_SERVED
+		&& test_client_state(clients[1]) == TEST_CLOSED;
+
+	//The client is under its limit again
+	socket_handle_close(clients[0]);
+	test_loop_ms(50);
+	clients[2] = test_client(addr);
+	test_loop_ms(50);
+	res = res && test_client_state(clients[2]) == TEST_SERVED;
+
+	test_close_clients(clients + 1, 2);
+	server_destroy(server);
+	server_set_limits(0, 0, 0);
+	return res;
+}
+
+//Out of file descriptors, pending clients are closed through the
+//reserved descriptor and the listener pauses instead of spinning.
+//Accepting resumes once descriptors are available.
+int test_server_no_fds()
+{
+	SocketHandle hd, clients[TEST_N_CLIENTS];
+	SocketAddress addr;
+	Server *server;
+	struct rlimit saved, limit;
+	long cpu;
+	int i, fd, res;
+
+	//Clients wait in the backlog, io_uring would accept them as soon as 
+	//they connect
+	test_open_listener("127.0.0.1", &hd, &addr);
+	abort_on_error(socket_handle_set_blocking(hd, 0));
+	for (i = 0; i < TEST_N_CLIENTS; i++)
+		clients[i] = test_client(addr);
+
+	//Room for the reserved descriptor and two sessions
+	fd = open("/dev/null", O_RDONLY);
+	abort_if_fail(fd >= 0, "open(): %s", strerror(errno));
+	close(fd);
+	abort_if_fail(getrlimit(RLIMIT_NOFILE, &saved) == 0,
+			"getrlimit(): %s", strerror(errno));
+	limit = saved;
+	limit.rlim_cur = fd + 3;
+	abort_if_fail(setrlimit(RLIMIT_NOFILE, &limit) == 0,
+			"setrlimit(): %s", strerror(errno));
+	server = server_create_from_handle(hd, 0);
+
+	//One pending client is dropped per pause
+	cpu = test_cpu_usec();
+	test_loop_ms(4 * SERVER_PAUSE_MSEC);
+	cpu = test_cpu_usec() - cpu;
+	abort_if_fail(setrlimit(RLIMIT_NOFILE, &saved) == 0,
+			"setrlimit(): %s", strerror(errno));
+
+	res = test_client_state(clients[0]) == TEST_SERVED
+		&& test_client_state(clients[1]) == TEST_SERVED
+		&& test_client_state(clients[2]) == TEST_CLOSED
+		&& test_client_state(clients[3]) == TEST_CLOSED
+		&& cpu < SERVER_PAUSE_MSEC * 1000;
+
+	//An accept submitted to io_uring keeps the limit it was submitted
+	//with, and fails once more
+	test_loop_ms(2 * SERVER_PAUSE_MSEC);
+	socket_handle_close(clients[2]);
+	clients[2] = test_client(addr);
+	test_loop_ms(2 * SERVER_PAUSE_MSEC);
+	res = res && test_client_state(clients[2]) == TEST_SERVED;
+
+	test_close_clients(clients, TEST_N_CLIENTS);
+	server_destroy(server);
+	return res;
+}
+
+int main()
+{
+	utils_init();
+	session_set_timeouts(0, 0);
+
+	//Accepting through libevent first, the ring is created on first use
+	uring_set_enabled(0);
+	test_run(test_server_session_limit());
+	test_run(test_server_accept_batch());
+	test_run(test_server_client_limit());
+	test_run(test_server_no_fds());
+
+	//The ring needs descriptors of its own
+	uring_set_enabled(1);
+	uring_available();
+	test_run(test_server_no_fds());
+
+	utils_shutdown();
+	return 0;
+}
@@ -0,0 +1,579 @@
+/* session.c
+ * Unit tests for session timeouts and buffers in src/session.c
+ *
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ *
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libtest.h"
+
+#include <sys/resource.h>
+
+//Connects a blocking client to a test proxy and sends data
+static SocketHandle test_client(SocketAddress proxy_addr,
+		const void *data, size_t len)
+{
+	SocketAddress local_addr;
+	SocketHandle hd;
+	size_t out;
+
+	memset(&local_addr, 0, sizeof(SocketAddress));
+	local_addr.host.type = NETWORK_INET;
+	abort_on_error(socket_handle_create_bound(local_addr, &hd));
+	abort_on_error(socket_handle_connect(hd, proxy_addr));
+	abort_on_error(socket_handle_write(hd, data, len, &out));
+	abort_if_fail(out == len, "Short write");
+
+	return hd;
+}
+
+//Reads until the proxy closes the connection, returns number of bytes
+static size_t test_read_to_eof(SocketHandle hd)
+{
+	char buf[64];
+	size_t out, total = 0;
+
+	do
+	{
+		abort_on_error(socket_handle_read(hd, buf, sizeof(buf), &out));
+		total += out;
+	} while (out);
+
+	return total;
+}
+
+static long test_run_proxy(SocketHandle proxy_hd)
+{
+	Server *proxy;
+	struct timeval start, end, elapsed;
+
+	proxy = server_create_test(proxy_hd);
+	evutil_gettimeofday(&start, NULL);
+	event_base_loop(evbase, 0);
+	evutil_gettimeofday(&end, NULL);
+	server_destroy(proxy);
+
+	evutil_timersub(&end, &start, &elapsed);
+	return elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000;
+}
+
+//Client that stops in the middle of the handshake is dropped
+int test_session_handshake_timeout()
+{
+	const uint8_t greeting[] = { 5, 1 };
+	SocketHandle proxy_hd, client;
+	SocketAddress proxy_addr;
+	long elapsed;
+
+	session_set_timeouts(100, 0);
+	test_open_listener("127.0.0.1", &proxy_hd, &proxy_addr);
+	client = test_client(proxy_addr, greeting, sizeof(greeting));
+
+	elapsed = test_run_proxy(proxy_hd);
+	if (elapsed < 90 || elapsed > 2000)
+		return 0;
+	if (test_read_to_eof(client) != 0)
+		return 0;
+
+	socket_handle_close(client);
+	return 1;
+}
+
+//Established connection without traffic is closed
+int test_session_idle_timeout()
+{
+	uint8_t request[3 + 10] = { 5, 1, 0, 5, 1, 0, 1, 127, 0, 0, 1 };
+	SocketHandle proxy_hd, server_hd, client;
+	SocketAddress proxy_addr, server_addr;
+	long elapsed;
+
+	session_set_timeouts(0, 1);
+	test_open_listener("127.0.0.1", &proxy_hd, &proxy_addr);
+	test_open_listener("127.0.0.1", &server_hd, &server_addr);
+	memcpy(request + 11, &server_addr.port, 2);
+	client = test_client(proxy_addr, request, sizeof(request));
+
+	//Destination is never accepted, the kernel completes the handshake
+	elapsed = test_run_proxy(proxy_hd);
+	if (elapsed < 900 || elapsed > 3000)
+		return 0;
+
+	//Method selection and connect reply, then EOF
+	if (test_read_to_eof(client) != 2 + 10)
+		return 0;
+
+	socket_handle_close(client);
+	socket_handle_close(server_hd);
+	return 1;
+}
+
+static void test_count_lane_buffers(const PoolStats *stats, void *data)
+{
+	if (strncmp(stats->name, "lane-buffer-", 12) == 0)
+		*((unsigned long *) data) += stats->n_used;
+}
+
+//Connected session holds no buffers once everything is relayed
+int test_session_buffers_released()
+{
+	uint8_t request[3 + 10 + 5] = { 5, 1, 0, 5, 1, 0, 1, 127, 0, 0, 1 };
+	SocketHandle proxy_hd, server_hd, client;
+	SocketAddress proxy_addr, server_addr;
+	Server *proxy;
+	struct timeval tv = { 0, 200000 };
+	unsigned long n_used = 0;
+	char buf[16];
+	size_t out;
+
+	session_set_timeouts(0, 0);
+	test_open_listener("127.0.0.1", &proxy_hd, &proxy_addr);
+	test_open_listener("127.0.0.1", &server_hd, &server_addr);
+	memcpy(request + 11, &server_addr.port, 2);
+	memcpy(request + 13, "hello", 5);
+	client = test_client(proxy_addr, request, sizeof(request));
+
+	proxy = server_create_test(proxy_hd);
+	event_base_loopexit(evbase, &tv);
+	event_base_loop(evbase, 0);
+
+	pool_foreach_stats(test_count_lane_buffers, &n_used);
+	if (n_used != 0)
+		return 0;
+
+	//Method selection and connect reply
+	abort_on_error(socket_handle_read(client, buf, sizeof(buf), &out));
+	if (out != 2 + 10)
+		return 0;
+
+	socket_handle_close(client);
+	event_base_loop(evbase, 0);
+	server_destroy(proxy);
+	socket_handle_close(server_hd);
+	return 1;
+}
+
+//Greeting, request and payload in a single write. The payload reaches 
+//the destination, the client gets both replies before relayed data.
+int test_session_early_data(int fastopen)
+{
+	uint8_t request[3 + 10 + 5] = { 5, 1, 0, 5, 1, 0, 1, 127, 0, 0, 1 };
+	SocketHandle proxy_hd, server_hd, client, remote;
+	SocketAddress proxy_addr, server_addr;
+	Server *proxy;
+	struct timeval tv = { 0, 200000 };
+	uint8_t buf[2 + 10 + 5];
+	size_t out;
+	int res;
+
+	session_set_timeouts(0, 0);
+	connector_set_fastopen(fastopen);
+	test_open_listener("127.0.0.1", &proxy_hd, &proxy_addr);
+	test_open_listener("127.0.0.1", &server_hd, &server_addr);
+	memcpy(request + 11, &server_addr.port, 2);
+	memcpy(request + 13, "hello", 5);
+	client = test_client(proxy_addr, request, sizeof(request));
+
+	proxy = server_create_test(proxy_hd);
+	event_base_loopexit(evbase, &tv);
+	event_base_loop(evbase, 0);
+
+	abort_on_error(socket_handle_accept(server_hd, &remote));
+	abort_on_error(socket_handle_set_blocking(remote, 1));
+	res = test_read_exact(remote, buf, 5) && memcmp(buf, "hello", 5) == 0;
+	abort_on_error(socket_handle_write(remote, "world", 5, &out));
+
+	event_base_loopexit(evbase, &tv);
+	event_base_loop(evbase, 0);
+
+	//Method selection, connect reply, then the relayed data
+	if (! test_read_exact(client, buf, sizeof(buf)))
+		res = 0;
+	if (buf[0] != 5 || buf[1] != 0 || buf[2] != 5 || buf[3] != 0
+			|| memcmp(buf + 12, "world", 5) != 0)
+		res = 0;
+
+	socket_handle_close(client);
+	event_base_loop(evbase, 0);
+	server_destroy(proxy);
+	socket_handle_close(remote);
+	socket_handle_close(server_hd);
+	connector_set_fastopen(0);
+	return res;
+}
+
+static void test_read_now_cb
+	(Session *session, SessionState state, void *data)
+{
+	if (state == SESSION_CLOSED)
+	{
+		session_destroy(session);
+		event_base_loopbreak(evbase);
+	}
+}
+
+//Greeting and request already queued on the socket are handled before
+//the event loop runs, as with deferred accept
+int test_session_read_now()
+{
+	uint8_t request[3 + 10] = { 5, 1, 0, 5, 1, 0, 1, 127, 0, 0, 1 };
+	SocketHandle proxy_hd, server_hd, client, client_hd;
+	SocketAddress proxy_addr, server_addr;
+	Session *session;
+	SessionState state;
+	struct timeval tv = { 0, 200000 };
+	uint8_t buf[2 + 10];
+
+	session_set_timeouts(0, 0);
+	test_open_listener("127.0.0.1", &proxy_hd, &proxy_addr);
+	test_open_listener("127.0.0.1", &server_hd, &server_addr);
+	memcpy(request + 11, &server_addr.port, 2);
+	client = test_client(proxy_addr, request, sizeof(request));
+
+	abort_on_error(socket_handle_accept(proxy_hd, &client_hd));
+	session = session_create(client_hd);
+	session_set_callback(session, test_read_now_cb, NULL);
+	session_read_now(session);
+	state = session_get_state(session);
+
+	//Replies go out once the connection is established
+	event_base_loopexit(evbase, &tv);
+	event_base_loop(evbase, 0);
+	if (! test_read_exact(client, buf, sizeof(buf)) 
+			|| buf[0] != 5 || buf[1] != 0 || buf[2] != 5 || buf[3] != 0)
+		state = SESSION_CLOSED;
+
+	socket_handle_close(client);
+	event_base_loop(evbase, 0);
+	socket_handle_close(proxy_hd);
+	socket_handle_close(server_hd);
+	return state == SESSION_CONNECTING || state == SESSION_CONNECTED;
+}
+
+//Relaying in both directions at once, more than the buffers hold
+#define TEST_RELAY_BYTES (256 * 1024)
+
+typedef struct _TestRelay TestRelay;
+
+//End of the relayed connection, sending a pattern and checking the one
+//coming from the other end
+typedef struct
+{
+	TestRelay *relay;
+	SocketHandle hd;
+	struct event *evt;
+	int dir; //< Pattern sent, the other end sends 1 - dir
+	size_t skip; //< SOCKS replies to read before relayed data
+	size_t sent, received;
+	int eof, ok;
+} TestPeer;
+
+struct _TestRelay
+{
+	TestPeer peers[2]; //< Client, destination
+	SocketHandle server_hd;
+	struct event *accept_evt;
+	size_t max_taken; //< Most registered buffers in use
+
+	//Destination does not read or write for pause_ms after connecting
+	long pause_ms;
+	struct event *pause_evt;
+	int pause_half; //< Buffers have filled up, halfway through the pause
+	long pause_cpu; //< CPU time used in the second half, microseconds
+	size_t chunk; //< Largest write, 0 for no limit
+	size_t bytes; //< Sent in each direction
+	unsigned long event_mods; //< Of the session, once it closed
+};
+
+//CPU time used by the process in microseconds
+static long test_cpu_usec()
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000L
+		+ usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static uint8_t test_pattern(int dir, size_t i)
+{
+	return (uint8_t) (i * 7 + i / 251 + dir * 101);
+}
+
+static int test_peer_done(TestPeer *peer)
+{
+	return peer->sent == peer->relay->bytes
+		&& peer->received == peer->relay->bytes;
+}
+
+static void test_peer_cb(evutil_socket_t fd, short events, void *data)
+{
+	TestPeer *peer = (TestPeer *) data;
+	TestRelay *relay = peer->relay;
+	uint8_t buf[4096];
+	size_t out, i, len;
+	const Error *e;
+
+	if (uring_buffer_get_n_taken() > relay->max_taken)
+		relay->max_taken = uring_buffer_get_n_taken();
+
+	if (events & EV_READ)
+	{
+		e = socket_handle_read(peer->hd, buf, sizeof(buf), &out);
+		if (e)
+		{
+			abort_if_fail(e->type == socket_error_again, "read(): %s",
+					error_desc(e));
+			error_handle(e);
+			out = 0;
+		}
+		else if (! out)
+		{
+			peer->eof = 1;
+		}
+
+		for (i = 0; i < out; i++)
+		{
+			if (peer->skip)
+				peer->skip--;
+			else if (buf[i] != test_pattern(1 - peer->dir, peer->received++))
+				peer->ok = 0;
+		}
+		if (peer->received > relay->bytes)
+			peer->ok = 0;
+	}
+
+	if ((events & EV_WRITE) && ! peer->skip && peer->sent < relay->bytes)
+	{
+		len = relay->bytes - peer->sent;
+		if (len > sizeof(buf))
+			len = sizeof(buf);
+		if (relay->chunk && len > relay->chunk)
+			len = relay->chunk;
+		for (i = 0; i < len; i++)
+			buf[i] = test_pattern(peer->dir, peer->sent + i);
+
+		e = socket_handle_write(peer->hd, buf, len, &out);
+		if (e)
+		{
+			abort_if_fail(e->type == socket_error_again, "write(): %s",
+					error_desc(e));
+			error_handle(e);
+			out = 0;
+		}
+		peer->sent += out;
+	}
+
+	if (peer->eof)
+	{
+		event_del(peer->evt);
+	}
+	else if (peer->sent == relay->bytes 
+			&& (event_get_events(peer->evt) & EV_WRITE))
+	{
+		event_del(peer->evt);
+		event_assign(peer->evt, evbase, peer->hd.fd, EV_READ | EV_PERSIST,
+				test_peer_cb, peer);
+		event_add(peer->evt, NULL);
+	}
+
+	//Client closes once everything has arrived at both ends
+	if (test_peer_done(relay->peers) && test_peer_done(relay->peers + 1)
+			&& relay->peers[0].evt)
+	{
+		event_free(relay->peers[0].evt);
+		relay->peers[0].evt = NULL;
+		socket_handle_close(relay->peers[0].hd);
+	}
+}
+
+static void test_peer_start(TestRelay *relay, int dir, SocketHandle hd)
+{
+	TestPeer *peer = relay->peers + dir;
+
+	peer->relay = relay;
+	peer->hd = hd;
+	peer->dir = dir;
+	peer->sent = peer->received = 0;
+	peer->eof = 0;
+	peer->ok = 1;
+	abort_on_error(socket_handle_set_blocking(hd, 0));
+	peer->evt = event_new(evbase, hd.fd, EV_READ | EV_WRITE | EV_PERSIST,
+			test_peer_cb, peer);
+	event_add(peer->evt, NULL);
+}
+
+static void test_relay_pause_half(TestRelay *relay)
+{
+	long half = relay->pause_ms / 2;
+	struct timeval tv = { half / 1000, (half % 1000) * 1000 };
+
+	evtimer_add(relay->pause_evt, &tv);
+}
+
+static void test_relay_accept_cb(evutil_socket_t fd, short events, void *data)
+{
+	TestRelay *relay = (TestRelay *) data;
+	SocketHandle hd;
+
+	abort_on_error(socket_handle_accept(relay->server_hd, &hd));
+	event_del(relay->accept_evt);
+	relay->peers[1].skip = 0;
+	test_peer_start(relay, 1, hd);
+
+	if (relay->pause_ms)
+	{
+		event_del(relay->peers[1].evt);
+		test_relay_pause_half(relay);
+	}
+}
+
+static void test_relay_resume_cb(evutil_socket_t fd, short events, void *data)
+{
+	TestRelay *relay = (TestRelay *) data;
+
+	if (! relay->pause_half)
+	{
+		relay->pause_half = 1;
+		relay->pause_cpu = test_cpu_usec();
+		test_relay_pause_half(relay);
+	}
+	else
+	{
+		relay->pause_cpu = test_cpu_usec() - relay->pause_cpu;
+		event_add(relay->peers[1].evt, NULL);
+	}
+}
+
+static void test_relay_session_cb
+	(Session *session, SessionState state, void *data)
+{
+	TestRelay *relay = (TestRelay *) data;
+
+	if (state == SESSION_CLOSED)
+	{
+		relay->event_mods = session_get_event_mod_count(session);
+		session_destroy(session);
+		event_base_loopbreak(evbase);
+	}
+}
+
+//Relays relay->bytes in both directions, returns whether all of it
+//arrived intact
+static int test_relay_run(TestRelay *relay, SessionRelayMode mode)
+{
+	uint8_t request[3 + 10] = { 5, 1, 0, 5, 1, 0, 1, 127, 0, 0, 1 };
+	SocketHandle proxy_hd, client_hd;
+	SocketAddress proxy_addr, server_addr;
+	Session *session;
+	int res;
+
+	session_set_timeouts(0, 0);
+	session_set_relay_mode(mode);
+	test_open_listener("127.0.0.1", &proxy_hd, &proxy_addr);
+	test_open_listener("127.0.0.1", &relay->server_hd, &server_addr);
+	memcpy(request + 11, &server_addr.port, 2);
+
+	relay->peers[0].skip = 2 + 10;
+	test_peer_start(relay, 0, test_client(proxy_addr, request, sizeof(request)));
+	relay->accept_evt = event_new(evbase, relay->server_hd.fd, EV_READ,
+			test_relay_accept_cb, relay);
+	event_add(relay->accept_evt, NULL);
+	relay->pause_evt = evtimer_new(evbase, test_relay_resume_cb, relay);
+
+	//The session is created directly to look at it once it closes
+	abort_on_error(socket_handle_accept(proxy_hd, &client_hd));
+	session = session_create(client_hd);
+	session_set_callback(session, test_relay_session_cb, relay);
+	event_base_loop(evbase, 0);
+	socket_handle_close(proxy_hd);
+
+	res = test_peer_done(relay->peers) && relay->peers[0].ok
+		&& test_peer_done(relay->peers + 1) && relay->peers[1].ok
+		&& ! relay->peers[0].evt;
+
+	if (relay->peers[0].evt)
+	{
+		event_free(relay->peers[0].evt);
+		socket_handle_close(relay->peers[0].hd);
+	}
+	if (relay->peers[1].evt)
+	{
+		event_free(relay->peers[1].evt);
+		socket_handle_close(relay->peers[1].hd);
+	}
+	event_free(relay->accept_evt);
+	event_free(relay->pause_evt);
+	socket_handle_close(relay->server_hd);
+	session_set_relay_mode(SESSION_RELAY_SPLICE);
+	return res;
+}
+
+//Data is relayed intact in both directions, through registered buffers
+//in io_uring mode
+int test_session_relay(SessionRelayMode mode)
+{
+	TestRelay relay[1];
+
+	memset(relay, 0, sizeof(TestRelay));
+	relay->bytes = TEST_RELAY_BYTES;
+	if (! test_relay_run(relay, mode))
+		return 0;
+
+	//Data is sent as soon as it arrives, events are only re-armed when a
+	//connection runs out of room, not for each of the 128 reads
+	if (mode == SESSION_RELAY_COPY && relay->event_mods > 32)
+		return 0;
+	if (mode == SESSION_RELAY_URING && uring_available()
+			&& relay->max_taken != 2)
+		return 0;
+	return uring_buffer_get_n_taken() == 0;
+}
+
+//Proxy waits without spinning while the destination does not read and 
+//the relay pipe is full
+int test_session_splice_backpressure()
+{
+	TestRelay relay[1];
+
+	memset(relay, 0, sizeof(TestRelay));
+	relay->bytes = 16 * TEST_RELAY_BYTES; //< More than socket buffers hold
+	relay->pause_ms = 500;
+	relay->chunk = 300; //< Pipe slots run out before its byte capacity
+	if (! test_relay_run(relay, SESSION_RELAY_SPLICE))
+		return 0;
+	return relay->pause_cpu < 5000;
+}
+
+int main()
+{
+	utils_init();
+	balancer_add_from_string("0.0.0.0");
+
+	test_run(test_session_handshake_timeout());
+	test_run(test_session_idle_timeout());
+	test_run(test_session_buffers_released());
+	test_run(test_session_early_data(0));
+	test_run(test_session_early_data(1));
+	test_run(test_session_read_now());
+	test_run(test_session_relay(SESSION_RELAY_COPY));
+	test_run(test_session_relay(SESSION_RELAY_SPLICE));
+	test_run(test_session_relay(SESSION_RELAY_URING));
+	test_run(test_session_splice_backpressure());
+
+	balancer_shutdown();
+	utils_shutdown();
+	return 0;
+}
@@ -0,0 +1,167 @@
+/* stats.c
+ * Unit tests for counters in src/stats.c
+ *
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ *
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libtest.h"
+
+#include <event2/buffer.h>
+
+//Returns whether formatted statistics contain the given line
+static int test_stats_contain(StatsFormat format, const char *line)
+{
+	struct evbuffer *buf = evbuffer_new();
+	const char *text;
+	int res;
+
+	stats_format(buf, format);
+	evbuffer_add(buf, "", 1);
+	text = (const char *) evbuffer_pullup(buf, -1);
+	res = strstr(text, line) != NULL;
+	if (! res)
+		fprintf(stderr, "'%s' not found in:\n%s", line, text);
+	evbuffer_free(buf);
+
+	return res;
+}
+
+//Counters survive the thread that updated them
+int test_stats_counters()
+{
+	Interface *a, *b;
+
+	a = balancer_add_from_string("127.0.0.1");
+	b = balancer_add_from_string("127.0.0.2@3");
+
+	stats_accept();
+	stats_session_state(SESSION_CLOSED, SESSION_AUTH);
+	stats_iface_bytes(b, 100, 20);
+	stats_iface_connect(b, 1);
+	stats_iface_connect(a, 0);
+	stats_thread_shutdown();
+
+	stats_accept();
+	stats_session_state(SESSION_AUTH, SESSION_CONNECTED);
+	stats_iface_bytes(b, 1, 2);
+
+	if (! test_stats_contain(STATS_FORMAT_TEXT, 
+				"sessions: auth=0 request=0 connecting=0 connected=1 "
+				"associated=0 shutdown=0\n"))
+		return 0;
+	if (! test_stats_contain(STATS_FORMAT_TEXT, "accepts: total=2 "))
+		return 0;
+	if (! test_stats_contain(STATS_FORMAT_TEXT, 
+				"interface 127.0.0.1: metric=1 connections=0 bytes_in=0 "
+				"bytes_out=0 connects_ok=0 connects_failed=1 "))
+		return 0;
+	if (! test_stats_contain(STATS_FORMAT_TEXT, 
+				"interface 127.0.0.2: metric=3 connections=0 bytes_in=101 "
+				"bytes_out=22 connects_ok=1 connects_failed=0 "))
+		return 0;
+	if (! test_stats_contain(STATS_FORMAT_PROMETHEUS, 
+				"dispatch_interface_bytes_total"
+				"{interface=\"127.0.0.2\",direction=\"in\"} 101\n"))
+		return 0;
+	if (! test_stats_contain(STATS_FORMAT_PROMETHEUS, 
+				"dispatch_sessions{state=\"connected\"} 1\n"))
+		return 0;
+
+	balancer_shutdown();
+	return 1;
+}
+
+//Buckets are contiguous and no wider than an eighth of their values
+int test_stats_histogram()
+{
+	StatsHistogram *hist;
+	uint64_t v;
+	int i;
+
+	for (i = 1; i < STATS_HIST_N_BUCKETS; i++)
+	{
+		uint64_t start = stats_hist_bucket_start(i);
+		uint64_t width = start - stats_hist_bucket_start(i - 1);
+		if (stats_hist_bucket(start) != i || stats_hist_bucket(start - 1) != i - 1)
+			return 0;
+		if (width * STATS_HIST_SUB > start && width > 1)
+			return 0;
+	}
+	if (stats_hist_bucket((uint64_t) 1 << 50) != STATS_HIST_N_BUCKETS - 1)
+		return 0;
+
+	//1..1000 microseconds
+	hist = (StatsHistogram *) fs_malloc(sizeof(StatsHistogram));
+	memset(hist, 0, sizeof(StatsHistogram));
+	for (v = 1; v <= 1000; v++)
+		stats_hist_add(hist, v);
+	if (counter_get(hist->count) != 1000 || counter_get(hist->sum) != 500500)
+		return 0;
+	if (stats_hist_quantile(hist, 0.5) < 450 
+			|| stats_hist_quantile(hist, 0.5) > 550)
+		return 0;
+	if (stats_hist_quantile(hist, 0.99) < 930 
+			|| stats_hist_quantile(hist, 0.99) > 1050)
+		return 0;
+	free(hist);
+
+	return 1;
+}
+
+//Phase latencies are reported both ways
+int test_stats_latency()
+{
+	Interface *a;
+
+	a = balancer_add_from_string("127.0.0.1");
+	stats_session_time(SESSION_AUTH, 1000);
+	stats_iface_connect_time(a, 2000);
+	stats_thread_shutdown();
+
+	if (! test_stats_contain(STATS_FORMAT_TEXT, 
+				"latency auth: count=1 mean_ms=1.000 "))
+		return 0;
+	if (! test_stats_contain(STATS_FORMAT_TEXT, 
+				"latency connect 127.0.0.1: count=1 mean_ms=2.000 "))
+		return 0;
+	if (! test_stats_contain(STATS_FORMAT_PROMETHEUS, 
+				"dispatch_phase_duration_seconds_count{phase=\"auth\"} 1\n"))
+		return 0;
+	if (! test_stats_contain(STATS_FORMAT_PROMETHEUS, 
+				"dispatch_interface_connect_seconds_bucket"
+				"{interface=\"127.0.0.1\",le=\"0.002048\"} 1\n"))
+		return 0;
+	if (! test_stats_contain(STATS_FORMAT_PROMETHEUS, 
+				"dispatch_interface_connect_seconds_bucket"
+				"{interface=\"127.0.0.1\",le=\"0.001024\"} 0\n"))
+		return 0;
+
+	balancer_shutdown();
+	return 1;
+}
+
+int main()
+{
+	utils_init();
+
+	test_run(test_stats_counters());
+	test_run(test_stats_histogram());
+	test_run(test_stats_latency());
+
+	utils_shutdown();
+	return 0;
+}
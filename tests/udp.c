@@ -0,0 +1,167 @@
+/* udp.c
+ * Unit tests for src/udp.c
+ *
+ * Copyright 2015-2018 Akash Rawal
+ * This file is part of dispatch_ng.
+ *
+ * dispatch_ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dispatch_ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dispatch_ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libtest.h"
+
+//Runs the event loop for a while
+static void test_pump(long ms)
+{
+	struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+
+	event_base_loopexit(evbase, &tv);
+	event_base_loop(evbase, 0);
+}
+
+static SocketHandle test_udp_socket(SocketAddress *addr_out)
+{
+	SocketAddress addr;
+	SocketHandle hd;
+
+	memset(&addr, 0, sizeof(SocketAddress));
+	abort_if_fail(host_address_from_str("127.0.0.1", &addr.host) == STATUS_SUCCESS,
+			"Bad address");
+	abort_on_error(socket_handle_create_udp(addr, &hd));
+	abort_on_error(socket_handle_getsockname(hd, addr_out));
+	return hd;
+}
+
+static int test_recv(SocketHandle hd, Datagram *msg, void *buf, size_t len)
+{
+	int n;
+	const Error *e;
+
+	msg->data = buf;
+	msg->len = len;
+	e = socket_handle_recv_datagrams(hd, msg, 1, &n);
+	if (e)
+	{
+		error_handle(e);
+		return 0;
+	}
+	return n;
+}
+
+static void test_send(SocketHandle hd, SocketAddress addr, 
+		const void *data, size_t len)
+{
+	Datagram msg;
+	int n;
+
+	msg.addr = addr;
+	msg.data = (void *) data;
+	msg.len = len;
+	abort_on_error(socket_handle_send_datagrams(hd, &msg, 1, &n));
+	abort_if_fail(n == 1, "Datagram not sent");
+}
+
+//Datagrams are relayed both ways, by address and by domain name
+int test_udp_associate()
+{
+	const uint8_t request[3 + 10] = { 5, 1, 0, 5, 3, 0, 1, 0, 0, 0, 0, 0, 0 };
+	uint8_t reply[2 + 10], buf[64], dgram[64];
+	SocketHandle proxy_hd, client, client_udp, echo;
+	SocketAddress proxy_addr, relay_addr, client_udp_addr, echo_addr, local;
+	Server *proxy;
+	Datagram msg;
+	size_t out;
+
+	test_open_listener("127.0.0.1", &proxy_hd, &proxy_addr);
+	proxy = server_create_test(proxy_hd);
+
+	memset(&local, 0, sizeof(SocketAddress));
+	local.host.type = NETWORK_INET;
+	abort_on_error(socket_handle_create_bound(local, &client));
+	abort_on_error(socket_handle_connect(client, proxy_addr));
+	abort_on_error(socket_handle_write(client, request, sizeof(request), &out));
+
+	//Method selection and association reply
+	test_pump(100);
+	abort_on_error(socket_handle_read(client, reply, sizeof(reply), &out));
+	if (out != sizeof(reply) || reply[3] != 0 || reply[5] != 1)
+		return 0;
+	relay_addr.host.type = NETWORK_INET;
+	memcpy(relay_addr.host.ip, reply + 6, 4);
+	memcpy(&relay_addr.port, reply + 10, 2);
+
+	client_udp = test_udp_socket(&client_udp_addr);
+	echo = test_udp_socket(&echo_addr);
+
+	//To an IPv4 address
+	memcpy(dgram, "\0\0\0\1", 4);
+	memcpy(dgram + 4, echo_addr.host.ip, 4);
+	memcpy(dgram + 8, &echo_addr.port, 2);
+	memcpy(dgram + 10, "ping", 4);
+	test_send(client_udp, relay_addr, dgram, 14);
+	test_pump(100);
+	if (test_recv(echo, &msg, buf, sizeof(buf)) != 1)
+		return 0;
+	if (msg.len != 4 || memcmp(buf, "ping", 4) != 0)
+		return 0;
+
+	//Reply comes back with the source in front
+	test_send(echo, msg.addr, "pong", 4);
+	test_pump(100);
+	if (test_recv(client_udp, &msg, buf, sizeof(buf)) != 1)
+		return 0;
+	if (msg.len != 14 || memcmp(buf, dgram, 10) != 0 
+			|| memcmp(buf + 10, "pong", 4) != 0)
+		return 0;
+
+	//To a domain name
+	memcpy(dgram, "\0\0\0\3\x09localhost", 14);
+	memcpy(dgram + 14, &echo_addr.port, 2);
+	memcpy(dgram + 16, "name", 4);
+	test_send(client_udp, relay_addr, dgram, 20);
+	test_pump(500);
+	if (test_recv(echo, &msg, buf, sizeof(buf)) != 1)
+		return 0;
+	if (msg.len != 4 || memcmp(buf, "name", 4) != 0)
+		return 0;
+
+	//Fragments are dropped
+	memcpy(dgram, "\0\0\1\1", 4);
+	memcpy(dgram + 4, echo_addr.host.ip, 4);
+	memcpy(dgram + 8, &echo_addr.port, 2);
+	test_send(client_udp, relay_addr, dgram, 14);
+	test_pump(100);
+	if (test_recv(echo, &msg, buf, sizeof(buf)) != 0)
+		return 0;
+
+	//Association ends with the connection
+	socket_handle_close(client);
+	event_base_loop(evbase, 0);
+	server_destroy(proxy);
+
+	socket_handle_close(client_udp);
+	socket_handle_close(echo);
+	return 1;
+}
+
+int main()
+{
+	utils_init();
+	balancer_add_from_string("0.0.0.0");
+
+	test_run(test_udp_associate());
+
+	balancer_shutdown();
+	utils_shutdown();
+	return 0;
+}
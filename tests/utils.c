@@ -58,6 +58,26 @@ int test_parse_long(const char *str, Status e_status, long e_out)
 	return 1;
 }
 
+int test_parse_size(const char *str, Status e_status, size_t e_out)
+{
+	size_t out;
+	if (parse_size(str, &out) != e_status)
+		return 0;
+	if (e_status == STATUS_SUCCESS ? e_out != out : 0)
+		return 0;
+	return 1;
+}
+
+int test_parse_bitrate(const char *str, Status e_status, double e_out)
+{
+	double out;
+	if (parse_bitrate(str, &out) != e_status)
+		return 0;
+	if (e_status == STATUS_SUCCESS ? e_out != out : 0)
+		return 0;
+	return 1;
+}
+
 int main()
 {
 	test_run(test_split_string("xyz", 'y', "x", "z"));
@@ -70,5 +90,19 @@ int main()
 	test_run(test_parse_long("1",  STATUS_SUCCESS, 1));
 	test_run(test_parse_long("1L", STATUS_FAILURE, 0));
 
+	test_run(test_parse_size("2048", STATUS_SUCCESS, 2048));
+	test_run(test_parse_size("256k", STATUS_SUCCESS, 256 * 1024));
+	test_run(test_parse_size("4M", STATUS_SUCCESS, 4 * 1024 * 1024));
+	test_run(test_parse_size("4MB", STATUS_FAILURE, 0));
+	test_run(test_parse_size("k", STATUS_FAILURE, 0));
+	test_run(test_parse_size("-1", STATUS_FAILURE, 0));
+
+	test_run(test_parse_bitrate("8000", STATUS_SUCCESS, 1000));
+	test_run(test_parse_bitrate("20M", STATUS_SUCCESS, 2500000));
+	test_run(test_parse_bitrate("0.5k", STATUS_SUCCESS, 62.5));
+	test_run(test_parse_bitrate("0", STATUS_FAILURE, 0));
+	test_run(test_parse_bitrate("M", STATUS_FAILURE, 0));
+	test_run(test_parse_bitrate("20Mbit", STATUS_FAILURE, 0));
+
 	return 0;
 }